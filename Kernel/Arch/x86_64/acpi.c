@@ -0,0 +1,165 @@
+#include <SampoOS/Kernel/memman.h>
+#include <string.h>
+#include "acpi.h"
+#include "memory-manager.h"
+#include "paging.h"
+
+struct acpi_rsdp
+{
+	char signature[8];
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt_addr;
+
+	// These are only there since ACPI 2.0.
+	uint32_t length;
+	uint64_t xsdt_addr;
+	uint8_t extended_checksum;
+	uint8_t reserved[3];
+} __attribute__((packed));
+
+static struct acpi_sdt_header *root_table = NULL;
+// The XSDT has 64-bit pointers to the other tables, the RSDT 32-bit ones.
+static bool root_is_xsdt = false;
+
+static bool
+acpi_checksum_ok(const void *table, size_t len)
+{
+	const uint8_t *bytes = table;
+	uint8_t sum = 0;
+	for (size_t i = 0; i < len; ++i)
+	{
+		sum += bytes[i];
+	}
+
+	return sum == 0;
+}
+
+// ACPI tables are neither page aligned nor of any fixed size, so map the
+// whole range of pages they touch.
+static void *
+acpi_map(uint64_t phys, size_t len)
+{
+	uintptr_t first_page = phys & ~(PAGE_SIZE - 1);
+	size_t page_count = (get_next_aligned_addr(phys + len) - first_page) / PAGE_SIZE;
+
+	uint8_t *mapping = virt_map_pages(first_page, page_count, VIRT_MAP_READ);
+	if (mapping == NULL)
+	{
+		return NULL;
+	}
+
+	return mapping + (phys - first_page);
+}
+
+static void
+acpi_unmap(void *table, size_t len)
+{
+	uintptr_t addr = (uintptr_t) table;
+	uintptr_t first_page = addr & ~(PAGE_SIZE - 1);
+
+	virt_unmap_pages((void *) first_page,
+			 (get_next_aligned_addr(addr + len) - first_page) / PAGE_SIZE);
+}
+
+// Maps a system description table, first only its header to find out how
+// long it is, and then the whole of it.
+static struct acpi_sdt_header *
+acpi_map_table(uint64_t phys)
+{
+	struct acpi_sdt_header *header = acpi_map(phys, sizeof(*header));
+	if (header == NULL)
+	{
+		return NULL;
+	}
+
+	size_t len = header->length;
+	acpi_unmap(header, sizeof(*header));
+
+	header = acpi_map(phys, len);
+	if (header == NULL)
+	{
+		return NULL;
+	}
+
+	if (!acpi_checksum_ok(header, len))
+	{
+		acpi_unmap(header, len);
+		return NULL;
+	}
+
+	return header;
+}
+
+bool
+init_acpi(uint64_t rsdp_phys)
+{
+	if (rsdp_phys == 0)
+	{
+		return false;
+	}
+
+	struct acpi_rsdp *rsdp = acpi_map(rsdp_phys, sizeof(*rsdp));
+	if (rsdp == NULL)
+	{
+		return false;
+	}
+
+	// The checksum of the ACPI 1.0 part covers the first 20 bytes.
+	if (memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || !acpi_checksum_ok(rsdp, 20))
+	{
+		acpi_unmap(rsdp, sizeof(*rsdp));
+		return false;
+	}
+
+	if (rsdp->revision >= 2 && rsdp->xsdt_addr != 0)
+	{
+		root_table = acpi_map_table(rsdp->xsdt_addr);
+		root_is_xsdt = root_table != NULL;
+	}
+
+	if (root_table == NULL)
+	{
+		root_table = acpi_map_table(rsdp->rsdt_addr);
+	}
+
+	acpi_unmap(rsdp, sizeof(*rsdp));
+
+	return root_table != NULL;
+}
+
+struct acpi_sdt_header *
+acpi_find_table(const char *signature)
+{
+	if (root_table == NULL)
+	{
+		return NULL;
+	}
+
+	size_t entry_size = root_is_xsdt ? 8 : 4;
+	size_t entry_count = (root_table->length - sizeof(*root_table)) / entry_size;
+	const uint8_t *entries = (const uint8_t *)(root_table + 1);
+
+	for (size_t i = 0; i < entry_count; ++i)
+	{
+		uint64_t table_phys = 0;
+		memcpy(&table_phys, &entries[i * entry_size], entry_size);
+
+		struct acpi_sdt_header *header = acpi_map(table_phys, sizeof(*header));
+		if (header == NULL)
+		{
+			return NULL;
+		}
+
+		bool is_match = memcmp(header->signature, signature, 4) == 0;
+		acpi_unmap(header, sizeof(*header));
+
+		if (is_match)
+		{
+			return acpi_map_table(table_phys);
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct acpi_sdt_header
+{
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed));
+
+// The multiple APIC description table, with its entries right after it.
+struct madt
+{
+	struct acpi_sdt_header header;
+	uint32_t local_apic_addr;
+	uint32_t flags;
+} __attribute__((packed));
+
+enum madt_entry_type
+{
+	MADT_ENTRY_LOCAL_APIC = 0,
+	MADT_ENTRY_IOAPIC = 1,
+	MADT_ENTRY_SOURCE_OVERRIDE = 2,
+	MADT_ENTRY_LOCAL_APIC_OVERRIDE = 5,
+	MADT_ENTRY_LOCAL_X2APIC = 9,
+};
+
+// Locates the root table through the RSDP Kickstart passed us.
+bool init_acpi(uint64_t rsdp_phys);
+
+// Finds and maps the system description table with the given signature,
+// or returns NULL if there is none. The mapping stays around for good.
+struct acpi_sdt_header *acpi_find_table(const char *signature);
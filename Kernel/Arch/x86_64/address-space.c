@@ -0,0 +1,516 @@
+#include <SampoOS/Kernel/memman.h>
+#include <string.h>
+#include "address-space.h"
+#include "memory-manager.h"
+#include "paging.h"
+#include "percpu.h"
+#include "preempt.h"
+#include "percpu-counter.h"
+#include "tlb.h"
+#include "arch-utils.h"
+
+#define PAGE_TABLE_ENTRY_COUNT 512
+
+// Levels of the paging structures, as seen from the entries inside them.
+enum page_table_level
+{
+	PAGE_TABLE_LEVEL_PT = 1,
+	PAGE_TABLE_LEVEL_PD = 2,
+	PAGE_TABLE_LEVEL_PDPT = 3,
+};
+
+static struct address_space kernel_address_space;
+static struct address_space *current_address_spaces[CPU_MAX];
+
+static struct percpu_counter cow_clones = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter cow_pages_shared = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter cow_faults = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter cow_copies = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter cow_reuses = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+
+static void free_table(enum page_table_level level, uintptr_t table_phys);
+
+void
+init_address_spaces(void)
+{
+	kernel_address_space.pml4 = page_entry_to_physaddr(read_cr3());
+	kernel_address_space.resident_pages = 0;
+
+	// Every CPU starts out in it, the APs included.
+	kernel_address_space.active_cpus = UINT64_MAX;
+	for (size_t i = 0; i < CPU_MAX; ++i)
+	{
+		current_address_spaces[i] = &kernel_address_space;
+	}
+
+	// Make read-only pages read-only for the kernel too, or its
+	// writes would go straight through copy-on-write pages.
+	write_cr0(read_cr0() | CR0_WRITE_PROTECT);
+}
+
+struct address_space *
+as_current(void)
+{
+	return current_address_spaces[this_cpu()->index];
+}
+
+// Paging structures of address spaces other than the active one can't be
+// reached through the fractal mapping, so they are accessed through
+// temporary mappings. Unmapping these is cheap thanks to the lazy purge.
+static inline uint64_t *
+map_table(uintptr_t table_phys)
+{
+	return virt_map_pages(table_phys, 1, VIRT_MAP_READ | VIRT_MAP_WRITE);
+}
+
+static inline void
+unmap_table(uint64_t *table)
+{
+	virt_unmap_pages(table, 1);
+}
+
+// Allocates a cleared paging structure, returning its physical address.
+static uintptr_t
+alloc_table(void)
+{
+	uintptr_t table_phys = pmm_alloc_page();
+	if (table_phys == 0)
+	{
+		return 0;
+	}
+
+	uint64_t *table = map_table(table_phys);
+	if (table == NULL)
+	{
+		pmm_free_page(table_phys);
+		return 0;
+	}
+
+	memset(table, 0, PAGE_SIZE);
+	unmap_table(table);
+
+	return table_phys;
+}
+
+static inline bool
+is_user_entry(uint64_t entry)
+{
+	return (entry & (PAGE_PRESENT | PAGE_USER)) == (PAGE_PRESENT | PAGE_USER);
+}
+
+bool
+as_create(struct address_space *as)
+{
+	uintptr_t pml4_phys = alloc_table();
+	if (pml4_phys == 0)
+	{
+		return false;
+	}
+
+	uint64_t *pml4 = map_table(pml4_phys);
+	if (pml4 == NULL)
+	{
+		pmm_free_page(pml4_phys);
+		return false;
+	}
+
+	// Share everything but the user half by reference. This includes
+	// Kickstart's identity mapping, which sits in the lower half, but
+	// isn't accessible to user space.
+	uint64_t *current_pml4 = get_pml4_from_addr(NULL);
+	for (size_t i = 0; i < PAGE_TABLE_ENTRY_COUNT; ++i)
+	{
+		if (i < USER_PML4_ENTRY_COUNT && (current_pml4[i] & PAGE_USER) != 0)
+		{
+			continue;
+		}
+
+		pml4[i] = current_pml4[i];
+	}
+
+	// Every address space must map its own paging structures.
+	pml4[FRACTAL_MAP_PML4_IDX] = NX_BIT | pml4_phys | PAGE_WRITABLE | PAGE_PRESENT;
+
+	unmap_table(pml4);
+
+	as->pml4 = pml4_phys;
+	as->resident_pages = 0;
+	as->active_cpus = 0;
+
+	return true;
+}
+
+// Returns the paging structure at `level` covering `base` in the
+// active address space, through the fractal mapping.
+static uint64_t *
+get_active_table(enum page_table_level level, uintptr_t base)
+{
+	switch (level)
+	{
+	case PAGE_TABLE_LEVEL_PDPT:
+		return get_pdpt_from_addr((void *)base);
+	case PAGE_TABLE_LEVEL_PD:
+		return get_pd_from_addr((void *)base);
+	case PAGE_TABLE_LEVEL_PT:
+	default:
+		return get_pt_from_addr((void *)base);
+	}
+}
+
+static inline unsigned int
+level_shift(enum page_table_level level)
+{
+	return 12 + 9 * (level - 1);
+}
+
+// Copies the active address space's paging structure at `level` covering
+// `base` into a new one for the child, write protecting the pages on the way.
+static uintptr_t
+clone_table(enum page_table_level level, uintptr_t base)
+{
+	uintptr_t child_phys = alloc_table();
+	if (child_phys == 0)
+	{
+		return 0;
+	}
+
+	uint64_t *child = map_table(child_phys);
+	if (child == NULL)
+	{
+		pmm_free_page(child_phys);
+		return 0;
+	}
+
+	uint64_t *parent = get_active_table(level, base);
+	bool ok = true;
+
+	for (size_t i = 0; i < PAGE_TABLE_ENTRY_COUNT && ok; ++i)
+	{
+		uint64_t entry = parent[i];
+		if (!is_user_entry(entry))
+		{
+			continue;
+		}
+
+		if (level != PAGE_TABLE_LEVEL_PT)
+		{
+			// User mappings are only ever made with 4KiB pages.
+			uintptr_t next = clone_table(level - 1, base + ((uintptr_t) i << level_shift(level)));
+			if (next == 0)
+			{
+				ok = false;
+				break;
+			}
+
+			child[i] = next | PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT;
+			continue;
+		}
+
+		// Writable pages turn into copy-on-write ones for both sides.
+		// Read-only pages can just be shared.
+		if ((entry & PAGE_WRITABLE) != 0)
+		{
+			entry = (entry & ~PAGE_WRITABLE) | PAGE_COW;
+			parent[i] = entry;
+
+			// It may still be writable in the TLB of any CPU running the parent.
+			tlb_batch_add(as_current(), base + ((uintptr_t) i << level_shift(level)), 1);
+		}
+
+		pmm_page_share(page_entry_to_physaddr(entry));
+		child[i] = entry;
+
+		percpu_counter_inc(&cow_pages_shared);
+	}
+
+	unmap_table(child);
+
+	if (!ok)
+	{
+		// Drop whatever got cloned already.
+		free_table(level, child_phys);
+		return 0;
+	}
+
+	return child_phys;
+}
+
+bool
+as_clone(struct address_space *child)
+{
+	if (!as_create(child))
+	{
+		return false;
+	}
+
+	uint64_t *child_pml4 = map_table(child->pml4);
+	if (child_pml4 == NULL)
+	{
+		as_destroy(child);
+		return false;
+	}
+
+	// The write protected pages are batched up on this CPU, until the end.
+	preempt_disable();
+
+	struct address_space *parent = as_current();
+	uint64_t *current_pml4 = get_pml4_from_addr(NULL);
+	bool ok = true;
+	for (size_t i = 0; i < USER_PML4_ENTRY_COUNT; ++i)
+	{
+		if (!is_user_entry(current_pml4[i]))
+		{
+			continue;
+		}
+
+		uintptr_t pdpt = clone_table(PAGE_TABLE_LEVEL_PDPT, (uintptr_t) i << 39);
+		if (pdpt == 0)
+		{
+			ok = false;
+			break;
+		}
+
+		child_pml4[i] = pdpt | PAGE_USER | PAGE_WRITABLE | PAGE_PRESENT;
+	}
+
+	unmap_table(child_pml4);
+
+	tlb_batch_flush();
+	preempt_enable();
+
+	if (!ok)
+	{
+		as_destroy(child);
+		return false;
+	}
+
+	child->resident_pages = parent->resident_pages;
+	percpu_counter_inc(&cow_clones);
+
+	return true;
+}
+
+static void
+free_table(enum page_table_level level, uintptr_t table_phys)
+{
+	uint64_t *table = map_table(table_phys);
+	if (table == NULL)
+	{
+		// We'd rather leak the memory than crash.
+		return;
+	}
+
+	for (size_t i = 0; i < PAGE_TABLE_ENTRY_COUNT; ++i)
+	{
+		uint64_t entry = table[i];
+		if (!is_user_entry(entry))
+		{
+			continue;
+		}
+
+		if (level == PAGE_TABLE_LEVEL_PT)
+		{
+			pmm_page_release(page_entry_to_physaddr(entry));
+		}
+		else
+		{
+			free_table(level - 1, page_entry_to_physaddr(entry));
+		}
+	}
+
+	unmap_table(table);
+	pmm_free_page(table_phys);
+}
+
+void
+as_clear_user(struct address_space *as)
+{
+	uint64_t *pml4 = map_table(as->pml4);
+	if (pml4 == NULL)
+	{
+		return;
+	}
+
+	preempt_disable();
+
+	for (size_t i = 0; i < USER_PML4_ENTRY_COUNT; ++i)
+	{
+		if (!is_user_entry(pml4[i]))
+		{
+			continue;
+		}
+
+		free_table(PAGE_TABLE_LEVEL_PDPT, page_entry_to_physaddr(pml4[i]));
+		pml4[i] = 0;
+
+		tlb_batch_add(as, (uintptr_t) i << 39, UINT64_C(1) << 27);
+	}
+
+	unmap_table(pml4);
+
+	tlb_batch_flush();
+	preempt_enable();
+
+	as->resident_pages = 0;
+}
+
+void
+as_destroy(struct address_space *as)
+{
+	if (__atomic_load_n(&as->active_cpus, __ATOMIC_ACQUIRE) != 0)
+	{
+		return;
+	}
+
+	as_clear_user(as);
+	pmm_free_page(as->pml4);
+	as->pml4 = 0;
+}
+
+void
+as_switch(struct address_space *as)
+{
+	uint64_t flags = local_irq_save();
+
+	size_t index = this_cpu()->index;
+	uint64_t bit = UINT64_C(1) << index;
+	struct address_space *prev = current_address_spaces[index];
+
+	// Shootdowns must find us in `as` before we can pick up any of its
+	// entries, tlb_batch_flush does the opposite.
+	__atomic_fetch_or(&as->active_cpus, bit, __ATOMIC_SEQ_CST);
+	current_address_spaces[index] = as;
+	write_cr3(as->pml4);
+
+	// Reloading CR3 flushed whatever we had cached from `prev`.
+	if (prev != as)
+	{
+		__atomic_fetch_and(&prev->active_cpus, ~bit, __ATOMIC_RELEASE);
+	}
+
+	local_irq_restore(flags);
+}
+
+bool
+as_map_user_page(uintptr_t virt_addr,
+		 uintptr_t physical_page_addr,
+		 enum virt_map_perm mapping_perms)
+{
+	if (virtaddr_to_pml4e_idx(virt_addr) >= USER_PML4_ENTRY_COUNT)
+	{
+		return false;
+	}
+
+	uint64_t *pte = virt_get_pte((void *)virt_addr);
+	if (pte == NULL || (*pte & PAGE_PRESENT) != 0)
+	{
+		return false;
+	}
+
+	*pte = virt_make_pte(physical_page_addr, mapping_perms) | PAGE_USER;
+	++as_current()->resident_pages;
+
+	return true;
+}
+
+bool
+as_handle_cow_fault(uintptr_t fault_addr)
+{
+	void *page_addr = (void *)(fault_addr & ~(PAGE_SIZE - 1));
+
+	// Walk down through the fractal mapping, making sure that every level is there.
+	if ((get_pml4_from_addr(page_addr)[virtaddr_to_pml4e_idx(page_addr)] & PAGE_PRESENT) == 0 ||
+	    (get_pdpt_from_addr(page_addr)[virtaddr_to_pdpe_idx(page_addr)] & PAGE_PRESENT) == 0)
+	{
+		return false;
+	}
+
+	uint64_t pde = get_pd_from_addr(page_addr)[virtaddr_to_pde_idx(page_addr)];
+	if ((pde & PAGE_PRESENT) == 0 || (pde & PAGE_HUGE) != 0)
+	{
+		return false;
+	}
+
+	// Nothing is locked here, so another CPU running this address space
+	// may be resolving the same fault. The entry is only ever swapped
+	// from the one read here, and only whoever swaps it gets to drop the
+	// reference to the old page.
+	uint64_t *pte = &get_pt_from_addr(page_addr)[virtaddr_to_pte_idx(page_addr)];
+	uint64_t entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+	if ((entry & PAGE_WRITABLE) != 0)
+	{
+		// Another CPU got to the fault first, and this one still had
+		// the read-only entry cached.
+		invalidate_page(page_addr);
+		return true;
+	}
+
+	if ((entry & PAGE_COW) == 0)
+	{
+		return false;
+	}
+
+	percpu_counter_inc(&cow_faults);
+
+	uintptr_t old_page = page_entry_to_physaddr(entry);
+	if (!pmm_page_is_shared(old_page))
+	{
+		// Everyone else has made their own copy already, so this one is
+		// ours. If the swap fails, the entry changed and the write is
+		// simply retried.
+		uint64_t writable = (entry & ~PAGE_COW) | PAGE_WRITABLE;
+		if (__atomic_compare_exchange_n(pte, &entry, writable, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			percpu_counter_inc(&cow_reuses);
+		}
+
+		invalidate_page(page_addr);
+		return true;
+	}
+
+	uintptr_t new_page = pmm_alloc_page();
+	if (new_page == 0)
+	{
+		return false;
+	}
+
+	void *copy_window = virt_map_pages(new_page, 1, VIRT_MAP_READ | VIRT_MAP_WRITE);
+	if (copy_window == NULL)
+	{
+		pmm_free_page(new_page);
+		return false;
+	}
+
+	memcpy(copy_window, page_addr, PAGE_SIZE);
+	virt_unmap_pages(copy_window, 1);
+
+	uint64_t copy = ((entry - old_page) & ~PAGE_COW) | new_page | PAGE_WRITABLE;
+	if (!__atomic_compare_exchange_n(pte, &entry, copy, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		// Another CPU resolved the fault first, with a copy of its own or
+		// with the page itself.
+		pmm_free_page(new_page);
+		invalidate_page(page_addr);
+		return true;
+	}
+
+	// The old page is still mapped on any other CPU running this address
+	// space, and they must not write to it once it is no longer ours.
+	tlb_batch_add(as_current(), (uintptr_t) page_addr, 1);
+	tlb_batch_flush();
+
+	pmm_page_release(old_page);
+
+	percpu_counter_inc(&cow_copies);
+	return true;
+}
+
+void
+as_get_cow_stats(struct as_cow_stats *stats)
+{
+	stats->clones = percpu_counter_sum(&cow_clones);
+	stats->pages_shared = percpu_counter_sum(&cow_pages_shared);
+	stats->cow_faults = percpu_counter_sum(&cow_faults);
+	stats->cow_copies = percpu_counter_sum(&cow_copies);
+	stats->cow_reuses = percpu_counter_sum(&cow_reuses);
+}
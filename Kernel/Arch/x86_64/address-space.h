@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "memory-manager.h"
+
+// A virtual address space. The kernel half is shared by reference between
+// all of them, and the user half is private, though possibly sharing pages
+// copy-on-write with other address spaces.
+struct address_space
+{
+	uintptr_t pml4; // <- Physical address, loaded into CR3.
+	size_t resident_pages; // <- User pages mapped.
+
+	// The CPUs which have it loaded, one bit per CPU index. Only these
+	// need to hear about changes to the user half, see tlb.h.
+	uint64_t active_cpus;
+};
+
+// Adopts the bootstrap paging structures from Kickstart as the kernel's own address space.
+void init_address_spaces(void);
+
+// The address space loaded on the calling CPU.
+struct address_space *as_current(void);
+
+// Creates an address space with an empty user half.
+bool as_create(struct address_space *as);
+
+// Clones the active address space into `child`. Only the page tables of
+// the user half are copied: the pages themselves become shared and write
+// protected, and they get copied on the first write to them.
+bool as_clone(struct address_space *child);
+
+// Unmaps the entire user half, dropping the references to its pages.
+void as_clear_user(struct address_space *as);
+
+// Frees the address space. It must not be loaded on any CPU.
+void as_destroy(struct address_space *as);
+
+void as_switch(struct address_space *as);
+
+// Maps a page into the user half of the active address space.
+bool as_map_user_page(uintptr_t virt_addr,
+		      uintptr_t physical_page_addr,
+		      enum virt_map_perm mapping_perms);
+
+// Called by the page fault handler for writes to present pages.
+bool as_handle_cow_fault(uintptr_t fault_addr);
+
+struct as_cow_stats
+{
+	uint64_t clones;
+	uint64_t pages_shared;
+	uint64_t cow_faults;
+	uint64_t cow_copies;
+	uint64_t cow_reuses; // <- Faults where the page had no other owners left.
+};
+
+void as_get_cow_stats(struct as_cow_stats *stats);
@@ -0,0 +1,365 @@
+#include <cpuid.h>
+#include "apic.h"
+#include "memory-manager.h"
+#include "interrupts.h"
+#include "percpu.h"
+#include "pit.h"
+#include "clock.h"
+#include "arch-utils.h"
+
+#define APIC_REG_ID 0x020
+#define APIC_REG_EOI 0x0B0
+#define APIC_REG_SPURIOUS 0x0F0
+#define APIC_REG_ICR_LOW 0x300
+#define APIC_REG_ICR_HIGH 0x310
+#define APIC_REG_LVT_TIMER 0x320
+#define APIC_REG_LVT_PERF 0x340
+#define APIC_REG_TIMER_INITIAL_COUNT 0x380
+#define APIC_REG_TIMER_CURRENT_COUNT 0x390
+#define APIC_REG_TIMER_DIVIDE 0x3E0
+
+#define APIC_SPURIOUS_ENABLE 0x100
+
+#define APIC_ICR_DELIVERY_FIXED (0x0 << 8)
+#define APIC_ICR_DELIVERY_INIT (0x5 << 8)
+#define APIC_ICR_DELIVERY_STARTUP (0x6 << 8)
+#define APIC_ICR_DELIVERY_PENDING (1 << 12)
+#define APIC_ICR_LEVEL_ASSERT (1 << 14)
+
+#define APIC_LVT_DELIVERY_NMI (0x4 << 8)
+#define APIC_LVT_MASKED (1 << 16)
+#define APIC_LVT_TIMER_PERIODIC (1 << 17)
+#define APIC_LVT_TIMER_TSC_DEADLINE (2 << 17)
+
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_X2APIC_ENABLE (1 << 10)
+#define APIC_BASE_ENABLE (1 << 11)
+
+// In x2APIC mode, the register at offset `reg` is MSR 0x800 + reg / 16.
+#define MSR_X2APIC_BASE 0x800
+#define MSR_TSC_DEADLINE 0x6E0
+
+#define CPUID_1_ECX_X2APIC (1 << 21)
+#define CPUID_1_ECX_TSC_DEADLINE (1 << 24)
+
+// Divide the timer input clock by 16.
+#define APIC_TIMER_DIVIDE_16 0x3
+
+#define APIC_TIMER_CALIBRATION_US 10000
+
+static volatile uint32_t *apic_regs = NULL;
+
+// Both are decided once on the bootstrap CPU, and the others follow.
+static bool x2apic_mode = false;
+static bool tsc_deadline_mode = false;
+
+// The periodic timer in TSC-deadline mode, which is one-shot. The
+// deadline is UINT64_MAX while the tick is stopped.
+static uint64_t timer_period[CPU_MAX];
+static uint64_t timer_deadline[CPU_MAX];
+
+// Set with apic_timer_set_oneshot, UINT64_MAX if there is none. The
+// hardware gets whichever of the two deadlines comes first.
+static uint64_t timer_oneshot[CPU_MAX];
+static uint64_t timer_programmed[CPU_MAX];
+
+static inline uint32_t
+apic_read(uint32_t reg)
+{
+	if (x2apic_mode)
+	{
+		return rdmsr(MSR_X2APIC_BASE + reg / 16);
+	}
+
+	return apic_regs[reg / 4];
+}
+
+static inline void
+apic_write(uint32_t reg, uint32_t val)
+{
+	if (x2apic_mode)
+	{
+		wrmsr(MSR_X2APIC_BASE + reg / 16, val);
+		return;
+	}
+
+	apic_regs[reg / 4] = val;
+}
+
+bool
+init_apic(uint64_t apic_phys)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) != 0)
+	{
+		x2apic_mode = (ecx & CPUID_1_ECX_X2APIC) != 0;
+		tsc_deadline_mode = (ecx & CPUID_1_ECX_TSC_DEADLINE) != 0;
+	}
+
+	// The registers are MSRs then, no need for the MMIO window.
+	if (x2apic_mode)
+	{
+		return true;
+	}
+
+	apic_regs = virt_map_pages(apic_phys, 1, VIRT_MAP_READ | VIRT_MAP_WRITE | VIRT_MAP_UNCACHED);
+
+	return apic_regs != NULL;
+}
+
+bool
+apic_is_x2apic(void)
+{
+	return x2apic_mode;
+}
+
+bool
+apic_timer_is_tsc_deadline(void)
+{
+	return tsc_deadline_mode;
+}
+
+void
+apic_enable_local(void)
+{
+	if (x2apic_mode)
+	{
+		// Going from xAPIC to x2APIC mode is allowed while enabled,
+		// and the firmware left it enabled.
+		wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE | APIC_BASE_X2APIC_ENABLE);
+	}
+
+	apic_write(APIC_REG_SPURIOUS, APIC_SPURIOUS_ENABLE | INTERRUPT_VECTOR_APIC_SPURIOUS);
+}
+
+uint32_t
+apic_id(void)
+{
+	if (x2apic_mode)
+	{
+		return apic_read(APIC_REG_ID);
+	}
+
+	return apic_read(APIC_REG_ID) >> 24;
+}
+
+void
+apic_eoi(void)
+{
+	apic_write(APIC_REG_EOI, 0);
+}
+
+uint32_t
+apic_timer_calibrate(void)
+{
+	if (tsc_deadline_mode)
+	{
+		return clock_tsc_hz() / 1000;
+	}
+
+	apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+	apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED);
+	apic_write(APIC_REG_TIMER_INITIAL_COUNT, UINT32_MAX);
+
+	pit_delay_us(APIC_TIMER_CALIBRATION_US);
+
+	uint32_t elapsed = UINT32_MAX - apic_read(APIC_REG_TIMER_CURRENT_COUNT);
+	apic_write(APIC_REG_TIMER_INITIAL_COUNT, 0);
+
+	return elapsed / (APIC_TIMER_CALIBRATION_US / 1000);
+}
+
+// Arms the TSC-deadline timer for the earlier of the tick and the one-shot
+// deadline, unless it already is.
+static void
+apic_timer_program(size_t index)
+{
+	uint64_t deadline = timer_deadline[index];
+	if (timer_oneshot[index] < deadline)
+	{
+		deadline = timer_oneshot[index];
+	}
+
+	if (deadline == timer_programmed[index])
+	{
+		return;
+	}
+
+	// Writing 0 disarms it.
+	timer_programmed[index] = deadline;
+	wrmsr(MSR_TSC_DEADLINE, deadline == UINT64_MAX ? 0 : deadline);
+}
+
+void
+apic_timer_start_periodic(uint8_t vector, uint32_t ticks)
+{
+	if (tsc_deadline_mode)
+	{
+		size_t index = this_cpu()->index;
+		timer_period[index] = ticks;
+		timer_deadline[index] = rdtsc() + ticks;
+		timer_oneshot[index] = UINT64_MAX;
+		timer_programmed[index] = UINT64_MAX;
+
+		apic_write(APIC_REG_LVT_TIMER, APIC_LVT_TIMER_TSC_DEADLINE | vector);
+
+		// The LVT write must land before the deadline is armed, and
+		// writes to x2APIC MSRs aren't serializing.
+		asm volatile("mfence" : : : "memory");
+		apic_timer_program(index);
+		return;
+	}
+
+	apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+	apic_write(APIC_REG_LVT_TIMER, APIC_LVT_TIMER_PERIODIC | vector);
+	apic_write(APIC_REG_TIMER_INITIAL_COUNT, ticks);
+}
+
+bool
+apic_timer_rearm(void)
+{
+	if (!tsc_deadline_mode)
+	{
+		return true;
+	}
+
+	size_t index = this_cpu()->index;
+	uint64_t now = rdtsc();
+
+	// It has fired, so nothing is armed any more.
+	timer_programmed[index] = UINT64_MAX;
+
+	if (timer_oneshot[index] <= now)
+	{
+		timer_oneshot[index] = UINT64_MAX;
+	}
+
+	bool tick = timer_deadline[index] <= now;
+	if (tick)
+	{
+		// Keep to the original schedule, unless we have fallen a whole period behind.
+		uint64_t deadline = timer_deadline[index] + timer_period[index];
+		if (deadline <= now)
+		{
+			deadline = now + timer_period[index];
+		}
+
+		timer_deadline[index] = deadline;
+	}
+
+	apic_timer_program(index);
+
+	return tick;
+}
+
+void
+apic_timer_set_oneshot(uint64_t deadline)
+{
+	if (!tsc_deadline_mode)
+	{
+		return;
+	}
+
+	size_t index = this_cpu()->index;
+	timer_oneshot[index] = deadline == 0 ? UINT64_MAX : deadline;
+	apic_timer_program(index);
+}
+
+void
+apic_timer_stop_tick(void)
+{
+	if (!tsc_deadline_mode)
+	{
+		return;
+	}
+
+	size_t index = this_cpu()->index;
+	timer_deadline[index] = UINT64_MAX;
+	apic_timer_program(index);
+}
+
+void
+apic_timer_restart_tick(void)
+{
+	if (!tsc_deadline_mode)
+	{
+		return;
+	}
+
+	size_t index = this_cpu()->index;
+	if (timer_deadline[index] != UINT64_MAX)
+	{
+		return;
+	}
+
+	timer_deadline[index] = rdtsc() + timer_period[index];
+	apic_timer_program(index);
+}
+
+void
+apic_timer_stop(void)
+{
+	if (tsc_deadline_mode)
+	{
+		size_t index = this_cpu()->index;
+		timer_deadline[index] = UINT64_MAX;
+		timer_oneshot[index] = UINT64_MAX;
+		timer_programmed[index] = UINT64_MAX;
+		wrmsr(MSR_TSC_DEADLINE, 0);
+	}
+
+	apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED);
+	apic_write(APIC_REG_TIMER_INITIAL_COUNT, 0);
+}
+
+void
+apic_perf_counter_nmi(bool enabled)
+{
+	apic_write(APIC_REG_LVT_PERF, APIC_LVT_DELIVERY_NMI | (enabled ? 0 : APIC_LVT_MASKED));
+}
+
+static void
+apic_send_icr(uint32_t target_apic_id, uint32_t icr_low)
+{
+	if (x2apic_mode)
+	{
+		// A single write, and nothing to wait for. Unlike the MMIO
+		// write, WRMSR doesn't wait for earlier stores, which the
+		// target may be about to look at.
+		asm volatile("mfence" : : : "memory");
+		wrmsr(MSR_X2APIC_BASE + APIC_REG_ICR_LOW / 16, ((uint64_t) target_apic_id << 32) | icr_low);
+		return;
+	}
+
+	// An interrupt handler sending an IPI of its own in between the
+	// two writes would send ours to its target.
+	uint64_t flags = local_irq_save();
+
+	apic_write(APIC_REG_ICR_HIGH, target_apic_id << 24);
+	apic_write(APIC_REG_ICR_LOW, icr_low);
+
+	while ((apic_read(APIC_REG_ICR_LOW) & APIC_ICR_DELIVERY_PENDING) != 0)
+	{
+		cpu_relax();
+	}
+
+	local_irq_restore(flags);
+}
+
+void
+apic_send_init(uint32_t target_apic_id)
+{
+	apic_send_icr(target_apic_id, APIC_ICR_DELIVERY_INIT | APIC_ICR_LEVEL_ASSERT);
+}
+
+void
+apic_send_startup(uint32_t target_apic_id, uint8_t vector)
+{
+	apic_send_icr(target_apic_id, APIC_ICR_DELIVERY_STARTUP | APIC_ICR_LEVEL_ASSERT | vector);
+}
+
+void
+apic_send_ipi(uint32_t target_apic_id, uint8_t vector)
+{
+	apic_send_icr(target_apic_id, APIC_ICR_DELIVERY_FIXED | APIC_ICR_LEVEL_ASSERT | vector);
+}
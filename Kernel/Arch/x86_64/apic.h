@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Picks x2APIC mode and the TSC-deadline timer if the CPU has them.
+// Otherwise maps the xAPIC registers, which are at the same physical
+// address for every CPU.
+bool init_apic(uint64_t apic_phys);
+
+bool apic_is_x2apic(void);
+bool apic_timer_is_tsc_deadline(void);
+
+// Software-enables the local APIC of the calling CPU, switching it to
+// x2APIC mode if that is what the bootstrap CPU picked.
+void apic_enable_local(void);
+
+uint32_t apic_id(void);
+
+void apic_eoi(void);
+
+// Measures the local APIC timer against the PIT, and returns the number
+// of timer ticks in a millisecond. The rate is the same on every CPU.
+// With the TSC-deadline timer, the ticks are TSC cycles.
+uint32_t apic_timer_calibrate(void);
+
+// Makes the local APIC timer of the calling CPU raise `vector` every
+// `ticks` timer ticks.
+void apic_timer_start_periodic(uint8_t vector, uint32_t ticks);
+
+// The TSC-deadline timer only fires once, so its interrupt handler has
+// to call this to get the next period going. Returns whether the tick
+// was due, rather than only the one-shot deadline. Always true with the
+// other timer modes, which have no one-shot deadline.
+bool apic_timer_rearm(void);
+
+// The rest only do anything with the TSC-deadline timer. Interrupts must
+// be disabled, as they change the state of the calling CPU's timer.
+
+// Makes the timer interrupt also come at TSC `deadline`, on top of the
+// periodic tick. 0 cancels it.
+void apic_timer_set_oneshot(uint64_t deadline);
+
+// For going without the tick while idle, leaving only the one-shot deadline.
+void apic_timer_stop_tick(void);
+void apic_timer_restart_tick(void);
+
+void apic_timer_stop(void);
+
+// Makes the calling CPU's performance counter overflows come in as NMIs,
+// or masks them. Delivering one masks them too, so the NMI handler has
+// to unmask them again.
+void apic_perf_counter_nmi(bool enabled);
+
+void apic_send_init(uint32_t target_apic_id);
+void apic_send_startup(uint32_t target_apic_id, uint8_t vector);
+void apic_send_ipi(uint32_t target_apic_id, uint8_t vector);
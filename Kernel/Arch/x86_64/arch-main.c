@@ -1,8 +1,150 @@
 #include <SampoOS/Kernel/bootinfo.h>
 #include "memory-manager.h"
+#include "interrupts.h"
+#include "address-space.h"
+#include "percpu.h"
+#include "acpi.h"
+#include "smp.h"
+#include "ioapic.h"
+#include "tlb.h"
+#include "clock.h"
+#include "syscall.h"
+#include "fpu.h"
+#include "symbols.h"
+#include "sched.h"
+#include "rcu.h"
+#include "idle.h"
+#include "timer.h"
+#include "workqueue.h"
+#include "serial.h"
+#include "printk.h"
+#include "bench.h"
+#include "lockstat.h"
+#include "latency-trace.h"
+#include "profiler.h"
+#include "static-key.h"
+#include "trace.h"
 
 void
 kernel_arch_init(struct sampo_bootinfo *info)
 {
+	serial_init();
+	init_percpu();
+	init_printk();
+	init_interrupts();
+	init_static_keys();
 	init_memory_manager(info);
+	if (!init_interrupt_stacks())
+	{
+		printk("Could not allocate the exception stacks");
+	}
+
+	if (!init_symbols(info))
+	{
+		printk("No kernel symbols, addresses stay unresolved");
+	}
+
+	init_address_spaces();
+	init_tlb();
+	syscall_init_cpu();
+	init_fpu();
+
+	if (init_acpi(info->acpi_rsdp_ptr))
+	{
+		init_smp();
+		if (!init_ioapic())
+		{
+			printk("No I/O APIC found, device interrupts are off");
+		}
+	}
+	else
+	{
+		printk("No ACPI tables found, only using the bootstrap CPU");
+	}
+
+	if (!init_clock())
+	{
+		printk("Could not set up the clock");
+		return;
+	}
+
+	init_rcu();
+	init_idle();
+	init_timers();
+
+	if (!init_sched())
+	{
+		printk("Could not start the scheduler");
+		return;
+	}
+
+	if (!serial_enable_interrupts())
+	{
+		printk("Serial output stays polled");
+	}
+
+	if (init_workqueues())
+	{
+		printk_start_deferred();
+		pmm_start_background_compaction();
+	}
+	else
+	{
+		printk("Could not start the work queues");
+	}
+
+#ifdef SAMPO_PROFILER
+	if (init_profiler())
+	{
+		profiler_start(PROFILER_DEFAULT_HZ);
+	}
+	else
+	{
+		printk("Could not start the profiler");
+	}
+#endif
+
+#ifdef SAMPO_TRACE
+	if (!trace_set_all(true))
+	{
+		printk("Could not allocate the trace buffers");
+	}
+#endif
+
+#ifdef SAMPO_BENCHMARKS
+	bench_page_coloring();
+	bench_compaction();
+	bench_fork();
+	bench_sched();
+	bench_rcu();
+	bench_ipi();
+	bench_workqueue();
+	bench_idle();
+	bench_timer();
+	bench_interrupts();
+	bench_clock();
+	bench_syscall();
+	bench_serial();
+	bench_printk();
+	bench_fpu();
+	bench_trace();
+#endif
+
+#ifdef SAMPO_TRACE
+	trace_set_all(false);
+	trace_dump();
+#endif
+
+#ifdef SAMPO_PROFILER
+	profiler_stop();
+	profiler_dump();
+#endif
+
+#ifdef SAMPO_LOCKSTAT
+	lockstat_dump();
+#endif
+
+#ifdef SAMPO_LATENCY_TRACE
+	latency_trace_dump();
+#endif
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include "latency-trace.h"
 
 inline void
 outb(uint16_t port, uint8_t val)
@@ -52,3 +53,132 @@ inl(uint16_t port)
 
 	return ret;
 }
+
+static inline uint64_t
+rdtsc(void)
+{
+	uint32_t low, high;
+	asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+
+	return ((uint64_t)high << 32) | low;
+}
+
+static inline uintptr_t
+read_cr2(void)
+{
+	uintptr_t ret;
+	asm volatile ("mov %%cr2, %0" : "=r"(ret));
+
+	return ret;
+}
+
+#define CR0_WRITE_PROTECT (UINT64_C(1) << 16)
+
+static inline uintptr_t
+read_cr0(void)
+{
+	uintptr_t ret;
+	asm volatile ("mov %%cr0, %0" : "=r"(ret));
+
+	return ret;
+}
+
+static inline void
+write_cr0(uintptr_t val)
+{
+	asm volatile ("mov %0, %%cr0" : : "r"(val) : "memory");
+}
+
+static inline uintptr_t
+read_cr3(void)
+{
+	uintptr_t ret;
+	asm volatile ("mov %%cr3, %0" : "=r"(ret));
+
+	return ret;
+}
+
+static inline void
+write_cr3(uintptr_t val)
+{
+	asm volatile ("mov %0, %%cr3" : : "r"(val) : "memory");
+}
+
+// Disables interrupts on this CPU, returning the previous RFLAGS
+// so that local_irq_restore can put them back the way they were.
+#define RFLAGS_INTERRUPT_ENABLE (UINT64_C(1) << 9)
+
+static inline uint64_t
+local_irq_save(void)
+{
+	uint64_t flags;
+	asm volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+
+	if ((flags & RFLAGS_INTERRUPT_ENABLE) != 0)
+	{
+		latency_trace_irqs_off(LATENCY_TRACE_HERE());
+	}
+
+	return flags;
+}
+
+static inline void
+local_irq_restore(uint64_t flags)
+{
+	if ((flags & RFLAGS_INTERRUPT_ENABLE) != 0)
+	{
+		latency_trace_irqs_on(LATENCY_TRACE_HERE());
+	}
+
+	asm volatile ("push %0; popfq" : : "r"(flags) : "memory", "cc");
+}
+
+// For when there is no previous state to go back to.
+static inline void
+local_irq_disable(void)
+{
+	local_irq_save();
+}
+
+static inline void
+local_irq_enable(void)
+{
+	latency_trace_irqs_on(LATENCY_TRACE_HERE());
+	asm volatile ("sti" : : : "memory");
+}
+
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint32_t low, high;
+	asm volatile ("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+
+	return ((uint64_t)high << 32) | low;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t) val), "d"((uint32_t)(val >> 32)));
+}
+
+static inline uintptr_t
+read_cr4(void)
+{
+	uintptr_t ret;
+	asm volatile ("mov %%cr4, %0" : "=r"(ret));
+
+	return ret;
+}
+
+static inline void
+write_cr4(uintptr_t val)
+{
+	asm volatile ("mov %0, %%cr4" : : "r"(val) : "memory");
+}
+
+static inline void
+cpu_relax(void)
+{
+	asm volatile ("pause" : : : "memory");
+}
@@ -0,0 +1,53 @@
+; The user mode half of bench-clock.c. It is copied into a user page, so
+; it must not refer to anything outside itself.
+
+; From <SampoOS/syscall.h>.
+%define SYSCALL_EXIT 0
+%define SYSCALL_CLOCK 2
+%define CLOCK_MONOTONIC 0
+
+%define PAGE_SIZE 4096
+
+section .rodata
+global bench_clock_user:data
+global bench_clock_user_end:data
+
+; Reads the monotonic clock as many times as RDI says, with the clock
+; system call, and exits with the TSC cycles that took. How many times
+; the clock went backwards is left at the bottom of the stack page, which
+; RSP starts out at the top of. R12 to R15 survive the calls.
+bench_clock_user:
+	mov r12, rdi
+	xor r14, r14 ; <- The last reading.
+	xor r15, r15 ; <- Times the clock went backwards.
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov r13, rax
+
+.call:
+	mov eax, SYSCALL_CLOCK
+	mov edi, CLOCK_MONOTONIC
+	syscall
+	cmp rax, r14
+	jae .forward
+	inc r15
+.forward:
+	mov r14, rax
+	dec r12
+	jnz .call
+
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	sub rax, r13
+
+	mov [rsp - PAGE_SIZE], r15
+
+	mov rdi, rax
+	mov eax, SYSCALL_EXIT
+	syscall
+	ud2
+bench_clock_user_end:
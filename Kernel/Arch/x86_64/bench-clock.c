@@ -0,0 +1,104 @@
+#include <SampoOS/Kernel/memman.h>
+#include "bench.h"
+#include "clock.h"
+#include "syscall.h"
+#include "address-space.h"
+#include "preempt.h"
+#include "pit.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define CALLS 1000000
+
+#define DRIFT_CHECK_US 50000
+
+extern const uint8_t bench_clock_user[];
+extern const uint8_t bench_clock_user_end[];
+
+static void
+print_per_call(const char *name, uint64_t cycles, size_t backwards)
+{
+	// In tenths of a nanosecond.
+	uint64_t tenths = clock_cycles_to_ns(cycles * 10) / CALLS;
+	serial_printf("\t%s | %u.%u | %u | %u\n",
+		      name,
+		      (unsigned int) (tenths / 10),
+		      (unsigned int) (tenths % 10),
+		      (unsigned int) (cycles / CALLS),
+		      (unsigned int) backwards);
+}
+
+static void
+bench_page(void)
+{
+	const struct sampo_clock_page *page = clock_page();
+
+	size_t backwards = 0;
+	uint64_t last = 0;
+	uint64_t start = rdtsc();
+	for (size_t i = 0; i < CALLS; ++i)
+	{
+		uint64_t now = sampo_clock_monotonic_ns(page);
+		if (now < last)
+		{
+			++backwards;
+		}
+		last = now;
+	}
+	uint64_t cycles = rdtsc() - start;
+
+	print_per_call("clock page", cycles, backwards);
+}
+
+// What reading the clock page saves: getting into the kernel and back.
+static void
+bench_syscall_clock(void)
+{
+	if (!bench_map_user(bench_clock_user, bench_clock_user_end - bench_clock_user))
+	{
+		serial_write("\tCould not map the user pages\n");
+		return;
+	}
+
+	// Our user mode runs in this thread's address space, which is the
+	// CPU's, so it must stay here.
+	preempt_disable();
+	uint64_t cycles = syscall_enter_user(BENCH_USER_CODE, BENCH_USER_STACK + PAGE_SIZE, CALLS);
+	size_t backwards = *(volatile uint64_t *) BENCH_USER_STACK;
+	preempt_enable();
+
+	as_clear_user(as_current());
+
+	print_per_call("system call", cycles, backwards);
+}
+
+// Times a PIT wait with the clock, which is off by the calibration error,
+// plus what it takes to program the PIT.
+static void
+check_drift(void)
+{
+	uint64_t start = clock_monotonic_ns();
+	pit_delay_us(DRIFT_CHECK_US);
+	uint64_t elapsed_us = (clock_monotonic_ns() - start) / 1000;
+
+	serial_printf("\t%u us PIT wait took %u us by the clock\n",
+		      DRIFT_CHECK_US,
+		      (unsigned int) elapsed_us);
+}
+
+void
+bench_clock(void)
+{
+	serial_printf("Clock benchmark (TSC at %u kHz from the %s, %s):\n",
+		      (unsigned int) (clock_tsc_hz() / 1000),
+		      clock_calibration_source(),
+		      clock_tsc_is_invariant() ? "invariant" : "not invariant");
+	serial_write("\tpath | ns per call | cycles per call | went backwards\n");
+
+	bench_page();
+	bench_syscall_clock();
+	check_drift();
+
+	uint64_t realtime = clock_realtime_ns() / 1000000000;
+	serial_printf("\trealtime is %u s since 1970\n", (unsigned int) realtime);
+}
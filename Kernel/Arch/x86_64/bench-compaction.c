@@ -0,0 +1,76 @@
+#include <SampoOS/Kernel/memman.h>
+#include "bench.h"
+#include "memory-manager.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+// Demand-paged pages, which end up every other one in their blocks.
+#define MOVABLE_PAGES 2048
+
+static uintptr_t pinned_pages[MOVABLE_PAGES];
+
+void
+bench_compaction(void)
+{
+	serial_write("Compaction benchmark:\n");
+
+	volatile uint64_t *buffer = virt_reserve_pages_kernel_end(MOVABLE_PAGES, VIRT_MAP_READ | VIRT_MAP_WRITE, 0);
+	if (buffer == NULL)
+	{
+		serial_write("\tCould not reserve the buffer\n");
+		return;
+	}
+
+	// Interleave the buffer's pages with pinned ones, then let go of
+	// those, leaving sparse blocks of movable pages.
+	size_t pinned = 0;
+	for (size_t i = 0; i < MOVABLE_PAGES; ++i)
+	{
+		pinned_pages[i] = pmm_alloc_page();
+		pinned += pinned_pages[i] != 0 ? 1 : 0;
+		buffer[i * PAGE_SIZE / sizeof(uint64_t)] = i;
+	}
+
+	for (size_t i = 0; i < MOVABLE_PAGES; ++i)
+	{
+		if (pinned_pages[i] != 0)
+		{
+			pmm_free_page(pinned_pages[i]);
+		}
+	}
+
+	struct pmm_compaction_stats before;
+	pmm_get_compaction_stats(&before);
+
+	uint64_t start = rdtsc();
+	size_t reclaimed = pmm_compact(SIZE_MAX, 0);
+	uint64_t cycles = rdtsc() - start;
+
+	struct pmm_compaction_stats after;
+	pmm_get_compaction_stats(&after);
+
+	size_t corrupted = 0;
+	for (size_t i = 0; i < MOVABLE_PAGES; ++i)
+	{
+		corrupted += buffer[i * PAGE_SIZE / sizeof(uint64_t)] != i ? 1 : 0;
+	}
+
+	serial_printf("\t%zu pages interleaved with %zu pinned ones: %zu blocks reclaimed, %llu pages moved, %llu blocks skipped in %llu cycles\n",
+		      (size_t) MOVABLE_PAGES,
+		      pinned,
+		      reclaimed,
+		      (unsigned long long) (after.pages_moved - before.pages_moved),
+		      (unsigned long long) (after.blocks_skipped - before.blocks_skipped),
+		      (unsigned long long) cycles);
+	if (corrupted != 0)
+	{
+		serial_printf("\t%zu pages lost their contents in the move\n", corrupted);
+	}
+
+	uintptr_t block = pmm_alloc_huge_page();
+	serial_printf("\tHuge page allocation %s\n", block != 0 ? "succeeded" : "failed");
+	for (size_t i = 0; block != 0 && i < 512; ++i)
+	{
+		pmm_free_page(block + i * PAGE_SIZE);
+	}
+}
@@ -0,0 +1,142 @@
+#include <SampoOS/Kernel/memman.h>
+#include <string.h>
+#include "bench.h"
+#include "address-space.h"
+#include "memory-manager.h"
+#include "tlb.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+// Where the benchmark's "parent process" keeps its memory.
+#define BENCH_USER_BASE UINT64_C(0x0000008000000000)
+
+#define ITERATIONS 8
+
+static const size_t rss_sizes[] = { 0, 16, 64, 256, 1024, 4096 };
+
+// Grows the resident set of the active address space to `page_count` pages.
+static bool
+grow_rss(size_t page_count)
+{
+	for (size_t i = as_current()->resident_pages; i < page_count; ++i)
+	{
+		uintptr_t page = pmm_alloc_page();
+		if (page == 0)
+		{
+			return false;
+		}
+
+		uintptr_t virt_addr = BENCH_USER_BASE + i * PAGE_SIZE;
+		if (!as_map_user_page(virt_addr, page, VIRT_MAP_READ | VIRT_MAP_WRITE))
+		{
+			pmm_free_page(page);
+			return false;
+		}
+
+		memset((void *)virt_addr, (int) i, PAGE_SIZE);
+	}
+
+	return true;
+}
+
+void
+bench_fork(void)
+{
+	serial_write("Fork/exec benchmark (cycles, average of 8):\n");
+	serial_write("\tRSS pages | fork | exec | first write | eager copy\n");
+
+	struct address_space child;
+
+	for (size_t i = 0; i < sizeof(rss_sizes) / sizeof(*rss_sizes); ++i)
+	{
+		size_t rss = rss_sizes[i];
+		if (!grow_rss(rss))
+		{
+			serial_write("\tOut of memory\n");
+			break;
+		}
+
+		uint64_t fork_cycles = 0;
+		uint64_t exec_cycles = 0;
+		uint64_t write_cycles = 0;
+		for (size_t iteration = 0; iteration < ITERATIONS; ++iteration)
+		{
+			uint64_t start = rdtsc();
+			if (!as_clone(&child))
+			{
+				serial_write("\tCould not clone the address space\n");
+				return;
+			}
+			fork_cycles += rdtsc() - start;
+
+			// The parent writing to its memory while the child still
+			// shares it, which is where the copying is actually paid for.
+			if (rss != 0)
+			{
+				start = rdtsc();
+				*(volatile uint8_t *) BENCH_USER_BASE = 0;
+				write_cycles += rdtsc() - start;
+			}
+
+			// An exec throws the cloned user half away right away.
+			start = rdtsc();
+			as_clear_user(&child);
+			exec_cycles += rdtsc() - start;
+
+			as_destroy(&child);
+		}
+
+		// What a fork copying all of the memory up front would cost at least.
+		bool copied = true;
+		uint64_t start = rdtsc();
+		for (size_t page = 0; page < rss; ++page)
+		{
+			uintptr_t copy_page = pmm_alloc_page();
+			if (copy_page == 0)
+			{
+				copied = false;
+				break;
+			}
+
+			void *copy_window = virt_map_pages(copy_page, 1, VIRT_MAP_READ | VIRT_MAP_WRITE);
+			if (copy_window == NULL)
+			{
+				pmm_free_page(copy_page);
+				copied = false;
+				break;
+			}
+
+			memcpy(copy_window, (void *)(BENCH_USER_BASE + page * PAGE_SIZE), PAGE_SIZE);
+			virt_unmap_pages(copy_window, 1);
+			pmm_free_page(copy_page);
+		}
+		uint64_t copy_cycles = rdtsc() - start;
+
+		// A copy cut short would look cheaper than it is.
+		if (!copied)
+		{
+			serial_write("\tOut of memory\n");
+			break;
+		}
+
+		serial_printf("\t%u | %u | %u | %u | %u\n",
+			      (unsigned int) rss,
+			      (unsigned int) (fork_cycles / ITERATIONS),
+			      (unsigned int) (exec_cycles / ITERATIONS),
+			      (unsigned int) (write_cycles / ITERATIONS),
+			      (unsigned int) copy_cycles);
+	}
+
+	as_clear_user(as_current());
+
+	struct tlb_stats tlb;
+	tlb_get_stats(&tlb);
+	serial_printf("\tTLB: %u shootdowns, %u IPIs sent, %u pages requested, %u invalidated one by one\n",
+		      (unsigned int) tlb.shootdowns,
+		      (unsigned int) tlb.ipis_sent,
+		      (unsigned int) tlb.pages_requested,
+		      (unsigned int) tlb.pages_invalidated);
+	serial_printf("\t     %u full flushes, %u kernel purges\n",
+		      (unsigned int) tlb.full_flushes,
+		      (unsigned int) tlb.kernel_purges);
+}
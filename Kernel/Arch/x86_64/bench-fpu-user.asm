@@ -0,0 +1,28 @@
+; The user mode half of bench-fpu.c. It is copied into a user page, so it
+; must not refer to anything outside itself.
+
+; From <SampoOS/syscall.h>.
+%define SYSCALL_EXIT 0
+
+section .rodata
+global bench_fpu_user:data
+global bench_fpu_user_end:data
+
+; Exits right away with zero if RDI is, and otherwise counts up in XMM0,
+; exiting with the new count. That only comes out as the number of times
+; the thread has been here if its state was kept in between.
+bench_fpu_user:
+	xor eax, eax
+	test rdi, rdi
+	jz .exit
+
+	movq rax, xmm0
+	inc rax
+	movq xmm0, rax
+
+.exit:
+	mov rdi, rax
+	mov eax, SYSCALL_EXIT
+	syscall
+	ud2
+bench_fpu_user_end:
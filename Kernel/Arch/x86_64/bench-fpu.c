@@ -0,0 +1,138 @@
+#include <SampoOS/Kernel/memman.h>
+#include "bench.h"
+#include "fpu.h"
+#include "sched.h"
+#include "percpu.h"
+#include "syscall.h"
+#include "address-space.h"
+#include "preempt.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define ROUNDS 10000
+
+// How often the SIMD threads also use the registers in the kernel, which
+// mustn't show in their counts.
+#define KERNEL_USE_INTERVAL 64
+
+extern const uint8_t bench_fpu_user[];
+extern const uint8_t bench_fpu_user_end[];
+
+enum round_kind
+{
+	ROUND_KERNEL, // <- Only yields.
+	ROUND_USER, // <- Goes to user mode and back before yielding.
+	ROUND_USER_SIMD, // <- The same, touching XMM0 there.
+};
+
+static size_t threads_done;
+static size_t mismatches;
+
+static void
+wait_for_threads(size_t count)
+{
+	while (__atomic_load_n(&threads_done, __ATOMIC_ACQUIRE) < count)
+	{
+		thread_yield();
+	}
+
+	__atomic_store_n(&threads_done, 0, __ATOMIC_RELAXED);
+}
+
+static void
+round_thread(void *arg)
+{
+	enum round_kind kind = (enum round_kind) (uintptr_t) arg;
+
+	for (size_t round = 1; round <= ROUNDS; ++round)
+	{
+		if (kind != ROUND_KERNEL)
+		{
+			// The user pages are only mapped on this CPU.
+			preempt_disable();
+			uint64_t count = syscall_enter_user(BENCH_USER_CODE, BENCH_USER_STACK + PAGE_SIZE,
+							    kind == ROUND_USER_SIMD);
+			preempt_enable();
+
+			if (kind == ROUND_USER_SIMD && count != round)
+			{
+				__atomic_fetch_add(&mismatches, 1, __ATOMIC_RELAXED);
+			}
+		}
+
+		if (kind == ROUND_USER_SIMD && round % KERNEL_USE_INTERVAL == 0)
+		{
+			kernel_fpu_begin();
+			asm volatile ("pxor %%xmm0, %%xmm0" : : : "memory");
+			kernel_fpu_end();
+		}
+
+		thread_yield();
+	}
+
+	__atomic_fetch_add(&threads_done, 1, __ATOMIC_RELEASE);
+}
+
+static void
+bench_switches(const char *name, enum round_kind first, enum round_kind second)
+{
+	struct sched_stats sched_before;
+	struct sched_stats sched_after;
+	struct fpu_stats fpu_before;
+	struct fpu_stats fpu_after;
+
+	__atomic_store_n(&mismatches, 0, __ATOMIC_RELAXED);
+	sched_get_stats(&sched_before);
+	fpu_get_stats(&fpu_before);
+
+	uint64_t start = rdtsc();
+	if (!thread_spawn(round_thread, (void *) (uintptr_t) first)
+	    || !thread_spawn(round_thread, (void *) (uintptr_t) second))
+	{
+		serial_write("\tCould not spawn a thread\n");
+		return;
+	}
+	wait_for_threads(2);
+	uint64_t cycles = rdtsc() - start;
+
+	sched_get_stats(&sched_after);
+	fpu_get_stats(&fpu_after);
+
+	uint64_t switches = sched_after.context_switches - sched_before.context_switches;
+	serial_printf("\t%s | %llu | %llu/%llu | %llu/%llu | %zu\n",
+		      name,
+		      (unsigned long long) (switches == 0 ? 0 : cycles / switches),
+		      (unsigned long long) (fpu_after.saves - fpu_before.saves),
+		      (unsigned long long) (fpu_after.saves_skipped - fpu_before.saves_skipped),
+		      (unsigned long long) (fpu_after.loads - fpu_before.loads),
+		      (unsigned long long) (fpu_after.loads_skipped - fpu_before.loads_skipped),
+		      __atomic_load_n(&mismatches, __ATOMIC_RELAXED));
+}
+
+void
+bench_fpu(void)
+{
+	serial_printf("FPU context switch benchmark (cycles, %zu byte state, %s):\n",
+		      fpu_state_size(), fpu_save_method_name());
+
+	if (!bench_map_user(bench_fpu_user, bench_fpu_user_end - bench_fpu_user))
+	{
+		serial_write("\tCould not map the user pages\n");
+		return;
+	}
+
+	// The threads stay on this CPU, with the user pages.
+	sched_set_active_cpus(1);
+
+	serial_write("\tthreads | per switch | saved/skipped | loaded/skipped | lost counts\n");
+	bench_switches("kernel only", ROUND_KERNEL, ROUND_KERNEL);
+	bench_switches("user, no SIMD", ROUND_USER, ROUND_USER);
+	bench_switches("user, SIMD", ROUND_USER_SIMD, ROUND_USER_SIMD);
+
+	// The kernel thread never needs the registers, so the other one's
+	// state stays in them.
+	bench_switches("user SIMD and kernel", ROUND_USER_SIMD, ROUND_KERNEL);
+
+	sched_set_active_cpus(cpu_count);
+	as_clear_user(as_current());
+}
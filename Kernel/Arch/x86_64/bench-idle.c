@@ -0,0 +1,184 @@
+#include "bench.h"
+#include "idle.h"
+#include "apic.h"
+#include "percpu.h"
+#include "preempt.h"
+#include "interrupts.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define WAKEUPS 1000
+
+// How long a CPU gets to fall asleep before we wake it up.
+#define SETTLE_CYCLES 20000
+
+// Long enough for the wake-ups to land while the CPU is still polling.
+#define POLL_CYCLES 200000
+
+#define STATE_TIMEOUT_CYCLES UINT64_C(1000000000)
+
+static bool
+wait_for_state(size_t cpu_index, bool idle)
+{
+	uint64_t start = rdtsc();
+	while (idle_cpu_is_idle(cpu_index) != idle)
+	{
+		if (rdtsc() - start > STATE_TIMEOUT_CYCLES)
+		{
+			return false;
+		}
+
+		cpu_relax();
+	}
+
+	return true;
+}
+
+// Wakes up every other CPU in turn, the way sched_wake_worker does.
+static bool
+wake_others(size_t self)
+{
+	for (size_t round = 0; round < WAKEUPS; ++round)
+	{
+		size_t target = (self + 1 + round % (cpu_count - 1)) % cpu_count;
+		if (!wait_for_state(target, true))
+		{
+			return false;
+		}
+
+		uint64_t start = rdtsc();
+		while (rdtsc() - start < SETTLE_CYCLES)
+		{
+			cpu_relax();
+		}
+
+		if (!idle_wake(target))
+		{
+			apic_send_ipi(cpus[target].apic_id, INTERRUPT_VECTOR_SCHED_KICK);
+		}
+
+		if (!wait_for_state(target, false))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// The bucket the given fraction of the wake-ups fall below.
+static size_t
+latency_percentile(const uint64_t *latency, uint64_t total, unsigned int percent)
+{
+	uint64_t seen = 0;
+	for (size_t i = 0; i < IDLE_LATENCY_BUCKETS; ++i)
+	{
+		seen += latency[i];
+		if (seen * 100 >= total * percent)
+		{
+			return i;
+		}
+	}
+
+	return IDLE_LATENCY_BUCKETS - 1;
+}
+
+static void
+run(const char *name, size_t self)
+{
+	idle_reset_stats();
+
+	if (!wake_others(self))
+	{
+		serial_printf("\t%s | a CPU stopped responding\n", name);
+		return;
+	}
+
+	struct idle_stats total = { 0 };
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		struct idle_stats stats;
+		idle_get_stats(i, &stats);
+
+		total.store_wakes += stats.store_wakes;
+		total.ipi_wakes += stats.ipi_wakes;
+		for (size_t bucket = 0; bucket < IDLE_LATENCY_BUCKETS; ++bucket)
+		{
+			total.latency[bucket] += stats.latency[bucket];
+		}
+	}
+
+	uint64_t measured = 0;
+	for (size_t bucket = 0; bucket < IDLE_LATENCY_BUCKETS; ++bucket)
+	{
+		measured += total.latency[bucket];
+	}
+
+	if (measured == 0)
+	{
+		serial_printf("\t%s | no wake-ups measured\n", name);
+		return;
+	}
+
+	serial_printf("\t%s | %u | %u | < 2^%u | < 2^%u\n",
+		      name,
+		      (unsigned int) total.store_wakes,
+		      (unsigned int) total.ipi_wakes,
+		      (unsigned int) latency_percentile(total.latency, measured, 50) + 1,
+		      (unsigned int) latency_percentile(total.latency, measured, 99) + 1);
+
+	for (size_t bucket = 0; bucket < IDLE_LATENCY_BUCKETS; ++bucket)
+	{
+		if (total.latency[bucket] != 0)
+		{
+			serial_printf("\t\t2^%u: %u\n", (unsigned int) bucket, (unsigned int) total.latency[bucket]);
+		}
+	}
+}
+
+void
+bench_idle(void)
+{
+	serial_printf("Idle wake-up latency benchmark (cycles, MWAIT %s):\n",
+		      idle_has_mwait() ? "supported" : "not supported");
+
+	if (cpu_count < 2)
+	{
+		serial_write("\tOnly one CPU\n");
+		return;
+	}
+
+	// Stay on this CPU while the others idle.
+	preempt_disable();
+	size_t self = this_cpu()->index;
+
+	enum idle_method method = idle_get_method();
+
+	serial_write("\tmethod | store wakes | IPI wakes | median | 99th percentile\n");
+
+	idle_set_method(IDLE_METHOD_HLT);
+	run("HLT + IPI", self);
+
+	if (idle_set_method(IDLE_METHOD_MWAIT))
+	{
+		for (unsigned int cstate = 1; cstate < 8; ++cstate)
+		{
+			if (idle_set_cstate(cstate))
+			{
+				serial_printf("\tMWAIT C%u (hint 0x%x):\n", cstate, (unsigned int) idle_mwait_hint());
+				run("MWAIT", self);
+			}
+		}
+
+		// Back to the default.
+		idle_set_cstate(1);
+	}
+
+	idle_set_poll_cycles(POLL_CYCLES);
+	run("poll", self);
+	idle_set_poll_cycles(0);
+
+	idle_set_method(method);
+
+	preempt_enable();
+}
@@ -0,0 +1,190 @@
+#include "bench.h"
+#include "apic.h"
+#include "percpu.h"
+#include "preempt.h"
+#include "interrupts.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define ROUNDS 1000
+
+// Close enough that the tick rarely gets in first, and takes the deadline
+// with it, see timer_interrupt.
+#define DEADLINE_CYCLES 20000
+
+#define TIMEOUT_CYCLES UINT64_C(100000000)
+
+struct latency
+{
+	uint64_t total;
+	uint64_t best;
+	uint64_t worst;
+	size_t count;
+};
+
+static interrupt_handler timer_handler;
+static uint64_t deadline;
+static uint64_t entered_at;
+
+static void
+latency_add(struct latency *latency, uint64_t cycles)
+{
+	latency->total += cycles;
+	latency->count += 1;
+	if (cycles < latency->best)
+	{
+		latency->best = cycles;
+	}
+	if (cycles > latency->worst)
+	{
+		latency->worst = cycles;
+	}
+}
+
+static void
+latency_print(const char *name, const struct latency *latency, size_t lost)
+{
+	if (latency->count == 0)
+	{
+		serial_printf("\t%s | nothing measured\n", name);
+		return;
+	}
+
+	serial_printf("\t%s | %u | %u | %u | %u\n",
+		      name,
+		      (unsigned int) (latency->total / latency->count),
+		      (unsigned int) latency->best,
+		      (unsigned int) latency->worst,
+		      (unsigned int) lost);
+}
+
+// Goes in front of the scheduler's own handler.
+static bool
+timer_entry(struct interrupt_frame *frame)
+{
+	uint64_t now = rdtsc();
+	uint64_t expected = __atomic_load_n(&deadline, __ATOMIC_RELAXED);
+	if (expected != 0 && now >= expected)
+	{
+		__atomic_store_n(&deadline, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&entered_at, now, __ATOMIC_RELEASE);
+	}
+
+	return timer_handler(frame);
+}
+
+static bool
+self_ipi_entry(struct interrupt_frame *frame)
+{
+	(void) frame;
+
+	__atomic_store_n(&entered_at, rdtsc(), __ATOMIC_RELEASE);
+	apic_eoi();
+
+	return true;
+}
+
+// Returns false if the interrupt didn't come in time.
+static bool
+wait_for_entry(uint64_t since)
+{
+	while (__atomic_load_n(&entered_at, __ATOMIC_ACQUIRE) == 0)
+	{
+		if (rdtsc() - since > TIMEOUT_CYCLES)
+		{
+			return false;
+		}
+
+		cpu_relax();
+	}
+
+	return true;
+}
+
+static void
+bench_timer_latency(void)
+{
+	if (!apic_timer_is_tsc_deadline())
+	{
+		serial_write("\ttimer | needs the TSC-deadline timer\n");
+		return;
+	}
+
+	timer_handler = interrupt_register_handler(INTERRUPT_VECTOR_APIC_TIMER, timer_entry);
+
+	struct latency latency = { .best = UINT64_MAX };
+	size_t lost = 0;
+	for (size_t round = 0; round < ROUNDS; ++round)
+	{
+		__atomic_store_n(&entered_at, 0, __ATOMIC_RELAXED);
+
+		uint64_t flags = local_irq_save();
+		uint64_t when = rdtsc() + DEADLINE_CYCLES;
+		__atomic_store_n(&deadline, when, __ATOMIC_RELAXED);
+		apic_timer_set_oneshot(when);
+		local_irq_restore(flags);
+
+		if (!wait_for_entry(when))
+		{
+			__atomic_store_n(&deadline, 0, __ATOMIC_RELAXED);
+			++lost;
+			continue;
+		}
+
+		latency_add(&latency, __atomic_load_n(&entered_at, __ATOMIC_RELAXED) - when);
+	}
+
+	interrupt_register_handler(INTERRUPT_VECTOR_APIC_TIMER, timer_handler);
+
+	latency_print("timer deadline to handler", &latency, lost);
+}
+
+static void
+bench_self_ipi_latency(void)
+{
+	struct cpu *self = this_cpu();
+
+	uint8_t vector;
+	if (!interrupt_alloc_vector(self->index, self_ipi_entry, &vector))
+	{
+		serial_write("\tself-IPI | no free vector\n");
+		return;
+	}
+
+	struct latency latency = { .best = UINT64_MAX };
+	size_t lost = 0;
+	for (size_t round = 0; round < ROUNDS; ++round)
+	{
+		__atomic_store_n(&entered_at, 0, __ATOMIC_RELAXED);
+
+		uint64_t start = rdtsc();
+		apic_send_ipi(self->apic_id, vector);
+
+		if (!wait_for_entry(start))
+		{
+			++lost;
+			continue;
+		}
+
+		latency_add(&latency, __atomic_load_n(&entered_at, __ATOMIC_RELAXED) - start);
+	}
+
+	interrupt_free_vector(self->index, vector);
+
+	latency_print("self-IPI to handler", &latency, lost);
+}
+
+void
+bench_interrupts(void)
+{
+	serial_write("Interrupt latency benchmark (cycles):\n");
+	serial_write("\tpath | mean | best | worst | lost\n");
+
+	// Stay on this CPU, with interrupts enabled.
+	preempt_disable();
+
+	bench_timer_latency();
+	bench_self_ipi_latency();
+
+	preempt_enable();
+}
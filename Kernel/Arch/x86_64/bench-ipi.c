@@ -0,0 +1,133 @@
+#include "bench.h"
+#include "apic.h"
+#include "percpu.h"
+#include "preempt.h"
+#include "interrupts.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define ROUND_TRIPS 1000
+#define WARMUP_ROUND_TRIPS 16
+
+// How long to wait for a reply before giving up on a CPU.
+#define REPLY_TIMEOUT_CYCLES UINT64_C(1000000000)
+
+// The CPU the pings come from. Everyone else sends them straight back.
+static uint32_t origin_apic_id;
+static uint64_t replies;
+
+static bool
+ping_interrupt(struct interrupt_frame *frame)
+{
+	(void) frame;
+
+	apic_eoi();
+
+	if (this_cpu()->apic_id == __atomic_load_n(&origin_apic_id, __ATOMIC_RELAXED))
+	{
+		__atomic_fetch_add(&replies, 1, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		apic_send_ipi(__atomic_load_n(&origin_apic_id, __ATOMIC_RELAXED), INTERRUPT_VECTOR_PING);
+	}
+
+	return true;
+}
+
+// Returns the cycles from sending the ping to getting the reply, or 0 if
+// no reply came. `send_cycles` gets how long writing the ICR took.
+static uint64_t
+ping(struct cpu *target, uint64_t *send_cycles)
+{
+	uint64_t expected = __atomic_load_n(&replies, __ATOMIC_RELAXED) + 1;
+
+	uint64_t start = rdtsc();
+	apic_send_ipi(target->apic_id, INTERRUPT_VECTOR_PING);
+	*send_cycles = rdtsc() - start;
+
+	while (__atomic_load_n(&replies, __ATOMIC_ACQUIRE) < expected)
+	{
+		if (rdtsc() - start > REPLY_TIMEOUT_CYCLES)
+		{
+			return 0;
+		}
+
+		cpu_relax();
+	}
+
+	return rdtsc() - start;
+}
+
+void
+bench_ipi(void)
+{
+	serial_printf("IPI benchmark (cycles, %s, %s timer):\n",
+		      apic_is_x2apic() ? "x2APIC" : "xAPIC",
+		      apic_timer_is_tsc_deadline() ? "TSC-deadline" : "periodic");
+
+	if (cpu_count < 2)
+	{
+		serial_write("\tOnly one CPU\n");
+		return;
+	}
+
+	interrupt_register_handler(INTERRUPT_VECTOR_PING, ping_interrupt);
+
+	// Stay on this CPU, but keep taking the replies.
+	preempt_disable();
+
+	struct cpu *self = this_cpu();
+	__atomic_store_n(&origin_apic_id, self->apic_id, __ATOMIC_RELAXED);
+
+	serial_write("\tCPU | send | round trip | best round trip\n");
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		struct cpu *target = &cpus[i];
+		if (target == self)
+		{
+			continue;
+		}
+
+		uint64_t send_cycles;
+		bool replied = true;
+		for (size_t round = 0; round < WARMUP_ROUND_TRIPS && replied; ++round)
+		{
+			replied = ping(target, &send_cycles) != 0;
+		}
+
+		uint64_t total = 0;
+		uint64_t best = UINT64_MAX;
+		uint64_t send_total = 0;
+		for (size_t round = 0; round < ROUND_TRIPS && replied; ++round)
+		{
+			uint64_t cycles = ping(target, &send_cycles);
+			if (cycles == 0)
+			{
+				replied = false;
+				break;
+			}
+
+			total += cycles;
+			send_total += send_cycles;
+			if (cycles < best)
+			{
+				best = cycles;
+			}
+		}
+
+		if (!replied)
+		{
+			serial_printf("\t%u | no reply\n", (unsigned int) i);
+			continue;
+		}
+
+		serial_printf("\t%u | %u | %u | %u\n",
+			      (unsigned int) i,
+			      (unsigned int) (send_total / ROUND_TRIPS),
+			      (unsigned int) (total / ROUND_TRIPS),
+			      (unsigned int) best);
+	}
+
+	preempt_enable();
+}
@@ -0,0 +1,139 @@
+#include <SampoOS/Kernel/memman.h>
+#include "bench.h"
+#include "memory-manager.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+// Pages held while fragmenting the physical memory.
+#define FRAGMENT_POOL_PAGES 8192
+
+#define BUFFER_PAGES_MAX 2048
+#define WALK_ROUNDS 8
+
+static uintptr_t fragment_pool[FRAGMENT_POOL_PAGES];
+
+// Allocates a pool of pages and hands every other one of them back in a
+// pseudo-random order, so that the free pages no longer come in address
+// order. This is what the allocator sees after a long uptime.
+static size_t
+fragment_physical_memory(void)
+{
+	size_t pool_len = 0;
+	while (pool_len < FRAGMENT_POOL_PAGES)
+	{
+		uintptr_t page = pmm_alloc_page();
+		if (page == 0)
+		{
+			break;
+		}
+
+		fragment_pool[pool_len++] = page;
+	}
+
+	uint32_t seed = 0x5A3F01;
+	for (size_t i = 0; i < pool_len; ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		if ((seed >> 16) & 1)
+		{
+			pmm_free_page(fragment_pool[i]);
+			fragment_pool[i] = 0;
+		}
+	}
+
+	return pool_len;
+}
+
+static void
+release_fragment_pool(size_t pool_len)
+{
+	for (size_t i = 0; i < pool_len; ++i)
+	{
+		if (fragment_pool[i] != 0)
+		{
+			pmm_free_page(fragment_pool[i]);
+		}
+	}
+}
+
+// Walks the buffer touching one byte every `stride` bytes, and returns
+// the average cycles per access.
+static uint32_t
+strided_walk(volatile uint8_t *buffer, size_t len, size_t stride)
+{
+	uint64_t accesses = 0;
+	uint64_t start = rdtsc();
+	for (size_t round = 0; round < WALK_ROUNDS; ++round)
+	{
+		for (size_t offset = 0; offset < len; offset += stride)
+		{
+			(void) buffer[offset];
+			++accesses;
+		}
+	}
+
+	return (rdtsc() - start) / accesses;
+}
+
+static void
+run_mode(bool colored, size_t buffer_pages)
+{
+	bool in_effect = pmm_set_page_coloring(colored);
+
+	// The buffer's physical pages are never given back; benchmark builds
+	// are not meant to keep running after this anyway.
+	volatile uint8_t *buffer =
+		virt_reserve_pages_kernel_end(buffer_pages, VIRT_MAP_READ | VIRT_MAP_WRITE, 0);
+	if (buffer == NULL)
+	{
+		serial_write("\tCould not reserve the buffer\n");
+		return;
+	}
+
+	size_t len = buffer_pages * PAGE_SIZE;
+
+	// Fault everything in, and warm up the cache.
+	for (size_t offset = 0; offset < len; offset += PAGE_SIZE)
+	{
+		buffer[offset] = 1;
+	}
+	strided_walk(buffer, len, 64);
+
+	serial_printf("\t%s:\n", in_effect ? "Colored" : "Address order");
+	for (size_t stride = 64; stride <= PAGE_SIZE; stride *= 4)
+	{
+		serial_printf("\t\tstride %u: %u cycles/access\n",
+			      (unsigned int) stride,
+			      strided_walk(buffer, len, stride));
+	}
+}
+
+void
+bench_page_coloring(void)
+{
+	pmm_set_page_coloring(false);
+	size_t colors = pmm_get_page_color_count();
+
+	serial_printf("Page coloring benchmark: %u colors\n", (unsigned int) colors);
+	if (colors == 1)
+	{
+		serial_write("\tThe last-level cache geometry is unknown, skipping\n");
+		return;
+	}
+
+	// A buffer filling most of an 8-way cache: if its pages were spread
+	// perfectly across the colors, it would never miss after warming up.
+	size_t buffer_pages = colors * 6;
+	if (buffer_pages > BUFFER_PAGES_MAX)
+	{
+		buffer_pages = BUFFER_PAGES_MAX;
+	}
+
+	size_t pool_len = fragment_physical_memory();
+
+	run_mode(false, buffer_pages);
+	run_mode(true, buffer_pages);
+
+	release_fragment_pool(pool_len);
+	pmm_set_page_coloring(false);
+}
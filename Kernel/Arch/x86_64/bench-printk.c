@@ -0,0 +1,39 @@
+#include "bench.h"
+#include "printk.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+// Twice the ring, to have the oldest records dropped.
+#define MESSAGES 1024
+
+void
+bench_printk(void)
+{
+	serial_write("printk benchmark:\n");
+
+	printk_flush();
+	serial_flush();
+
+	struct printk_stats before;
+	printk_get_stats(&before);
+
+	uint64_t start = rdtsc();
+	for (uint64_t i = 0; i < MESSAGES; ++i)
+	{
+		printk("bench %llu: tsc 0x%llx, %zu bytes at %p", (unsigned long long) i,
+		       (unsigned long long) rdtsc(), (size_t) i * 4096, (void *) &start);
+	}
+	uint64_t cycles = rdtsc() - start;
+
+	// Writing them out to the console happens here, outside the measurement.
+	printk_flush();
+
+	struct printk_stats after;
+	printk_get_stats(&after);
+
+	serial_printf("\t%u messages: %llu cycles per printk, %zu written, %zu lost\n",
+		      MESSAGES,
+		      (unsigned long long) (cycles / MESSAGES),
+		      after.written - before.written,
+		      after.lost - before.lost);
+}
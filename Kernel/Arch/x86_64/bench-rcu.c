@@ -0,0 +1,175 @@
+#include <SampoOS/Kernel/memman.h>
+#include <string.h>
+#include "bench.h"
+#include "rcu.h"
+#include "spinlock.h"
+#include "sched.h"
+#include "percpu.h"
+#include "memory-manager.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define TABLE_ENTRIES 256
+#define LOOKUPS_PER_THREAD 200000
+
+// A read-mostly lookup table, as a stand-in for things like the region
+// table or a symbol table.
+struct lookup_table
+{
+	uint64_t values[TABLE_ENTRIES];
+	struct rcu_head rcu;
+};
+
+static struct lookup_table *table;
+
+LOCK_CLASS(bench_table_lock_class, "bench table");
+static struct spinlock table_lock = SPINLOCK_INIT(&bench_table_lock_class);
+
+static size_t threads_done;
+static uint64_t lookup_cycles_total;
+
+static void
+wait_for_threads(size_t count)
+{
+	while (__atomic_load_n(&threads_done, __ATOMIC_ACQUIRE) < count)
+	{
+		thread_yield();
+	}
+
+	__atomic_store_n(&threads_done, 0, __ATOMIC_RELAXED);
+}
+
+static void
+rcu_reader_thread(void *arg)
+{
+	(void) arg;
+	uint64_t sum = 0;
+
+	uint64_t start = rdtsc();
+	for (size_t i = 0; i < LOOKUPS_PER_THREAD; ++i)
+	{
+		rcu_read_lock();
+		struct lookup_table *current = rcu_dereference(table);
+		sum += current->values[i % TABLE_ENTRIES];
+		rcu_read_unlock();
+	}
+	uint64_t cycles = rdtsc() - start;
+
+	asm volatile("" : : "r"(sum));
+	__atomic_fetch_add(&lookup_cycles_total, cycles, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&threads_done, 1, __ATOMIC_RELEASE);
+}
+
+static void
+locked_reader_thread(void *arg)
+{
+	(void) arg;
+	uint64_t sum = 0;
+
+	uint64_t start = rdtsc();
+	for (size_t i = 0; i < LOOKUPS_PER_THREAD; ++i)
+	{
+		spin_lock(&table_lock);
+		sum += table->values[i % TABLE_ENTRIES];
+		spin_unlock(&table_lock);
+	}
+	uint64_t cycles = rdtsc() - start;
+
+	asm volatile("" : : "r"(sum));
+	__atomic_fetch_add(&lookup_cycles_total, cycles, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&threads_done, 1, __ATOMIC_RELEASE);
+}
+
+// Runs one reader per CPU, and returns the average cost of a lookup.
+static uint64_t
+bench_readers(size_t cpus, thread_entry reader)
+{
+	sched_set_active_cpus(cpus);
+	__atomic_store_n(&lookup_cycles_total, 0, __ATOMIC_RELAXED);
+
+	for (size_t i = 0; i < cpus; ++i)
+	{
+		if (!thread_spawn(reader, NULL))
+		{
+			serial_write("\tCould not spawn a thread\n");
+			return 0;
+		}
+	}
+
+	wait_for_threads(cpus);
+
+	return __atomic_load_n(&lookup_cycles_total, __ATOMIC_RELAXED) / (cpus * LOOKUPS_PER_THREAD);
+}
+
+static void
+free_table(struct rcu_head *head)
+{
+	struct lookup_table *old = (struct lookup_table *)((uint8_t *) head - offsetof(struct lookup_table, rcu));
+	virt_free_pages(old, 1);
+}
+
+void
+bench_rcu(void)
+{
+	serial_write("RCU benchmark (cycles):\n");
+
+	table = virt_alloc_pages(1, VIRT_MAP_READ | VIRT_MAP_WRITE);
+	if (table == NULL)
+	{
+		serial_write("\tOut of memory\n");
+		return;
+	}
+
+	for (size_t i = 0; i < TABLE_ENTRIES; ++i)
+	{
+		table->values[i] = i;
+	}
+
+	serial_write("\tCPUs | RCU lookup | spinlock lookup\n");
+	for (size_t cpus = 1;; cpus = cpus * 2 < cpu_count ? cpus * 2 : cpu_count)
+	{
+		uint64_t rcu_cycles = bench_readers(cpus, rcu_reader_thread);
+		uint64_t locked_cycles = bench_readers(cpus, locked_reader_thread);
+
+		serial_printf("\t%u | %u | %u\n",
+			      (unsigned int) cpus,
+			      (unsigned int) rcu_cycles,
+			      (unsigned int) locked_cycles);
+
+		if (cpus == cpu_count)
+		{
+			break;
+		}
+	}
+
+	sched_set_active_cpus(cpu_count);
+
+	// An update: publish a copy, then wait for the readers of the old one.
+	struct lookup_table *copy = virt_alloc_pages(1, VIRT_MAP_READ | VIRT_MAP_WRITE);
+	if (copy == NULL)
+	{
+		return;
+	}
+
+	memcpy(copy, table, sizeof(*copy));
+	struct lookup_table *old = table;
+	rcu_assign_pointer(table, copy);
+
+	uint64_t start = rdtsc();
+	synchronize_rcu();
+	serial_printf("\tsynchronize_rcu: %u kcycles\n", (unsigned int) ((rdtsc() - start) / 1000));
+
+	virt_free_pages(old, 1);
+
+	// The usual way to get rid of an old version, without waiting.
+	struct lookup_table *last = table;
+	rcu_assign_pointer(table, NULL);
+	call_rcu(&last->rcu, free_table);
+
+	struct rcu_stats stats;
+	rcu_get_stats(&stats);
+	serial_printf("\t%u grace periods, %u callbacks queued, %u invoked\n",
+		      (unsigned int) stats.grace_periods,
+		      (unsigned int) stats.callbacks_queued,
+		      (unsigned int) stats.callbacks_invoked);
+}
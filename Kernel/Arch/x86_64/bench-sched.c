@@ -0,0 +1,178 @@
+#include "bench.h"
+#include "sched.h"
+#include "percpu.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define SPAWN_BATCH 32
+#define YIELD_ITERATIONS 10000
+#define SWITCH_ITERATIONS 10000
+
+#define SCALING_THREADS 64
+#define SCALING_WORK_CHUNKS 16
+#define SCALING_CHUNK_ITERATIONS 20000
+
+static size_t threads_done;
+
+static void
+wait_for_threads(size_t count)
+{
+	while (__atomic_load_n(&threads_done, __ATOMIC_ACQUIRE) < count)
+	{
+		thread_yield();
+	}
+
+	__atomic_store_n(&threads_done, 0, __ATOMIC_RELAXED);
+}
+
+static void
+noop_thread(void *arg)
+{
+	(void) arg;
+	__atomic_fetch_add(&threads_done, 1, __ATOMIC_RELEASE);
+}
+
+static void
+yield_thread(void *arg)
+{
+	(void) arg;
+
+	for (size_t i = 0; i < SWITCH_ITERATIONS; ++i)
+	{
+		thread_yield();
+	}
+
+	__atomic_fetch_add(&threads_done, 1, __ATOMIC_RELEASE);
+}
+
+// A CPU-bound thread, which yields now and then so that the run queues
+// see some traffic as well.
+static void
+work_thread(void *arg)
+{
+	uint64_t state = (uintptr_t) arg | 1;
+
+	for (size_t chunk = 0; chunk < SCALING_WORK_CHUNKS; ++chunk)
+	{
+		for (size_t i = 0; i < SCALING_CHUNK_ITERATIONS; ++i)
+		{
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+		}
+
+		asm volatile("" : : "r"(state));
+		thread_yield();
+	}
+
+	__atomic_fetch_add(&threads_done, 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t
+bench_spawn_batch(void)
+{
+	uint64_t start = rdtsc();
+	for (size_t i = 0; i < SPAWN_BATCH; ++i)
+	{
+		if (!thread_spawn(noop_thread, NULL))
+		{
+			serial_write("\tCould not spawn a thread\n");
+			return 0;
+		}
+	}
+	uint64_t cycles = rdtsc() - start;
+
+	wait_for_threads(SPAWN_BATCH);
+
+	return cycles / SPAWN_BATCH;
+}
+
+static uint64_t
+bench_scaling_run(size_t cpus)
+{
+	sched_set_active_cpus(cpus);
+
+	uint64_t start = rdtsc();
+	for (size_t i = 0; i < SCALING_THREADS; ++i)
+	{
+		if (!thread_spawn(work_thread, (void *)(i + 1)))
+		{
+			serial_write("\tCould not spawn a thread\n");
+			return 0;
+		}
+	}
+
+	wait_for_threads(SCALING_THREADS);
+
+	return rdtsc() - start;
+}
+
+void
+bench_sched(void)
+{
+	serial_printf("Scheduler benchmark (cycles), %u CPUs:\n", (unsigned int) cpu_count);
+
+	// Everything but the scaling runs stays on this CPU.
+	sched_set_active_cpus(1);
+
+	// The first batch gets its stacks from the memory manager, the second
+	// one reuses the stacks of the first.
+	uint64_t spawn_fresh = bench_spawn_batch();
+	uint64_t spawn_cached = bench_spawn_batch();
+	serial_printf("\tspawn: %u fresh, %u cached\n",
+		      (unsigned int) spawn_fresh, (unsigned int) spawn_cached);
+
+	uint64_t start = rdtsc();
+	for (size_t i = 0; i < YIELD_ITERATIONS; ++i)
+	{
+		thread_yield();
+	}
+	serial_printf("\tyield with nothing else to run: %u\n",
+		      (unsigned int) ((rdtsc() - start) / YIELD_ITERATIONS));
+
+	struct sched_stats before;
+	struct sched_stats after;
+	sched_get_stats(&before);
+	start = rdtsc();
+	if (!thread_spawn(yield_thread, NULL) || !thread_spawn(yield_thread, NULL))
+	{
+		serial_write("\tCould not spawn a thread\n");
+		return;
+	}
+	wait_for_threads(2);
+	uint64_t cycles = rdtsc() - start;
+	sched_get_stats(&after);
+	serial_printf("\tcontext switch: %u\n",
+		      (unsigned int) (cycles / (after.context_switches - before.context_switches)));
+
+	serial_write("\tCPUs | kcycles | speedup x100 | steals\n");
+	uint64_t single_cpu_cycles = 0;
+	for (size_t cpus = 1;; cpus = cpus * 2 < cpu_count ? cpus * 2 : cpu_count)
+	{
+		sched_get_stats(&before);
+		cycles = bench_scaling_run(cpus);
+		sched_get_stats(&after);
+		if (cycles == 0)
+		{
+			break;
+		}
+
+		if (cpus == 1)
+		{
+			single_cpu_cycles = cycles;
+		}
+
+		serial_printf("\t%u | %u | %u | %u\n",
+			      (unsigned int) cpus,
+			      (unsigned int) (cycles / 1000),
+			      (unsigned int) (single_cpu_cycles * 100 / cycles),
+			      (unsigned int) (after.steals - before.steals));
+
+		if (cpus == cpu_count)
+		{
+			break;
+		}
+	}
+
+	sched_set_active_cpus(cpu_count);
+}
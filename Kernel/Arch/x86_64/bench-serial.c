@@ -0,0 +1,55 @@
+#include "bench.h"
+#include "serial.h"
+#include "clock.h"
+#include "arch-utils.h"
+
+#define FLOOD_LINES 256
+
+// Far longer than draining a full ring takes, even at 38400 baud.
+#define DRAIN_TIMEOUT_NS UINT64_C(10000000000)
+
+void
+bench_serial(void)
+{
+	serial_write("Serial flood test:\n");
+
+	// Start from an empty ring, so that the drain is all ours.
+	serial_flush();
+
+	struct serial_stats before;
+	serial_get_stats(&before);
+
+	uint64_t start = rdtsc();
+	for (unsigned int line = 0; line < FLOOD_LINES; ++line)
+	{
+		serial_printf("\tflood %u: the quick brown fox jumps over the lazy dog\n", line);
+	}
+	uint64_t write_cycles = rdtsc() - start;
+
+	// The UART goes at its own pace, so wait for it like anyone else would.
+	uint64_t drain_start = clock_monotonic_ns();
+	while (serial_tx_backlog() != 0 && clock_monotonic_ns() - drain_start < DRAIN_TIMEOUT_NS)
+	{
+		asm volatile("hlt");
+	}
+	uint64_t drain_ns = clock_monotonic_ns() - drain_start;
+
+	struct serial_stats after;
+	serial_get_stats(&after);
+
+	uint64_t queued = after.queued - before.queued;
+	uint64_t dropped = after.dropped - before.dropped;
+	uint64_t sent = after.sent - before.sent;
+	uint64_t total_ns = clock_cycles_to_ns(write_cycles) + drain_ns;
+
+	serial_printf("\t%u lines: %u cycles per line for the writer\n",
+		      FLOOD_LINES,
+		      (unsigned int) (write_cycles / FLOOD_LINES));
+	serial_printf("\t%u bytes queued, %u dropped, %u sent in %u us, %u bytes/s, %u interrupts\n",
+		      (unsigned int) queued,
+		      (unsigned int) dropped,
+		      (unsigned int) sent,
+		      (unsigned int) (total_ns / 1000),
+		      (unsigned int) (total_ns == 0 ? 0 : sent * 1000000000 / total_ns),
+		      (unsigned int) (after.interrupts - before.interrupts));
+}
@@ -0,0 +1,38 @@
+; The user mode half of bench-syscall.c. It is copied into a user page,
+; so it must not refer to anything outside itself.
+
+; From <SampoOS/syscall.h>.
+%define SYSCALL_EXIT 0
+%define SYSCALL_NULL 1
+
+section .rodata
+global bench_syscall_user:data
+global bench_syscall_user_end:data
+
+; Makes as many null system calls as RDI says, and exits with the TSC
+; cycles they took. R12 and R13 survive the calls.
+bench_syscall_user:
+	mov r12, rdi
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	mov r13, rax
+
+.round_trip:
+	mov eax, SYSCALL_NULL
+	syscall
+	dec r12
+	jnz .round_trip
+
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	sub rax, r13
+
+	mov rdi, rax
+	mov eax, SYSCALL_EXIT
+	syscall
+	ud2
+bench_syscall_user_end:
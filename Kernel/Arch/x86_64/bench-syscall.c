@@ -0,0 +1,91 @@
+#include <SampoOS/Kernel/memman.h>
+#include <string.h>
+#include "bench.h"
+#include "syscall.h"
+#include "clock.h"
+#include "address-space.h"
+#include "memory-manager.h"
+#include "preempt.h"
+#include "serial.h"
+
+#define ROUND_TRIPS 1000000
+#define WARMUP_ROUND_TRIPS 1000
+
+extern const uint8_t bench_syscall_user[];
+extern const uint8_t bench_syscall_user_end[];
+
+// Maps a fresh page into the user half, with `size` bytes of `contents`
+// at its start and zeros after.
+static bool
+map_user_page(uintptr_t virt_addr, const void *contents, size_t size, enum virt_map_perm perms)
+{
+	uintptr_t page = pmm_alloc_page();
+	if (page == 0)
+	{
+		return false;
+	}
+
+	uint8_t *window = virt_map_pages(page, 1, VIRT_MAP_READ | VIRT_MAP_WRITE);
+	if (window == NULL)
+	{
+		pmm_free_page(page);
+		return false;
+	}
+
+	memset(window, 0, PAGE_SIZE);
+	if (size != 0)
+	{
+		memcpy(window, contents, size);
+	}
+	virt_unmap_pages(window, 1);
+
+	if (!as_map_user_page(virt_addr, page, perms))
+	{
+		pmm_free_page(page);
+		return false;
+	}
+
+	return true;
+}
+
+bool
+bench_map_user(const void *code, size_t size)
+{
+	if (!map_user_page(BENCH_USER_CODE, code, size, VIRT_MAP_READ | VIRT_MAP_EXEC)
+	    || !map_user_page(BENCH_USER_STACK, NULL, 0, VIRT_MAP_READ | VIRT_MAP_WRITE))
+	{
+		as_clear_user(as_current());
+		return false;
+	}
+
+	return true;
+}
+
+void
+bench_syscall(void)
+{
+	serial_write("System call benchmark:\n");
+
+	if (!bench_map_user(bench_syscall_user, bench_syscall_user_end - bench_syscall_user))
+	{
+		serial_write("\tCould not map the user pages\n");
+		return;
+	}
+
+	// Our user mode runs in this thread's address space, which is the
+	// CPU's, so it must stay here.
+	preempt_disable();
+	syscall_enter_user(BENCH_USER_CODE, BENCH_USER_STACK + PAGE_SIZE, WARMUP_ROUND_TRIPS);
+	uint64_t cycles = syscall_enter_user(BENCH_USER_CODE, BENCH_USER_STACK + PAGE_SIZE, ROUND_TRIPS);
+	preempt_enable();
+
+	as_clear_user(as_current());
+
+	// In tenths of a nanosecond.
+	uint64_t tenths = clock_cycles_to_ns(cycles * 10) / ROUND_TRIPS;
+	serial_printf("\t%u null system calls from user mode: %u cycles, %u.%u ns each\n",
+		      ROUND_TRIPS,
+		      (unsigned int) (cycles / ROUND_TRIPS),
+		      (unsigned int) (tenths / 10),
+		      (unsigned int) (tenths % 10));
+}
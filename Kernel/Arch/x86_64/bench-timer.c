@@ -0,0 +1,168 @@
+#include "bench.h"
+#include "timer.h"
+#include "sched.h"
+#include "apic.h"
+#include "clock.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define TIMEOUTS 1000000
+#define TIMER_POOL 4096
+
+// Spread out so that they land on every level of the wheel.
+#define ARM_MIN_CYCLES (UINT64_C(1) << 20)
+#define ARM_MAX_CYCLES (UINT64_C(1) << 40)
+
+#define FIRING_TIMERS 1000
+#define FIRING_SPREAD_MS 50
+#define SLACK_US 500
+
+struct bench_timer
+{
+	struct timer timer; // <- Must be first.
+	uint64_t deadline;
+};
+
+static struct bench_timer pool[TIMER_POOL];
+
+static size_t timers_fired;
+static uint64_t lateness_total;
+static uint64_t lateness_max;
+
+static uint64_t
+xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+static void
+count_expiry(struct timer *timer)
+{
+	struct bench_timer *bt = (struct bench_timer *) timer;
+
+	// Only this CPU's timer interrupt gets here.
+	uint64_t lateness = rdtsc() - bt->deadline;
+	lateness_total += lateness;
+	if (lateness > lateness_max)
+	{
+		lateness_max = lateness;
+	}
+
+	__atomic_fetch_add(&timers_fired, 1, __ATOMIC_RELEASE);
+}
+
+static void
+bench_arm_cancel(void)
+{
+	uint64_t seed = 0x9E3779B97F4A7C15;
+	for (size_t i = 0; i < TIMER_POOL; ++i)
+	{
+		timer_init(&pool[i].timer, count_expiry);
+	}
+
+	uint64_t arm_cycles = 0;
+	uint64_t cancel_cycles = 0;
+	size_t done = 0;
+	while (done < TIMEOUTS)
+	{
+		uint64_t now = rdtsc();
+		uint64_t start = now;
+		for (size_t i = 0; i < TIMER_POOL; ++i)
+		{
+			uint64_t delay = ARM_MIN_CYCLES + xorshift64(&seed) % (ARM_MAX_CYCLES - ARM_MIN_CYCLES);
+			pool[i].deadline = now + delay;
+			timer_arm(&pool[i].timer, pool[i].deadline, 0);
+		}
+		arm_cycles += rdtsc() - start;
+
+		start = rdtsc();
+		for (size_t i = 0; i < TIMER_POOL; ++i)
+		{
+			timer_cancel(&pool[i].timer);
+		}
+		cancel_cycles += rdtsc() - start;
+
+		done += TIMER_POOL;
+	}
+
+	serial_printf("\t%u timeouts: %u per arm, %u per cancel\n",
+		      (unsigned int) done,
+		      (unsigned int) (arm_cycles / done),
+		      (unsigned int) (cancel_cycles / done));
+}
+
+static void
+bench_firing(uint64_t cycles_per_ms, uint64_t slack)
+{
+	struct timer_stats before;
+	timer_get_stats(&before);
+
+	__atomic_store_n(&timers_fired, 0, __ATOMIC_RELAXED);
+	lateness_total = 0;
+	lateness_max = 0;
+
+	uint64_t seed = 0xD1B54A32D192ED03;
+	uint64_t now = rdtsc();
+	for (size_t i = 0; i < FIRING_TIMERS; ++i)
+	{
+		pool[i].deadline = now + cycles_per_ms + xorshift64(&seed) % (FIRING_SPREAD_MS * cycles_per_ms);
+		timer_arm(&pool[i].timer, pool[i].deadline, slack);
+	}
+
+	// The timers are on this CPU, so let anything else run meanwhile.
+	uint64_t give_up = now + 10 * FIRING_SPREAD_MS * cycles_per_ms;
+	while (__atomic_load_n(&timers_fired, __ATOMIC_ACQUIRE) < FIRING_TIMERS && rdtsc() < give_up)
+	{
+		thread_yield();
+	}
+
+	struct timer_stats after;
+	timer_get_stats(&after);
+
+	size_t fired = __atomic_load_n(&timers_fired, __ATOMIC_ACQUIRE);
+	if (fired < FIRING_TIMERS)
+	{
+		for (size_t i = 0; i < FIRING_TIMERS; ++i)
+		{
+			timer_cancel(&pool[i].timer);
+		}
+	}
+
+	serial_printf("\t%u | %u/%u | %u | %u | %u\n",
+		      (unsigned int) (slack * 1000 / cycles_per_ms),
+		      (unsigned int) fired,
+		      FIRING_TIMERS,
+		      (unsigned int) (after.interrupts - before.interrupts),
+		      (unsigned int) (fired == 0 ? 0 : lateness_total / fired),
+		      (unsigned int) lateness_max);
+}
+
+void
+bench_timer(void)
+{
+	serial_printf("Timer wheel benchmark (cycles, %s):\n",
+		      apic_timer_is_tsc_deadline() ? "TSC-deadline" : "driven by the tick");
+
+	bench_arm_cancel();
+
+	uint64_t cycles_per_ms = clock_tsc_hz() / 1000;
+
+	serial_printf("\t%u timers over %u ms:\n", FIRING_TIMERS, FIRING_SPREAD_MS);
+	serial_write("\tslack (us) | fired | interrupts | mean lateness | max lateness\n");
+	bench_firing(cycles_per_ms, 0);
+	bench_firing(cycles_per_ms, SLACK_US * cycles_per_ms / 1000);
+
+	struct timer_stats stats;
+	timer_get_stats(&stats);
+	serial_printf("\tarmed %u, cancelled %u, expired %u, cascaded %u\n",
+		      (unsigned int) stats.armed,
+		      (unsigned int) stats.cancelled,
+		      (unsigned int) stats.expired,
+		      (unsigned int) stats.cascaded);
+}
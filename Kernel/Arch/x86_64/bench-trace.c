@@ -0,0 +1,53 @@
+#include "bench.h"
+#include "trace.h"
+#include "memory-manager.h"
+#include "clock.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define ROUNDS 4096
+
+// The average cycles for allocating a page and freeing it again.
+static uint64_t
+time_alloc_free(void)
+{
+	uint64_t start = rdtsc();
+	for (size_t i = 0; i < ROUNDS; ++i)
+	{
+		pmm_free_page(pmm_alloc_page());
+	}
+
+	return (rdtsc() - start) / ROUNDS;
+}
+
+void
+bench_trace(void)
+{
+	serial_write("Tracepoint benchmark:\n");
+
+	// They are on already with `make TRACE=1`.
+	bool was_enabled = __atomic_load_n(&trace_keys[TRACE_PMM_ALLOC].enabled, __ATOMIC_RELAXED);
+
+	trace_set_enabled(TRACE_PMM_ALLOC, false);
+	trace_set_enabled(TRACE_PMM_FREE, false);
+	uint64_t off_cycles = time_alloc_free();
+
+	uint64_t start = rdtsc();
+	if (!trace_set_enabled(TRACE_PMM_ALLOC, true) || !trace_set_enabled(TRACE_PMM_FREE, true))
+	{
+		serial_write("\tCould not allocate the trace buffers\n");
+		return;
+	}
+	uint64_t flip_cycles = rdtsc() - start;
+
+	uint64_t on_cycles = time_alloc_free();
+
+	trace_set_enabled(TRACE_PMM_ALLOC, was_enabled);
+	trace_set_enabled(TRACE_PMM_FREE, was_enabled);
+
+	serial_printf("\tpage alloc and free: %llu cycles with the tracepoints off, %llu on\n",
+		      (unsigned long long) off_cycles,
+		      (unsigned long long) on_cycles);
+	serial_printf("\tturning both events on: %llu us\n",
+		      (unsigned long long) (clock_cycles_to_ns(flip_cycles) / 1000));
+}
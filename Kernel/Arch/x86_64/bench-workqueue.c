@@ -0,0 +1,74 @@
+#include "bench.h"
+#include "workqueue.h"
+#include "sched.h"
+#include "percpu.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define WORK_ITEMS 64
+#define ROUNDS 100
+
+static struct work items[WORK_ITEMS];
+static size_t items_done;
+
+static void
+count_work(struct work *work)
+{
+	(void) work;
+	__atomic_fetch_add(&items_done, 1, __ATOMIC_RELEASE);
+}
+
+static void
+wait_for_items(size_t count)
+{
+	while (__atomic_load_n(&items_done, __ATOMIC_ACQUIRE) < count)
+	{
+		thread_yield();
+	}
+
+	__atomic_store_n(&items_done, 0, __ATOMIC_RELAXED);
+}
+
+void
+bench_workqueue(void)
+{
+	serial_printf("Work queue benchmark (cycles, %u rounds of %u items):\n", ROUNDS, WORK_ITEMS);
+	serial_write("\tCPU | queue | latency | max latency | items per batch\n");
+
+	for (size_t i = 0; i < WORK_ITEMS; ++i)
+	{
+		work_init(&items[i], count_work);
+	}
+
+	for (size_t cpu = 0; cpu < cpu_count; ++cpu)
+	{
+		struct workqueue_stats before;
+		workqueue_get_stats(&before);
+
+		uint64_t queue_cycles = 0;
+		for (size_t round = 0; round < ROUNDS; ++round)
+		{
+			uint64_t start = rdtsc();
+			for (size_t i = 0; i < WORK_ITEMS; ++i)
+			{
+				queue_work_on(cpu, &items[i]);
+			}
+			queue_cycles += rdtsc() - start;
+
+			wait_for_items(WORK_ITEMS);
+		}
+
+		struct workqueue_stats after;
+		workqueue_get_stats(&after);
+
+		uint64_t run = after.run - before.run;
+		uint64_t batches = after.batches - before.batches;
+
+		serial_printf("\t%u | %u | %u | %u | %u\n",
+			      (unsigned int) cpu,
+			      (unsigned int) (queue_cycles / (ROUNDS * WORK_ITEMS)),
+			      (unsigned int) ((after.latency_cycles_total - before.latency_cycles_total) / (run != 0 ? run : 1)),
+			      (unsigned int) after.latency_cycles_max,
+			      (unsigned int) (run / (batches != 0 ? batches : 1)));
+	}
+}
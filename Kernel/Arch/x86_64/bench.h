@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Boot-time benchmarks, built in with `make BENCHMARKS=1`.
+// Each one reports its results over the serial port.
+
+// Where bench_map_user puts user code and a page of stack for it.
+#define BENCH_USER_CODE UINT64_C(0x0000008000000000)
+#define BENCH_USER_STACK UINT64_C(0x0000008000100000)
+
+// Maps `size` bytes of `code` into the user half of the CPU's address
+// space, for syscall_enter_user. as_clear_user unmaps it again.
+bool bench_map_user(const void *code, size_t size);
+
+void bench_page_coloring(void);
+void bench_compaction(void);
+void bench_fork(void);
+void bench_sched(void);
+void bench_rcu(void);
+void bench_ipi(void);
+void bench_workqueue(void);
+void bench_idle(void);
+void bench_timer(void);
+void bench_interrupts(void);
+void bench_clock(void);
+void bench_syscall(void);
+void bench_serial(void);
+void bench_printk(void);
+void bench_fpu(void);
+void bench_trace(void);
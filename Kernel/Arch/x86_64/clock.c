@@ -0,0 +1,346 @@
+#include <SampoOS/Kernel/memman.h>
+#include <cpuid.h>
+#include <string.h>
+#include "clock.h"
+#include "acpi.h"
+#include "pit.h"
+#include "rtc.h"
+#include "address-space.h"
+#include "memory-manager.h"
+#include "spinlock.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define CPUID_EXTENDED_POWER 0x80000007
+#define CPUID_EXTENDED_POWER_EDX_INVARIANT_TSC (1 << 8)
+
+#define NS_PER_SECOND UINT64_C(1000000000)
+#define FS_PER_SECOND UINT64_C(1000000000000000)
+
+#define CLOCK_SHIFT 32
+
+#define HPET_CALIBRATION_US 10000
+#define PIT_ROUNDS 3
+
+// The PIT is measured over a short and a long wait, so that what it takes
+// to program it drops out.
+#define PIT_SHORT_US 5000
+#define PIT_LONG_US 25000
+
+// Reads of the HPET taking longer than this are retried, up to a few
+// times, after which the fastest one is used. Under a hypervisor, every
+// read exits to it, and may well take longer.
+#define HPET_READ_MAX_CYCLES 10000
+#define HPET_READ_ATTEMPTS 8
+
+// How long the calibration waits for the HPET to count far enough before
+// falling back to the PIT, in TSC cycles: a second at 1GHz, far more than
+// the calibration takes on anything the TSC runs at.
+#define HPET_CALIBRATION_TIMEOUT_CYCLES UINT64_C(1000000000)
+
+#define ACPI_ADDRESS_SPACE_MEMORY 0
+
+struct acpi_hpet
+{
+	struct acpi_sdt_header header;
+	uint32_t event_timer_block_id;
+	uint8_t address_space_id;
+	uint8_t register_bit_width;
+	uint8_t register_bit_offset;
+	uint8_t reserved;
+	uint64_t address;
+	uint8_t hpet_number;
+	uint16_t minimum_tick;
+	uint8_t page_protection;
+} __attribute__((packed));
+
+#define HPET_REG_CAPABILITIES 0x000
+#define HPET_REG_CONFIG 0x010
+#define HPET_REG_COUNTER 0x0F0
+
+#define HPET_CAPABILITIES_COUNTER_64 (UINT64_C(1) << 13)
+#define HPET_CONFIG_ENABLE 0x1
+
+// The specification doesn't allow a slower counter than this.
+#define HPET_MAX_PERIOD_FS 100000000
+
+LOCK_CLASS(clock_lock_class, "clock");
+static struct spinlock clock_lock = SPINLOCK_INIT(&clock_lock_class);
+
+static struct sampo_clock_page *page;
+static uintptr_t page_phys;
+
+static uint64_t tsc_hz;
+static const char *calibration_source = "nothing";
+
+static volatile uint64_t *
+hpet_reg(volatile uint8_t *hpet, size_t offset)
+{
+	return (volatile uint64_t *) (hpet + offset);
+}
+
+// Reads the counter with the TSC halfway through.
+static uint64_t
+hpet_read_with_tsc(volatile uint8_t *hpet, uint64_t *tsc)
+{
+	uint64_t best_counter = 0;
+	uint64_t best_tsc = 0;
+	uint64_t best_cycles = UINT64_MAX;
+	for (size_t attempt = 0; attempt < HPET_READ_ATTEMPTS; ++attempt)
+	{
+		uint64_t before = rdtsc();
+		uint64_t counter = *hpet_reg(hpet, HPET_REG_COUNTER);
+		uint64_t after = rdtsc();
+		if (after - before < best_cycles)
+		{
+			best_cycles = after - before;
+			best_counter = counter;
+			best_tsc = before + (after - before) / 2;
+		}
+
+		if (best_cycles <= HPET_READ_MAX_CYCLES)
+		{
+			break;
+		}
+	}
+
+	*tsc = best_tsc;
+
+	return best_counter;
+}
+
+static uint64_t
+calibrate_with_hpet(void)
+{
+	struct acpi_hpet *table = (struct acpi_hpet *) acpi_find_table("HPET");
+	if (table == NULL || table->address_space_id != ACPI_ADDRESS_SPACE_MEMORY)
+	{
+		return 0;
+	}
+
+	uintptr_t offset = table->address & (PAGE_SIZE - 1);
+	uint8_t *mapping = virt_map_pages(table->address - offset, 1, VIRT_MAP_READ | VIRT_MAP_WRITE | VIRT_MAP_UNCACHED);
+	if (mapping == NULL)
+	{
+		return 0;
+	}
+
+	volatile uint8_t *hpet = mapping + offset;
+	uint64_t capabilities = *hpet_reg(hpet, HPET_REG_CAPABILITIES);
+	uint64_t period_fs = capabilities >> 32;
+	if (period_fs == 0 || period_fs > HPET_MAX_PERIOD_FS)
+	{
+		virt_unmap_pages(mapping, 1);
+		return 0;
+	}
+
+	uint64_t counter_mask = (capabilities & HPET_CAPABILITIES_COUNTER_64) != 0 ? UINT64_MAX : UINT32_MAX;
+	uint64_t wait_ticks = (uint64_t) HPET_CALIBRATION_US * (FS_PER_SECOND / 1000000) / period_fs;
+
+	uint64_t config = *hpet_reg(hpet, HPET_REG_CONFIG);
+	*hpet_reg(hpet, HPET_REG_CONFIG) = config | HPET_CONFIG_ENABLE;
+
+	// Both ends are read with the TSC, so one round does.
+	uint64_t tsc_start, tsc_end;
+	uint64_t start = hpet_read_with_tsc(hpet, &tsc_start);
+	uint64_t ticks;
+	do
+	{
+		ticks = (hpet_read_with_tsc(hpet, &tsc_end) - start) & counter_mask;
+	}
+	while (ticks < wait_ticks && tsc_end - tsc_start < HPET_CALIBRATION_TIMEOUT_CYCLES);
+
+	*hpet_reg(hpet, HPET_REG_CONFIG) = config;
+	virt_unmap_pages(mapping, 1);
+
+	// An HPET which doesn't count, or hardly does, is no use.
+	if (ticks < wait_ticks)
+	{
+		return 0;
+	}
+
+	return (unsigned __int128) (tsc_end - tsc_start) * FS_PER_SECOND / ((unsigned __int128) ticks * period_fs);
+}
+
+// Anything interrupting the wait only makes it look longer.
+static uint64_t
+pit_shortest_wait(uint32_t us)
+{
+	uint64_t shortest = UINT64_MAX;
+	for (size_t round = 0; round < PIT_ROUNDS; ++round)
+	{
+		uint64_t start = rdtsc();
+		pit_delay_us(us);
+		uint64_t cycles = rdtsc() - start;
+		if (cycles < shortest)
+		{
+			shortest = cycles;
+		}
+	}
+
+	return shortest;
+}
+
+static uint64_t
+calibrate_with_pit(void)
+{
+	uint64_t short_cycles = pit_shortest_wait(PIT_SHORT_US);
+	uint64_t long_cycles = pit_shortest_wait(PIT_LONG_US);
+	if (long_cycles <= short_cycles)
+	{
+		return long_cycles * 1000000 / PIT_LONG_US;
+	}
+
+	return (long_cycles - short_cycles) * 1000000 / (PIT_LONG_US - PIT_SHORT_US);
+}
+
+// The caller must hold the lock.
+static void
+clock_page_write_begin(void)
+{
+	__atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+clock_page_write_end(void)
+{
+	__atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELEASE);
+}
+
+bool
+init_clock(void)
+{
+	page_phys = pmm_alloc_page();
+	if (page_phys == 0)
+	{
+		return false;
+	}
+
+	page = virt_map_pages(page_phys, 1, VIRT_MAP_READ | VIRT_MAP_WRITE);
+	if (page == NULL)
+	{
+		pmm_page_release(page_phys);
+		return false;
+	}
+
+	memset(page, 0, PAGE_SIZE);
+
+	uint64_t flags = local_irq_save();
+
+	tsc_hz = calibrate_with_hpet();
+	if (tsc_hz != 0)
+	{
+		calibration_source = "HPET";
+	}
+	else
+	{
+		tsc_hz = calibrate_with_pit();
+		calibration_source = "PIT";
+	}
+
+	local_irq_restore(flags);
+
+	uint32_t eax, ebx, ecx, edx;
+	bool invariant = __get_cpuid(CPUID_EXTENDED_POWER, &eax, &ebx, &ecx, &edx) != 0
+		&& (edx & CPUID_EXTENDED_POWER_EDX_INVARIANT_TSC) != 0;
+
+	// Monotonic time starts at zero now. The product is 128 bits wide,
+	// so the base never needs moving on for the scaling not to overflow.
+	page->tsc_base = rdtsc();
+	page->monotonic_base_ns = 0;
+	page->mult = ((unsigned __int128) NS_PER_SECOND << CLOCK_SHIFT) / tsc_hz;
+	page->shift = CLOCK_SHIFT;
+	page->flags = invariant ? SAMPO_CLOCK_PAGE_TSC_INVARIANT : 0;
+
+	uint64_t seconds;
+	if (rtc_read_seconds(&seconds))
+	{
+		clock_set_realtime_ns(seconds * NS_PER_SECOND);
+	}
+	else
+	{
+		serial_write("Could not read the real-time clock\n");
+	}
+
+	serial_printf("TSC runs at %u kHz, measured against the %s%s\n",
+		      (unsigned int) (tsc_hz / 1000),
+		      calibration_source,
+		      invariant ? "" : ", and may change speed with power states");
+
+	return true;
+}
+
+uint64_t
+clock_tsc_hz(void)
+{
+	return tsc_hz;
+}
+
+bool
+clock_tsc_is_invariant(void)
+{
+	return (page->flags & SAMPO_CLOCK_PAGE_TSC_INVARIANT) != 0;
+}
+
+const char *
+clock_calibration_source(void)
+{
+	return calibration_source;
+}
+
+uint64_t
+clock_cycles_to_ns(uint64_t cycles)
+{
+	return ((unsigned __int128) cycles * page->mult) >> page->shift;
+}
+
+uint64_t
+clock_ns_to_cycles(uint64_t ns)
+{
+	return (unsigned __int128) ns * tsc_hz / NS_PER_SECOND;
+}
+
+uint64_t
+clock_monotonic_ns(void)
+{
+	return sampo_clock_monotonic_ns(page);
+}
+
+uint64_t
+clock_realtime_ns(void)
+{
+	return sampo_clock_realtime_ns(page);
+}
+
+void
+clock_set_realtime_ns(uint64_t ns)
+{
+	uint64_t flags = spin_lock_irqsave(&clock_lock);
+
+	clock_page_write_begin();
+	page->realtime_offset_ns = ns - sampo_clock_scale(page, rdtsc());
+	clock_page_write_end();
+
+	spin_unlock_irqrestore(&clock_lock, flags);
+}
+
+const struct sampo_clock_page *
+clock_page(void)
+{
+	return page;
+}
+
+bool
+clock_map_user_page(uintptr_t virt_addr)
+{
+	// Unmapping it drops a reference, like for any other user page.
+	pmm_page_share(page_phys);
+	if (!as_map_user_page(virt_addr, page_phys, VIRT_MAP_READ))
+	{
+		pmm_page_release(page_phys);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <SampoOS/clock-page.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Timekeeping off the TSC. Its frequency is measured against the HPET, or
+// the PIT without one, once at boot, and from then on the time is just
+// the TSC scaled to nanoseconds. The scaling is kept in a page of its own
+// that user space can map read-only and read the time from without a
+// system call, see <SampoOS/clock-page.h>.
+//
+// The TSC is assumed to be in step across CPUs, which firmware sees to on
+// anything with an invariant one.
+
+bool init_clock(void);
+
+uint64_t clock_tsc_hz(void);
+bool clock_tsc_is_invariant(void);
+
+// What the TSC was measured against.
+const char *clock_calibration_source(void);
+
+uint64_t clock_cycles_to_ns(uint64_t cycles);
+uint64_t clock_ns_to_cycles(uint64_t ns);
+
+// Nanoseconds since boot.
+uint64_t clock_monotonic_ns(void);
+
+// Nanoseconds since 1970, from the RTC at boot unless set since.
+uint64_t clock_realtime_ns(void);
+void clock_set_realtime_ns(uint64_t ns);
+
+const struct sampo_clock_page *clock_page(void);
+
+// Maps the clock page read-only into the user half of the active address
+// space.
+bool clock_map_user_page(uintptr_t virt_addr);
@@ -0,0 +1,369 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "format.h"
+
+enum length
+{
+	LENGTH_INT,
+	LENGTH_CHAR,
+	LENGTH_SHORT,
+	LENGTH_LONG,
+	LENGTH_LONG_LONG,
+	LENGTH_SIZE,
+	LENGTH_PTRDIFF,
+	LENGTH_INTMAX,
+};
+
+struct spec
+{
+	bool left_align;
+	bool zero_pad;
+	size_t width;
+	size_t precision;
+	bool has_precision;
+};
+
+static void
+output_padding(format_output output, void *context, char pad, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		output(context, pad);
+	}
+}
+
+static void
+output_string(format_output output, void *context, const struct spec *spec, const char *str)
+{
+	if (str == NULL)
+	{
+		str = "(null)";
+	}
+
+	// The precision goes first, as the string needn't be terminated
+	// within it.
+	size_t len = 0;
+	while ((!spec->has_precision || len < spec->precision) && str[len] != '\0')
+	{
+		++len;
+	}
+
+	size_t padding = spec->width > len ? spec->width - len : 0;
+	if (!spec->left_align)
+	{
+		output_padding(output, context, ' ', padding);
+	}
+
+	for (size_t i = 0; i < len; ++i)
+	{
+		output(context, str[i]);
+	}
+
+	if (spec->left_align)
+	{
+		output_padding(output, context, ' ', padding);
+	}
+}
+
+static void
+output_number(format_output output, void *context, const struct spec *spec,
+	      uint64_t value, bool negative, unsigned int base, bool upper, const char *prefix)
+{
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+
+	// Enough for 64 bits in octal.
+	char buffer[24];
+	size_t len = 0;
+	do
+	{
+		buffer[len++] = digits[value % base];
+		value /= base;
+	}
+	while (value != 0);
+
+	size_t prefix_len = 0;
+	while (prefix[prefix_len] != '\0')
+	{
+		++prefix_len;
+	}
+
+	size_t total = len + prefix_len + (negative ? 1 : 0);
+	size_t padding = spec->width > total ? spec->width - total : 0;
+
+	if (!spec->left_align && !spec->zero_pad)
+	{
+		output_padding(output, context, ' ', padding);
+	}
+
+	if (negative)
+	{
+		output(context, '-');
+	}
+
+	for (size_t i = 0; i < prefix_len; ++i)
+	{
+		output(context, prefix[i]);
+	}
+
+	// Zeros go between the sign and the digits.
+	if (!spec->left_align && spec->zero_pad)
+	{
+		output_padding(output, context, '0', padding);
+	}
+
+	while (len > 0)
+	{
+		output(context, buffer[--len]);
+	}
+
+	if (spec->left_align)
+	{
+		output_padding(output, context, ' ', padding);
+	}
+}
+
+static int64_t
+next_signed(va_list *args, enum length length)
+{
+	switch (length)
+	{
+	case LENGTH_CHAR:
+		return (signed char) va_arg(*args, int);
+	case LENGTH_SHORT:
+		return (short) va_arg(*args, int);
+	case LENGTH_LONG:
+		return va_arg(*args, long);
+	case LENGTH_LONG_LONG:
+		return va_arg(*args, long long);
+	case LENGTH_SIZE:
+	case LENGTH_PTRDIFF:
+		return va_arg(*args, ptrdiff_t);
+	case LENGTH_INTMAX:
+		return va_arg(*args, intmax_t);
+	case LENGTH_INT:
+	default:
+		return va_arg(*args, int);
+	}
+}
+
+static uint64_t
+next_unsigned(va_list *args, enum length length)
+{
+	switch (length)
+	{
+	case LENGTH_CHAR:
+		return (unsigned char) va_arg(*args, unsigned int);
+	case LENGTH_SHORT:
+		return (unsigned short) va_arg(*args, unsigned int);
+	case LENGTH_LONG:
+		return va_arg(*args, unsigned long);
+	case LENGTH_LONG_LONG:
+		return va_arg(*args, unsigned long long);
+	case LENGTH_SIZE:
+	case LENGTH_PTRDIFF:
+		return va_arg(*args, size_t);
+	case LENGTH_INTMAX:
+		return va_arg(*args, uintmax_t);
+	case LENGTH_INT:
+	default:
+		return va_arg(*args, unsigned int);
+	}
+}
+
+static size_t
+parse_number(const char **iter)
+{
+	size_t value = 0;
+	while (**iter >= '0' && **iter <= '9')
+	{
+		value = value * 10 + (**iter - '0');
+		++*iter;
+	}
+
+	return value;
+}
+
+void
+format_v(format_output output, void *context, const char *format, va_list args)
+{
+	// Passed by pointer from here on, which a va_list parameter can't be.
+	va_list ap;
+	va_copy(ap, args);
+
+	for (const char *iter = format; *iter != '\0'; ++iter)
+	{
+		if (*iter != '%')
+		{
+			output(context, *iter);
+			continue;
+		}
+
+		++iter;
+
+		struct spec spec = { 0 };
+		for (;; ++iter)
+		{
+			if (*iter == '-')
+			{
+				spec.left_align = true;
+			}
+			else if (*iter == '0')
+			{
+				spec.zero_pad = true;
+			}
+			else
+			{
+				break;
+			}
+		}
+
+		if (*iter == '*')
+		{
+			int width = va_arg(ap, int);
+			if (width < 0)
+			{
+				spec.left_align = true;
+				width = -width;
+			}
+			spec.width = width;
+			++iter;
+		}
+		else
+		{
+			spec.width = parse_number(&iter);
+		}
+
+		if (*iter == '.')
+		{
+			++iter;
+			spec.has_precision = true;
+			if (*iter == '*')
+			{
+				int precision = va_arg(ap, int);
+				spec.precision = precision < 0 ? 0 : precision;
+				++iter;
+			}
+			else
+			{
+				spec.precision = parse_number(&iter);
+			}
+		}
+
+		enum length length = LENGTH_INT;
+		switch (*iter)
+		{
+		case 'h':
+			++iter;
+			length = LENGTH_SHORT;
+			if (*iter == 'h')
+			{
+				++iter;
+				length = LENGTH_CHAR;
+			}
+			break;
+		case 'l':
+			++iter;
+			length = LENGTH_LONG;
+			if (*iter == 'l')
+			{
+				++iter;
+				length = LENGTH_LONG_LONG;
+			}
+			break;
+		case 'z':
+			++iter;
+			length = LENGTH_SIZE;
+			break;
+		case 't':
+			++iter;
+			length = LENGTH_PTRDIFF;
+			break;
+		case 'j':
+			++iter;
+			length = LENGTH_INTMAX;
+			break;
+		default:
+			break;
+		}
+
+		switch (*iter)
+		{
+		case '\0':
+			va_end(ap);
+			return;
+		case '%':
+			output(context, '%');
+			break;
+		case 'c':
+		{
+			char c[2] = { (char) va_arg(ap, int), '\0' };
+			output_string(output, context, &(struct spec) { .left_align = spec.left_align, .width = spec.width }, c);
+			break;
+		}
+		case 's':
+			output_string(output, context, &spec, va_arg(ap, const char *));
+			break;
+		case 'd':
+		case 'i':
+		{
+			int64_t value = next_signed(&ap, length);
+			uint64_t magnitude = value < 0 ? -(uint64_t) value : (uint64_t) value;
+			output_number(output, context, &spec, magnitude, value < 0, 10, false, "");
+			break;
+		}
+		case 'u':
+			output_number(output, context, &spec, next_unsigned(&ap, length), false, 10, false, "");
+			break;
+		case 'x':
+			output_number(output, context, &spec, next_unsigned(&ap, length), false, 16, false, "");
+			break;
+		case 'X':
+			output_number(output, context, &spec, next_unsigned(&ap, length), false, 16, true, "");
+			break;
+		case 'o':
+			output_number(output, context, &spec, next_unsigned(&ap, length), false, 8, false, "");
+			break;
+		case 'p':
+			output_number(output, context, &spec, (uintptr_t) va_arg(ap, void *), false, 16, false, "0x");
+			break;
+		default:
+			// Not a conversion we know, so show it as it was.
+			output(context, '%');
+			output(context, *iter);
+			break;
+		}
+	}
+
+	va_end(ap);
+}
+
+struct buffer_context
+{
+	char *buffer;
+	size_t size;
+	size_t len;
+};
+
+static void
+buffer_output(void *context, char c)
+{
+	struct buffer_context *out = context;
+	if (out->len + 1 < out->size)
+	{
+		out->buffer[out->len++] = c;
+	}
+}
+
+size_t
+format_buffer_v(char *buffer, size_t size, const char *format, va_list args)
+{
+	struct buffer_context out = { .buffer = buffer, .size = size, .len = 0 };
+	format_v(buffer_output, &out, format, args);
+
+	if (size != 0)
+	{
+		buffer[out.len] = '\0';
+	}
+
+	return out.len;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stddef.h>
+
+// The printf formatting behind serial_printf and printk, handing out the
+// output a character at a time. Supports the flags `-` and `0`, field
+// widths (also as `*`), precision for strings, the length modifiers hh, h,
+// l, ll, z, t and j, and the conversions d, i, u, x, X, o, p, c, s and %.
+
+typedef void (*format_output)(void *context, char c);
+
+void format_v(format_output output, void *context, const char *format, va_list args);
+
+// Formats into `buffer`, truncating to fit, always NUL terminated. Returns
+// the length of what was written.
+size_t format_buffer_v(char *buffer, size_t size, const char *format, va_list args);
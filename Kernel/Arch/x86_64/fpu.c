@@ -0,0 +1,385 @@
+#include <cpuid.h>
+#include "fpu.h"
+#include "percpu.h"
+#include "percpu-counter.h"
+#include "preempt.h"
+#include "printk.h"
+#include "arch-utils.h"
+
+#define CPUID_1_ECX_XSAVE (1 << 26)
+
+#define CPUID_XSAVE 0xD
+#define CPUID_XSAVE_1_EAX_XSAVEOPT (1 << 0)
+#define CPUID_XSAVE_1_EAX_XSAVEC (1 << 1)
+#define CPUID_XSAVE_1_EAX_XGETBV1 (1 << 2)
+
+#define CR0_MONITOR_COPROCESSOR (UINT64_C(1) << 1)
+#define CR0_EMULATION (UINT64_C(1) << 2)
+#define CR0_TASK_SWITCHED (UINT64_C(1) << 3)
+#define CR0_NUMERIC_ERROR (UINT64_C(1) << 5)
+
+#define CR4_OSFXSR (UINT64_C(1) << 9)
+#define CR4_OSXMMEXCPT (UINT64_C(1) << 10)
+#define CR4_OSXSAVE (UINT64_C(1) << 18)
+
+#define XFEATURE_X87 (UINT64_C(1) << 0)
+#define XFEATURE_SSE (UINT64_C(1) << 1)
+#define XFEATURE_AVX (UINT64_C(1) << 2)
+#define XFEATURE_OPMASK (UINT64_C(1) << 5)
+#define XFEATURE_ZMM_HI256 (UINT64_C(1) << 6)
+#define XFEATURE_HI16_ZMM (UINT64_C(1) << 7)
+#define XFEATURES_AVX512 (XFEATURE_OPMASK | XFEATURE_ZMM_HI256 | XFEATURE_HI16_ZMM)
+
+#define FCW_DEFAULT 0x037F
+#define MXCSR_DEFAULT 0x1F80
+
+enum fpu_save_method
+{
+	FPU_SAVE_FXSAVE,
+	FPU_SAVE_XSAVE,
+	FPU_SAVE_XSAVEC, // <- Compacted, skips what is in its initial state.
+	FPU_SAVE_XSAVEOPT, // <- Also skips what hasn't changed since it was loaded.
+};
+
+// The part of the save area FXSAVE lays out, and the header XSAVE adds.
+struct fpu_legacy_area
+{
+	uint16_t fcw;
+	uint16_t fsw;
+	uint8_t ftw;
+	uint8_t reserved0;
+	uint16_t fop;
+	uint64_t fip;
+	uint64_t fdp;
+	uint32_t mxcsr;
+	uint32_t mxcsr_mask;
+	uint8_t registers[480];
+
+	uint64_t xstate_bv; // <- The components not in their initial state.
+	uint64_t xcomp_bv;
+	uint8_t reserved1[48];
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct fpu_legacy_area) == 576, "The FXSAVE area is 512 bytes, plus the XSAVE header");
+
+// syscall-entry.asm and interrupt-stubs.asm test the flag at this offset.
+_Static_assert(offsetof(struct cpu, fpu_load_pending) == 216, "CPU_FPU_LOAD_PENDING is out of date");
+
+// With no component marked as saved, XRSTOR initializes every one of
+// them, but for MXCSR, which it always loads.
+static const struct fpu_legacy_area initial_state = {
+	.fcw = FCW_DEFAULT,
+	.mxcsr = MXCSR_DEFAULT,
+};
+
+static enum fpu_save_method save_method = FPU_SAVE_FXSAVE;
+static uint64_t features = XFEATURE_X87 | XFEATURE_SSE;
+static size_t state_size = 512;
+static bool has_xinuse = false;
+
+static struct percpu_counter fpu_saves = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter fpu_saves_skipped = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter fpu_loads = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter fpu_loads_skipped = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter fpu_kernel_uses = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+
+const char *
+fpu_save_method_name(void)
+{
+	switch (save_method)
+	{
+	case FPU_SAVE_FXSAVE:
+		return "FXSAVE";
+	case FPU_SAVE_XSAVE:
+		return "XSAVE";
+	case FPU_SAVE_XSAVEC:
+		return "XSAVEC";
+	case FPU_SAVE_XSAVEOPT:
+		return "XSAVEOPT";
+	}
+
+	return "?";
+}
+
+static inline void
+xsetbv(uint32_t reg, uint64_t value)
+{
+	asm volatile ("xsetbv" : : "c"(reg), "a"((uint32_t) value), "d"((uint32_t) (value >> 32)));
+}
+
+static inline uint64_t
+xgetbv(uint32_t reg)
+{
+	uint32_t low, high;
+	asm volatile ("xgetbv" : "=a"(low), "=d"(high) : "c"(reg));
+
+	return ((uint64_t) high << 32) | low;
+}
+
+static inline void
+load_default_control_words(void)
+{
+	uint32_t mxcsr = MXCSR_DEFAULT;
+	asm volatile ("fninit; ldmxcsr %0" : : "m"(mxcsr));
+}
+
+// Whether every register is as XRSTOR would initialize it. XINUSE has a
+// bit cleared for each component that is, but doesn't cover MXCSR.
+static bool
+registers_initial(void)
+{
+	if (!has_xinuse || (xgetbv(1) & features) != 0)
+	{
+		return false;
+	}
+
+	uint32_t mxcsr;
+	asm volatile ("stmxcsr %0" : "=m"(mxcsr));
+
+	return mxcsr == MXCSR_DEFAULT;
+}
+
+static inline bool
+fpu_is_loaded(struct cpu *cpu, struct fpu *fpu)
+{
+	return cpu->fpu_owner == fpu && fpu->loaded_on == cpu->index;
+}
+
+static void
+fpu_save(struct fpu *fpu)
+{
+	if (registers_initial())
+	{
+		fpu->initial = true;
+		percpu_counter_inc(&fpu_saves_skipped);
+		return;
+	}
+
+	uint32_t low = (uint32_t) features;
+	uint32_t high = (uint32_t) (features >> 32);
+	switch (save_method)
+	{
+	case FPU_SAVE_FXSAVE:
+		asm volatile ("fxsave64 (%0)" : : "r"(fpu->state) : "memory");
+		break;
+	case FPU_SAVE_XSAVE:
+		asm volatile ("xsave64 (%0)" : : "r"(fpu->state), "a"(low), "d"(high) : "memory");
+		break;
+	case FPU_SAVE_XSAVEC:
+		asm volatile ("xsavec64 (%0)" : : "r"(fpu->state), "a"(low), "d"(high) : "memory");
+		break;
+	case FPU_SAVE_XSAVEOPT:
+		asm volatile ("xsaveopt64 (%0)" : : "r"(fpu->state), "a"(low), "d"(high) : "memory");
+		break;
+	}
+
+	fpu->initial = false;
+	percpu_counter_inc(&fpu_saves);
+}
+
+static void
+fpu_load(struct cpu *cpu, struct fpu *fpu)
+{
+	const void *state = fpu->initial ? (const void *) &initial_state : fpu->state;
+	if (save_method == FPU_SAVE_FXSAVE)
+	{
+		asm volatile ("fxrstor64 (%0)" : : "r"(state) : "memory");
+	}
+	else
+	{
+		// Takes the compacted format as well, as the header says which it is.
+		asm volatile ("xrstor64 (%0)" : : "r"(state), "a"((uint32_t) features), "d"((uint32_t) (features >> 32)) : "memory");
+	}
+
+	cpu->fpu_owner = fpu;
+	fpu->loaded_on = cpu->index;
+	percpu_counter_inc(&fpu_loads);
+}
+
+void
+init_fpu(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	__cpuid(1, eax, ebx, ecx, edx);
+	if ((ecx & CPUID_1_ECX_XSAVE) == 0)
+	{
+		// Every x86_64 CPU has SSE2 and FXSAVE.
+		fpu_init_cpu();
+		printk("FPU state is %zu bytes, saved with %s", state_size, fpu_save_method_name());
+		return;
+	}
+
+	__cpuid_count(CPUID_XSAVE, 0, eax, ebx, ecx, edx);
+	uint64_t supported = ((uint64_t) edx << 32) | eax;
+
+	// AVX-512 takes all three of its components, and AVX besides.
+	features = supported & (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX | XFEATURES_AVX512);
+	if ((features & XFEATURE_AVX) == 0 || (features & XFEATURES_AVX512) != XFEATURES_AVX512)
+	{
+		features &= ~XFEATURES_AVX512;
+	}
+
+	save_method = FPU_SAVE_XSAVE;
+	fpu_init_cpu();
+
+	// Only now does CPUID size the area for what we enabled.
+	__cpuid_count(CPUID_XSAVE, 0, eax, ebx, ecx, edx);
+	state_size = ebx;
+
+	// XSAVEOPT skips both what is in its initial state and what hasn't
+	// changed since it was loaded, and the same thread's state mostly
+	// goes out and comes back on the same CPU, which is worth more than
+	// XSAVEC's smaller area.
+	__cpuid_count(CPUID_XSAVE, 1, eax, ebx, ecx, edx);
+	if ((eax & CPUID_XSAVE_1_EAX_XSAVEOPT) != 0)
+	{
+		save_method = FPU_SAVE_XSAVEOPT;
+	}
+	else if ((eax & CPUID_XSAVE_1_EAX_XSAVEC) != 0)
+	{
+		save_method = FPU_SAVE_XSAVEC;
+		state_size = ebx;
+	}
+
+	has_xinuse = (eax & CPUID_XSAVE_1_EAX_XGETBV1) != 0;
+
+	if (state_size < sizeof(struct fpu_legacy_area))
+	{
+		state_size = sizeof(struct fpu_legacy_area);
+	}
+
+	printk("FPU state is %zu bytes for components 0x%llx, saved with %s",
+	       state_size, (unsigned long long) features, fpu_save_method_name());
+}
+
+void
+fpu_init_cpu(void)
+{
+	// No emulation, and no #NM for touching the registers after a task
+	// switch: they are loaded before user mode could touch them.
+	uintptr_t cr0 = read_cr0();
+	cr0 &= ~(CR0_EMULATION | CR0_TASK_SWITCHED);
+	cr0 |= CR0_MONITOR_COPROCESSOR | CR0_NUMERIC_ERROR;
+	write_cr0(cr0);
+
+	uintptr_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+	if (save_method != FPU_SAVE_FXSAVE)
+	{
+		cr4 |= CR4_OSXSAVE;
+	}
+	write_cr4(cr4);
+
+	if (save_method != FPU_SAVE_FXSAVE)
+	{
+		xsetbv(0, features);
+	}
+
+	load_default_control_words();
+	this_cpu()->fpu_owner = NULL;
+}
+
+size_t
+fpu_state_size(void)
+{
+	return state_size;
+}
+
+void
+fpu_thread_init(struct fpu *fpu, void *state)
+{
+	// Nothing is written to the area until the first save, which the
+	// modified optimization can't skip, as it wasn't loaded from there.
+	fpu->state = state;
+	fpu->loaded_on = CPU_MAX;
+	fpu->in_use = false;
+	fpu->initial = true;
+}
+
+void
+fpu_switch(struct fpu *prev, struct fpu *next)
+{
+	struct cpu *cpu = this_cpu();
+
+	// If it had to be loaded, it hasn't been back to user mode since it
+	// was last saved.
+	if (!cpu->fpu_load_pending && fpu_is_loaded(cpu, prev))
+	{
+		fpu_save(prev);
+	}
+
+	cpu->fpu_current = next;
+	cpu->fpu_load_pending = false;
+	if (next->in_use)
+	{
+		if (fpu_is_loaded(cpu, next))
+		{
+			percpu_counter_inc(&fpu_loads_skipped);
+		}
+		else
+		{
+			cpu->fpu_load_pending = true;
+		}
+	}
+}
+
+void
+fpu_enter_user(void)
+{
+	struct cpu *cpu = this_cpu();
+	struct fpu *fpu = cpu->fpu_current;
+
+	fpu->in_use = true;
+	if (!fpu_is_loaded(cpu, fpu))
+	{
+		fpu_load(cpu, fpu);
+	}
+	cpu->fpu_load_pending = false;
+}
+
+void
+fpu_load_user(void)
+{
+	struct cpu *cpu = this_cpu();
+
+	fpu_load(cpu, cpu->fpu_current);
+	cpu->fpu_load_pending = false;
+}
+
+void
+kernel_fpu_begin(void)
+{
+	preempt_disable();
+
+	struct cpu *cpu = this_cpu();
+	struct fpu *fpu = cpu->fpu_current;
+	if (fpu != NULL)
+	{
+		if (!cpu->fpu_load_pending && fpu_is_loaded(cpu, fpu))
+		{
+			fpu_save(fpu);
+		}
+
+		cpu->fpu_load_pending = fpu->in_use;
+	}
+
+	cpu->fpu_owner = NULL;
+	load_default_control_words();
+	percpu_counter_inc(&fpu_kernel_uses);
+}
+
+void
+kernel_fpu_end(void)
+{
+	// The registers are left as they are, for the next load to overwrite.
+	preempt_enable();
+}
+
+void
+fpu_get_stats(struct fpu_stats *stats)
+{
+	stats->saves = percpu_counter_sum(&fpu_saves);
+	stats->saves_skipped = percpu_counter_sum(&fpu_saves_skipped);
+	stats->loads = percpu_counter_sum(&fpu_loads);
+	stats->loads_skipped = percpu_counter_sum(&fpu_loads_skipped);
+	stats->kernel_uses = percpu_counter_sum(&fpu_kernel_uses);
+}
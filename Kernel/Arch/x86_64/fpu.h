@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// The x87, SSE and AVX registers. The kernel is built without SIMD, so
+// they only ever hold user state, and kernel code that wants them has to
+// bracket its use with kernel_fpu_begin and kernel_fpu_end.
+//
+// Switching out a thread saves its state, unless it has never been to
+// user mode, or its registers are all in their initial state. The
+// registers keep it after that, and it is only loaded again on the way
+// back to user mode, which it skips if no other thread's state has been
+// loaded on the CPU in the meantime. Threads that stay in the kernel
+// never pay for either.
+
+struct fpu
+{
+	void *state; // <- fpu_state_size() bytes, aligned to 64.
+
+	// The CPU whose registers it was last loaded into, CPU_MAX if none.
+	size_t loaded_on;
+
+	// Set once the thread has been to user mode, before which it can't
+	// have touched the registers.
+	bool in_use;
+
+	// Saved with every register in its initial state, which is loaded
+	// from a shared copy instead of `state`.
+	bool initial;
+};
+
+struct fpu_stats
+{
+	uint64_t saves;
+	uint64_t saves_skipped; // <- The registers were in their initial state.
+	uint64_t loads;
+	uint64_t loads_skipped; // <- The registers still held the state.
+	uint64_t kernel_uses;
+};
+
+// Enables every state component the CPU has on the bootstrap CPU, and
+// picks the fastest way to save them. Must be called before init_smp.
+void init_fpu(void);
+
+// The same for each application processor.
+void fpu_init_cpu(void);
+
+// The instruction that saves the state, like "XSAVEOPT".
+const char *fpu_save_method_name(void);
+
+size_t fpu_state_size(void);
+
+// Gives a new thread the initial state, in `state`.
+void fpu_thread_init(struct fpu *fpu, void *state);
+
+// Called by the scheduler with interrupts disabled, before switching from
+// the thread owning `prev` to the one owning `next`.
+void fpu_switch(struct fpu *prev, struct fpu *next);
+
+// Marks the running thread as using the registers, and loads its state.
+// Called on the way into user mode, with interrupts disabled.
+void fpu_enter_user(void);
+
+// Loads the running thread's state. Called on the ways back to user mode
+// when the CPU's `fpu_load_pending` is set, with interrupts disabled.
+void fpu_load_user(void);
+
+// Lets kernel code use the SIMD registers until kernel_fpu_end, with
+// preemption disabled meanwhile. They start out with the default control
+// words, and nothing else in particular. Not for interrupt handlers, as
+// the thread they interrupt may be in between the two already.
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+void fpu_get_stats(struct fpu_stats *stats);
@@ -0,0 +1,347 @@
+#include <cpuid.h>
+#include "idle.h"
+#include "percpu.h"
+#include "latency-trace.h"
+#include "arch-utils.h"
+
+#define CPUID_1_ECX_MONITOR (1 << 3)
+
+#define CPUID_5_ECX_EXTENSIONS (1 << 0)
+#define CPUID_5_ECX_INTERRUPT_BREAK (1 << 1)
+
+// MWAIT extension: interrupts end the wait even while masked. That way
+// we can clear our state before taking them, see idle_mwait.
+#define MWAIT_ECX_INTERRUPT_BREAK 1
+
+#define MWAIT_CSTATE_MAX 8
+
+enum idle_state
+{
+	IDLE_STATE_RUNNING,
+	IDLE_STATE_POLLING,
+	IDLE_STATE_MWAIT,
+	IDLE_STATE_HLT,
+};
+
+// The line MONITOR watches. Only wakers write to it while we sleep, so
+// nothing else ends the wait early.
+struct idle_cpu
+{
+	// The TSC at which someone asked for the wake-up, 0 if no one has.
+	uint64_t wake;
+	enum idle_state state;
+} __attribute__((aligned(64)));
+
+static struct idle_cpu idle_cpus[CPU_MAX];
+
+// Kept apart from the wake flags, as wakers update theirs.
+static struct idle_stats idle_stats[CPU_MAX];
+
+static bool mwait_supported = false;
+static enum idle_method method = IDLE_METHOD_HLT;
+static uint64_t poll_cycles = 0;
+static uint32_t mwait_hint = 0;
+
+// How many sub-states each C-state has, from CPUID leaf 5. C0 is first.
+static uint32_t mwait_substates = 0;
+
+static inline void
+monitor(const void *addr)
+{
+	asm volatile ("monitor" : : "a"(addr), "c"(0), "d"(0) : "memory");
+}
+
+static inline void
+mwait(uint32_t hint, uint32_t extensions)
+{
+	asm volatile ("mwait" : : "a"(hint), "c"(extensions) : "memory");
+}
+
+static void
+idle_record_wakeup(struct idle_stats *stats, uint64_t requested_at)
+{
+	uint64_t cycles = rdtsc() - requested_at;
+	size_t bucket = cycles == 0 ? 0 : 63 - __builtin_clzll(cycles);
+	if (bucket >= IDLE_LATENCY_BUCKETS)
+	{
+		bucket = IDLE_LATENCY_BUCKETS - 1;
+	}
+
+	++stats->latency[bucket];
+}
+
+void
+init_idle(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0 || (ecx & CPUID_1_ECX_MONITOR) == 0)
+	{
+		return;
+	}
+
+	if (__get_cpuid(0, &eax, &ebx, &ecx, &edx) == 0 || eax < 5)
+	{
+		return;
+	}
+
+	// We can only clear our state in time if masked interrupts end the wait.
+	__cpuid(5, eax, ebx, ecx, edx);
+	if ((ecx & CPUID_5_ECX_EXTENSIONS) == 0 || (ecx & CPUID_5_ECX_INTERRUPT_BREAK) == 0)
+	{
+		return;
+	}
+
+	mwait_supported = true;
+	mwait_substates = edx;
+	method = IDLE_METHOD_MWAIT;
+
+	// C1 wakes up the fastest. If it isn't listed, the hint stays at 0,
+	// which is C1 all the same.
+	idle_set_cstate(1);
+}
+
+bool
+idle_has_mwait(void)
+{
+	return mwait_supported;
+}
+
+bool
+idle_set_method(enum idle_method new_method)
+{
+	if (new_method == IDLE_METHOD_MWAIT && !mwait_supported)
+	{
+		return false;
+	}
+
+	__atomic_store_n(&method, new_method, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+enum idle_method
+idle_get_method(void)
+{
+	return __atomic_load_n(&method, __ATOMIC_RELAXED);
+}
+
+void
+idle_set_poll_cycles(uint64_t cycles)
+{
+	__atomic_store_n(&poll_cycles, cycles, __ATOMIC_RELAXED);
+}
+
+bool
+idle_set_cstate(unsigned int cstate)
+{
+	if (!mwait_supported || cstate < 1 || cstate >= MWAIT_CSTATE_MAX)
+	{
+		return false;
+	}
+
+	uint32_t substates = (mwait_substates >> (cstate * 4)) & 0xF;
+	if (substates == 0)
+	{
+		return false;
+	}
+
+	// The C-state goes in as one less, so that 0 is C1.
+	__atomic_store_n(&mwait_hint, ((cstate - 1) << 4) | (substates - 1), __ATOMIC_RELAXED);
+
+	return true;
+}
+
+uint32_t
+idle_mwait_hint(void)
+{
+	return __atomic_load_n(&mwait_hint, __ATOMIC_RELAXED);
+}
+
+// Returns the wake-up request, or 0 if there wasn't one in time.
+static uint64_t
+idle_poll(struct idle_cpu *ic, uint64_t cycles)
+{
+	uint64_t start = rdtsc();
+	do
+	{
+		uint64_t wake = __atomic_load_n(&ic->wake, __ATOMIC_ACQUIRE);
+		if (wake != 0)
+		{
+			return wake;
+		}
+
+		cpu_relax();
+	}
+	while (rdtsc() - start < cycles);
+
+	return 0;
+}
+
+// Interrupts stay disabled all the way through, and only end the wait.
+// So by the time we take them, we are no longer in IDLE_STATE_MWAIT and
+// no waker can mistake us for a CPU that a store is enough for.
+static uint64_t
+idle_mwait(struct idle_cpu *ic)
+{
+	__atomic_store_n(&ic->state, IDLE_STATE_MWAIT, __ATOMIC_SEQ_CST);
+
+	monitor(&ic->wake);
+
+	// Anything stored before the monitor was armed wouldn't wake us up.
+	uint64_t wake = __atomic_load_n(&ic->wake, __ATOMIC_ACQUIRE);
+	if (wake != 0)
+	{
+		return wake;
+	}
+
+	mwait(idle_mwait_hint(), MWAIT_ECX_INTERRUPT_BREAK);
+
+	return __atomic_load_n(&ic->wake, __ATOMIC_ACQUIRE);
+}
+
+void
+idle_enter(void)
+{
+	struct cpu *cpu = this_cpu();
+	struct idle_cpu *ic = &idle_cpus[cpu->index];
+	struct idle_stats *stats = &idle_stats[cpu->index];
+
+	++stats->entries;
+
+	// Waiting for work with interrupts off doesn't hold anything up.
+	latency_trace_idle();
+
+	// Whatever was left over from a wake-up which came too late is stale,
+	// and wakers only store once they see we're idle.
+	__atomic_store_n(&ic->wake, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ic->state, IDLE_STATE_POLLING, __ATOMIC_SEQ_CST);
+
+	uint64_t cycles = __atomic_load_n(&poll_cycles, __ATOMIC_RELAXED);
+	uint64_t wake = cycles != 0 ? idle_poll(ic, cycles) : 0;
+	if (wake != 0)
+	{
+		++stats->polled_wakeups;
+		idle_record_wakeup(stats, wake);
+	}
+	else if (idle_get_method() == IDLE_METHOD_MWAIT)
+	{
+		wake = idle_mwait(ic);
+		if (wake != 0)
+		{
+			++stats->mwait_wakeups;
+			idle_record_wakeup(stats, wake);
+		}
+	}
+	else
+	{
+		// Waking us up takes an IPI from here on, so the interrupt
+		// handler may well run before we get to account for it. A
+		// waker which saw us polling may have stored its wake-up just
+		// now, and sent none, see idle_wake.
+		__atomic_store_n(&ic->state, IDLE_STATE_HLT, __ATOMIC_SEQ_CST);
+		wake = __atomic_load_n(&ic->wake, __ATOMIC_SEQ_CST);
+		if (wake != 0)
+		{
+			++stats->polled_wakeups;
+			idle_record_wakeup(stats, wake);
+		}
+		else
+		{
+			asm volatile ("sti; hlt; cli");
+			idle_note_wakeup();
+		}
+	}
+
+	__atomic_store_n(&ic->state, IDLE_STATE_RUNNING, __ATOMIC_RELEASE);
+	local_irq_enable();
+}
+
+bool
+idle_wake(size_t cpu_index)
+{
+	struct idle_cpu *ic = &idle_cpus[cpu_index];
+	struct idle_stats *stats = &idle_stats[this_cpu()->index];
+
+	// Pairs with the state changes in idle_enter: either we see the CPU
+	// idle here, or it sees whatever the caller did before calling us.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	enum idle_state state = __atomic_load_n(&ic->state, __ATOMIC_RELAXED);
+	if (state == IDLE_STATE_RUNNING)
+	{
+		return false;
+	}
+
+	// Never 0, which means no wake-up.
+	__atomic_store_n(&ic->wake, rdtsc() | 1, __ATOMIC_SEQ_CST);
+
+	// The CPU may have gone on to halt since we looked. Either it sees
+	// the store once it has said so, or we see that it has.
+	if (state != IDLE_STATE_HLT)
+	{
+		state = __atomic_load_n(&ic->state, __ATOMIC_SEQ_CST);
+	}
+
+	if (state == IDLE_STATE_HLT)
+	{
+		__atomic_fetch_add(&stats->ipi_wakes, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	__atomic_fetch_add(&stats->store_wakes, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+void
+idle_note_wakeup(void)
+{
+	struct cpu *cpu = this_cpu();
+	struct idle_cpu *ic = &idle_cpus[cpu->index];
+	if (__atomic_load_n(&ic->state, __ATOMIC_RELAXED) != IDLE_STATE_HLT)
+	{
+		return;
+	}
+
+	// We may have been woken up by some other interrupt.
+	uint64_t wake = __atomic_exchange_n(&ic->wake, 0, __ATOMIC_ACQUIRE);
+	if (wake != 0)
+	{
+		struct idle_stats *stats = &idle_stats[cpu->index];
+		++stats->hlt_wakeups;
+		idle_record_wakeup(stats, wake);
+	}
+
+	__atomic_store_n(&ic->state, IDLE_STATE_RUNNING, __ATOMIC_RELEASE);
+}
+
+bool
+idle_cpu_is_idle(size_t cpu_index)
+{
+	return __atomic_load_n(&idle_cpus[cpu_index].state, __ATOMIC_ACQUIRE) != IDLE_STATE_RUNNING;
+}
+
+void
+idle_get_stats(size_t cpu_index, struct idle_stats *stats)
+{
+	struct idle_stats *from = &idle_stats[cpu_index];
+
+	stats->entries = __atomic_load_n(&from->entries, __ATOMIC_RELAXED);
+	stats->polled_wakeups = __atomic_load_n(&from->polled_wakeups, __ATOMIC_RELAXED);
+	stats->mwait_wakeups = __atomic_load_n(&from->mwait_wakeups, __ATOMIC_RELAXED);
+	stats->hlt_wakeups = __atomic_load_n(&from->hlt_wakeups, __ATOMIC_RELAXED);
+	stats->store_wakes = __atomic_load_n(&from->store_wakes, __ATOMIC_RELAXED);
+	stats->ipi_wakes = __atomic_load_n(&from->ipi_wakes, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < IDLE_LATENCY_BUCKETS; ++i)
+	{
+		stats->latency[i] = __atomic_load_n(&from->latency[i], __ATOMIC_RELAXED);
+	}
+}
+
+void
+idle_reset_stats(void)
+{
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		idle_stats[i] = (struct idle_stats) { 0 };
+	}
+}
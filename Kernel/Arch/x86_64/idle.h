@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// What a CPU does when it has nothing to run. Every CPU has a wake flag on
+// a cache line of its own. An idle CPU first polls it for a while, if
+// asked to, and then sleeps with MWAIT watching it if the CPU can, so that
+// waking it up takes a single store rather than an IPI. Without MWAIT it
+// halts, and waking it up takes an IPI like before.
+
+enum idle_method
+{
+	IDLE_METHOD_HLT,
+	IDLE_METHOD_MWAIT,
+};
+
+// Wake-up latencies go into power-of-two buckets of TSC cycles: bucket n
+// counts those from 2^n up to 2^(n+1) cycles.
+#define IDLE_LATENCY_BUCKETS 32
+
+struct idle_stats
+{
+	uint64_t entries;
+	uint64_t polled_wakeups; // <- Woken up while still polling.
+	uint64_t mwait_wakeups;
+	uint64_t hlt_wakeups;
+	uint64_t store_wakes; // <- idle_wake calls which didn't need an IPI.
+	uint64_t ipi_wakes;
+
+	// From idle_wake to the CPU noticing, for every wake-up above.
+	uint64_t latency[IDLE_LATENCY_BUCKETS];
+} __attribute__((aligned(64)));
+
+// Picks MWAIT if the CPU has it, with the shallowest C-state.
+void init_idle(void);
+
+bool idle_has_mwait(void);
+
+// Fails if the CPU can't do MWAIT.
+bool idle_set_method(enum idle_method method);
+enum idle_method idle_get_method(void);
+
+// How long to poll before going to sleep. 0 skips polling altogether.
+// Interrupts stay disabled meanwhile, so keep it short.
+void idle_set_poll_cycles(uint64_t cycles);
+
+// Picks the deepest sub-state of C-state `cstate` (1 for C1 and so on) for
+// MWAIT. Deeper ones save more power and take longer to wake up from.
+// Fails if the CPU doesn't report any sub-states for it.
+bool idle_set_cstate(unsigned int cstate);
+
+// The EAX hint given to MWAIT.
+uint32_t idle_mwait_hint(void);
+
+// Waits for something to do. Called by the idle thread with interrupts
+// disabled, once the scheduler found nothing to run. Returns with
+// interrupts enabled, after a wake-up or an interrupt.
+void idle_enter(void);
+
+// Wakes the given CPU if it is idle. Returns true if it was polling or in
+// MWAIT and the store was enough. Otherwise the caller must send an IPI,
+// if the CPU is to do anything about it before its next tick.
+bool idle_wake(size_t cpu_index);
+
+// For interrupt handlers that wake halted CPUs, like the scheduler's kick,
+// to account for the wake-up before they switch away from the idle thread.
+void idle_note_wakeup(void);
+
+bool idle_cpu_is_idle(size_t cpu_index);
+
+void idle_get_stats(size_t cpu_index, struct idle_stats *stats);
+void idle_reset_stats(void);
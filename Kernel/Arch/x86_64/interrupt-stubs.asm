@@ -0,0 +1,253 @@
+; Entry stubs for the IDT, one per vector. Every stub normalizes the stack
+; so that it always holds an error code and the vector number, and then
+; jumps to one of the common paths, which save registers into a
+; `struct interrupt_frame` (see interrupts.h) and call interrupt_dispatch.
+
+; Exceptions for which the CPU pushes an error code.
+%macro EXCEPTION_STUB_ERR 1
+exception_stub_%1:
+	push %1
+	jmp exception_common
+%endmacro
+
+; Exceptions without an error code get a zero in its place.
+%macro EXCEPTION_STUB_NOERR 1
+exception_stub_%1:
+	push 0
+	push %1
+	jmp exception_common
+%endmacro
+
+; Exceptions that can come in anywhere, see paranoid_common.
+%macro PARANOID_STUB_ERR 1
+exception_stub_%1:
+	push %1
+	jmp paranoid_common
+%endmacro
+
+%macro PARANOID_STUB_NOERR 1
+exception_stub_%1:
+	push 0
+	push %1
+	jmp paranoid_common
+%endmacro
+
+; The registers the C calling convention lets a function clobber, plus
+; RBP, which is kept for walking the interrupted stack.
+%macro PUSH_SCRATCH_REGS 0
+	push rax
+	push rcx
+	push rdx
+	push rsi
+	push rdi
+	push r8
+	push r9
+	push r10
+	push r11
+	push rbp
+%endmacro
+
+%macro POP_SCRATCH_REGS 0
+	pop rbp
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rdi
+	pop rsi
+	pop rdx
+	pop rcx
+	pop rax
+%endmacro
+
+; The rest of the frame, RBX and R12 to R15.
+%define CALLEE_SAVED_SIZE 40
+
+%define MSR_GS_BASE 0xC0000101
+
+; Where the CPU's CS is, above the registers, the vector number and the
+; error code, and RIP.
+%define FRAME_CS 144
+
+; Checked by fpu.c.
+%define CPU_FPU_LOAD_PENDING 216
+
+; Coming from user mode, the GS base is the user's, and the kernel's is
+; waiting to be swapped in. Expects the vector number and the error code
+; on top of the CPU's part of the frame.
+%macro SWAPGS_IF_FROM_USER 0
+	test byte [rsp + 24], 3
+	jz %%from_kernel
+	swapgs
+%%from_kernel:
+%endmacro
+
+; The same on the way out, with only the CPU's part left.
+%macro SWAPGS_IF_TO_USER 0
+	test byte [rsp + 8], 3
+	jz %%to_kernel
+	swapgs
+%%to_kernel:
+%endmacro
+
+; On the way back to user mode, the running thread's FPU state may have
+; to be loaded first, see fpu.h. Expects the whole frame on the stack,
+; aligned for the call, and interrupts disabled.
+%macro LOAD_FPU_IF_TO_USER 0
+	test byte [rsp + FRAME_CS], 3
+	jz %%done
+	cmp byte [gs:CPU_FPU_LOAD_PENDING], 0
+	je %%done
+	call fpu_load_user
+%%done:
+%endmacro
+
+section .text
+extern interrupt_dispatch:function
+extern fpu_load_user:function
+
+; The frame is a multiple of 16 bytes on both paths, and the CPU aligned
+; the stack before pushing its part, so we are aligned for the call.
+
+exception_common:
+	SWAPGS_IF_FROM_USER
+	PUSH_SCRATCH_REGS
+	push rbx
+	push r12
+	push r13
+	push r14
+	push r15
+
+	mov rdi, rsp
+	cld
+	call interrupt_dispatch
+	LOAD_FPU_IF_TO_USER
+
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rbx
+	POP_SCRATCH_REGS
+
+	; Drop the vector number and the error code.
+	add rsp, 16
+	SWAPGS_IF_TO_USER
+	iretq
+
+; NMIs, machine checks and double faults can also come in kernel mode
+; before the SYSCALL entry has swapped GS, or after the way out has, so
+; the privilege level says nothing. The GS base does: only the kernel's
+; is in the upper half.
+paranoid_common:
+	PUSH_SCRATCH_REGS
+	push rbx
+	push r12
+	push r13
+	push r14
+	push r15
+
+	; RBX survives the call, and says whether to swap back.
+	xor ebx, ebx
+	mov ecx, MSR_GS_BASE
+	rdmsr
+	test edx, edx
+	js .kernel_gs
+	swapgs
+	mov ebx, 1
+.kernel_gs:
+
+	mov rdi, rsp
+	cld
+	call interrupt_dispatch
+
+	test ebx, ebx
+	jz .no_swap
+	swapgs
+.no_swap:
+
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rbx
+	POP_SCRATCH_REGS
+
+	add rsp, 16
+	iretq
+
+; The handlers are C functions, which preserve the callee-saved registers
+; themselves, so their slots in the frame are only skipped over. Even a
+; context switch from within a handler saves them, see sched-switch.asm.
+irq_common:
+	SWAPGS_IF_FROM_USER
+	PUSH_SCRATCH_REGS
+	sub rsp, CALLEE_SAVED_SIZE
+
+	mov rdi, rsp
+	cld
+	call interrupt_dispatch
+	LOAD_FPU_IF_TO_USER
+
+	add rsp, CALLEE_SAVED_SIZE
+	POP_SCRATCH_REGS
+
+	add rsp, 16
+	SWAPGS_IF_TO_USER
+	iretq
+
+EXCEPTION_STUB_NOERR 0
+EXCEPTION_STUB_NOERR 1
+PARANOID_STUB_NOERR  2
+EXCEPTION_STUB_NOERR 3
+EXCEPTION_STUB_NOERR 4
+EXCEPTION_STUB_NOERR 5
+EXCEPTION_STUB_NOERR 6
+EXCEPTION_STUB_NOERR 7
+PARANOID_STUB_ERR    8
+EXCEPTION_STUB_NOERR 9
+EXCEPTION_STUB_ERR   10
+EXCEPTION_STUB_ERR   11
+EXCEPTION_STUB_ERR   12
+EXCEPTION_STUB_ERR   13
+EXCEPTION_STUB_ERR   14
+EXCEPTION_STUB_NOERR 15
+EXCEPTION_STUB_NOERR 16
+EXCEPTION_STUB_ERR   17
+PARANOID_STUB_NOERR  18
+EXCEPTION_STUB_NOERR 19
+EXCEPTION_STUB_NOERR 20
+EXCEPTION_STUB_ERR   21
+EXCEPTION_STUB_NOERR 22
+EXCEPTION_STUB_NOERR 23
+EXCEPTION_STUB_NOERR 24
+EXCEPTION_STUB_NOERR 25
+EXCEPTION_STUB_NOERR 26
+EXCEPTION_STUB_NOERR 27
+EXCEPTION_STUB_NOERR 28
+EXCEPTION_STUB_ERR   29
+EXCEPTION_STUB_ERR   30
+EXCEPTION_STUB_NOERR 31
+
+; Interrupts from the local APIC and devices, which never push an error code.
+%assign i 32
+%rep 224
+irq_stub_%+i:
+	push 0
+	push i
+	jmp irq_common
+%assign i i+1
+%endrep
+
+section .rodata
+global interrupt_stubs:data
+interrupt_stubs:
+%assign i 0
+%rep 32
+	dq exception_stub_%+i
+%assign i i+1
+%endrep
+%rep 224
+	dq irq_stub_%+i
+%assign i i+1
+%endrep
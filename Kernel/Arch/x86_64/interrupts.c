@@ -0,0 +1,254 @@
+#include <SampoOS/Kernel/memman.h>
+#include "interrupts.h"
+#include "percpu.h"
+#include "memory-manager.h"
+#include "latency-trace.h"
+#include "trace.h"
+#include "sched.h"
+#include "apic.h"
+#include "serial.h"
+#include "arch-utils.h"
+#include <stddef.h>
+
+#define IDT_ENTRY_COUNT 256
+
+// The exceptions which get a stack of their own, by their IST slot. A
+// double fault may well come from running out of stack, and NMIs and
+// machine checks can arrive anywhere, whatever the state of the stack.
+// The others may nest, so they stay on the stack they came in on.
+enum interrupt_stack
+{
+	INTERRUPT_STACK_DOUBLE_FAULT = 1,
+	INTERRUPT_STACK_NMI = 2,
+	INTERRUPT_STACK_MACHINE_CHECK = 3,
+
+	INTERRUPT_STACK_COUNT = 3,
+};
+
+#define INTERRUPT_STACK_PAGES 2
+
+// Present, DPL 0, 64-bit interrupt gate.
+static const uint8_t IDT_GATE_INTERRUPT = 0x8E;
+
+struct idt_entry
+{
+	uint16_t offset_low;
+	uint16_t selector;
+	uint8_t ist;
+	uint8_t type_attr;
+	uint16_t offset_mid;
+	uint32_t offset_high;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct idt_pointer
+{
+	uint16_t limit;
+	uint64_t base;
+} __attribute__((packed));
+
+static struct idt_entry idt[IDT_ENTRY_COUNT] __attribute__((aligned(16)));
+static interrupt_handler handlers[IDT_ENTRY_COUNT];
+
+// The dynamic range, for each CPU.
+static interrupt_handler cpu_handlers[CPU_MAX][INTERRUPT_VECTOR_DYNAMIC_COUNT];
+
+// Defined in interrupt-stubs.asm, one entry stub per vector.
+extern const uint64_t interrupt_stubs[IDT_ENTRY_COUNT];
+
+static void
+idt_set_gate(uint8_t vector, uint64_t stub_addr, uint8_t type_attr)
+{
+	struct idt_entry *entry = &idt[vector];
+
+	entry->offset_low = stub_addr & 0xFFFF;
+	entry->selector = KERNEL_CODE_SELECTOR;
+	entry->ist = 0;
+	entry->type_attr = type_attr;
+	entry->offset_mid = (stub_addr >> 16) & 0xFFFF;
+	entry->offset_high = (stub_addr >> 32) & 0xFFFFFFFF;
+	entry->reserved = 0;
+}
+
+void
+init_interrupts(void)
+{
+	for (size_t i = 0; i < IDT_ENTRY_COUNT; ++i)
+	{
+		idt_set_gate(i, interrupt_stubs[i], IDT_GATE_INTERRUPT);
+	}
+
+	interrupts_load_idt();
+}
+
+bool
+interrupts_alloc_stacks(struct cpu *cpu)
+{
+	uint8_t *stacks = virt_alloc_pages(INTERRUPT_STACK_COUNT * INTERRUPT_STACK_PAGES, VIRT_MAP_READ | VIRT_MAP_WRITE);
+	if (stacks == NULL)
+	{
+		return false;
+	}
+
+	// The TSS numbers them from 1, and keeps the first one in ist[0].
+	for (size_t i = 0; i < INTERRUPT_STACK_COUNT; ++i)
+	{
+		cpu->tss.ist[i] = (uintptr_t)(stacks + (i + 1) * INTERRUPT_STACK_PAGES * PAGE_SIZE);
+	}
+
+	return true;
+}
+
+void
+interrupts_free_stacks(struct cpu *cpu)
+{
+	if (cpu->tss.ist[0] == 0)
+	{
+		return;
+	}
+
+	virt_free_pages((void *)(cpu->tss.ist[0] - INTERRUPT_STACK_PAGES * PAGE_SIZE),
+			INTERRUPT_STACK_COUNT * INTERRUPT_STACK_PAGES);
+
+	for (size_t i = 0; i < INTERRUPT_STACK_COUNT; ++i)
+	{
+		cpu->tss.ist[i] = 0;
+	}
+}
+
+bool
+init_interrupt_stacks(void)
+{
+	if (!interrupts_alloc_stacks(this_cpu()))
+	{
+		return false;
+	}
+
+	// The TSS is only read when an exception comes, so this is all it takes.
+	idt[INTERRUPT_VECTOR_DOUBLE_FAULT].ist = INTERRUPT_STACK_DOUBLE_FAULT;
+	idt[INTERRUPT_VECTOR_NMI].ist = INTERRUPT_STACK_NMI;
+	idt[INTERRUPT_VECTOR_MACHINE_CHECK].ist = INTERRUPT_STACK_MACHINE_CHECK;
+
+	return true;
+}
+
+void
+interrupts_load_idt(void)
+{
+	struct idt_pointer idtr = {
+		.limit = sizeof(idt) - 1,
+		.base = (uint64_t)(uintptr_t) idt,
+	};
+
+	asm volatile("lidt %0" : : "m"(idtr));
+}
+
+interrupt_handler
+interrupt_register_handler(uint8_t vector, interrupt_handler handler)
+{
+	return __atomic_exchange_n(&handlers[vector], handler, __ATOMIC_ACQ_REL);
+}
+
+bool
+interrupt_alloc_vector(size_t cpu_index, interrupt_handler handler, uint8_t *vector)
+{
+	interrupt_handler *cpu_table = cpu_handlers[cpu_index];
+	for (size_t i = 0; i < INTERRUPT_VECTOR_DYNAMIC_COUNT; ++i)
+	{
+		interrupt_handler expected = NULL;
+		if (__atomic_compare_exchange_n(&cpu_table[i], &expected, handler, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			*vector = INTERRUPT_VECTOR_DYNAMIC_FIRST + i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void
+interrupt_free_vector(size_t cpu_index, uint8_t vector)
+{
+	__atomic_store_n(&cpu_handlers[cpu_index][vector - INTERRUPT_VECTOR_DYNAMIC_FIRST], NULL, __ATOMIC_RELEASE);
+}
+
+// Called from the common entry stubs with a pointer to the saved registers.
+void
+interrupt_dispatch(struct interrupt_frame *frame)
+{
+	interrupt_handler handler;
+	if (frame->vector >= INTERRUPT_VECTOR_DYNAMIC_FIRST && frame->vector <= INTERRUPT_VECTOR_DYNAMIC_LAST)
+	{
+		handler = __atomic_load_n(&cpu_handlers[this_cpu()->index][frame->vector - INTERRUPT_VECTOR_DYNAMIC_FIRST], __ATOMIC_ACQUIRE);
+	}
+	else
+	{
+		handler = __atomic_load_n(&handlers[frame->vector], __ATOMIC_ACQUIRE);
+	}
+
+	// Interrupts stay off until the IRET, unless they already were.
+	bool irqs_were_on = (frame->rflags & RFLAGS_INTERRUPT_ENABLE) != 0;
+	if (irqs_were_on)
+	{
+		latency_trace_irqs_off((uintptr_t) handler);
+	}
+
+	// Exceptions stay out of the tracepoints, see trace.h.
+	uint64_t vector = frame->vector;
+	bool traced = vector >= INTERRUPT_VECTOR_EXCEPTION_COUNT;
+	if (traced)
+	{
+		trace_irq_entry(vector);
+	}
+
+	bool handled = handler != NULL && handler(frame);
+
+	if (traced)
+	{
+		trace_irq_exit(vector, handled);
+	}
+
+	if (irqs_were_on)
+	{
+		latency_trace_irqs_on((uintptr_t) handler);
+	}
+
+	if (handled)
+	{
+		// Only the interrupt handlers ask for a reschedule.
+		if (vector >= INTERRUPT_VECTOR_EXCEPTION_COUNT)
+		{
+			sched_interrupt_exit();
+		}
+
+		return;
+	}
+
+	if (frame->vector < INTERRUPT_VECTOR_EXCEPTION_COUNT)
+	{
+		// An exception nobody could deal with. The serial interrupt
+		// won't come anymore, so the report is pushed out by hand.
+		serial_printf("Unhandled exception %llu, error code %llx, at %llx:%llx on CPU %u\n",
+			      (unsigned long long) frame->vector,
+			      (unsigned long long) frame->error_code,
+			      (unsigned long long) frame->cs,
+			      (unsigned long long) frame->rip,
+			      (unsigned int) this_cpu()->index);
+		serial_flush();
+		for (;;)
+		{
+			asm volatile("cli; hlt");
+		}
+	}
+
+	// The local APIC won't deliver anything of the same or a lower
+	// priority until it gets its EOI, which spurious interrupts don't
+	// take.
+	if (frame->vector != INTERRUPT_VECTOR_APIC_SPURIOUS)
+	{
+		serial_printf("Stray interrupt %llu on CPU %u\n",
+			      (unsigned long long) frame->vector,
+			      (unsigned int) this_cpu()->index);
+		apic_eoi();
+	}
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct cpu;
+
+// Both Kickstart's 64-bit GDT and our per-CPU ones (see percpu.h) place
+// the kernel code segment right after the null descriptor.
+#define KERNEL_CODE_SELECTOR 0x08
+
+enum interrupt_vector
+{
+	INTERRUPT_VECTOR_DIVIDE_ERROR = 0,
+	INTERRUPT_VECTOR_DEBUG = 1,
+	INTERRUPT_VECTOR_NMI = 2,
+	INTERRUPT_VECTOR_BREAKPOINT = 3,
+	INTERRUPT_VECTOR_OVERFLOW = 4,
+	INTERRUPT_VECTOR_BOUND_RANGE = 5,
+	INTERRUPT_VECTOR_INVALID_OPCODE = 6,
+	INTERRUPT_VECTOR_DEVICE_NOT_AVAILABLE = 7,
+	INTERRUPT_VECTOR_DOUBLE_FAULT = 8,
+	INTERRUPT_VECTOR_INVALID_TSS = 10,
+	INTERRUPT_VECTOR_SEGMENT_NOT_PRESENT = 11,
+	INTERRUPT_VECTOR_STACK_FAULT = 12,
+	INTERRUPT_VECTOR_GENERAL_PROTECTION = 13,
+	INTERRUPT_VECTOR_PAGE_FAULT = 14,
+	INTERRUPT_VECTOR_X87_FPU_ERROR = 16,
+	INTERRUPT_VECTOR_ALIGNMENT_CHECK = 17,
+	INTERRUPT_VECTOR_MACHINE_CHECK = 18,
+	INTERRUPT_VECTOR_SIMD_ERROR = 19,
+
+	INTERRUPT_VECTOR_EXCEPTION_COUNT = 32,
+
+	INTERRUPT_VECTOR_APIC_TIMER = 32,
+
+	// Handed out per CPU, see interrupt_alloc_vector.
+	INTERRUPT_VECTOR_DYNAMIC_FIRST = 0x30,
+	INTERRUPT_VECTOR_DYNAMIC_LAST = 0xEF,
+
+	INTERRUPT_VECTOR_TLB_SHOOTDOWN = 0xF0,
+	INTERRUPT_VECTOR_PING = 0xF1, // <- Bounced between CPUs by bench-ipi.c.
+	INTERRUPT_VECTOR_SCHED_KICK = 0xF2,
+	INTERRUPT_VECTOR_SYNC_CORE = 0xF4, // <- Sent while patching code, see static-key.c.
+	INTERRUPT_VECTOR_APIC_SPURIOUS = 0xFF,
+};
+
+#define INTERRUPT_VECTOR_DYNAMIC_COUNT (INTERRUPT_VECTOR_DYNAMIC_LAST - INTERRUPT_VECTOR_DYNAMIC_FIRST + 1)
+
+// The register state pushed by the entry stubs in interrupt-stubs.asm.
+// The layout must be kept in sync with the stubs.
+struct interrupt_frame
+{
+	// Only saved for exceptions. Interrupt handlers preserve them like
+	// any other C function, so the stubs don't bother.
+	uint64_t r15;
+	uint64_t r14;
+	uint64_t r13;
+	uint64_t r12;
+	uint64_t rbx;
+
+	uint64_t rbp;
+	uint64_t r11;
+	uint64_t r10;
+	uint64_t r9;
+	uint64_t r8;
+	uint64_t rdi;
+	uint64_t rsi;
+	uint64_t rdx;
+	uint64_t rcx;
+	uint64_t rax;
+
+	uint64_t vector;
+	uint64_t error_code; // <- Zero for vectors without an error code.
+
+	// Pushed by the CPU.
+	uint64_t rip;
+	uint64_t cs;
+	uint64_t rflags;
+	uint64_t rsp;
+	uint64_t ss;
+};
+
+// Returns true if the interrupt was handled and execution may resume.
+typedef bool (*interrupt_handler)(struct interrupt_frame *frame);
+
+void init_interrupts(void);
+
+// Moves the exceptions that can come with a bad stack, or in the middle
+// of anything, onto stacks of their own. Must be called once the memory
+// manager is up, and before init_smp.
+bool init_interrupt_stacks(void);
+
+// Allocates the exception stacks of `cpu` and points its TSS at them.
+bool interrupts_alloc_stacks(struct cpu *cpu);
+void interrupts_free_stacks(struct cpu *cpu);
+
+// Loads the IDT on the calling CPU. The IDT is shared by all of them.
+void interrupts_load_idt(void);
+
+// For the vectors which are the same on every CPU. Returns the handler
+// that was registered before.
+interrupt_handler interrupt_register_handler(uint8_t vector, interrupt_handler handler);
+
+// Picks a free vector in the dynamic range of the given CPU and registers
+// `handler` for it, for an interrupt which only ever goes to that CPU.
+// The same vector may well mean something else on another CPU.
+bool interrupt_alloc_vector(size_t cpu_index, interrupt_handler handler, uint8_t *vector);
+void interrupt_free_vector(size_t cpu_index, uint8_t vector);
@@ -0,0 +1,231 @@
+#include <SampoOS/Kernel/memman.h>
+#include <string.h>
+#include "ioapic.h"
+#include "acpi.h"
+#include "memory-manager.h"
+#include "spinlock.h"
+#include "arch-utils.h"
+
+#define IOAPIC_MAX 8
+#define ISA_IRQ_COUNT 16
+
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WINDOW 0x10
+
+#define IOAPIC_REG_VERSION 0x01
+#define IOAPIC_REG_REDIRECTION 0x10 // <- Two registers per entry.
+
+#define IOAPIC_VERSION_MAX_ENTRY(v) (((v) >> 16) & 0xFF)
+
+#define REDIRECTION_ACTIVE_LOW (1 << 13)
+#define REDIRECTION_LEVEL (1 << 15)
+#define REDIRECTION_MASKED (1 << 16)
+#define REDIRECTION_DESTINATION_SHIFT 24 // <- In the high register.
+
+// The master PIC's data port, and the slave's.
+#define PIC1_DATA 0x21
+#define PIC2_DATA 0xA1
+
+#define MADT_POLARITY_MASK 0x3
+#define MADT_POLARITY_ACTIVE_LOW 0x3
+#define MADT_TRIGGER_MASK 0xC
+#define MADT_TRIGGER_LEVEL 0xC
+
+struct ioapic
+{
+	volatile uint32_t *regs;
+	uint32_t gsi_base;
+	uint32_t entry_count;
+};
+
+// Where an ISA IRQ ended up, and how it is signalled. ISA IRQs are edge
+// triggered and active high unless overridden.
+struct isa_irq
+{
+	uint32_t gsi;
+	uint32_t flags; // <- REDIRECTION_ACTIVE_LOW and REDIRECTION_LEVEL.
+};
+
+static struct ioapic ioapics[IOAPIC_MAX];
+static size_t ioapic_count;
+static struct isa_irq isa_irqs[ISA_IRQ_COUNT];
+
+LOCK_CLASS(ioapic_lock_class, "I/O APIC");
+static struct spinlock ioapic_lock = SPINLOCK_INIT(&ioapic_lock_class);
+
+static uint32_t
+ioapic_read(struct ioapic *ioapic, uint32_t reg)
+{
+	ioapic->regs[IOAPIC_REGSEL / 4] = reg;
+
+	return ioapic->regs[IOAPIC_WINDOW / 4];
+}
+
+static void
+ioapic_write(struct ioapic *ioapic, uint32_t reg, uint32_t value)
+{
+	ioapic->regs[IOAPIC_REGSEL / 4] = reg;
+	ioapic->regs[IOAPIC_WINDOW / 4] = value;
+}
+
+static struct ioapic *
+ioapic_for_gsi(uint32_t gsi)
+{
+	for (size_t i = 0; i < ioapic_count; ++i)
+	{
+		if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].entry_count)
+		{
+			return &ioapics[i];
+		}
+	}
+
+	return NULL;
+}
+
+static uint32_t
+read_u32(const uint8_t *bytes)
+{
+	uint32_t val;
+	memcpy(&val, bytes, sizeof(val));
+
+	return val;
+}
+
+static void
+ioapic_add(uint64_t phys, uint32_t gsi_base)
+{
+	if (ioapic_count == IOAPIC_MAX)
+	{
+		return;
+	}
+
+	uintptr_t offset = phys & (PAGE_SIZE - 1);
+	uint8_t *mapping = virt_map_pages(phys - offset, 1, VIRT_MAP_READ | VIRT_MAP_WRITE | VIRT_MAP_UNCACHED);
+	if (mapping == NULL)
+	{
+		return;
+	}
+
+	struct ioapic *ioapic = &ioapics[ioapic_count++];
+	ioapic->regs = (volatile uint32_t *) (mapping + offset);
+	ioapic->gsi_base = gsi_base;
+	ioapic->entry_count = IOAPIC_VERSION_MAX_ENTRY(ioapic_read(ioapic, IOAPIC_REG_VERSION)) + 1;
+
+	// Nothing is delivered until someone asks for it.
+	for (uint32_t entry = 0; entry < ioapic->entry_count; ++entry)
+	{
+		ioapic_write(ioapic, IOAPIC_REG_REDIRECTION + entry * 2, REDIRECTION_MASKED);
+		ioapic_write(ioapic, IOAPIC_REG_REDIRECTION + entry * 2 + 1, 0);
+	}
+}
+
+bool
+init_ioapic(void)
+{
+	struct madt *madt = (struct madt *) acpi_find_table("APIC");
+	if (madt == NULL)
+	{
+		return false;
+	}
+
+	for (size_t irq = 0; irq < ISA_IRQ_COUNT; ++irq)
+	{
+		isa_irqs[irq] = (struct isa_irq) { .gsi = irq, .flags = 0 };
+	}
+
+	const uint8_t *entries = (const uint8_t *)(madt + 1);
+	size_t entries_len = madt->header.length - sizeof(*madt);
+	for (size_t offset = 0; offset + 2 <= entries_len; offset += entries[offset + 1])
+	{
+		if (entries[offset + 1] == 0)
+		{
+			break;
+		}
+
+		switch (entries[offset])
+		{
+		case MADT_ENTRY_IOAPIC:
+			ioapic_add(read_u32(&entries[offset + 4]), read_u32(&entries[offset + 8]));
+			break;
+		case MADT_ENTRY_SOURCE_OVERRIDE:
+		{
+			uint8_t source = entries[offset + 3];
+			if (source >= ISA_IRQ_COUNT)
+			{
+				break;
+			}
+
+			uint16_t flags;
+			memcpy(&flags, &entries[offset + 8], sizeof(flags));
+			isa_irqs[source].gsi = read_u32(&entries[offset + 4]);
+			isa_irqs[source].flags =
+				((flags & MADT_POLARITY_MASK) == MADT_POLARITY_ACTIVE_LOW ? REDIRECTION_ACTIVE_LOW : 0) |
+				((flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL ? REDIRECTION_LEVEL : 0);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	if (ioapic_count == 0)
+	{
+		return false;
+	}
+
+	// The PICs would deliver the same IRQs alongside, on vectors of their own.
+	outb(PIC1_DATA, 0xFF);
+	outb(PIC2_DATA, 0xFF);
+
+	return true;
+}
+
+bool
+ioapic_route_isa_irq(uint8_t irq, uint8_t vector, uint32_t apic_id)
+{
+	// Reaching further takes interrupt remapping.
+	if (irq >= ISA_IRQ_COUNT || apic_id > 0xFF)
+	{
+		return false;
+	}
+
+	struct ioapic *ioapic = ioapic_for_gsi(isa_irqs[irq].gsi);
+	if (ioapic == NULL)
+	{
+		return false;
+	}
+
+	uint32_t entry = isa_irqs[irq].gsi - ioapic->gsi_base;
+	uint64_t flags = spin_lock_irqsave(&ioapic_lock);
+
+	// Fixed delivery to one CPU, by its APIC ID. Unmasked last.
+	ioapic_write(ioapic, IOAPIC_REG_REDIRECTION + entry * 2 + 1, apic_id << REDIRECTION_DESTINATION_SHIFT);
+	ioapic_write(ioapic, IOAPIC_REG_REDIRECTION + entry * 2, vector | isa_irqs[irq].flags);
+
+	spin_unlock_irqrestore(&ioapic_lock, flags);
+
+	return true;
+}
+
+void
+ioapic_mask_isa_irq(uint8_t irq)
+{
+	if (irq >= ISA_IRQ_COUNT)
+	{
+		return;
+	}
+
+	struct ioapic *ioapic = ioapic_for_gsi(isa_irqs[irq].gsi);
+	if (ioapic == NULL)
+	{
+		return;
+	}
+
+	uint32_t entry = isa_irqs[irq].gsi - ioapic->gsi_base;
+	uint64_t flags = spin_lock_irqsave(&ioapic_lock);
+
+	uint32_t low = ioapic_read(ioapic, IOAPIC_REG_REDIRECTION + entry * 2);
+	ioapic_write(ioapic, IOAPIC_REG_REDIRECTION + entry * 2, low | REDIRECTION_MASKED);
+
+	spin_unlock_irqrestore(&ioapic_lock, flags);
+}
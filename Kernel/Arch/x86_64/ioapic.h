@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Routing of device interrupts through the I/O APICs the MADT lists. The
+// legacy PICs are masked off once they are found.
+
+bool init_ioapic(void);
+
+// Delivers ISA interrupt `irq` as `vector` to the CPU with `apic_id`,
+// following the MADT's source overrides for where the IRQ is wired to and
+// how it is signalled.
+bool ioapic_route_isa_irq(uint8_t irq, uint8_t vector, uint32_t apic_id);
+
+void ioapic_mask_isa_irq(uint8_t irq);
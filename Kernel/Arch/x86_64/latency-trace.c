@@ -0,0 +1,194 @@
+#include "latency-trace.h"
+#include "percpu.h"
+#include "clock.h"
+#include "serial.h"
+#include "symbols.h"
+#include "arch-utils.h"
+
+#ifdef SAMPO_LATENCY_TRACE
+
+struct latency_section
+{
+	uint64_t cycles;
+	uintptr_t start_site;
+	uintptr_t end_site;
+	size_t cpu;
+};
+
+// The stretches of one kind on one CPU. Only that CPU writes to it, with
+// interrupts disabled or with preemption disabled, so that an interrupt
+// coming in meanwhile never gets to a stretch of the same kind.
+struct latency_tracer
+{
+	uint64_t since; // <- When the open stretch started, 0 if none is.
+	uintptr_t start_site;
+
+	uint64_t stretches;
+
+	// The longest first.
+	size_t top_count;
+	struct latency_section top[LATENCY_TRACE_TOP];
+};
+
+struct latency_trace_cpu
+{
+	struct latency_tracer irqs_off;
+	struct latency_tracer preempt_off;
+} __attribute__((aligned(64)));
+
+static struct latency_trace_cpu trace_cpus[CPU_MAX];
+
+// Keeps `top` sorted, dropping the shortest one once it is full.
+static void
+top_insert(struct latency_section *top, size_t *count, const struct latency_section *section)
+{
+	size_t i;
+	if (*count < LATENCY_TRACE_TOP)
+	{
+		i = (*count)++;
+	}
+	else if (section->cycles > top[LATENCY_TRACE_TOP - 1].cycles)
+	{
+		i = LATENCY_TRACE_TOP - 1;
+	}
+	else
+	{
+		return;
+	}
+
+	for (; i > 0 && top[i - 1].cycles < section->cycles; --i)
+	{
+		top[i] = top[i - 1];
+	}
+
+	top[i] = *section;
+}
+
+static void
+tracer_start(struct latency_tracer *tracer, uintptr_t site)
+{
+	tracer->start_site = site;
+	tracer->since = rdtsc();
+}
+
+static void
+tracer_end(struct latency_tracer *tracer, uintptr_t site, size_t cpu)
+{
+	if (tracer->since == 0)
+	{
+		return;
+	}
+
+	struct latency_section section = {
+		.cycles = rdtsc() - tracer->since,
+		.start_site = tracer->start_site,
+		.end_site = site,
+		.cpu = cpu,
+	};
+	tracer->since = 0;
+	++tracer->stretches;
+
+	// Most stretches are short, and go no further than this.
+	if (tracer->top_count == LATENCY_TRACE_TOP && section.cycles <= tracer->top[LATENCY_TRACE_TOP - 1].cycles)
+	{
+		return;
+	}
+
+	top_insert(tracer->top, &tracer->top_count, &section);
+}
+
+void
+latency_trace_irqs_off(uintptr_t site)
+{
+	tracer_start(&trace_cpus[this_cpu()->index].irqs_off, site);
+}
+
+void
+latency_trace_irqs_on(uintptr_t site)
+{
+	size_t cpu = this_cpu()->index;
+	tracer_end(&trace_cpus[cpu].irqs_off, site, cpu);
+}
+
+void
+latency_trace_preempt_off(uintptr_t site)
+{
+	tracer_start(&trace_cpus[this_cpu()->index].preempt_off, site);
+}
+
+void
+latency_trace_preempt_on(uintptr_t site)
+{
+	size_t cpu = this_cpu()->index;
+	tracer_end(&trace_cpus[cpu].preempt_off, site, cpu);
+}
+
+void
+latency_trace_idle(void)
+{
+	size_t cpu = this_cpu()->index;
+	tracer_end(&trace_cpus[cpu].irqs_off, (uintptr_t) __builtin_return_address(0), cpu);
+}
+
+// As `function+0x12`, or the bare address if it is in no function we
+// know of, a NULL handler included.
+static void
+print_site(uintptr_t site)
+{
+	struct symbol symbol;
+	if (symbol_lookup(site, &symbol))
+	{
+		serial_printf("%s+0x%llx", symbol.name, (unsigned long long) (site - symbol.start));
+	}
+	else
+	{
+		serial_printf("0x%llx", (unsigned long long) site);
+	}
+}
+
+static void
+dump_tracers(const char *name, bool preemption)
+{
+	struct latency_section top[LATENCY_TRACE_TOP];
+	size_t top_count = 0;
+	uint64_t stretches = 0;
+
+	// The other CPUs may be recording meanwhile, which at worst tears an
+	// entry. Ours would be, if interrupts were on.
+	uint64_t flags = local_irq_save();
+	for (size_t cpu = 0; cpu < cpu_count; ++cpu)
+	{
+		const struct latency_tracer *tracer = preemption ? &trace_cpus[cpu].preempt_off : &trace_cpus[cpu].irqs_off;
+		size_t count = __atomic_load_n(&tracer->top_count, __ATOMIC_RELAXED);
+		for (size_t i = 0; i < count; ++i)
+		{
+			top_insert(top, &top_count, &tracer->top[i]);
+		}
+
+		stretches += __atomic_load_n(&tracer->stretches, __ATOMIC_RELAXED);
+	}
+	local_irq_restore(flags);
+
+	serial_printf("Longest stretches with %s, out of %llu:\n", name, (unsigned long long) stretches);
+	serial_write("\tcycles | us | cpu | from | to\n");
+	for (size_t i = 0; i < top_count; ++i)
+	{
+		serial_printf("\t%llu | %llu | %zu | ",
+			      (unsigned long long) top[i].cycles,
+			      (unsigned long long) (clock_cycles_to_ns(top[i].cycles) / 1000),
+			      top[i].cpu);
+		print_site(top[i].start_site);
+		serial_write(" | ");
+		print_site(top[i].end_site);
+		serial_write("\n");
+	}
+}
+
+void
+latency_trace_dump(void)
+{
+	dump_tracers("interrupts off", false);
+	dump_tracers("preemption off", true);
+}
+
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+
+// Interrupts-off and preemption-off latency tracing, built in with
+// `make LATENCY_TRACE=1`. Each CPU times every stretch it spends with
+// interrupts disabled, or with preemption disabled, as seen by the
+// wrappers in arch-utils.h and preempt.h and by interrupt_dispatch, and
+// keeps the longest ones along with where they started and ended.
+// Stretches the CPU spends waiting for work don't count.
+
+// How many stretches of each kind every CPU keeps.
+#define LATENCY_TRACE_TOP 16
+
+#ifdef SAMPO_LATENCY_TRACE
+
+// The address of the instruction it is used at, which is in the caller
+// once the wrappers are inlined.
+#define LATENCY_TRACE_HERE() \
+	({ uintptr_t here_; asm volatile ("lea (%%rip), %0" : "=r"(here_)); here_; })
+
+// Called with interrupts disabled, as they go off, and before they go
+// back on. The end of a stretch without a start is ignored, which covers
+// boot, before interrupts are first enabled.
+void latency_trace_irqs_off(uintptr_t site);
+void latency_trace_irqs_on(uintptr_t site);
+
+// Called as the preemption count goes from 0 to 1, after it does, and
+// from 1 to 0, before it does, so that interrupts in between only see
+// nested sections.
+void latency_trace_preempt_off(uintptr_t site);
+void latency_trace_preempt_on(uintptr_t site);
+
+// Ends the stretch with interrupts off here, as the CPU is about to go
+// idle with them off.
+void latency_trace_idle(void);
+
+// Prints the longest stretches of every CPU over the serial port.
+void latency_trace_dump(void);
+
+#else
+
+#define LATENCY_TRACE_HERE() ((uintptr_t) 0)
+
+static inline void
+latency_trace_irqs_off(uintptr_t site)
+{
+	(void) site;
+}
+
+static inline void
+latency_trace_irqs_on(uintptr_t site)
+{
+	(void) site;
+}
+
+static inline void
+latency_trace_idle(void)
+{
+}
+
+#endif
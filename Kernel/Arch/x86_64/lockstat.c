@@ -0,0 +1,101 @@
+#include "lockstat.h"
+#include "serial.h"
+
+#ifdef SAMPO_LOCKSTAT
+
+#define LOCKSTAT_FIRST_BUCKET_SHIFT 5
+
+static struct lock_class *lock_classes = NULL;
+
+static size_t
+lockstat_bucket(uint64_t cycles)
+{
+	if (cycles < (UINT64_C(1) << (LOCKSTAT_FIRST_BUCKET_SHIFT + 1)))
+	{
+		return 0;
+	}
+
+	size_t bucket = 63 - __builtin_clzll(cycles) - LOCKSTAT_FIRST_BUCKET_SHIFT;
+
+	return bucket < LOCKSTAT_HISTOGRAM_BUCKETS ? bucket : LOCKSTAT_HISTOGRAM_BUCKETS - 1;
+}
+
+// Classes are put on the list the first time one of their locks is taken,
+// so that nothing needs registering up front.
+static void
+lockstat_register(struct lock_class *class)
+{
+	if (__atomic_exchange_n(&class->registered, true, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+
+	class->next = __atomic_load_n(&lock_classes, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&lock_classes, &class->next, class, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	{
+	}
+}
+
+void
+lockstat_record_acquire(struct lock_class *class, bool contended, uint64_t wait_cycles)
+{
+	if (!__atomic_load_n(&class->registered, __ATOMIC_RELAXED))
+	{
+		lockstat_register(class);
+	}
+
+	__atomic_fetch_add(&class->acquisitions, 1, __ATOMIC_RELAXED);
+
+	if (contended)
+	{
+		__atomic_fetch_add(&class->contentions, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&class->wait_histogram[lockstat_bucket(wait_cycles)], 1, __ATOMIC_RELAXED);
+	}
+}
+
+void
+lockstat_record_release(struct lock_class *class, uint64_t hold_cycles)
+{
+	__atomic_fetch_add(&class->hold_histogram[lockstat_bucket(hold_cycles)], 1, __ATOMIC_RELAXED);
+}
+
+static void
+lockstat_dump_histogram(const char *label, const uint64_t *histogram)
+{
+	serial_printf("\t\t%s:", label);
+
+	for (size_t i = 0; i < LOCKSTAT_HISTOGRAM_BUCKETS; ++i)
+	{
+		uint64_t count = __atomic_load_n(&histogram[i], __ATOMIC_RELAXED);
+		if (count != 0)
+		{
+			serial_printf(" %s2^%u:%u",
+				      i == 0 ? "<" : (i == LOCKSTAT_HISTOGRAM_BUCKETS - 1 ? ">=" : ""),
+				      (unsigned int) (i + LOCKSTAT_FIRST_BUCKET_SHIFT + (i == 0 ? 1 : 0)),
+				      (unsigned int) count);
+		}
+	}
+
+	serial_write("\n");
+}
+
+void
+lockstat_dump(void)
+{
+	serial_write("Lock statistics (cycles):\n");
+
+	for (struct lock_class *class = __atomic_load_n(&lock_classes, __ATOMIC_ACQUIRE);
+	     class != NULL;
+	     class = class->next)
+	{
+		serial_printf("\t%s: %u acquisitions, %u contended\n",
+			      class->name,
+			      (unsigned int) __atomic_load_n(&class->acquisitions, __ATOMIC_RELAXED),
+			      (unsigned int) __atomic_load_n(&class->contentions, __ATOMIC_RELAXED));
+		lockstat_dump_histogram("wait", class->wait_histogram);
+		lockstat_dump_histogram("hold", class->hold_histogram);
+	}
+}
+
+#endif
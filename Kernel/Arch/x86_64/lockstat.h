@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "arch-utils.h"
+
+// Lock statistics, built in with `make LOCKSTAT=1`. Statistics are kept
+// per lock class, which is shared by every lock used for the same thing.
+
+// Bucket i counts durations of [2^(i + 5), 2^(i + 6)) cycles, except that
+// the first and last ones are open-ended.
+#define LOCKSTAT_HISTOGRAM_BUCKETS 16
+
+struct lock_class
+{
+	const char *name;
+
+	struct lock_class *next;
+	bool registered;
+
+	uint64_t acquisitions;
+	uint64_t contentions;
+	uint64_t wait_histogram[LOCKSTAT_HISTOGRAM_BUCKETS];
+	uint64_t hold_histogram[LOCKSTAT_HISTOGRAM_BUCKETS];
+};
+
+#define LOCK_CLASS(var, class_name) \
+	__attribute__((unused)) static struct lock_class var = { .name = class_name }
+
+#ifdef SAMPO_LOCKSTAT
+
+// Embedded in every lock.
+struct lockstat_lock
+{
+	struct lock_class *class;
+	uint64_t acquired_at;
+};
+
+#define LOCKSTAT_INIT(lock_class) { .class = (lock_class) }
+
+void lockstat_record_acquire(struct lock_class *class, bool contended, uint64_t wait_cycles);
+void lockstat_record_release(struct lock_class *class, uint64_t hold_cycles);
+
+// Prints the statistics of every lock class used so far over the serial port.
+void lockstat_dump(void);
+
+static inline void
+lockstat_init(struct lockstat_lock *stat, struct lock_class *class)
+{
+	stat->class = class;
+	stat->acquired_at = 0;
+}
+
+static inline uint64_t
+lockstat_clock(void)
+{
+	return rdtsc();
+}
+
+static inline void
+lockstat_acquired(struct lockstat_lock *stat, bool contended, uint64_t wait_start)
+{
+	uint64_t now = rdtsc();
+	stat->acquired_at = now;
+
+	lockstat_record_acquire(stat->class, contended, contended ? now - wait_start : 0);
+}
+
+static inline void
+lockstat_released(struct lockstat_lock *stat)
+{
+	lockstat_record_release(stat->class, rdtsc() - stat->acquired_at);
+}
+
+#else
+
+struct lockstat_lock
+{
+};
+
+#define LOCKSTAT_INIT(lock_class) { }
+
+static inline void
+lockstat_init(struct lockstat_lock *stat, struct lock_class *class)
+{
+	(void) stat;
+	(void) class;
+}
+
+static inline uint64_t
+lockstat_clock(void)
+{
+	return 0;
+}
+
+static inline void
+lockstat_acquired(struct lockstat_lock *stat, bool contended, uint64_t wait_start)
+{
+	(void) stat;
+	(void) contended;
+	(void) wait_start;
+}
+
+static inline void
+lockstat_released(struct lockstat_lock *stat)
+{
+	(void) stat;
+}
+
+#endif
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "lockstat.h"
+#include "preempt.h"
+#include "arch-utils.h"
+
+// An MCS queue lock, for contended critical sections. Every waiter spins
+// on its own node, so handing the lock over only touches the cache line
+// of the next waiter.
+//
+// Each acquisition needs a node, which is usually on the stack of the
+// caller, and which must be passed to the matching unlock. Preemption
+// stays disabled while the lock is held.
+struct mcs_node
+{
+	struct mcs_node *next;
+	bool locked;
+};
+
+struct mcs_lock
+{
+	struct mcs_node *tail;
+	struct lockstat_lock stat;
+};
+
+#define MCS_LOCK_INIT(lock_class) { .tail = NULL, .stat = LOCKSTAT_INIT(lock_class) }
+
+static inline void
+mcs_lock_init(struct mcs_lock *lock, struct lock_class *class)
+{
+	lock->tail = NULL;
+	lockstat_init(&lock->stat, class);
+}
+
+static inline void
+mcs_lock(struct mcs_lock *lock, struct mcs_node *node)
+{
+	preempt_disable();
+
+	node->next = NULL;
+	node->locked = true;
+
+	struct mcs_node *prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if (prev == NULL)
+	{
+		lockstat_acquired(&lock->stat, false, 0);
+		return;
+	}
+
+	uint64_t wait_start = lockstat_clock();
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+	while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+	{
+		cpu_relax();
+	}
+
+	lockstat_acquired(&lock->stat, true, wait_start);
+}
+
+static inline void
+mcs_unlock(struct mcs_lock *lock, struct mcs_node *node)
+{
+	lockstat_released(&lock->stat);
+
+	struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (next == NULL)
+	{
+		struct mcs_node *expected = node;
+		if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false,
+						__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		{
+			preempt_enable();
+			return;
+		}
+
+		// Someone swapped themselves in as the tail, but hasn't linked
+		// themselves to us yet.
+		while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+		{
+			cpu_relax();
+		}
+	}
+
+	__atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+
+	preempt_enable();
+}
+
+static inline uint64_t
+mcs_lock_irqsave(struct mcs_lock *lock, struct mcs_node *node)
+{
+	uint64_t flags = local_irq_save();
+	mcs_lock(lock, node);
+
+	return flags;
+}
+
+static inline void
+mcs_unlock_irqrestore(struct mcs_lock *lock, struct mcs_node *node, uint64_t flags)
+{
+	mcs_unlock(lock, node);
+	local_irq_restore(flags);
+}
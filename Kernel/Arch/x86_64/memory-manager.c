@@ -1,20 +1,27 @@
 #include <SampoOS/Kernel/memman.h>
 #include <string.h>
 #include "memory-manager.h"
+#include "interrupts.h"
+#include "arch-utils.h"
+#include "paging.h"
+#include "address-space.h"
+#include "spinlock.h"
+#include "mcs-lock.h"
+#include "percpu-counter.h"
+#include "tlb.h"
+#include "trace.h"
+#include "timer.h"
+#include "workqueue.h"
+#include "clock.h"
+#include <cpuid.h>
 
 const size_t PAGE_SIZE = 0x1000;
 
-#define page_entry_to_physaddr(e) ((e) & UINT64_C(0x000FFFFFFFFFF000))
-#define virtaddr_to_pml4e_idx(addr) ((((uintptr_t)(addr)) >> 39) & 0x1FF)
-#define virtaddr_to_pdpe_idx(addr) ((((uintptr_t)(addr)) >> 30) & 0x1FF)
-#define virtaddr_to_pde_idx(addr) ((((uintptr_t)(addr)) >> 21) & 0x1FF)
-#define virtaddr_to_pte_idx(addr) ((((uintptr_t)(addr)) >> 12) & 0x1FF)
-
-#define get_next_aligned_addr(addr) ((((uintptr_t)(addr)) + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1))
-
-static const uint64_t PAGE_PRESENT = UINT64_C(1) << 0;
-static const uint64_t PAGE_WRITABLE = UINT64_C(1) << 1;
-static const uint64_t NX_BIT = UINT64_C(1) << 63;
+// Bits of the error code pushed for a page fault.
+static const uint64_t PF_ERR_PRESENT = UINT64_C(1) << 0;
+static const uint64_t PF_ERR_WRITE = UINT64_C(1) << 1;
+static const uint64_t PF_ERR_USER = UINT64_C(1) << 2;
+static const uint64_t PF_ERR_RESERVED = UINT64_C(1) << 3;
 
 extern uint8_t kern_begin[];
 extern uint8_t kern_end[];
@@ -24,51 +31,121 @@ uintptr_t kernel_end_addr;
 static size_t physmem_len = 0;
 static struct physmem_region *physmap = NULL;
 
-const size_t FRACTAL_MAP_PML4_IDX = 510;
-static const uintptr_t KERN_PT_BASE = UINT64_C(0xFFFF000000000000) + (FRACTAL_MAP_PML4_IDX << 39);
-static const uintptr_t KERN_PD_BASE = KERN_PT_BASE + (FRACTAL_MAP_PML4_IDX << 30);
-static const uintptr_t KERN_PDP_BASE = KERN_PD_BASE + (FRACTAL_MAP_PML4_IDX << 21);
-static const uintptr_t KERN_PML4_BASE = KERN_PDP_BASE + (FRACTAL_MAP_PML4_IDX << 12);
-
-static inline uint64_t *
-get_pml4_from_addr(void *p)
-{
-	(void) p;
-	return (uint64_t *) KERN_PML4_BASE;
-}
-
-static inline uint64_t *
-get_pdpt_from_addr(void *p)
-{
-	uintptr_t addr = (uintptr_t) p;
-
-	return (uint64_t *) (KERN_PDP_BASE + ((addr >> 27) & 0x00001FF000));
-}
-
-static inline uint64_t *
-get_pd_from_addr(void *p)
-{
-	uintptr_t addr = (uintptr_t) p;
+// Guards the kernel half of the page tables, the kernel virtual ranges
+// and the demand regions.
+LOCK_CLASS(virt_lock_class, "virt");
+static struct spinlock virt_lock = SPINLOCK_INIT(&virt_lock_class);
 
-	return (uint64_t *) (KERN_PD_BASE + ((addr >> 18) & 0x003FFFF000));
-}
+// Guards the allocation bitmaps, the reverse maps and the share counts.
+// Every allocation goes through it, so it is a queue lock. It may be
+// taken while holding virt_lock, but never the other way around.
+LOCK_CLASS(pmm_lock_class, "pmm");
+static struct mcs_lock pmm_lock = MCS_LOCK_INIT(&pmm_lock_class);
 
-static inline uint64_t *
-get_pt_from_addr(void *p)
+// Kernel virtual regions which are reserved up front, but only get backed
+// by physical memory once they are touched.
+struct virt_demand_region
 {
-	uintptr_t addr = (uintptr_t) p;
-
-	return (uint64_t *) (KERN_PT_BASE + ((addr >> 9) & 0x7FFFFFF000));
-}
-
-static inline void
-invalidate_page(void *p)
+	uintptr_t addr;
+	size_t page_count;
+	enum virt_map_perm perms;
+
+	// How many pages, aligned around the faulting page, get populated by a single fault.
+	size_t fault_around_pages;
+};
+
+#define VIRT_DEMAND_REGION_MAX 64
+static struct virt_demand_region demand_regions[VIRT_DEMAND_REGION_MAX];
+static size_t demand_region_count = 0;
+
+// Pages handed out and given back through the allocation bitmaps, and
+// how many are free as a result.
+static struct percpu_counter pmm_free_pages = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter pmm_allocations = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter pmm_frees = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+
+static struct percpu_counter fault_count = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter fault_pages_populated = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter fault_retries = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter fault_cycles_total = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH * 100000);
+// Not a counter, and faults are resolved under virt_lock anyway.
+static uint64_t fault_cycles_max = 0;
+
+// A range of kernel virtual pages above the kernel image.
+struct virt_range
 {
-	asm volatile("invlpg (%0)" : : "b"(p) : "memory");
-}
+	uintptr_t addr;
+	size_t page_count;
+	uint64_t tlb_generation; // <- Only for retiring ranges, the kernel purge they wait on.
+};
+
+#define VIRT_RANGE_MAX 128
+
+// Ranges which have been unmapped and purged from the TLB, ready for reuse.
+static struct virt_range free_ranges[VIRT_RANGE_MAX];
+static size_t free_range_count = 0;
+
+// Ranges which have been unmapped, but which may still have stale TLB
+// entries. These must not be reused before the next purge.
+static struct virt_range lazy_ranges[VIRT_RANGE_MAX];
+static size_t lazy_range_count = 0;
+static size_t lazy_stale_pages = 0;
+
+// Ranges which have been purged from our TLB, but which the other CPUs
+// may not have flushed yet.
+static struct virt_range retiring_ranges[VIRT_RANGE_MAX];
+static size_t retiring_range_count = 0;
+
+// How many stale pages we let build up before purging them all at once.
+#define VIRT_LAZY_PURGE_THRESHOLD_PAGES 512
+
+static struct percpu_counter purge_pages_unmapped = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter purge_unmaps = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter purge_count = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+
+// Compaction works in units of 2MiB blocks, the size of a large page.
+#define PAGES_PER_BLOCK 512
+#define BLOCK_SIZE (PAGES_PER_BLOCK * 0x1000)
+
+// Blocks which are used more than this are left alone by compaction,
+// and are instead where the pages of emptier blocks are moved to.
+#define COMPACTION_MAX_USED_PAGES (PAGES_PER_BLOCK / 2)
+
+static struct percpu_counter compaction_runs = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter compaction_blocks_reclaimed = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter compaction_pages_moved = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter compaction_blocks_skipped = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+
+// Number of page colors in the last-level cache, i.e. how many pages
+// fit in a single way of it. 1 means that coloring is not possible.
+static size_t page_color_count = 1;
+static bool page_coloring_enabled = false;
+
+// Where the previous compaction run stopped, so that time-limited runs
+// make progress across the whole of the physical memory.
+static uintptr_t compaction_cursor = 0;
+
+// Keeps compaction runs from overlapping, and guards the cursor. Taken
+// before virt_lock, which compaction drops while it waits for purges.
+LOCK_CLASS(compaction_lock_class, "compaction");
+static struct spinlock compaction_lock = SPINLOCK_INIT(&compaction_lock_class);
+
+// In the background, CPU 0's worker keeps a few blocks free, spending a
+// bounded time on it at a time.
+#define COMPACTION_BACKGROUND_BLOCKS 8
+#define COMPACTION_BACKGROUND_BUDGET_NS 500000
+#define COMPACTION_BACKGROUND_INTERVAL_NS 1000000000
+
+static struct timer compaction_timer;
+static struct work compaction_work;
 
 static void pmm_mark_page_busy(uintptr_t page);
-static void pmm_free_page(uintptr_t page);
+static size_t pmm_count_free_pages(void);
+static void pmm_free_page_locked(uintptr_t page);
+static bool memory_manager_page_fault(struct interrupt_frame *frame);
+static struct virt_demand_region *virt_reserve_demand_region(size_t page_count,
+							      enum virt_map_perm mapping_perms,
+							      size_t fault_around_pages);
 
 void
 init_memory_manager(struct sampo_bootinfo *bootinfo)
@@ -326,6 +403,180 @@ init_memory_manager(struct sampo_bootinfo *bootinfo)
 	{
 		pmm_mark_page_busy(page);
 	}
+
+	percpu_counter_set(&pmm_free_pages, pmm_count_free_pages());
+
+	interrupt_register_handler(INTERRUPT_VECTOR_PAGE_FAULT, memory_manager_page_fault);
+
+	// Finally, set up the reverse maps and share counts of the available
+	// regions. These are populated up front: faulting them in on demand
+	// would re-enter the memory manager while it holds its locks.
+	for (size_t i = 0; i < physmem_len; ++i)
+	{
+		struct physmem_region *region = &physmap[i];
+		if (region->type != PHYSMEM_REGION_TYPE_AVAILABLE)
+		{
+			continue;
+		}
+
+		size_t rmap_len = (region->len / PAGE_SIZE) * sizeof(*region->rmap);
+		uintptr_t *rmap = virt_alloc_pages(get_next_aligned_addr(rmap_len) / PAGE_SIZE,
+						   VIRT_MAP_READ | VIRT_MAP_WRITE);
+		if (rmap == NULL)
+		{
+			break;
+		}
+
+		memset(rmap, 0, rmap_len);
+		region->rmap = rmap;
+
+		size_t share_len = (region->len / PAGE_SIZE) * sizeof(*region->share_count);
+		uint32_t *share_count = virt_alloc_pages(get_next_aligned_addr(share_len) / PAGE_SIZE,
+							 VIRT_MAP_READ | VIRT_MAP_WRITE);
+		if (share_count == NULL)
+		{
+			break;
+		}
+
+		memset(share_count, 0, share_len);
+		region->share_count = share_count;
+	}
+}
+
+static struct physmem_region *
+pmm_find_region(uintptr_t page)
+{
+	for (size_t i = 0; i < physmem_len; ++i)
+	{
+		struct physmem_region *region = &physmap[i];
+		if ((page >= region->addr) && (page < region->addr + region->len))
+		{
+			return region;
+		}
+	}
+
+	return NULL;
+}
+
+static inline bool
+pmm_page_is_used(struct physmem_region *region, size_t page_idx)
+{
+	return (region->alloc_map[page_idx / 8] & (1 << (page_idx % 8))) != 0;
+}
+
+// Marks a free page as used. The caller must hold pmm_lock.
+static inline void
+pmm_take_page(struct physmem_region *region, size_t page_idx)
+{
+	region->alloc_map[page_idx / 8] |= (1 << (page_idx % 8));
+
+	percpu_counter_add(&pmm_free_pages, -1);
+	percpu_counter_inc(&pmm_allocations);
+}
+
+static size_t
+pmm_count_free_pages(void)
+{
+	size_t free_pages = 0;
+	for (size_t i = 0; i < physmem_len; ++i)
+	{
+		struct physmem_region *region = &physmap[i];
+		if (region->type != PHYSMEM_REGION_TYPE_AVAILABLE)
+		{
+			continue;
+		}
+
+		for (size_t page_idx = 0; page_idx < region->len / PAGE_SIZE; ++page_idx)
+		{
+			// The memory under 1MiB is never handed out.
+			if (region->addr + page_idx * PAGE_SIZE >= 0x100000 && !pmm_page_is_used(region, page_idx))
+			{
+				++free_pages;
+			}
+		}
+	}
+
+	return free_pages;
+}
+
+bool
+pmm_is_usable_ram(uintptr_t page)
+{
+	struct mcs_node node;
+	uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+
+	struct physmem_region *region = pmm_find_region(page);
+	bool usable = region != NULL &&
+		region->type == PHYSMEM_REGION_TYPE_AVAILABLE &&
+		!pmm_page_is_used(region, (page - region->addr) / PAGE_SIZE);
+
+	mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+
+	return usable;
+}
+
+void
+pmm_page_share(uintptr_t page)
+{
+	struct mcs_node node;
+	uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+
+	struct physmem_region *region = pmm_find_region(page);
+	if (region != NULL && region->share_count != NULL)
+	{
+		++region->share_count[(page - region->addr) / PAGE_SIZE];
+	}
+
+	mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+}
+
+void
+pmm_page_release(uintptr_t page)
+{
+	struct mcs_node node;
+	uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+
+	struct physmem_region *region = pmm_find_region(page);
+	if (region != NULL && region->share_count != NULL)
+	{
+		uint32_t *share_count = &region->share_count[(page - region->addr) / PAGE_SIZE];
+		if (*share_count != 0)
+		{
+			--*share_count;
+		}
+		else
+		{
+			pmm_free_page_locked(page);
+		}
+	}
+
+	mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+}
+
+bool
+pmm_page_is_shared(uintptr_t page)
+{
+	struct mcs_node node;
+	uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+
+	struct physmem_region *region = pmm_find_region(page);
+	bool shared = region != NULL && region->share_count != NULL &&
+		region->share_count[(page - region->addr) / PAGE_SIZE] != 0;
+
+	mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+
+	return shared;
+}
+
+// The caller must hold pmm_lock.
+static inline void
+pmm_set_rmap(uintptr_t page, uintptr_t virt_addr)
+{
+	struct physmem_region *region = pmm_find_region(page);
+	if (region != NULL && region->rmap != NULL)
+	{
+		region->rmap[(page - region->addr) / PAGE_SIZE] = virt_addr;
+	}
 }
 
 static void
@@ -334,7 +585,7 @@ pmm_mark_page_busy(uintptr_t page)
 	for (size_t i = 0; i < physmem_len; ++i)
 	{
 		struct physmem_region *region = &physmap[i];
-		if (page < region->addr)
+		if ((page < region->addr) || (page >= region->addr + region->len))
 		{
 			continue;
 		}
@@ -358,12 +609,12 @@ pmm_mark_page_busy(uintptr_t page)
 }
 
 static void
-pmm_free_page(uintptr_t page)
+pmm_free_page_locked(uintptr_t page)
 {
 	for (size_t i = 0; i < physmem_len; ++i)
 	{
 		struct physmem_region *region = &physmap[i];
-		if (page < region->addr)
+		if ((page < region->addr) || (page >= region->addr + region->len))
 		{
 			continue;
 		}
@@ -380,82 +631,1284 @@ pmm_free_page(uintptr_t page)
 		size_t bitmap_byte_idx = page_idx / 8;
 		size_t bitmap_bit_idx = page_idx % 8;
 
-		region->alloc_map[bitmap_byte_idx] &= ~(1 << bitmap_bit_idx);
+		if ((region->alloc_map[bitmap_byte_idx] & (1 << bitmap_bit_idx)) != 0)
+		{
+			region->alloc_map[bitmap_byte_idx] &= ~(1 << bitmap_bit_idx);
+
+			percpu_counter_inc(&pmm_free_pages);
+			percpu_counter_inc(&pmm_frees);
+		}
+
+		if (region->rmap != NULL)
+		{
+			region->rmap[page_idx] = 0;
+		}
 
 		break;
 	}
 }
 
-void *
-virt_map_pages_kernel_end(uintptr_t physical_page_addr,
-			  size_t page_count,
-			  enum virt_map_perm mapping_perms)
+void
+pmm_free_page(uintptr_t page)
 {
-	void *ret = (void *)kernel_end_addr;
-	for (size_t i = 0; i < page_count; ++i){
-		size_t pml4e_idx = virtaddr_to_pml4e_idx(kernel_end_addr);
-		size_t pdpe_idx = virtaddr_to_pdpe_idx(kernel_end_addr);
-		size_t pde_idx = virtaddr_to_pde_idx(kernel_end_addr);
-		size_t pte_idx = virtaddr_to_pte_idx(kernel_end_addr);
+	struct mcs_node node;
+	uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+	pmm_free_page_locked(page);
+	mcs_unlock_irqrestore(&pmm_lock, &node, flags);
 
-		// We must now traverse to see if all the necessary page
-		// tables are available. If not, we need to allocate more.
-		//
-		// NOTE: Since this is called during the initialization
-		// of the physical memory manager before it has set up
-		// its data structures, this could fail.
-		uint64_t *pml4 = get_pml4_from_addr((void *)kernel_end_addr);
-		uint64_t pml4e = pml4[pml4e_idx];
+	trace_pmm_free(page);
+}
 
-		// We know that since these are after the kernel, this will never
-		// not be present, but check for consistency.
-		if ((PAGE_PRESENT & pml4e) == 0)
+static uintptr_t
+pmm_alloc_page_locked(void)
+{
+	for (size_t i = 0; i < physmem_len; ++i)
+	{
+		struct physmem_region *region = &physmap[i];
+		if (region->type != PHYSMEM_REGION_TYPE_AVAILABLE)
 		{
-			// Should never happen.
-		        return NULL;
+			continue;
 		}
 
-		uint64_t *pdpt = get_pdpt_from_addr((void *)kernel_end_addr);
-		uint64_t pdpe = pdpt[pdpe_idx];
-		if ((PAGE_PRESENT & pdpe) == 0)
+		size_t page_count = region->len / PAGE_SIZE;
+		for (size_t page_idx = 0; page_idx < page_count; ++page_idx)
 		{
-			// TODO: Allocate new physical page.
+			size_t bitmap_byte_idx = page_idx / 8;
+			size_t bitmap_bit_idx = page_idx % 8;
+
+			// Skip over fully used bytes in one go.
+			if (bitmap_bit_idx == 0 && region->alloc_map[bitmap_byte_idx] == 0xFF)
+			{
+				page_idx += 7;
+				continue;
+			}
+
+			if ((region->alloc_map[bitmap_byte_idx] & (1 << bitmap_bit_idx)) != 0)
+			{
+				continue;
+			}
+
+			uintptr_t page = region->addr + page_idx * PAGE_SIZE;
+
+			// Like Kickstart, we leave the memory under 1MiB alone.
+			// This also means that 0 can never be a valid allocation.
+			if (page < 0x100000)
+			{
+				continue;
+			}
+
+			pmm_take_page(region, page_idx);
+			return page;
 		}
+	}
+
+	return 0;
+}
+
+uintptr_t
+pmm_alloc_page(void)
+{
+	struct mcs_node node;
+	uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+	uintptr_t page = pmm_alloc_page_locked();
+	mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+
+	trace_pmm_alloc(page);
+
+	return page;
+}
+
+// Finds the cache geometry of the last-level cache via CPUID leaf 4,
+// and derives from it the number of page colors.
+static size_t
+pmm_detect_page_colors(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(0, &eax, &ebx, &ecx, &edx) == 0 || eax < 4)
+	{
+		return 1;
+	}
+
+	size_t colors = 1;
+	unsigned int highest_level = 0;
+	for (unsigned int subleaf = 0; ; ++subleaf)
+	{
+		__cpuid_count(4, subleaf, eax, ebx, ecx, edx);
 
-		uint64_t *pd = get_pd_from_addr((void *)kernel_end_addr);
-		uint64_t pde = pd[pde_idx];
-		if ((PAGE_PRESENT & pde) == 0)
+		unsigned int cache_type = eax & 0x1F;
+		if (cache_type == 0)
 		{
-			// TODO: Allocate new physical page.
+			// No more caches.
+			break;
 		}
 
-		uint64_t *pt = get_pt_from_addr((void *)kernel_end_addr);
-		uint64_t pte = pt[pte_idx];
-		if ((PAGE_PRESENT & pte) != 0)
+		// Instruction caches don't matter here.
+		unsigned int cache_level = (eax >> 5) & 0x7;
+		if (cache_type == 2 || cache_level < highest_level)
 		{
-			// We are trying to allocate over something else.
-			// Shouldn't happen!
-			return NULL;
+			continue;
+		}
+
+		size_t line_size = (ebx & 0xFFF) + 1;
+		size_t partitions = ((ebx >> 12) & 0x3FF) + 1;
+		size_t sets = (size_t) ecx + 1;
+
+		// The bytes covered by one way of the cache.
+		size_t way_size = line_size * partitions * sets;
+
+		highest_level = cache_level;
+		colors = way_size / PAGE_SIZE;
+	}
+
+	if (colors == 0)
+	{
+		colors = 1;
+	}
+
+	if (colors > PAGE_COLOR_MAX)
+	{
+		colors = PAGE_COLOR_MAX;
+	}
+
+	return colors;
+}
+
+bool
+pmm_set_page_coloring(bool enabled)
+{
+	struct mcs_node node;
+	uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+
+	if (page_color_count == 1)
+	{
+		page_color_count = pmm_detect_page_colors();
+	}
+
+	page_coloring_enabled = enabled && page_color_count > 1;
+	bool in_effect = page_coloring_enabled;
+
+	mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+
+	return in_effect;
+}
+
+size_t
+pmm_get_page_color_count(void)
+{
+	return page_color_count;
+}
+
+static uintptr_t
+pmm_alloc_page_with_color_locked(size_t color)
+{
+	if (page_color_count == 1)
+	{
+		return pmm_alloc_page_locked();
+	}
+
+	color %= page_color_count;
+
+	for (size_t i = 0; i < physmem_len; ++i)
+	{
+		struct physmem_region *region = &physmap[i];
+		if (region->type != PHYSMEM_REGION_TYPE_AVAILABLE)
+		{
+			continue;
+		}
+
+		// Only every page_color_count'th page has the color we want,
+		// so find the first one of those in this region.
+		size_t first_color = (region->addr / PAGE_SIZE) % page_color_count;
+		size_t page_count = region->len / PAGE_SIZE;
+
+		for (size_t page_idx = (color + page_color_count - first_color) % page_color_count;
+		     page_idx < page_count;
+		     page_idx += page_color_count)
+		{
+			uintptr_t page = region->addr + page_idx * PAGE_SIZE;
+			if (page < 0x100000 || pmm_page_is_used(region, page_idx))
+			{
+				continue;
+			}
+
+			pmm_take_page(region, page_idx);
+			return page;
 		}
+	}
+
+	// We ran out of this color: any page is better than none.
+	return pmm_alloc_page_locked();
+}
+
+uintptr_t
+pmm_alloc_page_with_color(size_t color)
+{
+	struct mcs_node node;
+	uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+	uintptr_t page = pmm_alloc_page_with_color_locked(color);
+	mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+
+	trace_pmm_alloc(page);
+
+	return page;
+}
+
+// Makes sure that the paging structure `table`, referred to by `entry`,
+// exists. If it doesn't, a new one is allocated and then cleared
+// through the fractal mapping.
+static bool
+virt_ensure_table(uint64_t *entry, void *table, uint64_t extra_flags)
+{
+	if ((PAGE_PRESENT & *entry) != 0)
+	{
+		return true;
+	}
+
+	uintptr_t page = pmm_alloc_page();
+	if (page == 0)
+	{
+		return false;
+	}
+
+	// The intermediate levels are permissive, and the leaf entries
+	// decide the actual permissions.
+	*entry = page | extra_flags | PAGE_WRITABLE | PAGE_PRESENT;
+	invalidate_page(table);
+	memset(table, 0, PAGE_SIZE);
+
+	return true;
+}
+
+uint64_t *
+virt_get_pte(void *addr)
+{
+	uint64_t *pml4 = get_pml4_from_addr(addr);
+	uint64_t *pml4e = &pml4[virtaddr_to_pml4e_idx(addr)];
+
+	uint64_t *pdpt = get_pdpt_from_addr(addr);
+	uint64_t *pd = get_pd_from_addr(addr);
+	uint64_t *pt = get_pt_from_addr(addr);
+
+	// User space owns the lower half, and its paging structures must
+	// allow user access for the leaf entries to matter.
+	uint64_t table_flags = 0;
+	if (virtaddr_to_pml4e_idx(addr) < USER_PML4_ENTRY_COUNT)
+	{
+		table_flags = PAGE_USER;
 
-		// Create page table entry and set proper permissions
-		pte = physical_page_addr | PAGE_PRESENT;
-		if ((mapping_perms & VIRT_MAP_WRITE) != 0)
+		if (!virt_ensure_table(pml4e, pdpt, table_flags))
 		{
-			pte |= PAGE_WRITABLE;
+			return NULL;
 		}
-		if ((mapping_perms & VIRT_MAP_EXEC) == 0)
+
+		if ((PAGE_USER & *pml4e) == 0)
 		{
-			pte |= NX_BIT;
+			// This is Kickstart's identity mapping, which isn't for user space.
+			return NULL;
 		}
+	}
+	else if ((PAGE_PRESENT & *pml4e) == 0)
+	{
+		// The kernel half of the address space is always set up by
+		// Kickstart, and it is shared by every address space, so new
+		// entries can't be added here.
+		return NULL;
+	}
 
-		// Set the page table entry, and flush
-		pt[pte_idx] = pte;
-		invalidate_page((void *)kernel_end_addr);
+	if (!virt_ensure_table(&pdpt[virtaddr_to_pdpe_idx(addr)], pd, table_flags))
+	{
+		return NULL;
+	}
 
-		physical_page_addr += PAGE_SIZE;
-		kernel_end_addr += PAGE_SIZE;
+	if (!virt_ensure_table(&pd[virtaddr_to_pde_idx(addr)], pt, table_flags))
+	{
+		return NULL;
 	}
 
-	return ret;
+	return &pt[virtaddr_to_pte_idx(addr)];
+}
+
+static void *
+virt_map_pages_kernel_end_locked(uintptr_t physical_page_addr,
+				 size_t page_count,
+				 enum virt_map_perm mapping_perms)
+{
+	void *ret = (void *)kernel_end_addr;
+	for (size_t i = 0; i < page_count; ++i){
+		// We must now traverse to see if all the necessary page
+		// tables are available. If not, we need to allocate more.
+		//
+		// NOTE: Since this is called during the initialization
+		// of the physical memory manager before it has set up
+		// its data structures, this could fail.
+		uint64_t *pte = virt_get_pte((void *)kernel_end_addr);
+		if (pte == NULL)
+		{
+			return NULL;
+		}
+
+		if ((PAGE_PRESENT & *pte) != 0)
+		{
+			// We are trying to allocate over something else.
+			// Shouldn't happen!
+			return NULL;
+		}
+
+		// Set the page table entry with proper permissions, and flush
+		*pte = virt_make_pte(physical_page_addr, mapping_perms);
+		invalidate_page((void *)kernel_end_addr);
+
+		physical_page_addr += PAGE_SIZE;
+		kernel_end_addr += PAGE_SIZE;
+	}
+
+	return ret;
+}
+
+void *
+virt_map_pages_kernel_end(uintptr_t physical_page_addr,
+			  size_t page_count,
+			  enum virt_map_perm mapping_perms)
+{
+	uint64_t flags = spin_lock_irqsave(&virt_lock);
+	void *addr = virt_map_pages_kernel_end_locked(physical_page_addr, page_count, mapping_perms);
+	spin_unlock_irqrestore(&virt_lock, flags);
+
+	return addr;
+}
+
+static struct virt_demand_region *
+virt_reserve_demand_region(size_t page_count,
+			   enum virt_map_perm mapping_perms,
+			   size_t fault_around_pages)
+{
+	if (demand_region_count == VIRT_DEMAND_REGION_MAX)
+	{
+		return NULL;
+	}
+
+	struct virt_demand_region *region = &demand_regions[demand_region_count++];
+	region->addr = kernel_end_addr;
+	region->page_count = page_count;
+	region->perms = mapping_perms;
+	region->fault_around_pages = fault_around_pages;
+
+	// Nothing gets mapped here: the page fault handler does that on first touch.
+	kernel_end_addr += page_count * PAGE_SIZE;
+
+	return region;
+}
+
+void *
+virt_reserve_pages_kernel_end(size_t page_count,
+			      enum virt_map_perm mapping_perms,
+			      size_t fault_around_pages)
+{
+	uint64_t flags = spin_lock_irqsave(&virt_lock);
+	struct virt_demand_region *region =
+		virt_reserve_demand_region(page_count, mapping_perms, fault_around_pages);
+	spin_unlock_irqrestore(&virt_lock, flags);
+
+	return region != NULL ? (void *)region->addr : NULL;
+}
+
+enum virt_fault_result
+{
+	VIRT_FAULT_FAILED,
+	VIRT_FAULT_RESOLVED,
+	VIRT_FAULT_RETRY, // <- Compaction is moving the page, nothing was populated.
+};
+
+// Backs a single page of a demand region with a fresh, zeroed physical page.
+// Pages which are already present are left alone. The caller must hold virt_lock.
+static enum virt_fault_result
+virt_populate_page(uintptr_t addr, struct virt_demand_region *region)
+{
+	uint64_t *pte = virt_get_pte((void *)addr);
+	if (pte == NULL)
+	{
+		return VIRT_FAULT_FAILED;
+	}
+
+	if ((PAGE_PRESENT & *pte) != 0)
+	{
+		return VIRT_FAULT_RESOLVED;
+	}
+
+	// Compaction is moving the page, and the access is retried until it
+	// is back. Compaction waits on a purge meanwhile, which we may well
+	// be keeping it from by faulting with interrupts disabled.
+	if ((PAGE_MIGRATING & *pte) != 0)
+	{
+		tlb_process_pending();
+		return VIRT_FAULT_RETRY;
+	}
+
+	struct mcs_node node;
+	uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+
+	uintptr_t page = page_coloring_enabled ?
+		pmm_alloc_page_with_color_locked(addr / PAGE_SIZE) :
+		pmm_alloc_page_locked();
+	if (page != 0)
+	{
+		// Compaction can't see the page before it is mapped, since it
+		// holds virt_lock as well.
+		pmm_set_rmap(page, addr);
+	}
+
+	mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+
+	if (page == 0)
+	{
+		return VIRT_FAULT_FAILED;
+	}
+
+	// The page must be writable for us to clear it,
+	// so the real permissions are applied only afterwards.
+	*pte = page | NX_BIT | PAGE_WRITABLE | PAGE_PRESENT;
+	invalidate_page((void *)addr);
+	memset((void *)addr, 0, PAGE_SIZE);
+
+	uint64_t final_pte = virt_make_pte(page, region->perms);
+	if (final_pte != *pte)
+	{
+		*pte = final_pte;
+		invalidate_page((void *)addr);
+	}
+
+	percpu_counter_inc(&fault_pages_populated);
+
+	return VIRT_FAULT_RESOLVED;
+}
+
+static enum virt_fault_result
+virt_handle_demand_fault(uintptr_t fault_addr)
+{
+	struct virt_demand_region *region = NULL;
+	for (size_t i = 0; i < demand_region_count; ++i)
+	{
+		struct virt_demand_region *candidate = &demand_regions[i];
+		if ((fault_addr >= candidate->addr) &&
+		    (fault_addr < candidate->addr + candidate->page_count * PAGE_SIZE))
+		{
+			region = candidate;
+			break;
+		}
+	}
+
+	if (region == NULL)
+	{
+		return VIRT_FAULT_FAILED;
+	}
+
+	uintptr_t fault_page = fault_addr & ~(PAGE_SIZE - 1);
+
+	// The faulting page itself must succeed.
+	enum virt_fault_result result = virt_populate_page(fault_page, region);
+	if (result != VIRT_FAULT_RESOLVED || region->fault_around_pages <= 1)
+	{
+		return result;
+	}
+
+	// Populate the rest of the fault-around window, which is aligned
+	// relative to the start of the region. This is only opportunistic,
+	// so stop at the first failure. Pages being moved are skipped.
+	size_t window_len = region->fault_around_pages * PAGE_SIZE;
+	uintptr_t region_end = region->addr + region->page_count * PAGE_SIZE;
+	uintptr_t window_start = region->addr + ((fault_page - region->addr) / window_len) * window_len;
+	uintptr_t window_end = window_start + window_len;
+	if (window_end > region_end)
+	{
+		window_end = region_end;
+	}
+
+	for (uintptr_t page = window_start; page < window_end; page += PAGE_SIZE)
+	{
+		if (virt_populate_page(page, region) == VIRT_FAULT_FAILED)
+		{
+			break;
+		}
+	}
+
+	return VIRT_FAULT_RESOLVED;
+}
+
+static bool
+memory_manager_page_fault(struct interrupt_frame *frame)
+{
+	uint64_t start = rdtsc();
+
+	if ((frame->error_code & PF_ERR_RESERVED) != 0)
+	{
+		return false;
+	}
+
+	// Writes to present pages can only be resolved if they are copy-on-write.
+	if ((frame->error_code & (PF_ERR_PRESENT | PF_ERR_WRITE)) == (PF_ERR_PRESENT | PF_ERR_WRITE))
+	{
+		return as_handle_cow_fault(read_cr2());
+	}
+
+	// Demand regions only cover non-present kernel pages.
+	if ((frame->error_code & (PF_ERR_PRESENT | PF_ERR_USER)) != 0)
+	{
+		return false;
+	}
+
+	uint64_t flags = spin_lock_irqsave(&virt_lock);
+
+	enum virt_fault_result result = virt_handle_demand_fault(read_cr2());
+	if (result == VIRT_FAULT_RETRY)
+	{
+		// Not a resolved fault, and its time would skew theirs.
+		percpu_counter_inc(&fault_retries);
+	}
+	else if (result == VIRT_FAULT_RESOLVED)
+	{
+		uint64_t cycles = rdtsc() - start;
+
+		percpu_counter_inc(&fault_count);
+		percpu_counter_add(&fault_cycles_total, cycles);
+		if (cycles > fault_cycles_max)
+		{
+			fault_cycles_max = cycles;
+		}
+	}
+
+	spin_unlock_irqrestore(&virt_lock, flags);
+
+	return result != VIRT_FAULT_FAILED;
+}
+
+void
+virt_get_fault_stats(struct virt_fault_stats *stats)
+{
+	stats->fault_count = percpu_counter_sum(&fault_count);
+	stats->pages_populated = percpu_counter_sum(&fault_pages_populated);
+	stats->fault_retries = percpu_counter_sum(&fault_retries);
+	stats->fault_cycles_total = percpu_counter_sum(&fault_cycles_total);
+	stats->fault_cycles_max = __atomic_load_n(&fault_cycles_max, __ATOMIC_RELAXED);
+}
+
+static void
+virt_release_range(uintptr_t addr, size_t page_count)
+{
+	uintptr_t end = addr + page_count * PAGE_SIZE;
+
+	// Coalesce with any adjacent free range first.
+	for (size_t i = 0; i < free_range_count; ++i)
+	{
+		struct virt_range *range = &free_ranges[i];
+		uintptr_t range_end = range->addr + range->page_count * PAGE_SIZE;
+		if (range_end == addr)
+		{
+			range->page_count += page_count;
+			return;
+		}
+
+		if (range->addr == end)
+		{
+			range->addr = addr;
+			range->page_count += page_count;
+			return;
+		}
+	}
+
+	if (free_range_count == VIRT_RANGE_MAX)
+	{
+		// We have nowhere to remember this range, so we just leak the
+		// virtual addresses. There's plenty of them.
+		return;
+	}
+
+	free_ranges[free_range_count].addr = addr;
+	free_ranges[free_range_count].page_count = page_count;
+	++free_range_count;
+}
+
+// Frees the retiring ranges which every CPU has flushed by now.
+static void
+virt_reclaim_retiring_ranges_locked(void)
+{
+	uint64_t completed = tlb_kernel_purge_completed();
+
+	size_t i = 0;
+	while (i < retiring_range_count)
+	{
+		struct virt_range *range = &retiring_ranges[i];
+		if (range->tlb_generation > completed)
+		{
+			++i;
+			continue;
+		}
+
+		virt_release_range(range->addr, range->page_count);
+		*range = retiring_ranges[--retiring_range_count];
+	}
+}
+
+static void
+virt_purge_lazy_ranges_locked(void)
+{
+	if (lazy_range_count == 0)
+	{
+		return;
+	}
+
+	// A single flush covers every stale page that was unmapped lazily.
+	// The other CPUs flush once they get to it, and we don't wait for
+	// them: the ranges retire until they have.
+	uint64_t generation = tlb_kernel_purge();
+
+	for (size_t i = 0; i < lazy_range_count; ++i)
+	{
+		if (retiring_range_count == VIRT_RANGE_MAX)
+		{
+			// Leaked, like in virt_release_range.
+			break;
+		}
+
+		retiring_ranges[retiring_range_count] = lazy_ranges[i];
+		retiring_ranges[retiring_range_count].tlb_generation = generation;
+		++retiring_range_count;
+	}
+
+	percpu_counter_inc(&purge_count);
+
+	lazy_range_count = 0;
+	lazy_stale_pages = 0;
+
+	// Straight away, if we are the only CPU.
+	virt_reclaim_retiring_ranges_locked();
+}
+
+void
+virt_purge_lazy_ranges(void)
+{
+	uint64_t flags = spin_lock_irqsave(&virt_lock);
+	virt_purge_lazy_ranges_locked();
+	spin_unlock_irqrestore(&virt_lock, flags);
+}
+
+static uintptr_t
+virt_take_free_range(size_t page_count)
+{
+	for (size_t i = 0; i < free_range_count; ++i)
+	{
+		struct virt_range *range = &free_ranges[i];
+		if (range->page_count < page_count)
+		{
+			continue;
+		}
+
+		uintptr_t addr = range->addr;
+		range->addr += page_count * PAGE_SIZE;
+		range->page_count -= page_count;
+
+		if (range->page_count == 0)
+		{
+			*range = free_ranges[--free_range_count];
+		}
+
+		return addr;
+	}
+
+	return 0;
+}
+
+// Takes `page_count` pages of kernel virtual address space, either from
+// the purged free ranges or by growing past the current kernel end.
+static uintptr_t
+virt_alloc_range(size_t page_count)
+{
+	uintptr_t addr = virt_take_free_range(page_count);
+	if (addr == 0 && retiring_range_count != 0)
+	{
+		virt_reclaim_retiring_ranges_locked();
+		addr = virt_take_free_range(page_count);
+	}
+
+	if (addr != 0)
+	{
+		return addr;
+	}
+
+	addr = kernel_end_addr;
+	kernel_end_addr += page_count * PAGE_SIZE;
+
+	return addr;
+}
+
+static void virt_unmap_pages_locked(void *addr, size_t page_count);
+
+static void *
+virt_map_pages_locked(uintptr_t physical_page_addr,
+		      size_t page_count,
+		      enum virt_map_perm mapping_perms)
+{
+	uintptr_t addr = virt_alloc_range(page_count);
+
+	for (size_t i = 0; i < page_count; ++i)
+	{
+		uintptr_t page = addr + i * PAGE_SIZE;
+		uint64_t *pte = virt_get_pte((void *)page);
+		if (pte == NULL)
+		{
+			// Hand back what we've mapped so far.
+			virt_unmap_pages_locked((void *)addr, i);
+			virt_release_range(page, page_count - i);
+			return NULL;
+		}
+
+		// Ranges only become free once they have been purged from the TLB,
+		// so nothing stale can be left around for these.
+		*pte = virt_make_pte(physical_page_addr + i * PAGE_SIZE, mapping_perms);
+	}
+
+	return (void *)addr;
+}
+
+void *
+virt_map_pages(uintptr_t physical_page_addr,
+	       size_t page_count,
+	       enum virt_map_perm mapping_perms)
+{
+	uint64_t flags = spin_lock_irqsave(&virt_lock);
+	void *addr = virt_map_pages_locked(physical_page_addr, page_count, mapping_perms);
+	spin_unlock_irqrestore(&virt_lock, flags);
+
+	trace_virt_map(addr, physical_page_addr, page_count);
+
+	return addr;
+}
+
+static void
+virt_unmap_pages_locked(void *addr, size_t page_count)
+{
+	if (page_count == 0)
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < page_count; ++i)
+	{
+		uint64_t *pt = get_pt_from_addr((uint8_t *)addr + i * PAGE_SIZE);
+		pt[virtaddr_to_pte_idx((uintptr_t)addr + i * PAGE_SIZE)] = 0;
+	}
+
+	// Instead of an invlpg for every page, the range is quarantined until
+	// enough stale pages have built up to be worth a single flush.
+	if (lazy_range_count == VIRT_RANGE_MAX)
+	{
+		virt_purge_lazy_ranges_locked();
+	}
+
+	lazy_ranges[lazy_range_count].addr = (uintptr_t) addr;
+	lazy_ranges[lazy_range_count].page_count = page_count;
+	++lazy_range_count;
+	lazy_stale_pages += page_count;
+
+	percpu_counter_add(&purge_pages_unmapped, page_count);
+	percpu_counter_inc(&purge_unmaps);
+
+	if (lazy_stale_pages >= VIRT_LAZY_PURGE_THRESHOLD_PAGES)
+	{
+		virt_purge_lazy_ranges_locked();
+	}
+}
+
+void
+virt_unmap_pages(void *addr, size_t page_count)
+{
+	uint64_t flags = spin_lock_irqsave(&virt_lock);
+	virt_unmap_pages_locked(addr, page_count);
+	spin_unlock_irqrestore(&virt_lock, flags);
+
+	trace_virt_unmap(addr, page_count);
+}
+
+static void
+virt_free_pages_locked(void *addr, size_t page_count)
+{
+	for (size_t i = 0; i < page_count; ++i)
+	{
+		uint64_t *pt = get_pt_from_addr((uint8_t *)addr + i * PAGE_SIZE);
+		pmm_free_page(page_entry_to_physaddr(pt[virtaddr_to_pte_idx((uintptr_t)addr + i * PAGE_SIZE)]));
+	}
+
+	virt_unmap_pages_locked(addr, page_count);
+}
+
+void *
+virt_alloc_pages(size_t page_count, enum virt_map_perm mapping_perms)
+{
+	uint64_t flags = spin_lock_irqsave(&virt_lock);
+
+	uintptr_t addr = virt_alloc_range(page_count);
+
+	for (size_t i = 0; i < page_count; ++i)
+	{
+		uintptr_t page = addr + i * PAGE_SIZE;
+		uint64_t *pte = virt_get_pte((void *)page);
+		uintptr_t physical_page_addr = pte != NULL ? pmm_alloc_page() : 0;
+		if (physical_page_addr == 0)
+		{
+			virt_free_pages_locked((void *)addr, i);
+			virt_release_range(page, page_count - i);
+			spin_unlock_irqrestore(&virt_lock, flags);
+			trace_virt_alloc(NULL, page_count);
+			return NULL;
+		}
+
+		*pte = virt_make_pte(physical_page_addr, mapping_perms);
+	}
+
+	spin_unlock_irqrestore(&virt_lock, flags);
+
+	trace_virt_alloc((void *)addr, page_count);
+
+	return (void *)addr;
+}
+
+void
+virt_free_pages(void *addr, size_t page_count)
+{
+	uint64_t flags = spin_lock_irqsave(&virt_lock);
+	virt_free_pages_locked(addr, page_count);
+	spin_unlock_irqrestore(&virt_lock, flags);
+
+	trace_virt_free(addr, page_count);
+}
+
+void
+virt_get_purge_stats(struct virt_purge_stats *stats)
+{
+	stats->pages_unmapped = percpu_counter_sum(&purge_pages_unmapped);
+	stats->unmaps = percpu_counter_sum(&purge_unmaps);
+	stats->purge_count = percpu_counter_sum(&purge_count);
+	stats->shootdowns_avoided = stats->unmaps > stats->purge_count ? stats->unmaps - stats->purge_count : 0;
+}
+
+// Counts the used pages of the 2MiB block starting at `first_idx` within `region`.
+// Compaction calls this without pmm_lock, since it only needs an estimate.
+static size_t
+pmm_block_used_pages(struct physmem_region *region, size_t first_idx)
+{
+	size_t used = 0;
+
+	// The regions aren't necessarily 2MiB-aligned, so the block might
+	// not start at a byte boundary in the bitmap.
+	if ((first_idx % 8) != 0)
+	{
+		for (size_t i = first_idx; i < first_idx + PAGES_PER_BLOCK; ++i)
+		{
+			used += pmm_page_is_used(region, i) ? 1 : 0;
+		}
+
+		return used;
+	}
+
+	for (size_t i = 0; i < PAGES_PER_BLOCK / 8; ++i)
+	{
+		used += __builtin_popcount(region->alloc_map[first_idx / 8 + i]);
+	}
+
+	return used;
+}
+
+static inline uintptr_t
+pmm_first_block_in_region(struct physmem_region *region)
+{
+	return (region->addr + (BLOCK_SIZE - 1)) & ~((uintptr_t) BLOCK_SIZE - 1);
+}
+
+static size_t
+pmm_count_free_blocks(void)
+{
+	size_t free_blocks = 0;
+	for (size_t i = 0; i < physmem_len; ++i)
+	{
+		struct physmem_region *region = &physmap[i];
+		if (region->type != PHYSMEM_REGION_TYPE_AVAILABLE)
+		{
+			continue;
+		}
+
+		for (uintptr_t block = pmm_first_block_in_region(region);
+		     block + BLOCK_SIZE <= region->addr + region->len;
+		     block += BLOCK_SIZE)
+		{
+			if (pmm_block_used_pages(region, (block - region->addr) / PAGE_SIZE) == 0)
+			{
+				++free_blocks;
+			}
+		}
+	}
+
+	return free_blocks;
+}
+
+// Finds a page to migrate into. Pages are taken from partially used memory
+// only: taking them from the block being emptied, or from an entirely free
+// block, would defeat the purpose. The caller must hold pmm_lock.
+static uintptr_t
+pmm_alloc_migration_target(uintptr_t source_block)
+{
+	for (size_t i = 0; i < physmem_len; ++i)
+	{
+		struct physmem_region *region = &physmap[i];
+		if (region->type != PHYSMEM_REGION_TYPE_AVAILABLE)
+		{
+			continue;
+		}
+
+		size_t page_count = region->len / PAGE_SIZE;
+		for (size_t page_idx = 0; page_idx < page_count; ++page_idx)
+		{
+			uintptr_t page = region->addr + page_idx * PAGE_SIZE;
+			uintptr_t block = page & ~((uintptr_t) BLOCK_SIZE - 1);
+			bool is_whole_block = (block >= region->addr) &&
+				(block + BLOCK_SIZE <= region->addr + region->len);
+
+			if (is_whole_block && (page == block))
+			{
+				size_t used = pmm_block_used_pages(region, page_idx);
+				if (block == source_block || used == 0 || used > COMPACTION_MAX_USED_PAGES)
+				{
+					// The source block and free blocks are off limits, and
+					// sparse blocks will likely be compacted themselves.
+					page_idx += PAGES_PER_BLOCK - 1;
+					continue;
+				}
+			}
+
+			if (page < 0x100000 || pmm_page_is_used(region, page_idx))
+			{
+				continue;
+			}
+
+			pmm_take_page(region, page_idx);
+			return page;
+		}
+	}
+
+	return 0;
+}
+
+// Moves the contents of a movable page to `new_page`, and points the
+// mapping referencing it to the new location. The page must have been
+// taken out of its mapping, and purged from every TLB, so that nothing
+// can write to it meanwhile. The caller must hold virt_lock.
+static bool
+pmm_migrate_page(struct physmem_region *region, size_t page_idx, uintptr_t new_page)
+{
+	uintptr_t old_page = region->addr + page_idx * PAGE_SIZE;
+	uintptr_t virt_addr = region->rmap[page_idx];
+
+	void *old_window = virt_map_pages_locked(old_page, 1, VIRT_MAP_READ);
+	void *new_window = old_window != NULL ? virt_map_pages_locked(new_page, 1, VIRT_MAP_READ | VIRT_MAP_WRITE) : NULL;
+	if (new_window == NULL)
+	{
+		if (old_window != NULL)
+		{
+			virt_unmap_pages_locked(old_window, 1);
+		}
+
+		return false;
+	}
+
+	memcpy(new_window, old_window, PAGE_SIZE);
+
+	// Nothing caches an entry which isn't present, so there's nothing to
+	// invalidate.
+	uint64_t *pte = virt_get_pte((void *)virt_addr);
+	*pte = ((*pte - page_entry_to_physaddr(*pte)) & ~PAGE_MIGRATING) | new_page | PAGE_PRESENT;
+
+	virt_unmap_pages_locked(old_window, 1);
+	virt_unmap_pages_locked(new_window, 1);
+
+	struct mcs_node node;
+	uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+	pmm_set_rmap(new_page, virt_addr);
+	pmm_free_page_locked(old_page);
+	mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+
+	percpu_counter_inc(&compaction_pages_moved);
+
+	return true;
+}
+
+// Tries to empty the block at `block` within `region`. Returns true if the
+// block ended up entirely free. The caller must hold compaction_lock, and
+// have interrupts enabled.
+static bool
+pmm_compact_block(struct physmem_region *region, uintptr_t block)
+{
+	size_t first_idx = (block - region->addr) / PAGE_SIZE;
+
+	uint64_t flags = spin_lock_irqsave(&virt_lock);
+
+	// Every used page must be movable, or there's no point in moving any of them.
+	for (size_t i = first_idx; i < first_idx + PAGES_PER_BLOCK; ++i)
+	{
+		if (pmm_page_is_used(region, i) && region->rmap[i] == 0)
+		{
+			spin_unlock_irqrestore(&virt_lock, flags);
+			percpu_counter_inc(&compaction_blocks_skipped);
+			return false;
+		}
+	}
+
+	// Take the pages out of their mappings, and get them out of every
+	// TLB before copying them, or other CPUs could go on writing to the
+	// old pages. Accesses meanwhile fault, and wait in virt_populate_page.
+	for (size_t i = first_idx; i < first_idx + PAGES_PER_BLOCK; ++i)
+	{
+		if (pmm_page_is_used(region, i))
+		{
+			uint64_t *pte = virt_get_pte((void *)region->rmap[i]);
+			*pte = (*pte & ~PAGE_PRESENT) | PAGE_MIGRATING;
+		}
+	}
+
+	uint64_t generation = tlb_kernel_purge();
+
+	// The other CPUs may be spinning on virt_lock with interrupts
+	// disabled, and couldn't take the purge.
+	spin_unlock_irqrestore(&virt_lock, flags);
+	while (tlb_kernel_purge_completed() < generation)
+	{
+		cpu_relax();
+	}
+	flags = spin_lock_irqsave(&virt_lock);
+
+	bool emptied = true;
+	for (size_t i = first_idx; i < first_idx + PAGES_PER_BLOCK; ++i)
+	{
+		// Pages allocated meanwhile are still mapped.
+		if (!pmm_page_is_used(region, i) || region->rmap[i] == 0)
+		{
+			continue;
+		}
+
+		uint64_t *pte = virt_get_pte((void *)region->rmap[i]);
+		if ((*pte & PAGE_MIGRATING) == 0)
+		{
+			continue;
+		}
+
+		if (emptied)
+		{
+			struct mcs_node node;
+			uint64_t pmm_flags = mcs_lock_irqsave(&pmm_lock, &node);
+			uintptr_t new_page = pmm_alloc_migration_target(block);
+			mcs_unlock_irqrestore(&pmm_lock, &node, pmm_flags);
+
+			if (new_page != 0 && pmm_migrate_page(region, i, new_page))
+			{
+				continue;
+			}
+
+			if (new_page != 0)
+			{
+				pmm_free_page(new_page);
+			}
+
+			emptied = false;
+		}
+
+		// Put back the pages which couldn't be moved.
+		*pte = (*pte & ~PAGE_MIGRATING) | PAGE_PRESENT;
+	}
+
+	emptied = emptied && pmm_block_used_pages(region, first_idx) == 0;
+
+	spin_unlock_irqrestore(&virt_lock, flags);
+
+	return emptied;
+}
+
+// Only pages in demand regions are movable, and their mappings only
+// change under virt_lock. The caller must hold compaction_lock.
+static size_t
+pmm_compact_locked(size_t target_free_blocks, uint64_t cycle_budget)
+{
+	uint64_t start = rdtsc();
+	size_t reclaimed = 0;
+	size_t free_blocks = pmm_count_free_blocks();
+
+	percpu_counter_inc(&compaction_runs);
+
+	// Go through the memory at most once, starting from the cursor and wrapping around.
+	for (size_t pass = 0; pass < 2; ++pass)
+	{
+		for (size_t i = 0; i < physmem_len; ++i)
+		{
+			struct physmem_region *region = &physmap[i];
+			if (region->type != PHYSMEM_REGION_TYPE_AVAILABLE || region->rmap == NULL)
+			{
+				continue;
+			}
+
+			for (uintptr_t block = pmm_first_block_in_region(region);
+			     block + BLOCK_SIZE <= region->addr + region->len;
+			     block += BLOCK_SIZE)
+			{
+				if ((pass == 0) == (block < compaction_cursor))
+				{
+					continue;
+				}
+
+				if (free_blocks >= target_free_blocks)
+				{
+					return reclaimed;
+				}
+
+				if (cycle_budget != 0 && rdtsc() - start >= cycle_budget)
+				{
+					compaction_cursor = block;
+					return reclaimed;
+				}
+
+				size_t used = pmm_block_used_pages(region, (block - region->addr) / PAGE_SIZE);
+				if (used == 0 || used > COMPACTION_MAX_USED_PAGES)
+				{
+					continue;
+				}
+
+				if (pmm_compact_block(region, block))
+				{
+					++reclaimed;
+					++free_blocks;
+					percpu_counter_inc(&compaction_blocks_reclaimed);
+				}
+			}
+		}
+	}
+
+	compaction_cursor = 0;
+
+	return reclaimed;
+}
+
+size_t
+pmm_compact(size_t target_free_blocks, uint64_t cycle_budget)
+{
+	spin_lock(&compaction_lock);
+	size_t reclaimed = pmm_compact_locked(target_free_blocks, cycle_budget);
+	spin_unlock(&compaction_lock);
+
+	return reclaimed;
+}
+
+static void
+pmm_compaction_timer(struct timer *timer)
+{
+	(void) timer;
+
+	queue_work_on(0, &compaction_work);
+}
+
+static void
+pmm_compaction_work(struct work *work)
+{
+	(void) work;
+
+	pmm_compact(COMPACTION_BACKGROUND_BLOCKS, clock_ns_to_cycles(COMPACTION_BACKGROUND_BUDGET_NS));
+
+	// We run on CPU 0, and so does the timer.
+	uint64_t interval = clock_ns_to_cycles(COMPACTION_BACKGROUND_INTERVAL_NS);
+	timer_arm(&compaction_timer, rdtsc() + interval, interval / 8);
+}
+
+void
+pmm_start_background_compaction(void)
+{
+	timer_init(&compaction_timer, pmm_compaction_timer);
+	work_init(&compaction_work, pmm_compaction_work);
+	queue_work_on(0, &compaction_work);
+}
+
+static uintptr_t
+pmm_take_free_block_locked(void)
+{
+	for (size_t i = 0; i < physmem_len; ++i)
+	{
+		struct physmem_region *region = &physmap[i];
+		if (region->type != PHYSMEM_REGION_TYPE_AVAILABLE)
+		{
+			continue;
+		}
+
+		for (uintptr_t block = pmm_first_block_in_region(region);
+		     block + BLOCK_SIZE <= region->addr + region->len;
+		     block += BLOCK_SIZE)
+		{
+			size_t first_idx = (block - region->addr) / PAGE_SIZE;
+			if (pmm_block_used_pages(region, first_idx) != 0)
+			{
+				continue;
+			}
+
+			for (size_t page_idx = first_idx; page_idx < first_idx + PAGES_PER_BLOCK; ++page_idx)
+			{
+				pmm_take_page(region, page_idx);
+			}
+
+			return block;
+		}
+	}
+
+	return 0;
+}
+
+static uintptr_t
+pmm_take_free_block(void)
+{
+	struct mcs_node node;
+	uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+	uintptr_t block = pmm_take_free_block_locked();
+	mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+
+	return block;
+}
+
+uintptr_t
+pmm_alloc_huge_page(void)
+{
+	uintptr_t block = pmm_take_free_block();
+	if (block == 0 && pmm_compact(1, 0) != 0)
+	{
+		block = pmm_take_free_block();
+	}
+
+	trace_pmm_alloc_huge(block);
+
+	return block;
+}
+
+void
+pmm_get_compaction_stats(struct pmm_compaction_stats *stats)
+{
+	stats->runs = percpu_counter_sum(&compaction_runs);
+	stats->blocks_reclaimed = percpu_counter_sum(&compaction_blocks_reclaimed);
+	stats->pages_moved = percpu_counter_sum(&compaction_pages_moved);
+	stats->blocks_skipped = percpu_counter_sum(&compaction_blocks_skipped);
+}
+
+size_t
+pmm_free_pages_approx(void)
+{
+	int64_t free_pages = percpu_counter_read(&pmm_free_pages);
+
+	return free_pages > 0 ? free_pages : 0;
+}
+
+void
+pmm_get_stats(struct pmm_stats *stats)
+{
+	stats->free_pages = percpu_counter_sum(&pmm_free_pages);
+	stats->allocations = percpu_counter_sum(&pmm_allocations);
+	stats->frees = percpu_counter_sum(&pmm_frees);
 }
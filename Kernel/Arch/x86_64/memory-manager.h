@@ -21,18 +21,147 @@ struct physmem_region
 
 	uint8_t *alloc_map; // Bitmap describing allocated and free regions.
 
+	// Reverse map: for every movable page, the kernel virtual address
+	// mapping it, and 0 for everything else. Only used for available regions.
+	uintptr_t *rmap;
+
+	// For pages shared copy-on-write, the number of owners besides the
+	// first one. Only used for available regions.
+	uint32_t *share_count;
+
 	enum physmem_region_type type;
 };
 
 void init_memory_manager(struct sampo_bootinfo *bootinfo);
 
+// Whether `page` is RAM which the bootloader didn't use. Unlike the page
+// allocator, this also covers the memory under 1MiB.
+bool pmm_is_usable_ram(uintptr_t page);
+
+// Returns the physical address of a newly allocated page, or 0 on failure.
+uintptr_t pmm_alloc_page(void);
+void pmm_free_page(uintptr_t page);
+
+struct pmm_stats
+{
+	uint64_t free_pages;
+	uint64_t allocations; // <- Pages ever allocated.
+	uint64_t frees;
+};
+
+// Cheap, but off by up to a few pages per CPU.
+size_t pmm_free_pages_approx(void);
+// Exact, but reads a cache line per CPU and counter.
+void pmm_get_stats(struct pmm_stats *stats);
+
+// Copy-on-write sharing: pages start out with a single owner, and
+// pmm_page_share adds another one. pmm_page_release drops an owner,
+// and frees the page once the last one is gone.
+void pmm_page_share(uintptr_t page);
+void pmm_page_release(uintptr_t page);
+bool pmm_page_is_shared(uintptr_t page);
+
+// Page coloring: when enabled, the pages backing demand-paged regions are
+// picked so that consecutive virtual pages land in different sets of the
+// last-level cache. Returns whether coloring is in effect, as it can't be
+// on CPUs which don't describe their caches via CPUID leaf 4.
+#define PAGE_COLOR_MAX 1024
+bool pmm_set_page_coloring(bool enabled);
+size_t pmm_get_page_color_count(void);
+
+// Allocates a page of the given color, or of any color if they have run out.
+uintptr_t pmm_alloc_page_with_color(size_t color);
+
+// Allocates a 2MiB-aligned, physically contiguous 2MiB block, compacting
+// the physical memory if there is no such free block. Returns 0 on failure.
+// Like pmm_compact, must be called with interrupts enabled.
+uintptr_t pmm_alloc_huge_page(void);
+
+// Migrates movable pages out of sparsely used 2MiB blocks until there are
+// at least `target_free_blocks` free aligned blocks, or until `cycle_budget`
+// TSC cycles have been spent (0 for no limit.) Time-limited runs pick up
+// from where the previous one stopped, so this can be called repeatedly
+// from the background. Returns the number of blocks reclaimed. Must be
+// called with interrupts enabled, as moving pages waits for every CPU to
+// purge the old ones from its TLB.
+size_t pmm_compact(size_t target_free_blocks, uint64_t cycle_budget);
+
+struct pmm_compaction_stats
+{
+	uint64_t runs;
+	uint64_t blocks_reclaimed;
+	uint64_t pages_moved;
+	uint64_t blocks_skipped; // <- Blocks with unmovable pages in them.
+};
+
+void pmm_get_compaction_stats(struct pmm_compaction_stats *stats);
+
+// Has CPU 0's worker compact the memory every second from now on, for
+// a bounded time, whenever fewer than a few blocks are free. Needs the
+// work queues.
+void pmm_start_background_compaction(void);
+
 enum virt_map_perm
 {
 	VIRT_MAP_READ = (1 << 0),
 	VIRT_MAP_WRITE = (1 << 1),
 	VIRT_MAP_EXEC = (1 << 2),
+	VIRT_MAP_UNCACHED = (1 << 3), // <- For memory-mapped I/O.
 };
 
 void *virt_map_pages_kernel_end(uintptr_t physical_page_addr,
 				size_t page_count,
 				enum virt_map_perm mapping_perms);
+
+// Maps physical pages to kernel virtual addresses, reusing previously
+// unmapped ranges once they have been purged from the TLB.
+void *virt_map_pages(uintptr_t physical_page_addr,
+		     size_t page_count,
+		     enum virt_map_perm mapping_perms);
+
+// Unmaps pages mapped by virt_map_pages. The TLB is not flushed right away:
+// the range is kept out of use until enough unmapped pages have built up,
+// and then they are all purged with a single flush on every CPU.
+void virt_unmap_pages(void *addr, size_t page_count);
+
+// Allocates `page_count` physical pages and maps them, virtually contiguous.
+void *virt_alloc_pages(size_t page_count, enum virt_map_perm mapping_perms);
+// Unmaps and frees pages allocated with virt_alloc_pages.
+void virt_free_pages(void *addr, size_t page_count);
+
+// Purges all lazily unmapped ranges now. They become reusable once every
+// CPU has flushed its TLB.
+void virt_purge_lazy_ranges(void);
+
+struct virt_purge_stats
+{
+	uint64_t pages_unmapped; // <- None of which got an immediate invlpg.
+
+	// Each unmap would otherwise have needed a shootdown of its own, so
+	// shootdowns_avoided is unmaps - purge_count.
+	uint64_t unmaps;
+	uint64_t purge_count; // <- Full flushes actually done, on every CPU.
+	uint64_t shootdowns_avoided;
+};
+
+void virt_get_purge_stats(struct virt_purge_stats *stats);
+
+// Reserves kernel virtual memory without backing it. Physical pages are
+// allocated and zeroed by the page fault handler on first touch, along
+// with up to `fault_around_pages` neighbouring pages (0 or 1 to disable.)
+void *virt_reserve_pages_kernel_end(size_t page_count,
+				    enum virt_map_perm mapping_perms,
+				    size_t fault_around_pages);
+
+struct virt_fault_stats
+{
+	uint64_t fault_count; // <- Demand faults resolved.
+	uint64_t pages_populated; // <- Including the fault-around pages.
+	uint64_t fault_retries; // <- Faults on pages compaction was moving, not in the above.
+
+	// Time spent in resolved faults, in TSC cycles.
+	uint64_t fault_cycles_total;
+	uint64_t fault_cycles_max;
+};
+
+void virt_get_fault_stats(struct virt_fault_stats *stats);
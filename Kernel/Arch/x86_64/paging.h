@@ -0,0 +1,110 @@
+#pragma once
+
+// Page table layout and helpers shared by the memory management code.
+// The paging structures of the active address space are reachable through
+// the fractal mapping at PML4 entry FRACTAL_MAP_PML4_IDX.
+
+#include <SampoOS/Kernel/memman.h>
+#include <stdint.h>
+#include "arch-utils.h"
+#include "memory-manager.h"
+
+#define page_entry_to_physaddr(e) ((e) & UINT64_C(0x000FFFFFFFFFF000))
+#define virtaddr_to_pml4e_idx(addr) ((((uintptr_t)(addr)) >> 39) & 0x1FF)
+#define virtaddr_to_pdpe_idx(addr) ((((uintptr_t)(addr)) >> 30) & 0x1FF)
+#define virtaddr_to_pde_idx(addr) ((((uintptr_t)(addr)) >> 21) & 0x1FF)
+#define virtaddr_to_pte_idx(addr) ((((uintptr_t)(addr)) >> 12) & 0x1FF)
+
+#define get_next_aligned_addr(addr) ((((uintptr_t)(addr)) + (PAGE_SIZE - 1)) & ~(PAGE_SIZE - 1))
+
+static const uint64_t PAGE_PRESENT = UINT64_C(1) << 0;
+static const uint64_t PAGE_WRITABLE = UINT64_C(1) << 1;
+static const uint64_t PAGE_USER = UINT64_C(1) << 2;
+static const uint64_t PAGE_WRITE_THROUGH = UINT64_C(1) << 3;
+static const uint64_t PAGE_CACHE_DISABLE = UINT64_C(1) << 4;
+static const uint64_t PAGE_HUGE = UINT64_C(1) << 7;
+// Available to software: marks a write-protected, copy-on-write page.
+static const uint64_t PAGE_COW = UINT64_C(1) << 9;
+// Available to software: marks a kernel page taken out of its mapping
+// while compaction moves it.
+static const uint64_t PAGE_MIGRATING = UINT64_C(1) << 10;
+static const uint64_t NX_BIT = UINT64_C(1) << 63;
+
+// The lower half of every address space belongs to user space.
+#define USER_PML4_ENTRY_COUNT 256
+
+static const size_t FRACTAL_MAP_PML4_IDX = 510;
+static const uintptr_t KERN_PT_BASE = UINT64_C(0xFFFF000000000000) + (FRACTAL_MAP_PML4_IDX << 39);
+static const uintptr_t KERN_PD_BASE = KERN_PT_BASE + (FRACTAL_MAP_PML4_IDX << 30);
+static const uintptr_t KERN_PDP_BASE = KERN_PD_BASE + (FRACTAL_MAP_PML4_IDX << 21);
+static const uintptr_t KERN_PML4_BASE = KERN_PDP_BASE + (FRACTAL_MAP_PML4_IDX << 12);
+
+static inline uint64_t *
+get_pml4_from_addr(void *p)
+{
+	(void) p;
+	return (uint64_t *) KERN_PML4_BASE;
+}
+
+static inline uint64_t *
+get_pdpt_from_addr(void *p)
+{
+	uintptr_t addr = (uintptr_t) p;
+
+	return (uint64_t *) (KERN_PDP_BASE + ((addr >> 27) & 0x00001FF000));
+}
+
+static inline uint64_t *
+get_pd_from_addr(void *p)
+{
+	uintptr_t addr = (uintptr_t) p;
+
+	return (uint64_t *) (KERN_PD_BASE + ((addr >> 18) & 0x003FFFF000));
+}
+
+static inline uint64_t *
+get_pt_from_addr(void *p)
+{
+	uintptr_t addr = (uintptr_t) p;
+
+	return (uint64_t *) (KERN_PT_BASE + ((addr >> 9) & 0x7FFFFFF000));
+}
+
+static inline void
+invalidate_page(void *p)
+{
+	asm volatile("invlpg (%0)" : : "b"(p) : "memory");
+}
+
+// Flushes all non-global TLB entries by reloading CR3.
+static inline void
+flush_tlb(void)
+{
+	write_cr3(read_cr3());
+}
+
+static inline uint64_t
+virt_make_pte(uintptr_t physical_page_addr, enum virt_map_perm mapping_perms)
+{
+	uint64_t pte = physical_page_addr | PAGE_PRESENT;
+	if ((mapping_perms & VIRT_MAP_WRITE) != 0)
+	{
+		pte |= PAGE_WRITABLE;
+	}
+	if ((mapping_perms & VIRT_MAP_EXEC) == 0)
+	{
+		pte |= NX_BIT;
+	}
+	if ((mapping_perms & VIRT_MAP_UNCACHED) != 0)
+	{
+		pte |= PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH;
+	}
+
+	return pte;
+}
+
+// Returns the page table entry for `addr` in the active address space,
+// creating the intermediate paging structures on the way if needed.
+// Outside of memory-manager.c, this is only for the lower half, which
+// whoever owns the address space must serialize changes to.
+uint64_t *virt_get_pte(void *addr);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "percpu.h"
+
+// A counter split into per-CPU slots, each on a cache line of its own, so
+// that bumping it never touches a line another CPU is writing to. A slot
+// is folded into the shared total once it has drifted by `batch` either
+// way, so reading the total alone is off by less than `batch` times the
+// number of CPUs, while the exact value takes summing up every slot.
+
+#define PERCPU_COUNTER_DEFAULT_BATCH 64
+
+struct percpu_counter_slot
+{
+	int64_t delta;
+} __attribute__((aligned(64)));
+
+struct percpu_counter
+{
+	int64_t count;
+	int64_t batch; // <- The error bound per CPU.
+	struct percpu_counter_slot slots[CPU_MAX];
+};
+
+#define PERCPU_COUNTER_INIT(b) { .count = 0, .batch = (b), .slots = { { 0 } } }
+
+static inline void
+percpu_counter_add(struct percpu_counter *counter, int64_t amount)
+{
+	// The slot is ours, so the atomic add is uncontended. It keeps an
+	// interrupt, or a migration right after picking the slot, from
+	// losing an update.
+	struct percpu_counter_slot *slot = &counter->slots[this_cpu()->index];
+	int64_t delta = __atomic_add_fetch(&slot->delta, amount, __ATOMIC_RELAXED);
+	if (delta >= counter->batch || delta <= -counter->batch)
+	{
+		delta = __atomic_exchange_n(&slot->delta, 0, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&counter->count, delta, __ATOMIC_RELAXED);
+	}
+}
+
+static inline void
+percpu_counter_inc(struct percpu_counter *counter)
+{
+	percpu_counter_add(counter, 1);
+}
+
+static inline void
+percpu_counter_set(struct percpu_counter *counter, int64_t value)
+{
+	for (size_t i = 0; i < CPU_MAX; ++i)
+	{
+		__atomic_store_n(&counter->slots[i].delta, 0, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&counter->count, value, __ATOMIC_RELAXED);
+}
+
+// The fast, approximate read.
+static inline int64_t
+percpu_counter_read(struct percpu_counter *counter)
+{
+	return __atomic_load_n(&counter->count, __ATOMIC_RELAXED);
+}
+
+// The slow, exact read. It can still be off while the counter is being
+// updated, by what is in flight.
+static inline int64_t
+percpu_counter_sum(struct percpu_counter *counter)
+{
+	int64_t sum = __atomic_load_n(&counter->count, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		sum += __atomic_load_n(&counter->slots[i].delta, __ATOMIC_RELAXED);
+	}
+
+	return sum;
+}
@@ -0,0 +1,98 @@
+#include "percpu.h"
+#include "arch-utils.h"
+
+#define MSR_GS_BASE 0xC0000101
+
+#define GDT_KERNEL_CODE UINT64_C(0x00AF9A000000FFFF)
+#define GDT_KERNEL_DATA UINT64_C(0x00CF92000000FFFF)
+#define GDT_USER_DATA UINT64_C(0x00CFF2000000FFFF)
+#define GDT_USER_CODE UINT64_C(0x00AFFA000000FFFF)
+
+// Present, 64-bit available TSS.
+#define GDT_TSS_TYPE UINT64_C(0x89)
+
+// The boot stack, defined in start.asm.
+extern uint8_t stack_bot[];
+extern uint8_t stack_top[];
+
+struct cpu cpus[CPU_MAX];
+size_t cpu_count = 0;
+
+struct gdt_pointer
+{
+	uint16_t limit;
+	uint64_t base;
+} __attribute__((packed));
+
+static void
+gdt_fill(struct cpu *cpu)
+{
+	cpu->gdt[GDT_SELECTOR_NULL / 8] = 0;
+	cpu->gdt[GDT_SELECTOR_KERNEL_CODE / 8] = GDT_KERNEL_CODE;
+	cpu->gdt[GDT_SELECTOR_KERNEL_DATA / 8] = GDT_KERNEL_DATA;
+	cpu->gdt[GDT_SELECTOR_USER_DATA / 8] = GDT_USER_DATA;
+	cpu->gdt[GDT_SELECTOR_USER_CODE / 8] = GDT_USER_CODE;
+
+	uint64_t tss_base = (uint64_t)(uintptr_t) &cpu->tss;
+	uint64_t tss_limit = sizeof(cpu->tss) - 1;
+
+	cpu->gdt[GDT_SELECTOR_TSS / 8] =
+		(tss_limit & 0xFFFF) |
+		((tss_base & 0xFFFFFF) << 16) |
+		(GDT_TSS_TYPE << 40) |
+		(((tss_limit >> 16) & 0xF) << 48) |
+		(((tss_base >> 24) & 0xFF) << 56);
+	cpu->gdt[GDT_SELECTOR_TSS / 8 + 1] = tss_base >> 32;
+
+	// No I/O permission bitmap.
+	cpu->tss.iomap_base = sizeof(cpu->tss);
+}
+
+void
+percpu_load(struct cpu *cpu)
+{
+	gdt_fill(cpu);
+
+	struct gdt_pointer gdtr = {
+		.limit = sizeof(cpu->gdt) - 1,
+		.base = (uint64_t)(uintptr_t) cpu->gdt,
+	};
+
+	// Reload CS with a far return, and the rest of the segments directly.
+	asm volatile("lgdt %0\n\t"
+		     "pushq %1\n\t"
+		     "leaq 1f(%%rip), %%rax\n\t"
+		     "pushq %%rax\n\t"
+		     "lretq\n"
+		     "1:\n\t"
+		     "mov %w2, %%ds\n\t"
+		     "mov %w2, %%es\n\t"
+		     "mov %w2, %%ss\n\t"
+		     "mov %w3, %%fs\n\t"
+		     "mov %w3, %%gs\n\t"
+		     "ltr %w4"
+		     :
+		     : "m"(gdtr),
+		       "i"(GDT_SELECTOR_KERNEL_CODE),
+		       "r"(GDT_SELECTOR_KERNEL_DATA),
+		       "r"(GDT_SELECTOR_NULL),
+		       "r"(GDT_SELECTOR_TSS)
+		     : "rax", "memory");
+
+	// Loading the GS selector cleared the base, so this must come last.
+	cpu->self = cpu;
+	wrmsr(MSR_GS_BASE, (uint64_t)(uintptr_t) cpu);
+}
+
+void
+init_percpu(void)
+{
+	struct cpu *cpu = &cpus[0];
+	cpu->index = 0;
+	cpu->online = true;
+	cpu->boot_stack_bottom = (uintptr_t) stack_bot;
+	cpu->boot_stack_top = (uintptr_t) stack_top;
+	cpu_count = 1;
+
+	percpu_load(cpu);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CPU_MAX 64
+
+struct fpu;
+
+enum gdt_selector
+{
+	GDT_SELECTOR_NULL = 0x00,
+	GDT_SELECTOR_KERNEL_CODE = 0x08,
+	GDT_SELECTOR_KERNEL_DATA = 0x10,
+	GDT_SELECTOR_USER_DATA = 0x18,
+	GDT_SELECTOR_USER_CODE = 0x20,
+	GDT_SELECTOR_TSS = 0x28, // <- Takes two entries.
+};
+
+#define GDT_ENTRY_COUNT 7
+
+struct tss
+{
+	uint32_t reserved0;
+	uint64_t rsp[3];
+	uint64_t reserved1;
+	uint64_t ist[7];
+	uint64_t reserved2;
+	uint16_t reserved3;
+	uint16_t iomap_base;
+} __attribute__((packed));
+
+// The data private to each CPU. The GS base of each CPU points to its own.
+struct cpu
+{
+	struct cpu *self; // <- Must be first, this_cpu() reads it from %gs:0.
+	size_t index;
+	uint32_t apic_id;
+	bool online;
+
+	// Preemption is held off while this is non-zero, see preempt.h.
+	uint32_t preempt_count;
+	bool need_resched;
+
+	// Where the SYSCALL entry keeps the user stack pointer while it
+	// switches stacks, see syscall-entry.asm.
+	uint64_t user_rsp;
+
+	uint64_t gdt[GDT_ENTRY_COUNT];
+	struct tss tss;
+
+	// The FPU state of the running thread, and the one whose state is in
+	// the registers, see fpu.h. The ways back to user mode load the
+	// running thread's first while the flag is set.
+	struct fpu *fpu_current;
+	struct fpu *fpu_owner;
+	bool fpu_load_pending;
+
+	// The stack the CPU came up on, which its boot context keeps running on.
+	uintptr_t boot_stack_bottom;
+	uintptr_t boot_stack_top;
+} __attribute__((aligned(64)));
+
+extern struct cpu cpus[CPU_MAX];
+
+// The number of CPUs which have been started.
+extern size_t cpu_count;
+
+static inline struct cpu *
+this_cpu(void)
+{
+	struct cpu *cpu;
+	asm volatile ("mov %%gs:0, %0" : "=r"(cpu));
+
+	return cpu;
+}
+
+// Sets up the bootstrap CPU's own data and descriptor tables.
+void init_percpu(void);
+
+// Loads the GDT, TSS and GS base of `cpu` on the calling CPU.
+void percpu_load(struct cpu *cpu);
@@ -0,0 +1,53 @@
+#include "pit.h"
+#include "arch-utils.h"
+
+#define PIT_FREQUENCY_HZ 1193182
+
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+
+// Channel 2's gate and output are wired to the keyboard controller port B.
+#define PIT_PORT_B 0x61
+#define PIT_PORT_B_GATE2 0x01
+#define PIT_PORT_B_SPEAKER 0x02
+#define PIT_PORT_B_OUT2 0x20
+
+// Channel 2, lobyte/hibyte access, mode 0 (interrupt on terminal count.)
+#define PIT_CHANNEL2_ONE_SHOT 0xB0
+
+// The counter is 16 bits wide, so long waits are done in chunks.
+#define PIT_MAX_CHUNK_US 50000
+
+void
+pit_delay_us(uint32_t us)
+{
+	uint8_t port_b = inb(PIT_PORT_B) & ~(PIT_PORT_B_SPEAKER | PIT_PORT_B_GATE2);
+
+	while (us > 0)
+	{
+		uint32_t chunk = us > PIT_MAX_CHUNK_US ? PIT_MAX_CHUNK_US : us;
+		uint16_t count = ((uint64_t) chunk * PIT_FREQUENCY_HZ) / 1000000;
+		if (count == 0)
+		{
+			count = 1;
+		}
+
+		// Keep the gate low while programming, so that the count
+		// only starts once it is raised.
+		outb(PIT_PORT_B, port_b);
+		outb(PIT_COMMAND, PIT_CHANNEL2_ONE_SHOT);
+		outb(PIT_CHANNEL2, count & 0xFF);
+		outb(PIT_CHANNEL2, count >> 8);
+		outb(PIT_PORT_B, port_b | PIT_PORT_B_GATE2);
+
+		// OUT2 goes high once the count reaches zero.
+		while ((inb(PIT_PORT_B) & PIT_PORT_B_OUT2) == 0)
+		{
+			cpu_relax();
+		}
+
+		us -= chunk;
+	}
+
+	outb(PIT_PORT_B, port_b);
+}
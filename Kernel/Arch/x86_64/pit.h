@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+// Busy-waits for at least `us` microseconds using channel 2 of the PIT.
+// Meant for boot-time delays, before there is anything better to use.
+void pit_delay_us(uint32_t us);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include "percpu.h"
+#include "latency-trace.h"
+
+// Defined in sched.c. Runs a reschedule that was held off while
+// preemption was disabled.
+void sched_preempt_pending(void);
+
+// Both of these are a single instruction on the CPU's own data, so it
+// doesn't matter if the thread migrates right before or after.
+static inline void
+preempt_disable(void)
+{
+	asm volatile("incl %%gs:%c0" : : "i"(offsetof(struct cpu, preempt_count)) : "memory");
+
+#ifdef SAMPO_LATENCY_TRACE
+	if (this_cpu()->preempt_count == 1)
+	{
+		latency_trace_preempt_off(LATENCY_TRACE_HERE());
+	}
+#endif
+}
+
+static inline void
+preempt_enable(void)
+{
+#ifdef SAMPO_LATENCY_TRACE
+	if (this_cpu()->preempt_count == 1)
+	{
+		latency_trace_preempt_on(LATENCY_TRACE_HERE());
+	}
+#endif
+
+	asm volatile("decl %%gs:%c0" : : "i"(offsetof(struct cpu, preempt_count)) : "memory");
+
+	struct cpu *cpu = this_cpu();
+	if (cpu->preempt_count == 0 && cpu->need_resched)
+	{
+		sched_preempt_pending();
+	}
+}
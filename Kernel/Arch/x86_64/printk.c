@@ -0,0 +1,309 @@
+#include <string.h>
+#include "printk.h"
+#include "format.h"
+#include "clock.h"
+#include "serial.h"
+#include "workqueue.h"
+#include "percpu.h"
+#include "arch-utils.h"
+#include <stdarg.h>
+
+#define PRINTK_RECORDS 512 // <- A power of two.
+#define PRINTK_RECORD_SIZE 256
+
+// A record's state holds the sequence number of the message in it, plus
+// one so that zero means empty, shifted over the busy bit.
+#define STATE_BUSY UINT64_C(1)
+#define STATE_SEQUENCE(state) (((state) >> 1) - 1)
+#define STATE_COMMITTED(sequence) (((sequence) + 1) << 1)
+
+struct printk_record
+{
+	uint64_t state;
+
+	// The newest message that found the record busy and gave up, so
+	// that the consumer knows not to wait for it.
+	uint64_t abandoned;
+
+	uint64_t tsc;
+	uint32_t cpu;
+	uint16_t len;
+	char text[PRINTK_RECORD_SIZE - 3 * sizeof(uint64_t) - sizeof(uint32_t) - sizeof(uint16_t)];
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct printk_record) == PRINTK_RECORD_SIZE, "printk records are padded");
+
+static struct printk_record records[PRINTK_RECORDS];
+
+// The next sequence number to hand out.
+static uint64_t head;
+
+// Only touched by whoever holds `draining`.
+static uint64_t next_to_write;
+static bool draining;
+
+static bool deferred;
+static struct work flush_work;
+
+static struct printk_console *consoles;
+
+static uint64_t logged;
+static uint64_t written;
+static uint64_t lost;
+
+// Lost by the writers, not yet reported by the consumer.
+static uint64_t lost_unreported;
+
+static void
+serial_console_write(const char *text, size_t len)
+{
+	serial_write_bytes(text, len);
+}
+
+static struct printk_console serial_console = { .write = serial_console_write, .next = NULL };
+
+static void
+console_write(const char *text, size_t len)
+{
+	for (struct printk_console *console = __atomic_load_n(&consoles, __ATOMIC_ACQUIRE);
+	     console != NULL;
+	     console = console->next)
+	{
+		console->write(text, len);
+	}
+}
+
+static void
+console_printf(const char *format, ...)
+{
+	char line[PRINTK_RECORD_SIZE + 64];
+
+	va_list args;
+	va_start(args, format);
+	size_t len = format_buffer_v(line, sizeof(line), format, args);
+	va_end(args);
+
+	console_write(line, len);
+}
+
+static void
+report_lost(uint64_t count)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	__atomic_fetch_add(&lost, count, __ATOMIC_RELAXED);
+	console_printf("[printk: %llu messages lost]\n", (unsigned long long) count);
+}
+
+static void
+write_record(uint64_t tsc, uint32_t cpu, const char *text, size_t len)
+{
+	bool newline = len == 0 || text[len - 1] != '\n';
+	if (clock_tsc_hz() == 0)
+	{
+		// Logged before the TSC was calibrated.
+		console_printf("[tsc %016llx] %u: %.*s%s",
+			       (unsigned long long) tsc, cpu, (int) len, text, newline ? "\n" : "");
+	}
+	else
+	{
+		uint64_t us = clock_cycles_to_ns(tsc) / 1000;
+		console_printf("[%5llu.%06llu] %u: %.*s%s",
+			       (unsigned long long) (us / 1000000),
+			       (unsigned long long) (us % 1000000),
+			       cpu, (int) len, text, newline ? "\n" : "");
+	}
+
+	__atomic_fetch_add(&written, 1, __ATOMIC_RELAXED);
+}
+
+// Writes out records until it reaches one that is still being written.
+// Returns false if someone else already is.
+static bool
+printk_drain(void)
+{
+	if (__atomic_exchange_n(&draining, true, __ATOMIC_ACQUIRE))
+	{
+		return false;
+	}
+
+	uint64_t sequence = next_to_write;
+	for (;;)
+	{
+		report_lost(__atomic_exchange_n(&lost_unreported, 0, __ATOMIC_RELAXED));
+
+		uint64_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+		if (sequence == end)
+		{
+			break;
+		}
+
+		// The writers have lapped us.
+		if (end - sequence > PRINTK_RECORDS)
+		{
+			report_lost(end - PRINTK_RECORDS - sequence);
+			sequence = end - PRINTK_RECORDS;
+		}
+
+		struct printk_record *record = &records[sequence & (PRINTK_RECORDS - 1)];
+		uint64_t state = __atomic_load_n(&record->state, __ATOMIC_ACQUIRE);
+		if (state == STATE_COMMITTED(sequence))
+		{
+			// A writer may be lapping us meanwhile, so copy it out and
+			// check it's still the same message, like a seqlock.
+			char text[sizeof(record->text)];
+			uint64_t tsc = record->tsc;
+			uint32_t cpu = record->cpu;
+			size_t len = record->len;
+			if (len > sizeof(text))
+			{
+				len = sizeof(text);
+			}
+			memcpy(text, record->text, len);
+
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&record->state, __ATOMIC_RELAXED) != state)
+			{
+				report_lost(1);
+			}
+			else
+			{
+				write_record(tsc, cpu, text, len);
+			}
+
+			++sequence;
+		}
+		else if (state != 0 && STATE_SEQUENCE(state) > sequence)
+		{
+			// Overwritten by a later message already.
+			report_lost(1);
+			++sequence;
+		}
+		else if (__atomic_load_n(&record->abandoned, __ATOMIC_ACQUIRE) == STATE_COMMITTED(sequence))
+		{
+			// Its writer gave up, and has counted it as lost.
+			++sequence;
+		}
+		else
+		{
+			// Still being written, and whoever is writing it kicks
+			// us again once they are done.
+			break;
+		}
+	}
+
+	next_to_write = sequence;
+	__atomic_store_n(&draining, false, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static void
+printk_kick(void)
+{
+	if (__atomic_load_n(&deferred, __ATOMIC_ACQUIRE))
+	{
+		// On the bootstrap CPU, which always has a worker.
+		queue_work_on(0, &flush_work);
+		return;
+	}
+
+	printk_drain();
+}
+
+static void
+printk_flush_work(struct work *work)
+{
+	(void) work;
+
+	// If someone else was draining, they may have stopped just short of
+	// what we were queued for, so try again once they're done.
+	while (!printk_drain())
+	{
+		cpu_relax();
+	}
+}
+
+void
+init_printk(void)
+{
+	work_init(&flush_work, printk_flush_work);
+	printk_register_console(&serial_console);
+}
+
+void
+printk(const char *format, ...)
+{
+	uint64_t tsc = rdtsc();
+	uint64_t sequence = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	struct printk_record *record = &records[sequence & (PRINTK_RECORDS - 1)];
+
+	// Take over the oldest message, unless someone is still writing it,
+	// which happens only if the ring wrapped around in the meantime. We
+	// can't wait for them, as they may be what we interrupted.
+	uint64_t state = __atomic_load_n(&record->state, __ATOMIC_RELAXED);
+	do
+	{
+		if ((state & STATE_BUSY) != 0 || (state != 0 && STATE_SEQUENCE(state) >= sequence))
+		{
+			__atomic_store_n(&record->abandoned, STATE_COMMITTED(sequence), __ATOMIC_RELEASE);
+			__atomic_fetch_add(&lost_unreported, 1, __ATOMIC_RELAXED);
+			printk_kick();
+			return;
+		}
+	}
+	while (!__atomic_compare_exchange_n(&record->state, &state, STATE_COMMITTED(sequence) | STATE_BUSY,
+					    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	va_list args;
+	va_start(args, format);
+	size_t len = format_buffer_v(record->text, sizeof(record->text), format, args);
+	va_end(args);
+
+	record->tsc = tsc;
+	record->cpu = this_cpu()->index;
+	record->len = len;
+
+	__atomic_store_n(&record->state, STATE_COMMITTED(sequence), __ATOMIC_RELEASE);
+	__atomic_fetch_add(&logged, 1, __ATOMIC_RELAXED);
+
+	printk_kick();
+}
+
+void
+printk_start_deferred(void)
+{
+	__atomic_store_n(&deferred, true, __ATOMIC_RELEASE);
+	queue_work_on(0, &flush_work);
+}
+
+void
+printk_flush(void)
+{
+	while (!printk_drain())
+	{
+		cpu_relax();
+	}
+}
+
+void
+printk_register_console(struct printk_console *console)
+{
+	struct printk_console *first = __atomic_load_n(&consoles, __ATOMIC_RELAXED);
+	do
+	{
+		console->next = first;
+	}
+	while (!__atomic_compare_exchange_n(&consoles, &first, console, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void
+printk_get_stats(struct printk_stats *stats)
+{
+	stats->logged = __atomic_load_n(&logged, __ATOMIC_RELAXED);
+	stats->written = __atomic_load_n(&written, __ATOMIC_RELAXED);
+	stats->lost = __atomic_load_n(&lost, __ATOMIC_RELAXED) + __atomic_load_n(&lost_unreported, __ATOMIC_RELAXED);
+}
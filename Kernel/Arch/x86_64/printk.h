@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// The kernel log. Each printk call takes the next record of a global ring
+// with a single fetch-and-add, formats its message straight into it and
+// stamps it with the TSC, so logging never waits, from any context. The
+// records are written out to the consoles later, by a work item, see
+// printk_start_deferred. When the ring laps the consoles, the oldest
+// records are dropped, and a line saying how many takes their place.
+
+struct printk_console
+{
+	void (*write)(const char *text, size_t len);
+	struct printk_console *next;
+};
+
+// Registers the serial console.
+void init_printk(void);
+
+// See format.h for what it understands. Messages are one line each, and
+// longer ones are cut short.
+void printk(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// Until this is called, every printk writes the ring out itself. Must be
+// called after init_workqueues.
+void printk_start_deferred(void);
+
+// Writes out everything logged so far, in the caller. For when the work
+// item won't get to run, like before halting.
+void printk_flush(void);
+
+// Consoles can't be removed again.
+void printk_register_console(struct printk_console *console);
+
+struct printk_stats
+{
+	size_t logged;
+	size_t written;
+	size_t lost; // <- Overwritten before being written out, or dropped on a collision.
+};
+
+void printk_get_stats(struct printk_stats *stats);
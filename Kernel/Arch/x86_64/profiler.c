@@ -0,0 +1,642 @@
+#include <SampoOS/Kernel/memman.h>
+#include <cpuid.h>
+#include "profiler.h"
+#include "interrupts.h"
+#include "apic.h"
+#include "timer.h"
+#include "workqueue.h"
+#include "sched.h"
+#include "percpu.h"
+#include "clock.h"
+#include "memory-manager.h"
+#include "symbols.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#ifdef SAMPO_PROFILER
+
+#define CPUID_PERFMON 0x0A
+#define CPUID_PERFMON_NO_CORE_CYCLES (1 << 0) // <- In EBX.
+
+#define MSR_PMC0 0xC1
+#define MSR_PERFEVTSEL0 0x186
+#define MSR_PERF_GLOBAL_CTRL 0x38F
+#define MSR_PERF_GLOBAL_OVF_CTRL 0x390
+
+#define PERFEVTSEL_UNHALTED_CORE_CYCLES 0x3C
+#define PERFEVTSEL_USR (1 << 16)
+#define PERFEVTSEL_OS (1 << 17)
+#define PERFEVTSEL_INT (1 << 20)
+#define PERFEVTSEL_EN (1 << 22)
+
+// How many of the hottest addresses the dump lists.
+#define DUMP_TOP 20
+
+enum profiler_source
+{
+	PROFILER_SOURCE_NONE, // <- Until init_profiler.
+	PROFILER_SOURCE_COUNTER,
+	PROFILER_SOURCE_TIMER,
+};
+
+struct profiler_sample
+{
+	uint8_t depth; // <- 0 for a sample taken in user mode, which has no chain.
+	uintptr_t chain[PROFILER_CHAIN_MAX]; // <- The interrupted address first.
+};
+
+// Only written by its own CPU, in its sample interrupt, or in its work
+// with interrupts disabled and sampling stopped.
+struct profiler_cpu
+{
+	struct profiler_sample *samples;
+	size_t count; // <- Published after the sample, for the dump.
+	uint64_t dropped;
+
+	bool sampling;
+	uint64_t next_sample; // <- TSC, for the timer.
+
+	struct timer timer;
+	struct work work;
+} __attribute__((aligned(64)));
+
+struct hot_function
+{
+	uintptr_t address;
+	size_t samples;
+};
+
+// The kernel image, from the linker script.
+extern uint8_t kern_begin[];
+extern uint8_t kern_end[];
+
+static struct profiler_cpu profiler_cpus[CPU_MAX];
+static size_t samples_per_cpu;
+
+static enum profiler_source source = PROFILER_SOURCE_NONE;
+static bool running;
+static uint32_t sample_hz;
+static uint64_t sample_period; // <- Cycles.
+
+static uint32_t perfmon_version;
+static uint64_t counter_sign_bit;
+
+// Whatever had the vectors before.
+static interrupt_handler nmi_handler;
+static interrupt_handler timer_handler;
+
+static bool
+perfmon_probe(void)
+{
+	if (__get_cpuid_max(0, NULL) < CPUID_PERFMON)
+	{
+		return false;
+	}
+
+	unsigned int eax, ebx, ecx, edx;
+	__cpuid(CPUID_PERFMON, eax, ebx, ecx, edx);
+
+	perfmon_version = eax & 0xFF;
+	unsigned int counters = (eax >> 8) & 0xFF;
+	unsigned int width = (eax >> 16) & 0xFF;
+	unsigned int events = (eax >> 24) & 0xFF;
+	if (perfmon_version == 0 || counters == 0 || width < 32
+	    || events == 0 || (ebx & CPUID_PERFMON_NO_CORE_CYCLES) != 0)
+	{
+		return false;
+	}
+
+	counter_sign_bit = UINT64_C(1) << (width - 1);
+
+	return true;
+}
+
+// Only the low 32 bits of a counter can be written, and the rest follow
+// bit 31, so a period of less than 2^31 cycles fits.
+static void
+counter_reload(void)
+{
+	wrmsr(MSR_PMC0, (uint32_t) -__atomic_load_n(&sample_period, __ATOMIC_RELAXED));
+
+	if (perfmon_version >= 2)
+	{
+		wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, 1);
+	}
+}
+
+// Follows the saved frame pointers up the stack the interrupted code was
+// on, as long as they stay within it, and collects the return addresses.
+static size_t
+walk_frames(uintptr_t rbp, uintptr_t rsp, uintptr_t *chain, size_t max)
+{
+	uintptr_t bottom, top;
+	sched_current_stack(&bottom, &top);
+
+	// Something else, like an exception stack, or the middle of a switch.
+	if (rsp < bottom || rsp >= top)
+	{
+		return 0;
+	}
+
+	size_t depth = 0;
+	while (depth < max && rbp >= rsp && rbp <= top - 2 * sizeof(uintptr_t) && rbp % sizeof(uintptr_t) == 0)
+	{
+		const uintptr_t *frame = (const uintptr_t *) rbp;
+		uintptr_t ret = frame[1];
+		if (ret < (uintptr_t) kern_begin || ret >= (uintptr_t) kern_end)
+		{
+			break;
+		}
+
+		chain[depth++] = ret;
+
+		// Frames only ever go up.
+		if (frame[0] <= rbp)
+		{
+			break;
+		}
+		rbp = frame[0];
+	}
+
+	return depth;
+}
+
+static void
+record_sample(struct profiler_cpu *pc, const struct interrupt_frame *frame)
+{
+	size_t count = pc->count;
+	if (count == samples_per_cpu)
+	{
+		++pc->dropped;
+		return;
+	}
+
+	struct profiler_sample *sample = &pc->samples[count];
+	if ((frame->cs & 3) != 0)
+	{
+		sample->depth = 0;
+	}
+	else
+	{
+		sample->chain[0] = frame->rip;
+		sample->depth = 1 + walk_frames(frame->rbp, frame->rsp, &sample->chain[1], PROFILER_CHAIN_MAX - 1);
+	}
+
+	__atomic_store_n(&pc->count, count + 1, __ATOMIC_RELEASE);
+}
+
+static bool
+profiler_nmi(struct interrupt_frame *frame)
+{
+	struct profiler_cpu *pc = &profiler_cpus[this_cpu()->index];
+	bool sampling = __atomic_load_n(&pc->sampling, __ATOMIC_RELAXED);
+
+	// The counter was reloaded with the sign bit set, and only loses it
+	// by overflowing.
+	if ((rdmsr(MSR_PMC0) & counter_sign_bit) != 0)
+	{
+		if (nmi_handler != NULL)
+		{
+			return nmi_handler(frame);
+		}
+
+		// Stopping reloads the counter, and one of ours may have
+		// been on its way by then.
+		return !sampling;
+	}
+
+	if (sampling)
+	{
+		record_sample(pc, frame);
+		counter_reload();
+		apic_perf_counter_nmi(true);
+	}
+
+	return true;
+}
+
+// Goes in front of the scheduler's own handler. The timer interrupt
+// comes for the tick and the timers too, and only samples once due.
+static bool
+profiler_timer_interrupt(struct interrupt_frame *frame)
+{
+	struct profiler_cpu *pc = &profiler_cpus[this_cpu()->index];
+	if (pc->sampling)
+	{
+		uint64_t now = rdtsc();
+		if (now >= pc->next_sample)
+		{
+			record_sample(pc, frame);
+
+			uint64_t period = __atomic_load_n(&sample_period, __ATOMIC_RELAXED);
+			pc->next_sample += period;
+			if (pc->next_sample <= now)
+			{
+				pc->next_sample = now + period;
+			}
+		}
+	}
+
+	return timer_handler(frame);
+}
+
+// Only there for the timer interrupt to come when the next sample is due.
+static void
+profiler_timer(struct timer *timer)
+{
+	struct profiler_cpu *pc = &profiler_cpus[this_cpu()->index];
+	if (pc->sampling)
+	{
+		timer_arm(timer, pc->next_sample, 0);
+	}
+}
+
+static void
+sampling_start(struct profiler_cpu *pc)
+{
+	pc->sampling = true;
+
+	if (source == PROFILER_SOURCE_COUNTER)
+	{
+		counter_reload();
+		apic_perf_counter_nmi(true);
+		wrmsr(MSR_PERFEVTSEL0, PERFEVTSEL_UNHALTED_CORE_CYCLES | PERFEVTSEL_USR | PERFEVTSEL_OS
+		      | PERFEVTSEL_INT | PERFEVTSEL_EN);
+
+		if (perfmon_version >= 2)
+		{
+			wrmsr(MSR_PERF_GLOBAL_CTRL, rdmsr(MSR_PERF_GLOBAL_CTRL) | 1);
+		}
+		return;
+	}
+
+	pc->next_sample = rdtsc() + __atomic_load_n(&sample_period, __ATOMIC_RELAXED);
+	timer_arm(&pc->timer, pc->next_sample, 0);
+}
+
+static void
+sampling_stop(struct profiler_cpu *pc)
+{
+	if (source == PROFILER_SOURCE_COUNTER)
+	{
+		wrmsr(MSR_PERFEVTSEL0, 0);
+		apic_perf_counter_nmi(false);
+		counter_reload();
+	}
+	else
+	{
+		timer_cancel(&pc->timer);
+	}
+
+	__atomic_store_n(&pc->sampling, false, __ATOMIC_RELAXED);
+}
+
+// Runs on each CPU to bring it in line with `running`.
+static void
+profiler_cpu_update(struct work *work)
+{
+	(void) work;
+
+	struct profiler_cpu *pc = &profiler_cpus[this_cpu()->index];
+	uint64_t flags = local_irq_save();
+
+	// Stopped first, so nothing records while the buffer is emptied.
+	sampling_stop(pc);
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+	{
+		__atomic_store_n(&pc->count, 0, __ATOMIC_RELEASE);
+		pc->dropped = 0;
+		sampling_start(pc);
+	}
+
+	local_irq_restore(flags);
+}
+
+bool
+init_profiler(void)
+{
+	samples_per_cpu = PROFILER_BUFFER_PAGES * PAGE_SIZE / sizeof(struct profiler_sample);
+
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		struct profiler_cpu *pc = &profiler_cpus[i];
+
+		pc->samples = virt_alloc_pages(PROFILER_BUFFER_PAGES, VIRT_MAP_READ | VIRT_MAP_WRITE);
+		if (pc->samples == NULL)
+		{
+			return false;
+		}
+
+		timer_init(&pc->timer, profiler_timer);
+		work_init(&pc->work, profiler_cpu_update);
+	}
+
+	if (perfmon_probe())
+	{
+		source = PROFILER_SOURCE_COUNTER;
+		nmi_handler = interrupt_register_handler(INTERRUPT_VECTOR_NMI, profiler_nmi);
+	}
+	else
+	{
+		source = PROFILER_SOURCE_TIMER;
+		timer_handler = interrupt_register_handler(INTERRUPT_VECTOR_APIC_TIMER, profiler_timer_interrupt);
+	}
+
+	return true;
+}
+
+static void
+profiler_update_cpus(bool run)
+{
+	__atomic_store_n(&running, run, __ATOMIC_RELEASE);
+
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		queue_work_on(i, &profiler_cpus[i].work);
+	}
+}
+
+void
+profiler_start(uint32_t hz)
+{
+	if (source == PROFILER_SOURCE_NONE || hz == 0)
+	{
+		return;
+	}
+
+	uint64_t period = clock_tsc_hz() / hz;
+	if (period > INT32_MAX)
+	{
+		period = INT32_MAX;
+	}
+
+	__atomic_store_n(&sample_hz, hz, __ATOMIC_RELAXED);
+	__atomic_store_n(&sample_period, period, __ATOMIC_RELAXED);
+	profiler_update_cpus(true);
+}
+
+void
+profiler_stop(void)
+{
+	if (source == PROFILER_SOURCE_NONE)
+	{
+		return;
+	}
+
+	profiler_update_cpus(false);
+}
+
+// Orders the samples by their chains, the interrupted address first, so
+// that equal chains end up next to each other, and so do equal addresses.
+static int
+sample_compare(const struct profiler_sample *a, const struct profiler_sample *b)
+{
+	size_t depth = a->depth < b->depth ? a->depth : b->depth;
+	for (size_t i = 0; i < depth; ++i)
+	{
+		if (a->chain[i] != b->chain[i])
+		{
+			return a->chain[i] < b->chain[i] ? -1 : 1;
+		}
+	}
+
+	return (int) a->depth - (int) b->depth;
+}
+
+static void
+sample_swap(struct profiler_sample *a, struct profiler_sample *b)
+{
+	struct profiler_sample tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static void
+sift_down(struct profiler_sample *items, size_t root, size_t count)
+{
+	for (;;)
+	{
+		size_t child = 2 * root + 1;
+		if (child >= count)
+		{
+			return;
+		}
+
+		if (child + 1 < count && sample_compare(&items[child], &items[child + 1]) < 0)
+		{
+			++child;
+		}
+
+		if (sample_compare(&items[root], &items[child]) >= 0)
+		{
+			return;
+		}
+
+		sample_swap(&items[root], &items[child]);
+		root = child;
+	}
+}
+
+// A heap sort, which needs no memory beyond the array.
+static void
+sort_samples(struct profiler_sample *items, size_t count)
+{
+	for (size_t i = count / 2; i-- > 0;)
+	{
+		sift_down(items, i, count);
+	}
+
+	for (size_t end = count; end-- > 1;)
+	{
+		sample_swap(&items[0], &items[end]);
+		sift_down(items, 0, end);
+	}
+}
+
+// The start of the function an address is in, so that samples in the
+// same functions fold together. Return addresses are looked up a byte
+// earlier, as the call may be the last thing in the function. Addresses
+// in no known function stay as they are.
+static uintptr_t
+frame_function(uintptr_t address, bool return_address)
+{
+	struct symbol symbol;
+	if (!symbol_lookup(return_address ? address - 1 : address, &symbol))
+	{
+		return address;
+	}
+
+	return symbol.start;
+}
+
+static void
+print_function(uintptr_t address)
+{
+	struct symbol symbol;
+	if (address == 0)
+	{
+		serial_write("[user]");
+	}
+	else if (symbol_lookup(address, &symbol))
+	{
+		serial_write(symbol.name);
+	}
+	else
+	{
+		serial_printf("0x%llx", (unsigned long long) address);
+	}
+}
+
+// Keeps `top` sorted, dropping the coldest one once it is full.
+static void
+top_insert(struct hot_function *top, size_t *count, uintptr_t address, size_t samples)
+{
+	size_t i;
+	if (*count < DUMP_TOP)
+	{
+		i = (*count)++;
+	}
+	else if (samples > top[DUMP_TOP - 1].samples)
+	{
+		i = DUMP_TOP - 1;
+	}
+	else
+	{
+		return;
+	}
+
+	for (; i > 0 && top[i - 1].samples < samples; --i)
+	{
+		top[i] = top[i - 1];
+	}
+
+	top[i] = (struct hot_function) { .address = address, .samples = samples };
+}
+
+// How many samples were taken in each function, not counting the ones
+// it called.
+static void
+dump_hottest(const struct profiler_sample *sorted, size_t total)
+{
+	struct hot_function top[DUMP_TOP];
+	size_t top_count = 0;
+
+	// User mode counts as address 0, and sorts first.
+	for (size_t i = 0; i < total;)
+	{
+		uintptr_t address = sorted[i].depth == 0 ? 0 : sorted[i].chain[0];
+		size_t run = 1;
+		while (i + run < total && (sorted[i + run].depth == 0 ? 0 : sorted[i + run].chain[0]) == address)
+		{
+			++run;
+		}
+
+		top_insert(top, &top_count, address, run);
+		i += run;
+	}
+
+	serial_write("Hottest functions:\n");
+	serial_write("\tsamples | % | function\n");
+	for (size_t i = 0; i < top_count; ++i)
+	{
+		serial_printf("\t%zu | %zu | ", top[i].samples, top[i].samples * 100 / total);
+		print_function(top[i].address);
+		serial_write("\n");
+	}
+}
+
+// The outermost frame first, as in `a;b;c 12`.
+static void
+dump_folded(const struct profiler_sample *sample, size_t samples)
+{
+	if (sample->depth == 0)
+	{
+		print_function(0);
+	}
+
+	for (size_t i = sample->depth; i-- > 0;)
+	{
+		print_function(sample->chain[i]);
+		if (i != 0)
+		{
+			serial_write(";");
+		}
+	}
+	serial_printf(" %zu\n", samples);
+}
+
+void
+profiler_dump(void)
+{
+	if (source == PROFILER_SOURCE_NONE)
+	{
+		return;
+	}
+
+	size_t counts[CPU_MAX];
+	size_t total = 0;
+	uint64_t dropped = 0;
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		counts[i] = __atomic_load_n(&profiler_cpus[i].count, __ATOMIC_ACQUIRE);
+		total += counts[i];
+		dropped += __atomic_load_n(&profiler_cpus[i].dropped, __ATOMIC_RELAXED);
+	}
+
+	serial_printf("Profile of %zu samples at %u Hz from the %s, %llu dropped:\n",
+		      total,
+		      (unsigned int) __atomic_load_n(&sample_hz, __ATOMIC_RELAXED),
+		      source == PROFILER_SOURCE_COUNTER ? "cycle counter" : "timer",
+		      (unsigned long long) dropped);
+	if (total == 0)
+	{
+		return;
+	}
+
+	// Sorted as a copy, with every address replaced by its function's.
+	size_t pages = (total * sizeof(struct profiler_sample) + PAGE_SIZE - 1) / PAGE_SIZE;
+	struct profiler_sample *sorted = virt_alloc_pages(pages, VIRT_MAP_READ | VIRT_MAP_WRITE);
+	if (sorted == NULL)
+	{
+		serial_write("\tNot enough memory to sort them\n");
+		return;
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		for (size_t j = 0; j < counts[i]; ++j)
+		{
+			const struct profiler_sample *sample = &profiler_cpus[i].samples[j];
+			struct profiler_sample *key = &sorted[n++];
+
+			key->depth = sample->depth;
+			for (size_t k = 0; k < sample->depth; ++k)
+			{
+				key->chain[k] = frame_function(sample->chain[k], k != 0);
+			}
+		}
+	}
+	sort_samples(sorted, total);
+
+	dump_hottest(sorted, total);
+
+	serial_write("Folded stacks:\n");
+	for (size_t i = 0; i < total;)
+	{
+		size_t run = 1;
+		while (i + run < total && sample_compare(&sorted[i], &sorted[i + run]) == 0)
+		{
+			++run;
+		}
+
+		dump_folded(&sorted[i], run);
+		serial_throttle(SERIAL_DUMP_BACKLOG_MAX);
+		i += run;
+	}
+	serial_write("End of folded stacks\n");
+
+	virt_free_pages(sorted, pages);
+}
+
+#endif
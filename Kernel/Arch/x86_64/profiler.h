@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// A sampling profiler, built in with `make PROFILER=1`, which also keeps
+// the frame pointers. While it runs, every CPU records where it was
+// interrupted and the return addresses of the frames below, into a
+// buffer of its own.
+//
+// The samples come from an NMI on overflow of a performance counter
+// counting unhalted cycles, when the CPU has architectural performance
+// monitoring, so code running with interrupts disabled shows up too.
+// Otherwise they come from the APIC timer interrupt, which can't see
+// that code, and which only comes as often as the tick without the
+// TSC-deadline timer.
+//
+// The dump names the functions, if Kickstart passed the kernel's symbols
+// along, see symbols.h. Tools/profile-symbolize.py resolves whatever
+// addresses are left against the kernel ELF.
+
+// The most addresses a sample keeps, the interrupted one included.
+#define PROFILER_CHAIN_MAX 8
+
+// The buffer of each CPU. Samples that find it full are dropped, until
+// the next start empties it.
+#define PROFILER_BUFFER_PAGES 256
+
+#define PROFILER_DEFAULT_HZ 1000
+
+#ifdef SAMPO_PROFILER
+
+// Picks where the samples come from and allocates the buffers. Must be
+// called after init_sched.
+bool init_profiler(void);
+
+// Throws away the samples so far, and has every CPU take `hz` samples a
+// second from then on. Needs the work queues, which get each CPU going.
+void profiler_start(uint32_t hz);
+void profiler_stop(void);
+
+// Prints how many samples each function took itself, and every call
+// chain sampled along with how often, in the folded format flame graph
+// tools take. May be called while the profiler runs.
+void profiler_dump(void);
+
+#endif
@@ -0,0 +1,274 @@
+#include "rcu.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "sched.h"
+#include "arch-utils.h"
+
+// The most callbacks a CPU runs in one go, so that a long list doesn't
+// keep interrupts disabled for too long. The rest wait for the next tick.
+#define RCU_BATCH_MAX 64
+
+struct rcu_list
+{
+	struct rcu_head *head;
+	struct rcu_head **tail;
+};
+
+// Only ever touched by its own CPU, with interrupts disabled.
+struct rcu_cpu
+{
+	// Queued since the last batch was handed to a grace period.
+	struct rcu_list next;
+
+	// Waiting for grace period `wait_gp` to complete.
+	struct rcu_list wait;
+	uint64_t wait_gp;
+
+	// Ready to be called.
+	struct rcu_list done;
+
+	// The last grace period this CPU reported a quiescent state for.
+	uint64_t quiescent_gp;
+
+	uint64_t callbacks_queued;
+	uint64_t callbacks_invoked;
+} __attribute__((aligned(64)));
+
+static struct rcu_cpu rcu_cpus[CPU_MAX];
+
+// Grace periods are numbered from 1. One is in progress when
+// `gp_started` is ahead of `gp_completed`.
+static uint64_t gp_started = 0;
+static uint64_t gp_completed = 0;
+
+// Whether another grace period is wanted as soon as the current one ends.
+static bool gp_requested = false;
+
+// The CPUs which have yet to pass through a quiescent state in the
+// current grace period, one bit per CPU index.
+static uint64_t cpus_pending = 0;
+static uint64_t cpus_online = 0;
+
+// Only taken when a grace period starts or ends, never by readers.
+LOCK_CLASS(rcu_gp_lock_class, "rcu grace period");
+static struct spinlock rcu_gp_lock = SPINLOCK_INIT(&rcu_gp_lock_class);
+
+static inline struct rcu_cpu *
+this_rcu_cpu(void)
+{
+	return &rcu_cpus[this_cpu()->index];
+}
+
+static void
+rcu_list_init(struct rcu_list *list)
+{
+	list->head = NULL;
+	list->tail = &list->head;
+}
+
+static void
+rcu_list_splice(struct rcu_list *to, struct rcu_list *from)
+{
+	if (from->head == NULL)
+	{
+		return;
+	}
+
+	*to->tail = from->head;
+	to->tail = from->tail;
+	rcu_list_init(from);
+}
+
+// The caller must hold rcu_gp_lock.
+static void
+rcu_start_gp_locked(void)
+{
+	// The mask must be in place before anyone sees the new grace period.
+	__atomic_store_n(&cpus_pending, cpus_online, __ATOMIC_RELAXED);
+	__atomic_store_n(&gp_started, gp_started + 1, __ATOMIC_RELEASE);
+}
+
+// Returns the grace period that, once completed, covers everything
+// queued before the call.
+static uint64_t
+rcu_request_gp(void)
+{
+	spin_lock(&rcu_gp_lock);
+
+	uint64_t target;
+	bool started = gp_started == gp_completed;
+	if (started)
+	{
+		rcu_start_gp_locked();
+		target = gp_started;
+	}
+	else
+	{
+		// The one in progress may have begun before our callbacks were
+		// queued, so only the one after it will do.
+		gp_requested = true;
+		target = gp_started + 1;
+	}
+
+	spin_unlock(&rcu_gp_lock);
+
+	if (started)
+	{
+		// Idle CPUs without a tick would only report once woken up.
+		sched_kick_tickless(cpus_online);
+	}
+
+	return target;
+}
+
+void
+init_rcu(void)
+{
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		struct rcu_cpu *rc = &rcu_cpus[i];
+		rcu_list_init(&rc->next);
+		rcu_list_init(&rc->wait);
+		rcu_list_init(&rc->done);
+	}
+
+	cpus_online = cpu_count == 64 ? UINT64_MAX : (UINT64_C(1) << cpu_count) - 1;
+}
+
+void
+call_rcu(struct rcu_head *head, rcu_callback func)
+{
+	head->next = NULL;
+	head->func = func;
+
+	uint64_t flags = local_irq_save();
+
+	struct rcu_cpu *rc = this_rcu_cpu();
+	*rc->next.tail = head;
+	rc->next.tail = &head->next;
+	++rc->callbacks_queued;
+
+	local_irq_restore(flags);
+}
+
+void
+rcu_note_quiescent_state(void)
+{
+	struct rcu_cpu *rc = this_rcu_cpu();
+
+	uint64_t started = __atomic_load_n(&gp_started, __ATOMIC_ACQUIRE);
+	if (started == rc->quiescent_gp || started == __atomic_load_n(&gp_completed, __ATOMIC_ACQUIRE))
+	{
+		return;
+	}
+
+	rc->quiescent_gp = started;
+
+	// A full barrier, which orders our earlier read-side critical
+	// sections before the report.
+	uint64_t bit = UINT64_C(1) << this_cpu()->index;
+	uint64_t pending = __atomic_fetch_and(&cpus_pending, ~bit, __ATOMIC_SEQ_CST);
+	if (pending != bit)
+	{
+		return;
+	}
+
+	// We were the last one.
+	spin_lock(&rcu_gp_lock);
+
+	__atomic_store_n(&gp_completed, started, __ATOMIC_RELEASE);
+	bool restarted = gp_requested;
+	if (restarted)
+	{
+		gp_requested = false;
+		rcu_start_gp_locked();
+	}
+
+	spin_unlock(&rcu_gp_lock);
+
+	if (restarted)
+	{
+		sched_kick_tickless(cpus_online);
+	}
+}
+
+bool
+rcu_needs_cpu(void)
+{
+	struct rcu_cpu *rc = this_rcu_cpu();
+
+	return rc->next.head != NULL || rc->wait.head != NULL || rc->done.head != NULL;
+}
+
+void
+rcu_process_callbacks(void)
+{
+	struct rcu_cpu *rc = this_rcu_cpu();
+	if (rc->next.tail == NULL)
+	{
+		// Not initialized yet.
+		return;
+	}
+
+	if (rc->wait.head != NULL && __atomic_load_n(&gp_completed, __ATOMIC_ACQUIRE) >= rc->wait_gp)
+	{
+		rcu_list_splice(&rc->done, &rc->wait);
+	}
+
+	if (rc->wait.head == NULL && rc->next.head != NULL)
+	{
+		rcu_list_splice(&rc->wait, &rc->next);
+		rc->wait_gp = rcu_request_gp();
+	}
+
+	for (size_t i = 0; i < RCU_BATCH_MAX && rc->done.head != NULL; ++i)
+	{
+		struct rcu_head *head = rc->done.head;
+		rc->done.head = head->next;
+		if (rc->done.head == NULL)
+		{
+			rc->done.tail = &rc->done.head;
+		}
+
+		head->func(head);
+		++rc->callbacks_invoked;
+	}
+}
+
+struct rcu_synchronize
+{
+	struct rcu_head head;
+	bool done;
+};
+
+static void
+rcu_synchronize_done(struct rcu_head *head)
+{
+	struct rcu_synchronize *sync = (struct rcu_synchronize *) head;
+	__atomic_store_n(&sync->done, true, __ATOMIC_RELEASE);
+}
+
+void
+synchronize_rcu(void)
+{
+	struct rcu_synchronize sync = { .done = false };
+	call_rcu(&sync.head, rcu_synchronize_done);
+
+	while (!__atomic_load_n(&sync.done, __ATOMIC_ACQUIRE))
+	{
+		thread_yield();
+	}
+}
+
+void
+rcu_get_stats(struct rcu_stats *stats)
+{
+	*stats = (struct rcu_stats) { 0 };
+	stats->grace_periods = __atomic_load_n(&gp_completed, __ATOMIC_RELAXED);
+
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		stats->callbacks_queued += __atomic_load_n(&rcu_cpus[i].callbacks_queued, __ATOMIC_RELAXED);
+		stats->callbacks_invoked += __atomic_load_n(&rcu_cpus[i].callbacks_invoked, __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "preempt.h"
+
+// Read-copy-update. Readers only disable preemption, so a CPU that
+// context switches, idles or takes a timer tick outside of a read-side
+// critical section has passed through a quiescent state. A grace period
+// ends once every CPU has done so after it began.
+
+struct rcu_head;
+typedef void (*rcu_callback)(struct rcu_head *head);
+
+// Embedded in the objects handed to call_rcu.
+struct rcu_head
+{
+	struct rcu_head *next;
+	rcu_callback func;
+};
+
+struct rcu_stats
+{
+	uint64_t grace_periods;
+	uint64_t callbacks_queued;
+	uint64_t callbacks_invoked;
+};
+
+// Read-side critical sections may nest, but must not block or yield.
+static inline void
+rcu_read_lock(void)
+{
+	preempt_disable();
+}
+
+static inline void
+rcu_read_unlock(void)
+{
+	preempt_enable();
+}
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Must be called after init_smp, and before init_sched.
+void init_rcu(void);
+
+// Calls `func(head)` on this CPU once a grace period has passed. Callbacks
+// run in batches from the scheduler, with interrupts disabled, so they
+// must be short and must not block.
+void call_rcu(struct rcu_head *head, rcu_callback func);
+
+// Waits, yielding, until every read-side critical section that was in
+// progress when called has finished.
+void synchronize_rcu(void);
+
+// Called by the scheduler, with interrupts disabled.
+void rcu_note_quiescent_state(void);
+void rcu_process_callbacks(void);
+
+// Whether the calling CPU has callbacks to see through, so it can't go
+// without the tick.
+bool rcu_needs_cpu(void);
+
+void rcu_get_stats(struct rcu_stats *stats);
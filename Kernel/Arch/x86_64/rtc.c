@@ -0,0 +1,164 @@
+#include "rtc.h"
+#include "arch-utils.h"
+
+#define CMOS_INDEX 0x70
+#define CMOS_DATA 0x71
+
+// Keeps NMIs masked while we're at it.
+#define CMOS_NMI_DISABLE 0x80
+
+#define RTC_SECONDS 0x00
+#define RTC_MINUTES 0x02
+#define RTC_HOURS 0x04
+#define RTC_DAY 0x07
+#define RTC_MONTH 0x08
+#define RTC_YEAR 0x09
+#define RTC_STATUS_A 0x0A
+#define RTC_STATUS_B 0x0B
+#define RTC_CENTURY 0x32 // <- Where nearly every PC keeps it, ACPI's FADT aside.
+
+#define RTC_STATUS_A_UPDATING 0x80
+#define RTC_STATUS_B_24_HOUR 0x02
+#define RTC_STATUS_B_BINARY 0x04
+#define RTC_HOURS_PM 0x80
+
+// Gives up after this many disagreeing reads.
+#define RTC_READ_TRIES 10
+
+struct rtc_time
+{
+	uint8_t seconds;
+	uint8_t minutes;
+	uint8_t hours;
+	uint8_t day;
+	uint8_t month;
+	uint8_t year;
+	uint8_t century;
+};
+
+static uint8_t
+cmos_read(uint8_t reg)
+{
+	outb(CMOS_INDEX, CMOS_NMI_DISABLE | reg);
+
+	return inb(CMOS_DATA);
+}
+
+static bool
+rtc_updating(void)
+{
+	return (cmos_read(RTC_STATUS_A) & RTC_STATUS_A_UPDATING) != 0;
+}
+
+static void
+rtc_read_raw(struct rtc_time *time)
+{
+	while (rtc_updating())
+	{
+		cpu_relax();
+	}
+
+	time->seconds = cmos_read(RTC_SECONDS);
+	time->minutes = cmos_read(RTC_MINUTES);
+	time->hours = cmos_read(RTC_HOURS);
+	time->day = cmos_read(RTC_DAY);
+	time->month = cmos_read(RTC_MONTH);
+	time->year = cmos_read(RTC_YEAR);
+	time->century = cmos_read(RTC_CENTURY);
+}
+
+static bool
+rtc_time_equal(const struct rtc_time *a, const struct rtc_time *b)
+{
+	return a->seconds == b->seconds
+		&& a->minutes == b->minutes
+		&& a->hours == b->hours
+		&& a->day == b->day
+		&& a->month == b->month
+		&& a->year == b->year
+		&& a->century == b->century;
+}
+
+static uint8_t
+bcd_to_binary(uint8_t bcd)
+{
+	return (bcd & 0x0F) + (bcd >> 4) * 10;
+}
+
+// Days from 1970-01-01 to the given date, for the proleptic Gregorian
+// calendar, counting years from March so that leap days come last.
+static int64_t
+days_from_civil(int64_t year, unsigned int month, unsigned int day)
+{
+	year -= month <= 2;
+	int64_t era = (year >= 0 ? year : year - 399) / 400;
+	unsigned int year_of_era = (unsigned int) (year - era * 400);
+	unsigned int day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	unsigned int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+	return era * 146097 + (int64_t) day_of_era - 719468;
+}
+
+bool
+rtc_read_seconds(uint64_t *seconds)
+{
+	// The registers may tick over between reads, so read them until
+	// two reads agree.
+	struct rtc_time time, again;
+	rtc_read_raw(&time);
+	unsigned int tries = 0;
+	for (;;)
+	{
+		rtc_read_raw(&again);
+		if (rtc_time_equal(&time, &again))
+		{
+			break;
+		}
+
+		if (++tries == RTC_READ_TRIES)
+		{
+			return false;
+		}
+
+		time = again;
+	}
+
+	uint8_t status = cmos_read(RTC_STATUS_B);
+	bool pm = (time.hours & RTC_HOURS_PM) != 0;
+	time.hours &= ~RTC_HOURS_PM;
+
+	if ((status & RTC_STATUS_B_BINARY) == 0)
+	{
+		time.seconds = bcd_to_binary(time.seconds);
+		time.minutes = bcd_to_binary(time.minutes);
+		time.hours = bcd_to_binary(time.hours);
+		time.day = bcd_to_binary(time.day);
+		time.month = bcd_to_binary(time.month);
+		time.year = bcd_to_binary(time.year);
+		time.century = bcd_to_binary(time.century);
+	}
+
+	if ((status & RTC_STATUS_B_24_HOUR) == 0)
+	{
+		// 12 AM is midnight, 12 PM noon.
+		time.hours %= 12;
+		if (pm)
+		{
+			time.hours += 12;
+		}
+	}
+
+	// Without a century register, assume it's the 21st.
+	unsigned int year = time.year + (time.century >= 19 && time.century <= 99 ? time.century * 100 : 2000);
+
+	if (time.month < 1 || time.month > 12 || time.day < 1 || time.day > 31
+	    || time.hours > 23 || time.minutes > 59 || time.seconds > 59 || year < 1970)
+	{
+		return false;
+	}
+
+	int64_t days = days_from_civil(year, time.month, time.day);
+	*seconds = (uint64_t) days * 86400 + time.hours * 3600 + time.minutes * 60 + time.seconds;
+
+	return true;
+}
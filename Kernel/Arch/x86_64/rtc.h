@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Reads the date and time off the CMOS real-time clock, as seconds since
+// 1970, assuming it keeps UTC. Only good to the second, and slow, so it
+// is only read once at boot to set the realtime clock.
+bool rtc_read_seconds(uint64_t *seconds);
@@ -0,0 +1,39 @@
+; Context switching between threads, see sched.c.
+
+section .text
+extern sched_thread_start:function
+
+; struct thread *sched_switch(struct thread *prev, struct thread *next)
+;
+; Saves the callee-saved registers of `prev` on its stack and its stack
+; pointer in its struct thread, whose first field it is, and resumes
+; `next` the same way. Returns `prev` to the code `next` resumes in.
+global sched_switch:function
+sched_switch:
+	push rbp
+	push rbx
+	push r12
+	push r13
+	push r14
+	push r15
+
+	mov [rdi], rsp
+	mov rsp, [rsi]
+
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rbx
+	pop rbp
+
+	mov rax, rdi
+	ret
+
+; Where new threads first return to from sched_switch, with the stack
+; pointer at the 16-byte aligned top of their stack.
+global sched_thread_trampoline:function
+sched_thread_trampoline:
+	mov rdi, rax
+	call sched_thread_start
+	ud2
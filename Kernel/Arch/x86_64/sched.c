@@ -0,0 +1,769 @@
+#include <SampoOS/Kernel/memman.h>
+#include "sched.h"
+#include "ws-deque.h"
+#include "percpu.h"
+#include "preempt.h"
+#include "rcu.h"
+#include "idle.h"
+#include "fpu.h"
+#include "timer.h"
+#include "apic.h"
+#include "interrupts.h"
+#include "memory-manager.h"
+#include "arch-utils.h"
+
+#define RUN_QUEUE_PAGES (THREAD_MAX * sizeof(void *) / PAGE_SIZE)
+
+// How many exited threads each CPU keeps around for reuse, stacks and all.
+#define THREAD_CACHE_MAX 32
+
+enum thread_state
+{
+	THREAD_RUNNABLE,
+	THREAD_RUNNING,
+	THREAD_SLEEPING, // <- Only workers sleep.
+	THREAD_DEAD,
+};
+
+// Kept at the top of the thread's own stack, right below its FPU save
+// area, see thread_alloc.
+struct thread
+{
+	uintptr_t rsp; // <- Must be first, sched-switch.asm saves it here.
+	enum thread_state state;
+	thread_entry entry;
+	void *arg;
+	struct thread *next_cached;
+
+	// Where interrupts and system calls from user mode start on the
+	// kernel stack, see syscall_enter_user. Only kept here while the
+	// thread is switched out, and in the TSS while it runs.
+	uintptr_t kernel_stack;
+
+	struct fpu fpu;
+} __attribute__((aligned(16)));
+
+struct sched_cpu
+{
+	struct ws_deque run_queue;
+
+	struct thread *current;
+	struct thread *idle;
+
+	// Never in the run queue, so never stolen.
+	struct thread *worker;
+	bool worker_woken;
+
+	// Stopped while idle, see sched_stop_tick.
+	bool tick_stopped;
+
+	// What the CPU was running before it entered the scheduler. On the
+	// bootstrap CPU that is the boot thread, on the others the idle thread.
+	struct thread boot_context;
+
+	struct thread *thread_cache;
+	size_t thread_cache_len;
+
+	uint64_t steal_seed;
+
+	uint64_t threads_spawned;
+	uint64_t context_switches;
+	uint64_t preemptions;
+	uint64_t steals;
+} __attribute__((aligned(64)));
+
+static struct sched_cpu sched_cpus[CPU_MAX];
+
+// Above the stack of every thread, sized by init_sched.
+static size_t thread_fpu_pages;
+
+static uint32_t timer_ticks_per_slice;
+static size_t active_cpus = 1;
+static size_t thread_count = 0;
+static bool sched_ready = false;
+
+// The CPUs idling without a tick, one bit per CPU index. Nothing but a
+// kick gets them looking for work.
+static uint64_t tickless_cpus = 0;
+
+// Defined in sched-switch.asm.
+struct thread *sched_switch(struct thread *prev, struct thread *next);
+extern const uint8_t sched_thread_trampoline[];
+
+static inline struct sched_cpu *
+this_sched_cpu(void)
+{
+	return &sched_cpus[this_cpu()->index];
+}
+
+static uintptr_t
+thread_stack_bottom(struct thread *thread)
+{
+	return (uintptr_t) thread + sizeof(*thread) - THREAD_STACK_PAGES * PAGE_SIZE;
+}
+
+static struct thread *
+thread_alloc(struct sched_cpu *sc)
+{
+	struct thread *thread = sc->thread_cache;
+	if (thread != NULL)
+	{
+		sc->thread_cache = thread->next_cached;
+		--sc->thread_cache_len;
+
+		return thread;
+	}
+
+	uint8_t *stack = virt_alloc_pages(THREAD_STACK_PAGES + thread_fpu_pages, VIRT_MAP_READ | VIRT_MAP_WRITE);
+	if (stack == NULL)
+	{
+		return NULL;
+	}
+
+	return (struct thread *)(stack + THREAD_STACK_PAGES * PAGE_SIZE - sizeof(*thread));
+}
+
+static void
+thread_free(struct sched_cpu *sc, struct thread *thread)
+{
+	if (sc->thread_cache_len < THREAD_CACHE_MAX)
+	{
+		thread->next_cached = sc->thread_cache;
+		sc->thread_cache = thread;
+		++sc->thread_cache_len;
+
+		return;
+	}
+
+	virt_free_pages((void *) thread_stack_bottom(thread), THREAD_STACK_PAGES + thread_fpu_pages);
+}
+
+// Sets up the stack of `thread` so that switching to it starts it in
+// sched_thread_start.
+static void
+thread_prepare_stack(struct thread *thread, thread_entry entry, void *arg)
+{
+	thread->entry = entry;
+	thread->arg = arg;
+	thread->state = THREAD_RUNNABLE;
+
+	// The registers sched_switch pops, and the address it returns to.
+	uint64_t *frame = (uint64_t *) thread - 7;
+	for (size_t i = 0; i < 6; ++i)
+	{
+		frame[i] = 0;
+	}
+	frame[6] = (uintptr_t) sched_thread_trampoline;
+
+	thread->rsp = (uintptr_t) frame;
+	thread->kernel_stack = (uintptr_t) thread;
+
+	// Its save area starts on the page after the stack.
+	fpu_thread_init(&thread->fpu, (uint8_t *) thread + sizeof(*thread));
+}
+
+static uint64_t
+xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+static struct thread *
+sched_steal(struct sched_cpu *sc)
+{
+	size_t active = __atomic_load_n(&active_cpus, __ATOMIC_RELAXED);
+	size_t self = sc - sched_cpus;
+	if (self >= active || active < 2)
+	{
+		return NULL;
+	}
+
+	// Start from a random victim, so the thieves don't all go for the same one.
+	size_t start = xorshift64(&sc->steal_seed) % active;
+	for (size_t i = 0; i < active; ++i)
+	{
+		size_t victim = (start + i) % active;
+		if (victim == self)
+		{
+			continue;
+		}
+
+		struct ws_deque *run_queue = &sched_cpus[victim].run_queue;
+		while (!ws_deque_looks_empty(run_queue))
+		{
+			void *thread;
+			enum ws_deque_result result = ws_deque_steal(run_queue, &thread);
+			if (result == WS_DEQUE_SUCCESS)
+			{
+				++sc->steals;
+				return thread;
+			}
+
+			if (result == WS_DEQUE_EMPTY)
+			{
+				break;
+			}
+
+			cpu_relax();
+		}
+	}
+
+	return NULL;
+}
+
+// Whether the worker of `sc` should run next, other than right now.
+static bool
+sched_worker_ready(struct sched_cpu *sc)
+{
+	struct thread *worker = sc->worker;
+	if (worker == NULL)
+	{
+		return false;
+	}
+
+	if (worker->state == THREAD_RUNNABLE)
+	{
+		return true;
+	}
+
+	return worker->state == THREAD_SLEEPING &&
+	       __atomic_exchange_n(&sc->worker_woken, false, __ATOMIC_ACQUIRE);
+}
+
+static struct thread *
+sched_pick_next(struct sched_cpu *sc, struct thread *prev)
+{
+	// A worker which has just run lets the others go first.
+	if (prev != sc->worker && sched_worker_ready(sc))
+	{
+		return sc->worker;
+	}
+
+	// The owner takes from the top as well, so its own threads run
+	// round-robin. Taking from the bottom would keep running whichever
+	// thread was preempted last.
+	for (;;)
+	{
+		void *thread;
+		enum ws_deque_result result = ws_deque_steal(&sc->run_queue, &thread);
+		if (result == WS_DEQUE_SUCCESS)
+		{
+			return thread;
+		}
+
+		if (result == WS_DEQUE_EMPTY)
+		{
+			break;
+		}
+	}
+
+	struct thread *thread = sched_steal(sc);
+	if (thread == NULL && prev == sc->worker && sched_worker_ready(sc))
+	{
+		// Woken up again while going to sleep.
+		return prev;
+	}
+
+	return thread;
+}
+
+// Called in the context of the thread that was just switched to, once
+// `prev` is no longer running on its stack, so only now can it be made
+// available to other CPUs, or reused.
+static void
+sched_finish_switch(struct thread *prev)
+{
+	struct sched_cpu *sc = this_sched_cpu();
+	if (prev == sc->idle)
+	{
+		return;
+	}
+
+	if (prev == sc->worker)
+	{
+		// Kept out of the run queue, see sched_pick_next.
+		if (prev->state == THREAD_RUNNING)
+		{
+			prev->state = THREAD_RUNNABLE;
+		}
+
+		return;
+	}
+
+	switch (prev->state)
+	{
+	case THREAD_RUNNING:
+		prev->state = THREAD_RUNNABLE;
+		ws_deque_push(&sc->run_queue, prev);
+		break;
+	case THREAD_DEAD:
+		thread_free(sc, prev);
+		__atomic_fetch_sub(&thread_count, 1, __ATOMIC_RELAXED);
+		break;
+	case THREAD_RUNNABLE:
+	case THREAD_SLEEPING:
+		break;
+	}
+}
+
+static void
+sched_kick(size_t cpu_index)
+{
+	// An idle CPU may only need a store, see idle_wake.
+	if (!idle_wake(cpu_index))
+	{
+		apic_send_ipi(cpus[cpu_index].apic_id, INTERRUPT_VECTOR_SCHED_KICK);
+	}
+}
+
+// Gets one of the tickless CPUs to come and steal, if there are any.
+static void
+sched_kick_one_tickless(struct sched_cpu *sc)
+{
+	size_t active = __atomic_load_n(&active_cpus, __ATOMIC_RELAXED);
+	uint64_t mask = active == 64 ? UINT64_MAX : (UINT64_C(1) << active) - 1;
+	mask &= ~(UINT64_C(1) << (sc - sched_cpus));
+
+	uint64_t idle = __atomic_load_n(&tickless_cpus, __ATOMIC_RELAXED) & mask;
+	if (idle != 0)
+	{
+		sched_kick(__builtin_ctzll(idle));
+	}
+}
+
+// Only with the TSC-deadline timer, which can still wake us up for the
+// timers. Called by the idle thread, with interrupts disabled.
+static void
+sched_stop_tick(struct sched_cpu *sc)
+{
+	if (sc->tick_stopped || !apic_timer_is_tsc_deadline() || rcu_needs_cpu())
+	{
+		return;
+	}
+
+	sc->tick_stopped = true;
+	apic_timer_stop_tick();
+	__atomic_fetch_or(&tickless_cpus, UINT64_C(1) << (sc - sched_cpus), __ATOMIC_SEQ_CST);
+
+	// Grace periods which start from now on kick us, see rcu_request_gp.
+	// This covers one which started in the meantime.
+	rcu_note_quiescent_state();
+}
+
+static void
+sched_restart_tick(struct sched_cpu *sc)
+{
+	sc->tick_stopped = false;
+	__atomic_fetch_and(&tickless_cpus, ~(UINT64_C(1) << (sc - sched_cpus)), __ATOMIC_RELAXED);
+	apic_timer_restart_tick();
+}
+
+// Switches to the next runnable thread, if there is one or if the current
+// one can't continue. Interrupts must be disabled.
+static void
+schedule(bool preempting)
+{
+	struct sched_cpu *sc = this_sched_cpu();
+	struct thread *prev = sc->current;
+
+	this_cpu()->need_resched = false;
+
+	// Nothing can be in a read-side critical section when we get here.
+	rcu_note_quiescent_state();
+	rcu_process_callbacks();
+
+	struct thread *next = sched_pick_next(sc, prev);
+	if (next == prev)
+	{
+		prev->state = THREAD_RUNNING;
+		return;
+	}
+
+	if (next == NULL)
+	{
+		if (prev->state == THREAD_RUNNING)
+		{
+			return;
+		}
+
+		next = sc->idle;
+	}
+
+	if (sc->tick_stopped && next != sc->idle)
+	{
+		sched_restart_tick(sc);
+	}
+
+	next->state = THREAD_RUNNING;
+	sc->current = next;
+	++sc->context_switches;
+	if (preempting && prev != sc->idle)
+	{
+		++sc->preemptions;
+	}
+
+	struct cpu *cpu = this_cpu();
+	prev->kernel_stack = cpu->tss.rsp[0];
+	cpu->tss.rsp[0] = next->kernel_stack;
+	fpu_switch(&prev->fpu, &next->fpu);
+
+	// We may well come back on another CPU.
+	prev = sched_switch(prev, next);
+	sched_finish_switch(prev);
+}
+
+// Where new threads start, see thread_prepare_stack.
+__attribute__((noreturn)) void
+sched_thread_start(struct thread *prev)
+{
+	sched_finish_switch(prev);
+
+	struct thread *thread = this_sched_cpu()->current;
+	local_irq_enable();
+
+	thread->entry(thread->arg);
+	thread_exit();
+}
+
+__attribute__((noreturn)) static void
+sched_idle_loop(void)
+{
+	for (;;)
+	{
+		local_irq_disable();
+		schedule(false);
+
+		// Nothing to run, look again once woken up or on the next tick,
+		// if there is going to be one.
+		sched_stop_tick(this_sched_cpu());
+		idle_enter();
+	}
+}
+
+static void
+sched_idle_entry(void *arg)
+{
+	(void) arg;
+	sched_idle_loop();
+}
+
+// Sent by sched_wake_worker to the worker's CPU.
+static bool
+sched_kick_interrupt(struct interrupt_frame *frame)
+{
+	(void) frame;
+
+	apic_eoi();
+	idle_note_wakeup();
+
+	// See sched_interrupt_exit.
+	this_cpu()->need_resched = true;
+
+	return true;
+}
+
+static bool
+sched_timer_interrupt(struct interrupt_frame *frame)
+{
+	(void) frame;
+
+	bool tick = apic_timer_rearm();
+	apic_eoi();
+
+	timer_interrupt();
+	if (!tick)
+	{
+		// Only for the timers.
+		return true;
+	}
+
+	// Threads are waiting here, so don't leave it to the others' ticks.
+	struct sched_cpu *sc = this_sched_cpu();
+	if (!ws_deque_looks_empty(&sc->run_queue))
+	{
+		sched_kick_one_tickless(sc);
+	}
+
+	// See sched_interrupt_exit.
+	this_cpu()->need_resched = true;
+
+	return true;
+}
+
+void
+sched_interrupt_exit(void)
+{
+	// Otherwise whoever disabled preemption reschedules once they're done.
+	struct cpu *cpu = this_cpu();
+	if (cpu->need_resched && cpu->preempt_count == 0)
+	{
+		schedule(true);
+	}
+}
+
+void
+sched_preempt_pending(void)
+{
+	// If interrupts are disabled, the reschedule waits for the next tick instead.
+	uint64_t flags = local_irq_save();
+	if ((flags & RFLAGS_INTERRUPT_ENABLE) != 0 && this_cpu()->preempt_count == 0)
+	{
+		schedule(true);
+	}
+	local_irq_restore(flags);
+}
+
+bool
+init_sched(void)
+{
+	thread_fpu_pages = (fpu_state_size() + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		struct sched_cpu *sc = &sched_cpus[i];
+
+		void *fpu_state = virt_alloc_pages(thread_fpu_pages, VIRT_MAP_READ | VIRT_MAP_WRITE);
+		if (fpu_state == NULL)
+		{
+			return false;
+		}
+
+		void **run_queue_items = virt_alloc_pages(RUN_QUEUE_PAGES, VIRT_MAP_READ | VIRT_MAP_WRITE);
+		if (run_queue_items == NULL)
+		{
+			return false;
+		}
+
+		ws_deque_init(&sc->run_queue, run_queue_items, THREAD_MAX);
+		sc->steal_seed = 0x9E3779B97F4A7C15 * (i + 1);
+		sc->boot_context.state = THREAD_RUNNING;
+		sc->current = &sc->boot_context;
+		sc->idle = &sc->boot_context;
+		fpu_thread_init(&sc->boot_context.fpu, fpu_state);
+		cpus[i].fpu_current = &sc->boot_context.fpu;
+	}
+
+	// The bootstrap CPU keeps running the boot thread, so it needs an idle
+	// thread of its own.
+	struct sched_cpu *sc = this_sched_cpu();
+	struct thread *idle = thread_alloc(sc);
+	if (idle == NULL)
+	{
+		return false;
+	}
+
+	thread_prepare_stack(idle, sched_idle_entry, NULL);
+	sc->idle = idle;
+	thread_count = 1;
+
+	timer_ticks_per_slice = apic_timer_calibrate() * SCHED_TIMESLICE_MS;
+	interrupt_register_handler(INTERRUPT_VECTOR_APIC_TIMER, sched_timer_interrupt);
+	interrupt_register_handler(INTERRUPT_VECTOR_SCHED_KICK, sched_kick_interrupt);
+
+	active_cpus = cpu_count;
+	__atomic_store_n(&sched_ready, true, __ATOMIC_RELEASE);
+
+	apic_timer_start_periodic(INTERRUPT_VECTOR_APIC_TIMER, timer_ticks_per_slice);
+	local_irq_enable();
+
+	return true;
+}
+
+void
+sched_ap_main(void)
+{
+	while (!__atomic_load_n(&sched_ready, __ATOMIC_ACQUIRE))
+	{
+		cpu_relax();
+	}
+
+	apic_timer_start_periodic(INTERRUPT_VECTOR_APIC_TIMER, timer_ticks_per_slice);
+	sched_idle_loop();
+}
+
+bool
+thread_spawn(thread_entry entry, void *arg)
+{
+	if (__atomic_fetch_add(&thread_count, 1, __ATOMIC_RELAXED) >= THREAD_MAX)
+	{
+		__atomic_fetch_sub(&thread_count, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	uint64_t flags = local_irq_save();
+	struct sched_cpu *sc = this_sched_cpu();
+
+	struct thread *thread = thread_alloc(sc);
+	if (thread == NULL)
+	{
+		local_irq_restore(flags);
+		__atomic_fetch_sub(&thread_count, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	thread_prepare_stack(thread, entry, arg);
+	ws_deque_push(&sc->run_queue, thread);
+	++sc->threads_spawned;
+	sched_kick_one_tickless(sc);
+
+	local_irq_restore(flags);
+
+	return true;
+}
+
+bool
+sched_start_worker(size_t cpu_index, thread_entry entry, void *arg)
+{
+	if (__atomic_fetch_add(&thread_count, 1, __ATOMIC_RELAXED) >= THREAD_MAX)
+	{
+		__atomic_fetch_sub(&thread_count, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	uint64_t flags = local_irq_save();
+	struct sched_cpu *sc = this_sched_cpu();
+
+	struct thread *worker = thread_alloc(sc);
+	if (worker == NULL)
+	{
+		local_irq_restore(flags);
+		__atomic_fetch_sub(&thread_count, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	thread_prepare_stack(worker, entry, arg);
+	++sc->threads_spawned;
+
+	local_irq_restore(flags);
+
+	// It starts out woken, so that it gets to run its entry point.
+	struct sched_cpu *target = &sched_cpus[cpu_index];
+	worker->state = THREAD_SLEEPING;
+	__atomic_store_n(&target->worker_woken, true, __ATOMIC_RELAXED);
+	__atomic_store_n(&target->worker, worker, __ATOMIC_RELEASE);
+
+	sched_wake_worker(cpu_index);
+
+	return true;
+}
+
+void
+sched_worker_sleep(void)
+{
+	uint64_t flags = local_irq_save();
+
+	this_sched_cpu()->current->state = THREAD_SLEEPING;
+	schedule(false);
+
+	local_irq_restore(flags);
+}
+
+void
+sched_wake_worker(size_t cpu_index)
+{
+	struct sched_cpu *sc = &sched_cpus[cpu_index];
+	if (__atomic_exchange_n(&sc->worker_woken, true, __ATOMIC_SEQ_CST))
+	{
+		return;
+	}
+
+	// If it isn't asleep yet, it finds worker_woken set on its way there.
+	struct thread *worker = __atomic_load_n(&sc->worker, __ATOMIC_ACQUIRE);
+	if (worker == NULL || __atomic_load_n(&worker->state, __ATOMIC_RELAXED) != THREAD_SLEEPING)
+	{
+		return;
+	}
+
+	sched_kick(cpu_index);
+}
+
+void
+sched_kick_tickless(uint64_t cpu_mask)
+{
+	// Pairs with sched_stop_tick: either we see the CPU tickless here, or
+	// it sees whatever the caller did before calling us.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	uint64_t self = UINT64_C(1) << this_cpu()->index;
+	uint64_t targets = __atomic_load_n(&tickless_cpus, __ATOMIC_RELAXED) & cpu_mask & ~self;
+	for (; targets != 0; targets &= targets - 1)
+	{
+		sched_kick(__builtin_ctzll(targets));
+	}
+}
+
+void
+thread_yield(void)
+{
+	uint64_t flags = local_irq_save();
+	schedule(false);
+	local_irq_restore(flags);
+}
+
+void
+thread_exit(void)
+{
+	local_irq_disable();
+
+	this_sched_cpu()->current->state = THREAD_DEAD;
+	schedule(false);
+
+	__builtin_unreachable();
+}
+
+void
+sched_set_active_cpus(size_t count)
+{
+	if (count < 1)
+	{
+		count = 1;
+	}
+	else if (count > cpu_count)
+	{
+		count = cpu_count;
+	}
+
+	__atomic_store_n(&active_cpus, count, __ATOMIC_RELAXED);
+}
+
+void
+sched_get_stats(struct sched_stats *stats)
+{
+	*stats = (struct sched_stats) { 0 };
+
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		struct sched_cpu *sc = &sched_cpus[i];
+
+		stats->threads_spawned += __atomic_load_n(&sc->threads_spawned, __ATOMIC_RELAXED);
+		stats->context_switches += __atomic_load_n(&sc->context_switches, __ATOMIC_RELAXED);
+		stats->preemptions += __atomic_load_n(&sc->preemptions, __ATOMIC_RELAXED);
+		stats->steals += __atomic_load_n(&sc->steals, __ATOMIC_RELAXED);
+	}
+}
+
+void
+sched_current_stack(uintptr_t *bottom, uintptr_t *top)
+{
+	struct sched_cpu *sc = this_sched_cpu();
+	struct thread *current = __atomic_load_n(&sc->current, __ATOMIC_RELAXED);
+
+	// Before init_sched, and after it for the boot context, that is the
+	// stack the CPU came up on.
+	if (current == NULL || current == &sc->boot_context)
+	{
+		struct cpu *cpu = this_cpu();
+		*bottom = cpu->boot_stack_bottom;
+		*top = cpu->boot_stack_top;
+		return;
+	}
+
+	*bottom = thread_stack_bottom(current);
+	*top = (uintptr_t) current;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// The most threads that can exist at once, the boot thread included.
+// Also the capacity of every run queue, so pushing to one never fails.
+#define THREAD_MAX 4096
+
+#define THREAD_STACK_PAGES 4
+
+#define SCHED_TIMESLICE_MS 5
+
+typedef void (*thread_entry)(void *arg);
+
+struct sched_stats
+{
+	uint64_t threads_spawned;
+	uint64_t context_switches;
+	uint64_t preemptions;
+	uint64_t steals;
+};
+
+// Turns the boot context into the first thread, and starts preempting
+// on the bootstrap CPU. Must be called after init_smp.
+bool init_sched(void);
+
+// Where the application processors go once they're up. They wait for
+// init_sched, and then idle and steal work from the other CPUs.
+__attribute__((noreturn)) void sched_ap_main(void);
+
+// Makes a new thread running `entry(arg)` runnable on the calling CPU.
+// The thread exits when `entry` returns.
+bool thread_spawn(thread_entry entry, void *arg);
+
+void thread_yield(void);
+
+// Each CPU can have a worker: a thread which never leaves that CPU, and
+// which sleeps until it is woken up. When woken, it runs ahead of the
+// threads in the run queue, though it takes turns with them if it
+// keeps running.
+bool sched_start_worker(size_t cpu_index, thread_entry entry, void *arg);
+
+// Called by a worker once it is out of work. Returns right away if it
+// was woken up in the meantime.
+void sched_worker_sleep(void);
+
+// Wakes the worker of the given CPU. Safe from interrupt handlers.
+void sched_wake_worker(size_t cpu_index);
+
+// Idle CPUs go without the tick when the timer allows it. This makes
+// those among `cpu_mask` go through the scheduler once, for anything
+// that needs them to, like RCU grace periods.
+void sched_kick_tickless(uint64_t cpu_mask);
+
+// Called by interrupt_dispatch, with interrupts still disabled, once an
+// interrupt has been handled and its end traced. The handlers only ask
+// for a reschedule, so that a thread switch never lands in the middle of
+// an interrupt, and this does it.
+void sched_interrupt_exit(void);
+
+// Not for the boot thread, which has no stack of its own to give back.
+__attribute__((noreturn)) void thread_exit(void);
+
+// Limits work stealing to the first `count` CPUs, for measuring how
+// throughput scales. The other CPUs finish what they have and then idle.
+void sched_set_active_cpus(size_t count);
+
+void sched_get_stats(struct sched_stats *stats);
+
+// The bounds of the stack the calling CPU's current thread runs on, for
+// walking it from an interrupt. Whatever was interrupted may be in the
+// middle of switching threads, in which case the stack pointer isn't
+// within them.
+void sched_current_stack(uintptr_t *bottom, uintptr_t *top);
@@ -0,0 +1,437 @@
+#include <string.h>
+#include "serial.h"
+#include "format.h"
+#include "interrupts.h"
+#include "ioapic.h"
+#include "apic.h"
+#include "percpu.h"
+#include "percpu-counter.h"
+#include "arch-utils.h"
+#include <stdarg.h>
+
+#define COM1 0x3f8
+#define COM1_IRQ 4
+
+#define UART_DATA 0
+#define UART_INTERRUPT_ENABLE 1
+#define UART_INTERRUPT_ID 2
+#define UART_LINE_STATUS 5
+#define UART_MODEM_STATUS 6
+
+#define UART_IER_RX_DATA 0x01
+#define UART_IER_THR_EMPTY 0x02
+#define UART_IER_LINE_STATUS 0x04
+
+#define UART_IIR_NONE_PENDING 0x01
+#define UART_IIR_ID_MASK 0x0E
+#define UART_IIR_MODEM_STATUS 0x00
+#define UART_IIR_THR_EMPTY 0x02
+#define UART_IIR_RX_DATA 0x04
+#define UART_IIR_LINE_STATUS 0x06
+#define UART_IIR_RX_TIMEOUT 0x0C
+
+#define UART_LSR_DATA_READY 0x01
+#define UART_LSR_THR_EMPTY 0x20
+
+// The transmit FIFO is empty whenever THRE says so, and this deep.
+#define UART_FIFO_SIZE 16
+
+#define TX_RING_SIZE 16384
+#define TX_RING_MASK (TX_RING_SIZE - 1)
+
+_Static_assert(SERIAL_DUMP_BACKLOG_MAX < TX_RING_SIZE, "Dumps must be throttled before the ring fills up");
+
+#define RX_RING_SIZE 1024
+#define RX_RING_MASK (RX_RING_SIZE - 1)
+
+// Each transmit slot holds a byte under the tag of the position it was
+// written for, so the sender can tell it has been filled in without
+// anyone telling it so.
+#define TX_SLOT_TAG_SHIFT 8
+#define TX_SLOT_TAG_MASK 0xFFFFFF
+
+// How much of its output serial_printf collects before queueing it.
+#define PRINTF_BUFFER_SIZE 128
+
+// Writers reserve a range of the ring by moving the head on, and fill
+// it in. Whoever holds `tx_busy`, the interrupt handler or a writer that
+// found the UART idle, moves the tail on as the FIFO takes the bytes.
+static uint32_t tx_slots[TX_RING_SIZE];
+static uint64_t tx_head;
+static uint64_t tx_tail;
+static bool tx_busy;
+
+// Filled by the interrupt handler, emptied by serial_read.
+static char rx_ring[RX_RING_SIZE];
+static uint64_t rx_head;
+static uint64_t rx_tail;
+
+// Until then, output goes straight to the UART.
+static bool interrupt_driven;
+
+static struct percpu_counter tx_queued = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter tx_dropped = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static uint64_t tx_sent;
+static uint64_t rx_received;
+static uint64_t rx_dropped;
+static uint64_t serial_interrupts;
+
+bool
+serial_init(void)
+{
+	outb(COM1 + 1, 0x00); // Disable interrupts
+	outb(COM1 + 3, 0x80); // Enable DLAB to set baud rate divisor
+	outb(COM1 + 0, 0x03); // Set low byte of divisor to 3.
+	outb(COM1 + 1, 0x00); // Set hight byte of divisor to 0. I.e. divisor is 3.
+	outb(COM1 + 3, 0x03); // Set mode: 8-bits, no parity and one stop-bit
+	outb(COM1 + 2, 0xC7); // Enable FIFO, and clear them. Set 14-byte threshold.
+	outb(COM1 + 4, 0x0B); // Enable IRQs, set RTS/DST
+	outb(COM1 + 4, 0x1E); // Set in loopback mode for self-test.
+	outb(COM1 + 0, 0xAE); // Test the serial by sending and then receiving.
+
+	if (inb(COM1 + 0) != 0xAE)
+	{
+		// Self-test failed.
+		return false;
+	}
+
+	// Self-test successful. Set normal operation mode, so no
+	// loopback, but with IRQs and OUT#1 and OUT#2 -bits enabled.
+	outb(COM1 + 4, 0x0F);
+	return true;
+}
+
+static bool
+is_transmit_empty(void)
+{
+	return (inb(COM1 + UART_LINE_STATUS) & UART_LSR_THR_EMPTY) != 0;
+}
+
+static void
+serial_putchar_polled(char a)
+{
+	while (!is_transmit_empty());
+
+	outb(COM1, a);
+}
+
+static uint32_t
+tx_slot_tag(uint64_t position)
+{
+	// Off by one, so that the zeroed ring holds nothing.
+	return (position + 1) & TX_SLOT_TAG_MASK;
+}
+
+static bool
+tx_slot_filled(uint64_t position, uint32_t *slot)
+{
+	*slot = __atomic_load_n(&tx_slots[position & TX_RING_MASK], __ATOMIC_ACQUIRE);
+
+	return (*slot >> TX_SLOT_TAG_SHIFT) == tx_slot_tag(position);
+}
+
+// The caller must hold `tx_busy`, and the FIFO must be empty.
+static void
+serial_fill_fifo(void)
+{
+	uint64_t tail = __atomic_load_n(&tx_tail, __ATOMIC_RELAXED);
+	size_t sent = 0;
+	uint32_t slot;
+	while (sent < UART_FIFO_SIZE && tx_slot_filled(tail + sent, &slot))
+	{
+		outb(COM1 + UART_DATA, slot & 0xFF);
+		++sent;
+	}
+
+	// Frees the slots for the writers.
+	__atomic_store_n(&tx_tail, tail + sent, __ATOMIC_RELEASE);
+	tx_sent += sent;
+}
+
+// Sends what it can without waiting for the UART. Anything left over goes
+// out from the interrupt once the FIFO has drained. Writers give up if
+// someone else is sending, as they check for more once they're done, but
+// the interrupt handler waits for them, so as not to lose track of the
+// FIFO having emptied. Interrupts are held off meanwhile, so it can.
+static void
+serial_start_tx(bool from_interrupt)
+{
+	uint64_t flags = local_irq_save();
+
+	uint32_t slot;
+	while (tx_slot_filled(__atomic_load_n(&tx_tail, __ATOMIC_ACQUIRE), &slot))
+	{
+		if (__atomic_exchange_n(&tx_busy, true, __ATOMIC_SEQ_CST))
+		{
+			if (!from_interrupt)
+			{
+				break;
+			}
+
+			cpu_relax();
+			continue;
+		}
+
+		bool fifo_empty = is_transmit_empty();
+		if (fifo_empty)
+		{
+			serial_fill_fifo();
+		}
+
+		__atomic_store_n(&tx_busy, false, __ATOMIC_SEQ_CST);
+
+		if (!fifo_empty)
+		{
+			// The interrupt comes once it is.
+			break;
+		}
+	}
+
+	local_irq_restore(flags);
+}
+
+// Never waits: what doesn't fit in the ring is dropped.
+static void
+serial_queue(const char *bytes, size_t len)
+{
+	if (!__atomic_load_n(&interrupt_driven, __ATOMIC_ACQUIRE))
+	{
+		for (size_t i = 0; i < len; ++i)
+		{
+			serial_putchar_polled(bytes[i]);
+		}
+
+		return;
+	}
+
+	uint64_t head = __atomic_load_n(&tx_head, __ATOMIC_RELAXED);
+	size_t count;
+	do
+	{
+		// The tail only moves on, so the room only grows meanwhile.
+		uint64_t tail = __atomic_load_n(&tx_tail, __ATOMIC_ACQUIRE);
+		size_t room = TX_RING_SIZE - (head - tail);
+		count = len < room ? len : room;
+		if (count == 0)
+		{
+			break;
+		}
+	}
+	while (!__atomic_compare_exchange_n(&tx_head, &head, head + count, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		uint32_t slot = (tx_slot_tag(head + i) << TX_SLOT_TAG_SHIFT) | (uint8_t) bytes[i];
+		__atomic_store_n(&tx_slots[(head + i) & TX_RING_MASK], slot, __ATOMIC_RELEASE);
+	}
+
+	percpu_counter_add(&tx_queued, count);
+	if (count < len)
+	{
+		percpu_counter_add(&tx_dropped, len - count);
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	serial_start_tx(false);
+}
+
+static void
+serial_receive(void)
+{
+	while ((inb(COM1 + UART_LINE_STATUS) & UART_LSR_DATA_READY) != 0)
+	{
+		char c = inb(COM1 + UART_DATA);
+		uint64_t head = rx_head;
+		if (head - __atomic_load_n(&rx_tail, __ATOMIC_ACQUIRE) == RX_RING_SIZE)
+		{
+			++rx_dropped;
+			continue;
+		}
+
+		rx_ring[head & RX_RING_MASK] = c;
+		__atomic_store_n(&rx_head, head + 1, __ATOMIC_RELEASE);
+		++rx_received;
+	}
+}
+
+static bool
+serial_interrupt(struct interrupt_frame *frame)
+{
+	(void) frame;
+
+	++serial_interrupts;
+
+	// The IRQ is edge triggered, so leave nothing pending, or it never
+	// comes again.
+	for (;;)
+	{
+		uint8_t id = inb(COM1 + UART_INTERRUPT_ID);
+		if ((id & UART_IIR_NONE_PENDING) != 0)
+		{
+			break;
+		}
+
+		switch (id & UART_IIR_ID_MASK)
+		{
+		case UART_IIR_RX_DATA:
+		case UART_IIR_RX_TIMEOUT:
+			serial_receive();
+			break;
+		case UART_IIR_LINE_STATUS:
+			inb(COM1 + UART_LINE_STATUS);
+			break;
+		case UART_IIR_MODEM_STATUS:
+			inb(COM1 + UART_MODEM_STATUS);
+			break;
+		case UART_IIR_THR_EMPTY:
+			// Reading the ID acknowledged it, the refill is below.
+			break;
+		}
+	}
+
+	serial_start_tx(true);
+	apic_eoi();
+
+	return true;
+}
+
+bool
+serial_enable_interrupts(void)
+{
+	struct cpu *cpu = this_cpu();
+
+	uint8_t vector;
+	if (!interrupt_alloc_vector(cpu->index, serial_interrupt, &vector))
+	{
+		return false;
+	}
+
+	if (!ioapic_route_isa_irq(COM1_IRQ, vector, cpu->apic_id))
+	{
+		interrupt_free_vector(cpu->index, vector);
+		return false;
+	}
+
+	outb(COM1 + UART_INTERRUPT_ENABLE, UART_IER_RX_DATA | UART_IER_THR_EMPTY | UART_IER_LINE_STATUS);
+	__atomic_store_n(&interrupt_driven, true, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+void
+serial_putchar(char a)
+{
+	serial_queue(&a, 1);
+}
+
+void
+serial_write(const char *str)
+{
+	serial_queue(str, strlen(str));
+}
+
+void
+serial_write_bytes(const char *bytes, size_t len)
+{
+	serial_queue(bytes, len);
+}
+
+size_t
+serial_read(char *buffer, size_t len)
+{
+	uint64_t tail = rx_tail;
+	uint64_t head = __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE);
+	size_t count = 0;
+	while (count < len && tail + count != head)
+	{
+		buffer[count] = rx_ring[(tail + count) & RX_RING_MASK];
+		++count;
+	}
+
+	__atomic_store_n(&rx_tail, tail + count, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+size_t
+serial_tx_backlog(void)
+{
+	return __atomic_load_n(&tx_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&tx_tail, __ATOMIC_ACQUIRE);
+}
+
+void
+serial_flush(void)
+{
+	while (serial_tx_backlog() != 0)
+	{
+		// Doesn't wait for the interrupt, which may not come.
+		uint64_t flags = local_irq_save();
+		if (!__atomic_exchange_n(&tx_busy, true, __ATOMIC_SEQ_CST))
+		{
+			if (is_transmit_empty())
+			{
+				serial_fill_fifo();
+			}
+
+			__atomic_store_n(&tx_busy, false, __ATOMIC_SEQ_CST);
+		}
+		local_irq_restore(flags);
+
+		cpu_relax();
+	}
+}
+
+void
+serial_throttle(size_t max_backlog)
+{
+	if (serial_tx_backlog() > max_backlog)
+	{
+		serial_flush();
+	}
+}
+
+void
+serial_get_stats(struct serial_stats *stats)
+{
+	stats->queued = percpu_counter_sum(&tx_queued);
+	stats->dropped = percpu_counter_sum(&tx_dropped);
+	stats->sent = __atomic_load_n(&tx_sent, __ATOMIC_RELAXED);
+	stats->received = __atomic_load_n(&rx_received, __ATOMIC_RELAXED);
+	stats->receive_dropped = __atomic_load_n(&rx_dropped, __ATOMIC_RELAXED);
+	stats->interrupts = __atomic_load_n(&serial_interrupts, __ATOMIC_RELAXED);
+}
+
+// Collects the output of serial_printf, so that it goes into the ring in
+// a few pieces rather than byte by byte, and isn't interleaved with what
+// other CPUs are printing unless it is long.
+struct printf_buffer
+{
+	char bytes[PRINTF_BUFFER_SIZE];
+	size_t len;
+};
+
+static void
+printf_output(void *context, char c)
+{
+	struct printf_buffer *out = context;
+	if (out->len == PRINTF_BUFFER_SIZE)
+	{
+		serial_queue(out->bytes, out->len);
+		out->len = 0;
+	}
+
+	out->bytes[out->len++] = c;
+}
+
+void
+serial_printf(const char *restrict format, ...)
+{
+	struct printf_buffer out = { .len = 0 };
+
+	va_list args;
+	va_start(args, format);
+	format_v(printf_output, &out, format, args);
+	va_end(args);
+
+	serial_queue(out.bytes, out.len);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// The COM1 console. Output is written straight to the UART until
+// serial_enable_interrupts, and from then on queued in a ring, which the
+// UART's interrupt sends out as its FIFO drains. Writers never wait for
+// the UART: what doesn't fit in the ring is dropped, and counted.
+
+bool serial_init(void);
+
+// Switches to interrupt-driven output and input, with the interrupt going
+// to the calling CPU. Needs the I/O APIC.
+bool serial_enable_interrupts(void);
+
+void serial_putchar(char a);
+
+void serial_write(const char *str);
+
+void serial_write_bytes(const char *bytes, size_t len);
+
+// See format.h for what it understands.
+void serial_printf(const char *restrict format, ...) __attribute__((format(printf, 1, 2)));
+
+// Takes up to `len` bytes received since the last call. Only one caller
+// at a time.
+size_t serial_read(char *buffer, size_t len);
+
+// Bytes queued but not yet handed to the UART.
+size_t serial_tx_backlog(void);
+
+// Waits until everything queued has been handed to the UART, without
+// relying on its interrupt, for when it may not come.
+void serial_flush(void);
+
+// Half the ring, which leaves room for whatever else is printed meanwhile.
+#define SERIAL_DUMP_BACKLOG_MAX 8192
+
+// For long dumps, which would otherwise overrun the ring and have their
+// output dropped: flushes whenever more than `max_backlog` bytes are
+// queued.
+void serial_throttle(size_t max_backlog);
+
+struct serial_stats
+{
+	uint64_t queued;
+	uint64_t dropped; // <- Bytes that found the ring full.
+	uint64_t sent;
+	uint64_t received;
+	uint64_t receive_dropped;
+	uint64_t interrupts;
+};
+
+void serial_get_stats(struct serial_stats *stats);
@@ -0,0 +1,92 @@
+; Real-mode entry point for the application processors.
+;
+; smp.c copies everything between smp_trampoline_start and
+; smp_trampoline_end to SMP_TRAMPOLINE_BASE, where the startup IPI makes
+; the AP begin executing in real mode. The trampoline goes straight to
+; long mode using the control register values of the bootstrap CPU, and
+; calls the entry point in the parameter block with the AP's struct cpu.
+;
+; The first 2MiB are identity mapped, so the trampoline keeps running
+; at the same addresses once paging is on.
+
+%define SMP_TRAMPOLINE_BASE 0x8000
+%define TRAMPOLINE_ADDR(label) (SMP_TRAMPOLINE_BASE + (label - smp_trampoline_start))
+
+; Offsets into trampoline_gdt.
+%define TRAMPOLINE_CODE_SELECTOR 0x08
+%define TRAMPOLINE_DATA_SELECTOR 0x10
+
+section .rodata
+align 16
+global smp_trampoline_start:data
+global smp_trampoline_end:data
+global smp_trampoline_params:data
+
+[BITS 16]
+smp_trampoline_start:
+	cli
+	cld
+	xor ax, ax
+	mov ds, ax
+
+	o32 lgdt [TRAMPOLINE_ADDR(trampoline_gdt.pointer)]
+
+	; PAE and friends, as the bootstrap CPU has them.
+	mov eax, [TRAMPOLINE_ADDR(smp_trampoline_params.cr4)]
+	mov cr4, eax
+
+	mov eax, [TRAMPOLINE_ADDR(smp_trampoline_params.cr3)]
+	mov cr3, eax
+
+	; Long mode and NX.
+	mov ecx, 0xC0000080
+	mov eax, [TRAMPOLINE_ADDR(smp_trampoline_params.efer)]
+	xor edx, edx
+	wrmsr
+
+	; Protected mode and paging in one go, which activates long mode.
+	mov eax, [TRAMPOLINE_ADDR(smp_trampoline_params.cr0)]
+	mov cr0, eax
+
+	jmp dword TRAMPOLINE_CODE_SELECTOR:TRAMPOLINE_ADDR(trampoline_long_mode)
+
+[BITS 64]
+trampoline_long_mode:
+	mov ax, TRAMPOLINE_DATA_SELECTOR
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+
+	mov rsp, [TRAMPOLINE_ADDR(smp_trampoline_params.stack_top)]
+	xor rbp, rbp
+	mov rdi, [TRAMPOLINE_ADDR(smp_trampoline_params.cpu)]
+	mov rax, [TRAMPOLINE_ADDR(smp_trampoline_params.entry)]
+	call rax
+
+	; The entry point never returns, but just in case.
+.hang:
+	cli
+	hlt
+	jmp .hang
+
+align 8
+trampoline_gdt:
+	dq 0
+	dq 0x00AF9A000000FFFF ; TRAMPOLINE_CODE_SELECTOR
+	dq 0x00CF92000000FFFF ; TRAMPOLINE_DATA_SELECTOR
+.pointer:
+	dw $ - trampoline_gdt - 1
+	dd TRAMPOLINE_ADDR(trampoline_gdt)
+
+; Filled in by smp.c for every AP, see struct smp_trampoline_params.
+align 8
+smp_trampoline_params:
+.cr0:		dq 0
+.cr3:		dq 0
+.cr4:		dq 0
+.efer:		dq 0
+.stack_top:	dq 0
+.entry:		dq 0
+.cpu:		dq 0
+
+smp_trampoline_end:
@@ -0,0 +1,248 @@
+#include <SampoOS/Kernel/memman.h>
+#include <string.h>
+#include "smp.h"
+#include "acpi.h"
+#include "apic.h"
+#include "percpu.h"
+#include "pit.h"
+#include "sched.h"
+#include "tlb.h"
+#include "interrupts.h"
+#include "syscall.h"
+#include "fpu.h"
+#include "memory-manager.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+// Must match smp-trampoline.asm. The startup IPI vector is the page number.
+#define SMP_TRAMPOLINE_BASE 0x8000
+
+#define AP_STACK_PAGES 4
+
+#define MSR_EFER 0xC0000080
+#define EFER_LMA (UINT64_C(1) << 10)
+
+// The layout of the parameter block at the end of the trampoline.
+struct smp_trampoline_params
+{
+	uint64_t cr0;
+	uint64_t cr3;
+	uint64_t cr4;
+	uint64_t efer;
+	uint64_t stack_top;
+	uint64_t entry;
+	uint64_t cpu;
+};
+
+extern const uint8_t smp_trampoline_start[];
+extern const uint8_t smp_trampoline_end[];
+extern const uint8_t smp_trampoline_params[];
+
+#define MADT_CPU_ENABLED 0x1
+
+// Set by each AP once it's up, and waited on by the bootstrap CPU.
+static volatile bool ap_started;
+
+static uint32_t
+read_u32(const uint8_t *bytes)
+{
+	uint32_t val;
+	memcpy(&val, bytes, sizeof(val));
+
+	return val;
+}
+
+__attribute__((noreturn)) static void
+smp_ap_main(struct cpu *cpu)
+{
+	percpu_load(cpu);
+	interrupts_load_idt();
+	apic_enable_local();
+
+	cpu->online = true;
+	tlb_init_ap();
+	syscall_init_cpu();
+	fpu_init_cpu();
+	__atomic_store_n(&ap_started, true, __ATOMIC_RELEASE);
+
+	sched_ap_main();
+}
+
+// Waits for up to `us` microseconds for the AP to report in.
+static bool
+smp_wait_for_ap(uint32_t us)
+{
+	for (uint32_t waited = 0; waited < us; waited += 10)
+	{
+		if (__atomic_load_n(&ap_started, __ATOMIC_ACQUIRE))
+		{
+			return true;
+		}
+
+		pit_delay_us(10);
+	}
+
+	return __atomic_load_n(&ap_started, __ATOMIC_ACQUIRE);
+}
+
+static bool
+smp_start_ap(struct cpu *cpu)
+{
+	uint8_t *stack = virt_alloc_pages(AP_STACK_PAGES, VIRT_MAP_READ | VIRT_MAP_WRITE);
+	if (stack == NULL)
+	{
+		return false;
+	}
+
+	// The IDT sends some exceptions to them from the start.
+	if (!interrupts_alloc_stacks(cpu))
+	{
+		virt_free_pages(stack, AP_STACK_PAGES);
+		return false;
+	}
+
+	// The trampoline is reachable through the identity mapping of the first 2MiB.
+	struct smp_trampoline_params *params = (struct smp_trampoline_params *)
+		(SMP_TRAMPOLINE_BASE + (smp_trampoline_params - smp_trampoline_start));
+
+	params->cr0 = read_cr0();
+	params->cr3 = read_cr3();
+	params->cr4 = read_cr4();
+	params->efer = rdmsr(MSR_EFER) & ~EFER_LMA;
+	params->stack_top = (uintptr_t)(stack + AP_STACK_PAGES * PAGE_SIZE);
+	cpu->boot_stack_bottom = (uintptr_t) stack;
+	cpu->boot_stack_top = params->stack_top;
+	params->entry = (uintptr_t) smp_ap_main;
+	params->cpu = (uintptr_t) cpu;
+
+	__atomic_store_n(&ap_started, false, __ATOMIC_RELEASE);
+
+	// The INIT-SIPI-SIPI sequence, with the delays from the
+	// Intel MultiProcessor Specification.
+	apic_send_init(cpu->apic_id);
+	pit_delay_us(10000);
+
+	apic_send_startup(cpu->apic_id, SMP_TRAMPOLINE_BASE / PAGE_SIZE);
+	if (!smp_wait_for_ap(200))
+	{
+		apic_send_startup(cpu->apic_id, SMP_TRAMPOLINE_BASE / PAGE_SIZE);
+		if (!smp_wait_for_ap(100000))
+		{
+			// The AP may yet answer the second SIPI, and then run on
+			// the stacks freed below with an identity that goes to the
+			// next one. An INIT puts it back to waiting for a SIPI,
+			// wherever it got to.
+			apic_send_init(cpu->apic_id);
+			pit_delay_us(10000);
+			__atomic_store_n(&cpu->online, false, __ATOMIC_RELEASE);
+
+			interrupts_free_stacks(cpu);
+			virt_free_pages(stack, AP_STACK_PAGES);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void
+init_smp(void)
+{
+	struct madt *madt = (struct madt *) acpi_find_table("APIC");
+	if (madt == NULL)
+	{
+		serial_write("No MADT found, only using the bootstrap CPU\n");
+		return;
+	}
+
+	const uint8_t *entries = (const uint8_t *)(madt + 1);
+	size_t entries_len = madt->header.length - sizeof(*madt);
+
+	uint64_t apic_phys = madt->local_apic_addr;
+	for (size_t offset = 0; offset + 2 <= entries_len; offset += entries[offset + 1])
+	{
+		if (entries[offset + 1] == 0)
+		{
+			// A broken table: stop before looping forever.
+			break;
+		}
+
+		if (entries[offset] == MADT_ENTRY_LOCAL_APIC_OVERRIDE)
+		{
+			memcpy(&apic_phys, &entries[offset + 4], sizeof(apic_phys));
+		}
+	}
+
+	if (!init_apic(apic_phys))
+	{
+		serial_write("Could not map the local APIC\n");
+		return;
+	}
+
+	apic_enable_local();
+	cpus[0].apic_id = apic_id();
+
+	if (!pmm_is_usable_ram(SMP_TRAMPOLINE_BASE))
+	{
+		serial_write("Memory for the SMP trampoline is not free, only using the bootstrap CPU\n");
+		return;
+	}
+
+	memcpy((void *) SMP_TRAMPOLINE_BASE, smp_trampoline_start,
+	       smp_trampoline_end - smp_trampoline_start);
+
+	for (size_t offset = 0; offset + 2 <= entries_len; offset += entries[offset + 1])
+	{
+		if (entries[offset + 1] == 0)
+		{
+			break;
+		}
+
+		uint32_t target_apic_id;
+		uint32_t flags;
+		switch (entries[offset])
+		{
+		case MADT_ENTRY_LOCAL_APIC:
+			target_apic_id = entries[offset + 3];
+			flags = read_u32(&entries[offset + 4]);
+			break;
+		case MADT_ENTRY_LOCAL_X2APIC:
+			target_apic_id = read_u32(&entries[offset + 4]);
+			flags = read_u32(&entries[offset + 8]);
+			break;
+		default:
+			continue;
+		}
+
+		// APIC IDs over 254 can't be reached without x2APIC mode,
+		// and all ones is the broadcast address in either.
+		if ((flags & MADT_CPU_ENABLED) == 0 ||
+		    target_apic_id == cpus[0].apic_id ||
+		    (!apic_is_x2apic() && target_apic_id > 0xFE) ||
+		    target_apic_id == UINT32_MAX)
+		{
+			continue;
+		}
+
+		if (cpu_count == CPU_MAX)
+		{
+			serial_printf("More than %u CPUs, ignoring the rest\n", CPU_MAX);
+			break;
+		}
+
+		struct cpu *cpu = &cpus[cpu_count];
+		cpu->index = cpu_count;
+		cpu->apic_id = target_apic_id;
+
+		if (smp_start_ap(cpu))
+		{
+			++cpu_count;
+		}
+		else
+		{
+			serial_printf("CPU with APIC ID %u did not start\n", target_apic_id);
+		}
+	}
+
+	serial_printf("%u CPUs online\n", (unsigned int) cpu_count);
+}
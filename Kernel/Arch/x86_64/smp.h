@@ -0,0 +1,5 @@
+#pragma once
+
+// Discovers the application processors from the ACPI MADT, and starts
+// each of them through the real-mode trampoline.
+void init_smp(void);
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include "lockstat.h"
+#include "preempt.h"
+#include "arch-utils.h"
+
+// A ticket lock, for short critical sections. Waiters are served in
+// order, and each one spins reading the same cache line, so heavily
+// contended locks should be MCS locks (see mcs-lock.h) instead.
+//
+// Preemption stays disabled while the lock is held.
+struct spinlock
+{
+	uint16_t owner; // <- The ticket currently being served.
+	uint16_t next;
+	struct lockstat_lock stat;
+};
+
+#define SPINLOCK_INIT(lock_class) { .owner = 0, .next = 0, .stat = LOCKSTAT_INIT(lock_class) }
+
+static inline void
+spin_lock_init(struct spinlock *lock, struct lock_class *class)
+{
+	lock->owner = 0;
+	lock->next = 0;
+	lockstat_init(&lock->stat, class);
+}
+
+static inline void
+spin_lock(struct spinlock *lock)
+{
+	preempt_disable();
+
+	uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) == ticket)
+	{
+		lockstat_acquired(&lock->stat, false, 0);
+		return;
+	}
+
+	uint64_t wait_start = lockstat_clock();
+	while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+	{
+		cpu_relax();
+	}
+
+	lockstat_acquired(&lock->stat, true, wait_start);
+}
+
+static inline void
+spin_unlock(struct spinlock *lock)
+{
+	lockstat_released(&lock->stat);
+
+	// Only the holder ever writes `owner`.
+	__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+
+	preempt_enable();
+}
+
+static inline uint64_t
+spin_lock_irqsave(struct spinlock *lock)
+{
+	uint64_t flags = local_irq_save();
+	spin_lock(lock);
+
+	return flags;
+}
+
+static inline void
+spin_unlock_irqrestore(struct spinlock *lock, uint64_t flags)
+{
+	spin_unlock(lock);
+	local_irq_restore(flags);
+}
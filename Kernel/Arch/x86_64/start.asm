@@ -1,5 +1,7 @@
 section .bss
 align 16
+global stack_bot:data
+global stack_top:data
 stack_bot:
 	resb 16384 		; 16 KiB
 stack_top:
@@ -0,0 +1,184 @@
+#include <cpuid.h>
+#include "static-key.h"
+#include "interrupts.h"
+#include "apic.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "arch-utils.h"
+
+#define JUMP_SIZE 5
+#define OPCODE_INT3 0xCC
+#define OPCODE_JMP_REL32 0xE9
+
+// Defined by linker.ld.
+extern const struct static_key_site static_key_sites_begin[];
+extern const struct static_key_site static_key_sites_end[];
+
+static const uint8_t nop5[JUMP_SIZE] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+
+// Only one site is patched at a time.
+LOCK_CLASS(static_key_lock_class, "static key");
+static struct spinlock static_key_lock = SPINLOCK_INIT(&static_key_lock_class);
+
+// The site whose first byte is an int3 right now, 0 if none is, and
+// where the CPUs which run into it go on.
+static uintptr_t patch_site = 0;
+static uintptr_t patch_resume = 0;
+
+// CPUs yet to serialize since the last step.
+static uint32_t sync_pending = 0;
+
+static interrupt_handler previous_breakpoint_handler = NULL;
+
+static inline void
+serialize(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	__cpuid(0, eax, ebx, ecx, edx);
+}
+
+static bool
+static_key_breakpoint(struct interrupt_frame *frame)
+{
+	// The int3 has been executed, so the return address is right after it.
+	uintptr_t site = __atomic_load_n(&patch_site, __ATOMIC_ACQUIRE);
+	if (site != 0 && frame->rip - 1 == site)
+	{
+		frame->rip = __atomic_load_n(&patch_resume, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	return previous_breakpoint_handler != NULL && previous_breakpoint_handler(frame);
+}
+
+static bool
+sync_core_interrupt(struct interrupt_frame *frame)
+{
+	(void) frame;
+
+	apic_eoi();
+
+	// The IRET would serialize too, but only after we have said we're done.
+	serialize();
+	__atomic_fetch_sub(&sync_pending, 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+void
+init_static_keys(void)
+{
+	previous_breakpoint_handler = interrupt_register_handler(INTERRUPT_VECTOR_BREAKPOINT, static_key_breakpoint);
+	interrupt_register_handler(INTERRUPT_VECTOR_SYNC_CORE, sync_core_interrupt);
+}
+
+// Makes every online CPU serialize, so that none of them runs code it
+// fetched before the last write. Preemption must be disabled.
+static void
+sync_cores(void)
+{
+	serialize();
+
+	uint64_t targets = 0;
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		if (i != this_cpu()->index && __atomic_load_n(&cpus[i].online, __ATOMIC_ACQUIRE))
+		{
+			targets |= UINT64_C(1) << i;
+		}
+	}
+
+	if (targets == 0)
+	{
+		return;
+	}
+
+	__atomic_store_n(&sync_pending, __builtin_popcountll(targets), __ATOMIC_RELAXED);
+	for (; targets != 0; targets &= targets - 1)
+	{
+		apic_send_ipi(cpus[__builtin_ctzll(targets)].apic_id, INTERRUPT_VECTOR_SYNC_CORE);
+	}
+
+	while (__atomic_load_n(&sync_pending, __ATOMIC_ACQUIRE) != 0)
+	{
+		cpu_relax();
+	}
+}
+
+// The kernel text is mapped read-only, so this lifts the write protection
+// for as long as the write takes, on this CPU only.
+static void
+text_write(uintptr_t addr, const uint8_t *bytes, size_t len)
+{
+	uint64_t flags = local_irq_save();
+	uintptr_t cr0 = read_cr0();
+	write_cr0(cr0 & ~CR0_WRITE_PROTECT);
+
+	volatile uint8_t *code = (volatile uint8_t *) addr;
+	for (size_t i = 0; i < len; ++i)
+	{
+		code[i] = bytes[i];
+	}
+
+	write_cr0(cr0);
+	local_irq_restore(flags);
+}
+
+static void
+patch_site_locked(const struct static_key_site *site, bool enabled)
+{
+	uint8_t code[JUMP_SIZE];
+	if (enabled)
+	{
+		int32_t offset = (int32_t) (site->target - (site->code + JUMP_SIZE));
+		code[0] = OPCODE_JMP_REL32;
+		for (size_t i = 0; i < sizeof(offset); ++i)
+		{
+			code[1 + i] = (uint8_t) (offset >> (8 * i));
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < JUMP_SIZE; ++i)
+		{
+			code[i] = nop5[i];
+		}
+	}
+
+	// Either way of going on is right while the key is changing.
+	__atomic_store_n(&patch_resume, enabled ? site->target : site->code + JUMP_SIZE, __ATOMIC_RELAXED);
+	__atomic_store_n(&patch_site, site->code, __ATOMIC_RELEASE);
+
+	static const uint8_t int3 = OPCODE_INT3;
+	text_write(site->code, &int3, 1);
+	sync_cores();
+
+	text_write(site->code + 1, code + 1, JUMP_SIZE - 1);
+	sync_cores();
+
+	text_write(site->code, code, 1);
+	sync_cores();
+
+	__atomic_store_n(&patch_site, 0, __ATOMIC_RELEASE);
+}
+
+void
+static_key_set(struct static_key *key, bool enabled)
+{
+	spin_lock(&static_key_lock);
+
+	if (key->enabled != enabled)
+	{
+		for (const struct static_key_site *site = static_key_sites_begin; site < static_key_sites_end; ++site)
+		{
+			if (site->key == key)
+			{
+				patch_site_locked(site, enabled);
+			}
+		}
+
+		__atomic_store_n(&key->enabled, enabled, __ATOMIC_RELAXED);
+	}
+
+	spin_unlock(&static_key_lock);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Branches which are flipped at runtime by patching the code. Every use
+// of static_key_enabled is a 5-byte NOP while its key is off, and a jump
+// to the code behind the `if` while it is on, so a disabled branch costs
+// nothing but the NOP. Flipping a key is slow in turn, as it stops every
+// CPU a few times for each place the key is used at.
+//
+// The sites are patched while other CPUs may be running them: the first
+// byte becomes an int3, whose handler sends any CPU running into it on to
+// where the new code would have, then the rest of the instruction is
+// written, and then the first byte. Every CPU serializes after each step.
+// This relies on nothing going through the patched code from within the
+// breakpoint handler, or from an NMI, which would find the int3 as well.
+
+struct static_key
+{
+	bool enabled;
+};
+
+#define STATIC_KEY_INIT { .enabled = false }
+
+// Where static_key_enabled was used, collected in .static_key_sites by
+// the linker.
+struct static_key_site
+{
+	uintptr_t code; // <- The NOP or jump.
+	uintptr_t target; // <- Where the jump goes.
+	struct static_key *key;
+};
+
+// Registers the breakpoint handler and the IPI which the patching needs.
+// Must be called before the first static_key_set.
+void init_static_keys(void);
+
+// Patches every site of the key, if it isn't set that way already. Takes
+// a while, and must be called from a thread, with interrupts enabled, as
+// it waits on the other CPUs.
+void static_key_set(struct static_key *key, bool enabled);
+
+// The key must be a constant address, which it is after inlining.
+static inline __attribute__((always_inline)) bool
+static_key_enabled(struct static_key *key)
+{
+	asm goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+		 ".pushsection .static_key_sites, \"a\"\n\t"
+		 ".balign 8\n\t"
+		 ".quad 1b, %l[enabled], %c0\n\t"
+		 ".popsection"
+		 : : "i"(key) : : enabled);
+
+	return false;
+enabled:
+	return true;
+}
@@ -0,0 +1,86 @@
+#include <SampoOS/Kernel/bootinfo.h>
+#include <SampoOS/Kernel/memman.h>
+#include "symbols.h"
+#include "memory-manager.h"
+#include "paging.h"
+
+// Only ever set once, before anything looks them up.
+static const struct sampo_bootinfo_symbol *symbols;
+static size_t symbol_count;
+static const char *symbol_names;
+
+static const void *
+symbols_map(uint64_t phys, size_t len)
+{
+	uintptr_t first_page = phys & ~(PAGE_SIZE - 1);
+	size_t page_count = (get_next_aligned_addr(phys + len) - first_page) / PAGE_SIZE;
+
+	const uint8_t *mapping = virt_map_pages(first_page, page_count, VIRT_MAP_READ);
+	if (mapping == NULL)
+	{
+		return NULL;
+	}
+
+	return mapping + (phys - first_page);
+}
+
+bool
+init_symbols(const struct sampo_bootinfo *info)
+{
+	if (info->symbols.symbols_count == 0)
+	{
+		return false;
+	}
+
+	const struct sampo_bootinfo_symbol *index =
+		symbols_map(info->symbols.symbols_ptr, info->symbols.symbols_count * sizeof(*index));
+	const char *names = symbols_map(info->symbols.names_ptr, info->symbols.names_len);
+	if (index == NULL || names == NULL)
+	{
+		return false;
+	}
+
+	symbols = index;
+	symbol_names = names;
+	symbol_count = info->symbols.symbols_count;
+
+	return true;
+}
+
+bool
+symbol_lookup(uintptr_t addr, struct symbol *symbol)
+{
+	// The last function starting at or before `addr`.
+	size_t low = 0;
+	size_t high = symbol_count;
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		if (symbols[mid].addr <= addr)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	if (low == 0)
+	{
+		return false;
+	}
+
+	// Past its end is whatever has no symbol, like the entry stubs.
+	const struct sampo_bootinfo_symbol *found = &symbols[low - 1];
+	if (found->size != 0 && addr - found->addr >= found->size)
+	{
+		return false;
+	}
+
+	symbol->name = &symbol_names[found->name_offset];
+	symbol->start = found->addr;
+	symbol->size = found->size;
+
+	return true;
+}
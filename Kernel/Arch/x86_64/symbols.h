@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct sampo_bootinfo;
+
+// The kernel's own functions, from the index Kickstart builds out of the
+// symbol table of the kernel ELF. Looking one up is a binary search.
+
+struct symbol
+{
+	const char *name;
+	uintptr_t start;
+	size_t size; // <- 0 if the symbol table didn't say.
+};
+
+// Maps the index Kickstart passed. Returns false if there is none, in
+// which case lookups find nothing.
+bool init_symbols(const struct sampo_bootinfo *info);
+
+// Finds the function `addr` is in. Safe from any context, NMIs included.
+bool symbol_lookup(uintptr_t addr, struct symbol *symbol);
@@ -0,0 +1,142 @@
+; The SYSCALL entry point, and the way into user mode, see syscall.h.
+
+; Offsets into struct cpu, checked by syscall.c.
+%define CPU_USER_RSP 32
+%define CPU_KERNEL_STACK 100 ; <- tss.rsp[0], which interrupts from user mode use too.
+%define CPU_FPU_LOAD_PENDING 216 ; <- Checked by fpu.c.
+
+; From <SampoOS/syscall.h>.
+%define SYSCALL_EXIT 0
+%define SYSCALL_COUNT 3
+%define SYSCALL_NO_SUCH_CALL -1
+
+; Interrupts enabled, plus the bit that is always set.
+%define USER_RFLAGS 0x202
+
+section .text
+extern syscall_table:data
+extern fpu_enter_user:function
+extern fpu_load_user:function
+
+; uint64_t syscall_enter_user(uintptr_t entry, uintptr_t user_rsp, uint64_t arg)
+;
+; Saves what the caller expects to get back on the kernel stack, and has
+; system calls start below it from now on. The exit call unwinds it.
+global syscall_enter_user:function
+syscall_enter_user:
+	pushfq
+	push rbp
+	push rbx
+	push r12
+	push r13
+	push r14
+	push r15
+	push qword [gs:CPU_KERNEL_STACK]
+
+	cli
+	mov [gs:CPU_KERNEL_STACK], rsp
+
+	; The thread's FPU state goes out with it, see fpu.h. With the
+	; arguments on the stack as well, it is aligned for the call.
+	push rdi
+	push rsi
+	push rdx
+	call fpu_enter_user
+	pop rdx
+	pop rsi
+	pop rdi
+
+	mov rcx, rdi
+	mov rsp, rsi
+	mov rdi, rdx
+	mov r11d, USER_RFLAGS
+
+	; Nothing of the kernel's goes out with it.
+	xor eax, eax
+	xor ebx, ebx
+	xor edx, edx
+	xor esi, esi
+	xor ebp, ebp
+	xor r8d, r8d
+	xor r9d, r9d
+	xor r10d, r10d
+	xor r12d, r12d
+	xor r13d, r13d
+	xor r14d, r14d
+	xor r15d, r15d
+
+	swapgs
+	o64 sysret
+
+; SYSCALL left the user RIP in RCX and RFLAGS in R11, and masked
+; interrupts, but didn't touch the stack. The kernel stack starts 8 bytes
+; off a 16-byte boundary, see syscall_enter_user, so it is aligned for the
+; call once the three user registers are on it.
+global syscall_entry:function
+syscall_entry:
+	swapgs
+	mov [gs:CPU_USER_RSP], rsp
+	mov rsp, [gs:CPU_KERNEL_STACK]
+	push qword [gs:CPU_USER_RSP]
+	push rcx
+	push r11
+
+	cmp rax, SYSCALL_EXIT
+	je .exit
+	cmp rax, SYSCALL_COUNT
+	jae .no_such_call
+
+	; The arguments are where the C calling convention has them, but for
+	; the fourth, as SYSCALL took RCX.
+	sti
+	mov rcx, r10
+	call [syscall_table + rax * 8]
+	cli
+	jmp .return
+
+.no_such_call:
+	mov rax, SYSCALL_NO_SUCH_CALL
+
+.return:
+	; Another thread's FPU state may have been loaded in the meantime.
+	cmp byte [gs:CPU_FPU_LOAD_PENDING], 0
+	jne .load_fpu
+
+.fpu_loaded:
+	; The handler may have left kernel values in these.
+	xor edi, edi
+	xor esi, esi
+	xor edx, edx
+	xor r8d, r8d
+	xor r9d, r9d
+	xor r10d, r10d
+
+	; RCX always holds a canonical user address, where SYSCALL came from,
+	; as SYSRET faults in kernel mode with the user stack otherwise.
+	pop r11
+	pop rcx
+	pop rsp
+	swapgs
+	o64 sysret
+
+.load_fpu:
+	push rax
+	sub rsp, 8
+	call fpu_load_user
+	add rsp, 8
+	pop rax
+	jmp .fpu_loaded
+
+; Returns from syscall_enter_user, with the argument as its result.
+.exit:
+	mov rax, rdi
+	mov rsp, [gs:CPU_KERNEL_STACK]
+	pop qword [gs:CPU_KERNEL_STACK]
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rbx
+	pop rbp
+	popfq
+	ret
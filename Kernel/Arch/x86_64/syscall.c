@@ -0,0 +1,84 @@
+#include <stddef.h>
+#include "syscall.h"
+#include "clock.h"
+#include "percpu.h"
+#include "arch-utils.h"
+
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_FMASK 0xC0000084
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+#define EFER_SCE (1 << 0)
+
+// Cleared on entry: interrupts stay off until we're on the kernel stack.
+#define RFLAGS_TF (1 << 8)
+#define RFLAGS_IF (1 << 9)
+#define RFLAGS_DF (1 << 10)
+#define RFLAGS_AC (1 << 18)
+
+// syscall-entry.asm reaches into struct cpu at these offsets.
+_Static_assert(offsetof(struct cpu, user_rsp) == 32, "CPU_USER_RSP is out of date");
+_Static_assert(offsetof(struct cpu, tss) + offsetof(struct tss, rsp) == 100, "CPU_KERNEL_STACK is out of date");
+
+extern void syscall_entry(void);
+
+static int64_t
+sys_null(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+
+	return 0;
+}
+
+static int64_t
+sys_clock(uint64_t clock_id, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+
+	switch (clock_id)
+	{
+	case SAMPO_CLOCK_MONOTONIC:
+		return clock_monotonic_ns();
+	case SAMPO_CLOCK_REALTIME:
+		return clock_realtime_ns();
+	default:
+		return SAMPO_SYSCALL_NO_SUCH_CALL;
+	}
+}
+
+// Indexed by syscall-entry.asm. The exit call never gets this far.
+const syscall_handler syscall_table[SAMPO_SYSCALL_COUNT] = {
+	[SAMPO_SYSCALL_EXIT] = sys_null,
+	[SAMPO_SYSCALL_NULL] = sys_null,
+	[SAMPO_SYSCALL_CLOCK] = sys_clock,
+};
+
+void
+syscall_init_cpu(void)
+{
+	// SYSCALL loads CS from STAR[47:32] and SS from the entry after it.
+	// SYSRET loads SS from the entry after STAR[63:48], and CS from the
+	// one after that, which is why the user data segment comes first.
+	uint64_t star = ((uint64_t) (GDT_SELECTOR_KERNEL_DATA | 3) << 48)
+		| ((uint64_t) GDT_SELECTOR_KERNEL_CODE << 32);
+
+	wrmsr(MSR_STAR, star);
+	wrmsr(MSR_LSTAR, (uint64_t) (uintptr_t) syscall_entry);
+	wrmsr(MSR_FMASK, RFLAGS_TF | RFLAGS_IF | RFLAGS_DF | RFLAGS_AC);
+
+	// What user space starts with in GS, once the entry paths swap it.
+	wrmsr(MSR_KERNEL_GS_BASE, 0);
+
+	wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+}
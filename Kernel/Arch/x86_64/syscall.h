@@ -0,0 +1,23 @@
+#pragma once
+
+#include <SampoOS/syscall.h>
+#include <stdint.h>
+
+// The kernel side of <SampoOS/syscall.h>. SYSCALL comes in on the kernel
+// stack the thread last entered user mode from, and calls the handler for
+// the number straight away with the arguments, see syscall-entry.asm.
+// Only the user RIP, RFLAGS and RSP are saved: the handlers are C
+// functions, which preserve the callee-saved registers themselves.
+
+typedef int64_t (*syscall_handler)(uint64_t arg0, uint64_t arg1, uint64_t arg2,
+				   uint64_t arg3, uint64_t arg4, uint64_t arg5);
+
+// Enables SYSCALL on the calling CPU.
+void syscall_init_cpu(void);
+
+// Runs the user code at `entry` with its stack pointer at `user_rsp` and
+// `arg` in RDI, until it makes the exit system call, and returns what it
+// passed to it. The code and stack must be mapped in the user half of the
+// active address space. Threads don't have address spaces of their own
+// yet, so the caller must keep preemption disabled meanwhile.
+uint64_t syscall_enter_user(uintptr_t entry, uintptr_t user_rsp, uint64_t arg);
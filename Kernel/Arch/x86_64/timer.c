@@ -0,0 +1,358 @@
+#include "timer.h"
+#include "apic.h"
+#include "percpu.h"
+#include "percpu-counter.h"
+#include "spinlock.h"
+#include "arch-utils.h"
+
+// The bottom level moves on every 2^14 TSC cycles, a few microseconds.
+#define WHEEL_UNIT_SHIFT 14
+#define WHEEL_UNIT (UINT64_C(1) << WHEEL_UNIT_SHIFT)
+
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 6
+
+// How far ahead the wheel reaches, in units. Timers beyond that wait on
+// the top level, and go round it again until they are in reach.
+#define WHEEL_RANGE (UINT64_C(1) << (WHEEL_SLOT_BITS * WHEEL_LEVELS))
+
+// In `level` when a timer is on the expired list instead of in a slot.
+#define WHEEL_LEVEL_EXPIRED WHEEL_LEVELS
+
+struct timer_wheel
+{
+	struct spinlock lock;
+
+	// The next unit to be dealt with. Everything before it has been.
+	uint64_t clock;
+
+	size_t pending;
+
+	// One bit per slot that has timers in it.
+	uint64_t occupied[WHEEL_LEVELS];
+	struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+
+	// Taken off the bottom level, waiting for their turn to run.
+	struct timer *expired;
+} __attribute__((aligned(64)));
+
+static struct timer_wheel timer_wheels[CPU_MAX];
+
+LOCK_CLASS(timer_wheel_lock_class, "timer wheel");
+
+static struct percpu_counter timers_armed = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter timers_cancelled = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter timers_expired = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter timers_cascaded = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter timer_interrupts = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+
+static inline uint64_t
+rotate_right(uint64_t value, unsigned int count)
+{
+	count &= 63;
+
+	return count == 0 ? value : (value >> count) | (value << (64 - count));
+}
+
+// Moves `deadline` later, by no more than `slack`, to the value with the
+// most trailing zeros, so that timers with similar deadlines end up on
+// the same one.
+static uint64_t
+timer_apply_slack(uint64_t deadline, uint64_t slack)
+{
+	uint64_t limit = deadline + slack;
+	if (slack == 0 || limit < deadline)
+	{
+		return deadline;
+	}
+
+	// The highest bit that differs is set in `limit`, so clearing the
+	// ones below it can't take us back past `deadline`.
+	unsigned int bit = 63 - __builtin_clzll(deadline ^ limit);
+
+	return limit & ~((UINT64_C(1) << bit) - 1);
+}
+
+static void
+list_insert(struct timer **head, struct timer *timer)
+{
+	timer->next = *head;
+	if (timer->next != NULL)
+	{
+		timer->next->pprev = &timer->next;
+	}
+
+	*head = timer;
+	__atomic_store_n(&timer->pprev, head, __ATOMIC_RELAXED);
+}
+
+static void
+wheel_insert(struct timer_wheel *w, struct timer *timer)
+{
+	// Rounded up, so that timers never run early.
+	uint64_t unit = timer->expires >> WHEEL_UNIT_SHIFT;
+	if ((timer->expires & (WHEEL_UNIT - 1)) != 0)
+	{
+		++unit;
+	}
+
+	if (unit < w->clock)
+	{
+		unit = w->clock;
+	}
+
+	uint64_t delta = unit - w->clock;
+	if (delta >= WHEEL_RANGE)
+	{
+		unit = w->clock + WHEEL_RANGE - 1;
+		delta = WHEEL_RANGE - 1;
+	}
+
+	size_t level = 0;
+	while (delta >= UINT64_C(1) << (WHEEL_SLOT_BITS * (level + 1)))
+	{
+		++level;
+	}
+
+	size_t slot = (unit >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK;
+	timer->level = level;
+	timer->slot = slot;
+
+	list_insert(&w->slots[level][slot], timer);
+	w->occupied[level] |= UINT64_C(1) << slot;
+}
+
+static void
+wheel_remove(struct timer_wheel *w, struct timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next != NULL)
+	{
+		timer->next->pprev = timer->pprev;
+	}
+
+	if (timer->level != WHEEL_LEVEL_EXPIRED && w->slots[timer->level][timer->slot] == NULL)
+	{
+		w->occupied[timer->level] &= ~(UINT64_C(1) << timer->slot);
+	}
+
+	__atomic_store_n(&timer->pprev, NULL, __ATOMIC_RELAXED);
+	--w->pending;
+}
+
+// The first unit, from the clock on, at which the wheel has something to
+// do: run the timers in a slot of the bottom level, or cascade a slot of
+// one of the others. Those are only ever cascaded at the start of their
+// slot, so if any of them is due, so is everything in the levels below.
+static uint64_t
+wheel_next_event(struct timer_wheel *w)
+{
+	uint64_t next = UINT64_MAX;
+	for (size_t level = 0; level < WHEEL_LEVELS; ++level)
+	{
+		if (w->occupied[level] == 0)
+		{
+			continue;
+		}
+
+		unsigned int shift = WHEEL_SLOT_BITS * level;
+		uint64_t start = (w->clock + (UINT64_C(1) << shift) - 1) >> shift;
+		uint64_t occupied = rotate_right(w->occupied[level], start & WHEEL_SLOT_MASK);
+		uint64_t event = (start + __builtin_ctzll(occupied)) << shift;
+		if (event < next)
+		{
+			next = event;
+		}
+	}
+
+	return next;
+}
+
+static void
+wheel_cascade(struct timer_wheel *w, size_t level, size_t slot)
+{
+	struct timer *timer = w->slots[level][slot];
+	w->slots[level][slot] = NULL;
+	w->occupied[level] &= ~(UINT64_C(1) << slot);
+
+	while (timer != NULL)
+	{
+		struct timer *next = timer->next;
+		wheel_insert(w, timer);
+		percpu_counter_inc(&timers_cascaded);
+		timer = next;
+	}
+}
+
+// Runs everything due by `now`. The lock is dropped around the callbacks.
+static bool
+wheel_advance(struct timer_wheel *w, uint64_t now)
+{
+	uint64_t now_unit = now >> WHEEL_UNIT_SHIFT;
+	bool ran = false;
+
+	for (;;)
+	{
+		uint64_t event = wheel_next_event(w);
+		if (event > now_unit)
+		{
+			break;
+		}
+
+		// Nothing to do in between.
+		w->clock = event;
+		for (size_t level = WHEEL_LEVELS - 1; level > 0; --level)
+		{
+			unsigned int shift = WHEEL_SLOT_BITS * level;
+			if ((event & ((UINT64_C(1) << shift) - 1)) == 0)
+			{
+				wheel_cascade(w, level, (event >> shift) & WHEEL_SLOT_MASK);
+			}
+		}
+
+		size_t slot = event & WHEEL_SLOT_MASK;
+		struct timer *expired = w->slots[0][slot];
+		w->slots[0][slot] = NULL;
+		w->occupied[0] &= ~(UINT64_C(1) << slot);
+		w->clock = event + 1;
+
+		// Still cancellable until they run.
+		w->expired = expired;
+		if (expired != NULL)
+		{
+			expired->pprev = &w->expired;
+		}
+
+		for (struct timer *timer = expired; timer != NULL; timer = timer->next)
+		{
+			timer->level = WHEEL_LEVEL_EXPIRED;
+		}
+
+		while (w->expired != NULL)
+		{
+			struct timer *timer = w->expired;
+			wheel_remove(w, timer);
+
+			spin_unlock(&w->lock);
+			timer->func(timer);
+			spin_lock(&w->lock);
+
+			percpu_counter_inc(&timers_expired);
+			ran = true;
+		}
+	}
+
+	if (w->pending == 0 && w->clock <= now_unit)
+	{
+		w->clock = now_unit + 1;
+	}
+
+	return ran;
+}
+
+// The caller must hold the lock, and be on the wheel's CPU.
+static void
+wheel_program(struct timer_wheel *w)
+{
+	uint64_t event = wheel_next_event(w);
+	apic_timer_set_oneshot(event == UINT64_MAX ? 0 : event << WHEEL_UNIT_SHIFT);
+}
+
+void
+init_timers(void)
+{
+	uint64_t clock = (rdtsc() >> WHEEL_UNIT_SHIFT) + 1;
+	for (size_t i = 0; i < CPU_MAX; ++i)
+	{
+		spin_lock_init(&timer_wheels[i].lock, &timer_wheel_lock_class);
+		timer_wheels[i].clock = clock;
+	}
+}
+
+void
+timer_arm(struct timer *timer, uint64_t deadline, uint64_t slack)
+{
+	if (timer_pending(timer))
+	{
+		timer_cancel(timer);
+	}
+
+	uint64_t flags = local_irq_save();
+
+	size_t cpu = this_cpu()->index;
+	struct timer_wheel *w = &timer_wheels[cpu];
+	spin_lock(&w->lock);
+
+	if (w->pending == 0)
+	{
+		// Nothing to catch up on, so skip straight to the present.
+		w->clock = (rdtsc() >> WHEEL_UNIT_SHIFT) + 1;
+	}
+
+	timer->expires = timer_apply_slack(deadline, slack);
+	timer->cpu = cpu;
+	wheel_insert(w, timer);
+	++w->pending;
+
+	wheel_program(w);
+
+	spin_unlock(&w->lock);
+	local_irq_restore(flags);
+
+	percpu_counter_inc(&timers_armed);
+}
+
+bool
+timer_cancel(struct timer *timer)
+{
+	struct timer_wheel *w = &timer_wheels[timer->cpu];
+
+	uint64_t flags = spin_lock_irqsave(&w->lock);
+
+	// It may have run while we waited for the lock.
+	bool pending = timer->pprev != NULL;
+	if (pending)
+	{
+		// Should it have been the next thing due, the interrupt comes
+		// for nothing, which isn't worth an IPI to prevent.
+		wheel_remove(w, timer);
+	}
+
+	spin_unlock_irqrestore(&w->lock, flags);
+
+	if (pending)
+	{
+		percpu_counter_inc(&timers_cancelled);
+	}
+
+	return pending;
+}
+
+void
+timer_interrupt(void)
+{
+	struct timer_wheel *w = &timer_wheels[this_cpu()->index];
+
+	spin_lock(&w->lock);
+
+	if (wheel_advance(w, rdtsc()))
+	{
+		percpu_counter_inc(&timer_interrupts);
+	}
+
+	wheel_program(w);
+
+	spin_unlock(&w->lock);
+}
+
+void
+timer_get_stats(struct timer_stats *stats)
+{
+	stats->armed = percpu_counter_sum(&timers_armed);
+	stats->cancelled = percpu_counter_sum(&timers_cancelled);
+	stats->expired = percpu_counter_sum(&timers_expired);
+	stats->cascaded = percpu_counter_sum(&timers_cascaded);
+	stats->interrupts = percpu_counter_sum(&timer_interrupts);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Timeouts, kept in a hierarchical timing wheel on each CPU. Arming and
+// cancelling a timer take constant time: a timer goes into a slot of the
+// level its expiry is far enough away for, and is cascaded down a level
+// whenever the wheel comes around to its slot, until it reaches the
+// bottom one and runs.
+//
+// With the TSC-deadline timer, the timer interrupt is programmed for the
+// next thing the wheel has to do, so idle CPUs can go without the tick.
+// Otherwise the wheel only moves on the tick, and timers run late by up
+// to a time slice.
+
+struct timer;
+typedef void (*timer_func)(struct timer *timer);
+
+// Embedded in whatever the timer is for, like rcu_head.
+struct timer
+{
+	struct timer *next;
+	struct timer **pprev; // <- NULL unless the timer is pending.
+	uint64_t expires; // <- TSC.
+	timer_func func;
+	uint32_t cpu;
+	uint8_t level;
+	uint8_t slot;
+};
+
+#define TIMER_INIT(f) { .next = NULL, .pprev = NULL, .expires = 0, .func = (f), .cpu = 0, .level = 0, .slot = 0 }
+
+static inline void
+timer_init(struct timer *timer, timer_func func)
+{
+	*timer = (struct timer) TIMER_INIT(func);
+}
+
+static inline bool
+timer_pending(const struct timer *timer)
+{
+	return __atomic_load_n(&timer->pprev, __ATOMIC_RELAXED) != NULL;
+}
+
+struct timer_stats
+{
+	uint64_t armed;
+	uint64_t cancelled;
+	uint64_t expired;
+	uint64_t cascaded; // <- Times a timer was moved down a level.
+	uint64_t interrupts; // <- Timer interrupts which ran any timers.
+};
+
+void init_timers(void);
+
+// Makes `timer` run on the calling CPU at TSC `deadline`, or up to `slack`
+// cycles later, which lets timers due at about the same time share an
+// interrupt. If it was pending, it is moved. The same timer must not be
+// armed or cancelled from two places at once.
+//
+// Timers run in the timer interrupt, and may arm themselves again.
+void timer_arm(struct timer *timer, uint64_t deadline, uint64_t slack);
+
+// Returns false if `timer` wasn't pending, in which case it may be running
+// on its CPU right now.
+bool timer_cancel(struct timer *timer);
+
+// Runs whatever has expired on the calling CPU, and programs the next
+// interrupt. Called from the timer interrupt.
+void timer_interrupt(void);
+
+void timer_get_stats(struct timer_stats *stats);
@@ -0,0 +1,318 @@
+#include "tlb.h"
+#include "address-space.h"
+#include "paging.h"
+#include "percpu.h"
+#include "apic.h"
+#include "interrupts.h"
+#include "arch-utils.h"
+
+// How many separate ranges a batch remembers. Past that, it turns into a
+// full flush.
+#define TLB_BATCH_RANGES 16
+
+// Batches up to this many pages are flushed page by page, bigger ones all
+// at once. An invlpg costs a few hundred cycles at most, whereas a full
+// flush costs as much in itself, and then more in refilling the TLB.
+#define TLB_INVLPG_MAX_PAGES 32
+
+struct tlb_range
+{
+	uintptr_t addr;
+	size_t page_count;
+};
+
+struct tlb_batch
+{
+	struct address_space *as; // <- NULL if the batch is empty.
+	struct tlb_range ranges[TLB_BATCH_RANGES];
+	size_t range_count;
+	size_t page_count;
+	bool overflowed; // <- Ran out of ranges, so only a full flush will do.
+
+	// CPUs yet to be done with the batch, while it is being flushed.
+	uint32_t pending;
+};
+
+struct tlb_cpu
+{
+	// Only touched by its own CPU, except that the CPUs it is sent to
+	// read it while it is being flushed.
+	struct tlb_batch batch;
+
+	// The CPUs whose batch we have been sent, one bit per CPU index.
+	uint64_t inbox;
+
+	// The last kernel purge this CPU has carried out.
+	uint64_t kernel_generation;
+
+	uint64_t shootdowns;
+	uint64_t ipis_sent;
+	uint64_t pages_requested;
+	uint64_t pages_invalidated;
+	uint64_t full_flushes;
+	uint64_t kernel_purges;
+} __attribute__((aligned(64)));
+
+static struct tlb_cpu tlb_cpus[CPU_MAX];
+
+static uint64_t kernel_generation = 0;
+
+static inline struct tlb_cpu *
+this_tlb_cpu(void)
+{
+	return &tlb_cpus[this_cpu()->index];
+}
+
+static uint64_t
+tlb_online_cpus(void)
+{
+	uint64_t online = 0;
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		if (__atomic_load_n(&cpus[i].online, __ATOMIC_ACQUIRE))
+		{
+			online |= UINT64_C(1) << i;
+		}
+	}
+
+	return online;
+}
+
+static void
+tlb_flush_all_local(struct tlb_cpu *tc)
+{
+	flush_tlb();
+	++tc->full_flushes;
+}
+
+static void
+tlb_flush_batch_local(struct tlb_cpu *tc, const struct tlb_batch *batch)
+{
+	if (batch->overflowed || batch->page_count > TLB_INVLPG_MAX_PAGES)
+	{
+		tlb_flush_all_local(tc);
+		return;
+	}
+
+	for (size_t i = 0; i < batch->range_count; ++i)
+	{
+		const struct tlb_range *range = &batch->ranges[i];
+		for (size_t page = 0; page < range->page_count; ++page)
+		{
+			invalidate_page((void *)(range->addr + page * PAGE_SIZE));
+		}
+	}
+
+	tc->pages_invalidated += batch->page_count;
+}
+
+// Carries out whatever other CPUs have asked of us. Interrupts must be disabled.
+static void
+tlb_process_requests(struct tlb_cpu *tc)
+{
+	uint64_t generation = __atomic_load_n(&kernel_generation, __ATOMIC_ACQUIRE);
+	if (generation != tc->kernel_generation)
+	{
+		tlb_flush_all_local(tc);
+		__atomic_store_n(&tc->kernel_generation, generation, __ATOMIC_RELEASE);
+	}
+
+	uint64_t senders = __atomic_exchange_n(&tc->inbox, 0, __ATOMIC_ACQUIRE);
+	while (senders != 0)
+	{
+		struct tlb_batch *batch = &tlb_cpus[__builtin_ctzll(senders)].batch;
+		senders &= senders - 1;
+
+		// If we have switched away from the address space since, the
+		// CR3 reload already took care of it.
+		if (batch->as == as_current())
+		{
+			tlb_flush_batch_local(tc, batch);
+		}
+
+		__atomic_fetch_sub(&batch->pending, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static bool
+tlb_shootdown_interrupt(struct interrupt_frame *frame)
+{
+	(void) frame;
+
+	apic_eoi();
+	tlb_process_requests(this_tlb_cpu());
+
+	return true;
+}
+
+void
+init_tlb(void)
+{
+	interrupt_register_handler(INTERRUPT_VECTOR_TLB_SHOOTDOWN, tlb_shootdown_interrupt);
+}
+
+void
+tlb_process_pending(void)
+{
+	tlb_process_requests(this_tlb_cpu());
+}
+
+void
+tlb_init_ap(void)
+{
+	// Purges from now on reach us, as we are online. Whatever was
+	// purged before, this flush covers as well.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t generation = __atomic_load_n(&kernel_generation, __ATOMIC_ACQUIRE);
+	flush_tlb();
+	__atomic_store_n(&this_tlb_cpu()->kernel_generation, generation, __ATOMIC_RELEASE);
+}
+
+void
+tlb_batch_add(struct address_space *as, uintptr_t addr, size_t page_count)
+{
+	struct tlb_batch *batch = &this_tlb_cpu()->batch;
+	if (batch->as != as && batch->as != NULL)
+	{
+		tlb_batch_flush();
+	}
+
+	batch->as = as;
+	batch->page_count += page_count;
+
+	if (batch->range_count != 0)
+	{
+		struct tlb_range *last = &batch->ranges[batch->range_count - 1];
+		if (last->addr + last->page_count * PAGE_SIZE == addr)
+		{
+			last->page_count += page_count;
+			return;
+		}
+	}
+
+	if (batch->range_count == TLB_BATCH_RANGES)
+	{
+		batch->overflowed = true;
+		return;
+	}
+
+	batch->ranges[batch->range_count].addr = addr;
+	batch->ranges[batch->range_count].page_count = page_count;
+	++batch->range_count;
+}
+
+void
+tlb_batch_flush(void)
+{
+	uint64_t flags = local_irq_save();
+
+	struct tlb_cpu *tc = this_tlb_cpu();
+	struct tlb_batch *batch = &tc->batch;
+	if (batch->as == NULL)
+	{
+		local_irq_restore(flags);
+		return;
+	}
+
+	if (batch->as == as_current())
+	{
+		tlb_flush_batch_local(tc, batch);
+	}
+
+	// The page table changes must be visible before we look at who might
+	// have cached the old entries, as_switch does the opposite.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	uint64_t self = UINT64_C(1) << this_cpu()->index;
+	uint64_t targets = __atomic_load_n(&batch->as->active_cpus, __ATOMIC_RELAXED) & tlb_online_cpus() & ~self;
+	if (targets != 0)
+	{
+		__atomic_store_n(&batch->pending, __builtin_popcountll(targets), __ATOMIC_RELAXED);
+
+		for (uint64_t remaining = targets; remaining != 0; remaining &= remaining - 1)
+		{
+			size_t target = __builtin_ctzll(remaining);
+			__atomic_fetch_or(&tlb_cpus[target].inbox, self, __ATOMIC_RELEASE);
+			apic_send_ipi(cpus[target].apic_id, INTERRUPT_VECTOR_TLB_SHOOTDOWN);
+			++tc->ipis_sent;
+		}
+
+		// Someone may be waiting on us in turn, with interrupts disabled.
+		while (__atomic_load_n(&batch->pending, __ATOMIC_ACQUIRE) != 0)
+		{
+			tlb_process_requests(tc);
+			cpu_relax();
+		}
+
+		++tc->shootdowns;
+	}
+
+	tc->pages_requested += batch->page_count;
+
+	batch->as = NULL;
+	batch->range_count = 0;
+	batch->page_count = 0;
+	batch->overflowed = false;
+
+	local_irq_restore(flags);
+}
+
+uint64_t
+tlb_kernel_purge(void)
+{
+	uint64_t flags = local_irq_save();
+	struct tlb_cpu *tc = this_tlb_cpu();
+
+	// A full barrier, so that the unmappings are visible to anyone who sees the new generation.
+	uint64_t generation = __atomic_add_fetch(&kernel_generation, 1, __ATOMIC_SEQ_CST);
+
+	tlb_flush_all_local(tc);
+	__atomic_store_n(&tc->kernel_generation, generation, __ATOMIC_RELEASE);
+	++tc->kernel_purges;
+
+	uint64_t targets = tlb_online_cpus() & ~(UINT64_C(1) << this_cpu()->index);
+	for (; targets != 0; targets &= targets - 1)
+	{
+		size_t target = __builtin_ctzll(targets);
+		apic_send_ipi(cpus[target].apic_id, INTERRUPT_VECTOR_TLB_SHOOTDOWN);
+		++tc->ipis_sent;
+	}
+
+	local_irq_restore(flags);
+
+	return generation;
+}
+
+uint64_t
+tlb_kernel_purge_completed(void)
+{
+	uint64_t completed = __atomic_load_n(&kernel_generation, __ATOMIC_ACQUIRE);
+	for (uint64_t online = tlb_online_cpus(); online != 0; online &= online - 1)
+	{
+		uint64_t generation = __atomic_load_n(&tlb_cpus[__builtin_ctzll(online)].kernel_generation, __ATOMIC_ACQUIRE);
+		if (generation < completed)
+		{
+			completed = generation;
+		}
+	}
+
+	return completed;
+}
+
+void
+tlb_get_stats(struct tlb_stats *stats)
+{
+	*stats = (struct tlb_stats) { 0 };
+
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		struct tlb_cpu *tc = &tlb_cpus[i];
+
+		stats->shootdowns += __atomic_load_n(&tc->shootdowns, __ATOMIC_RELAXED);
+		stats->ipis_sent += __atomic_load_n(&tc->ipis_sent, __ATOMIC_RELAXED);
+		stats->pages_requested += __atomic_load_n(&tc->pages_requested, __ATOMIC_RELAXED);
+		stats->pages_invalidated += __atomic_load_n(&tc->pages_invalidated, __ATOMIC_RELAXED);
+		stats->full_flushes += __atomic_load_n(&tc->full_flushes, __ATOMIC_RELAXED);
+		stats->kernel_purges += __atomic_load_n(&tc->kernel_purges, __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Cross-CPU TLB shootdowns.
+//
+// Changes to the user half only need to reach the CPUs which have that
+// address space loaded, see address_space.active_cpus. The invalidations
+// are collected in a per-CPU batch, and a flush then sends a single IPI to
+// each of those CPUs, however many ranges the batch holds, and waits for
+// them to be done with it. Each CPU picks between invlpg and a full flush
+// depending on how many pages the batch covers.
+//
+// The kernel half is only ever unmapped lazily (see virt_unmap_pages), so
+// it gets purges instead, which don't wait: the ranges are kept out of use
+// until every CPU has flushed.
+
+struct address_space;
+
+struct tlb_stats
+{
+	uint64_t shootdowns; // <- Batches which had to reach other CPUs.
+	uint64_t ipis_sent;
+	uint64_t pages_requested; // <- Pages in all the batches flushed.
+	uint64_t pages_invalidated; // <- Pages flushed one by one with invlpg, on any CPU.
+	uint64_t full_flushes; // <- CR3 reloads.
+	uint64_t kernel_purges;
+};
+
+void init_tlb(void);
+
+// Called by each AP before it starts running threads.
+void tlb_init_ap(void);
+
+// Adds pages of `as` whose mappings have changed to the calling CPU's batch.
+// If the batch is for another address space, it gets flushed first.
+// Between this and tlb_batch_flush, the caller must stay on its CPU.
+void tlb_batch_add(struct address_space *as, uintptr_t addr, size_t page_count);
+
+// Invalidates the batch on every CPU which has its address space loaded,
+// and returns once they all have. The caller must not hold any spinlock
+// which another CPU might wait on with interrupts disabled.
+void tlb_batch_flush(void);
+
+// Flushes the kernel half on the calling CPU, and asks the other CPUs to
+// do the same. Returns the purge's generation, which is complete once
+// tlb_kernel_purge_completed has caught up with it.
+uint64_t tlb_kernel_purge(void);
+
+// The newest kernel purge which every online CPU has carried out.
+uint64_t tlb_kernel_purge_completed(void);
+
+// Carries out whatever other CPUs are waiting on us for right away, for
+// code which keeps interrupts disabled while it waits in turn. Interrupts
+// must be disabled.
+void tlb_process_pending(void);
+
+void tlb_get_stats(struct tlb_stats *stats);
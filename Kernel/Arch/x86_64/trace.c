@@ -0,0 +1,194 @@
+#include "trace.h"
+#include "percpu.h"
+#include "clock.h"
+#include "memory-manager.h"
+#include "spinlock.h"
+#include "serial.h"
+#include "arch-utils.h"
+
+#define TRACE_BUFFER_RECORDS (TRACE_BUFFER_PAGES * 4096 / sizeof(struct trace_record))
+
+_Static_assert((TRACE_BUFFER_RECORDS & (TRACE_BUFFER_RECORDS - 1)) == 0, "The rings wrap with a mask");
+
+// How the converter should show an event, as Chrome trace phases.
+enum trace_phase
+{
+	TRACE_PHASE_INSTANT = 'i',
+	TRACE_PHASE_BEGIN = 'B',
+	TRACE_PHASE_END = 'E',
+};
+
+struct trace_event_info
+{
+	const char *name;
+	enum trace_phase phase;
+
+	// What the arguments are, NULL for the ones which aren't used.
+	const char *arg0;
+	const char *arg1;
+	const char *count;
+};
+
+static const struct trace_event_info event_info[TRACE_EVENT_COUNT] = {
+	[TRACE_PMM_ALLOC] = { "pmm_alloc", TRACE_PHASE_INSTANT, "page", NULL, NULL },
+	[TRACE_PMM_FREE] = { "pmm_free", TRACE_PHASE_INSTANT, "page", NULL, NULL },
+	[TRACE_PMM_ALLOC_HUGE] = { "pmm_alloc_huge", TRACE_PHASE_INSTANT, "block", NULL, NULL },
+	[TRACE_VIRT_MAP] = { "virt_map", TRACE_PHASE_INSTANT, "addr", "phys", "pages" },
+	[TRACE_VIRT_UNMAP] = { "virt_unmap", TRACE_PHASE_INSTANT, "addr", NULL, "pages" },
+	[TRACE_VIRT_ALLOC] = { "virt_alloc", TRACE_PHASE_INSTANT, "addr", NULL, "pages" },
+	[TRACE_VIRT_FREE] = { "virt_free", TRACE_PHASE_INSTANT, "addr", NULL, "pages" },
+	[TRACE_IRQ_ENTRY] = { "irq", TRACE_PHASE_BEGIN, "vector", NULL, NULL },
+	[TRACE_IRQ_EXIT] = { "irq", TRACE_PHASE_END, "vector", "handled", NULL },
+};
+
+struct trace_cpu
+{
+	struct trace_record *records;
+
+	// Slots ever taken. Only the CPU itself takes them, with interrupts
+	// disabled, so that the thread can neither move to another CPU nor be
+	// interrupted by a tracepoint halfway through a record.
+	uint64_t head;
+} __attribute__((aligned(64)));
+
+static struct trace_cpu trace_cpus[CPU_MAX];
+
+struct static_key trace_keys[TRACE_EVENT_COUNT];
+
+// Guards the allocation of the rings.
+LOCK_CLASS(trace_lock_class, "trace");
+static struct spinlock trace_lock = SPINLOCK_INIT(&trace_lock_class);
+
+void
+trace_write(enum trace_event event, uint64_t arg0, uint64_t arg1, uint32_t count)
+{
+	// Most of the tracepoints run after a lock has been dropped, with
+	// interrupts and preemption back on.
+	uint64_t flags = local_irq_save();
+
+	struct cpu *cpu = this_cpu();
+	struct trace_cpu *tc = &trace_cpus[cpu->index];
+	uint64_t slot = tc->head;
+
+	// Nothing else on this CPU can take a slot until this one is
+	// published, so the TSCs of its records stay in order.
+	struct trace_record *record = &tc->records[slot & (TRACE_BUFFER_RECORDS - 1)];
+	record->tsc = rdtsc();
+	record->event = event;
+	record->cpu = cpu->index;
+	record->count = count;
+	record->args[0] = arg0;
+	record->args[1] = arg1;
+
+	// Published after the record, for trace_dump.
+	__atomic_store_n(&tc->head, slot + 1, __ATOMIC_RELEASE);
+
+	local_irq_restore(flags);
+}
+
+static bool
+trace_allocate_rings(void)
+{
+	spin_lock(&trace_lock);
+
+	bool allocated = true;
+	for (size_t i = 0; i < cpu_count && allocated; ++i)
+	{
+		if (trace_cpus[i].records == NULL)
+		{
+			trace_cpus[i].records = virt_alloc_pages(TRACE_BUFFER_PAGES, VIRT_MAP_READ | VIRT_MAP_WRITE);
+			allocated = trace_cpus[i].records != NULL;
+		}
+	}
+
+	spin_unlock(&trace_lock);
+
+	return allocated;
+}
+
+bool
+trace_set_enabled(enum trace_event event, bool enabled)
+{
+	if (enabled && !trace_allocate_rings())
+	{
+		return false;
+	}
+
+	static_key_set(&trace_keys[event], enabled);
+
+	return true;
+}
+
+bool
+trace_set_all(bool enabled)
+{
+	for (size_t event = 0; event < TRACE_EVENT_COUNT; ++event)
+	{
+		if (!trace_set_enabled(event, enabled))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// The records come out as four hexadecimal words each: the TSC, then the
+// event, CPU and count packed as in struct trace_record, then the two
+// arguments. The events are described up front, so that the converter
+// doesn't need to know them.
+void
+trace_dump(void)
+{
+	uint64_t total = 0;
+	uint64_t overwritten = 0;
+	for (size_t cpu = 0; cpu < cpu_count; ++cpu)
+	{
+		uint64_t head = __atomic_load_n(&trace_cpus[cpu].head, __ATOMIC_RELAXED);
+		total += head;
+		overwritten += head > TRACE_BUFFER_RECORDS ? head - TRACE_BUFFER_RECORDS : 0;
+	}
+
+	serial_printf("Trace of %llu records, %llu overwritten, from %zu CPUs, TSC at %llu Hz\n",
+		      (unsigned long long) total,
+		      (unsigned long long) overwritten,
+		      cpu_count,
+		      (unsigned long long) clock_tsc_hz());
+
+	serial_write("Trace events:\n");
+	for (size_t event = 0; event < TRACE_EVENT_COUNT; ++event)
+	{
+		const struct trace_event_info *info = &event_info[event];
+		serial_printf("%zu %s %c %s %s %s\n",
+			      event,
+			      info->name,
+			      (char) info->phase,
+			      info->arg0 != NULL ? info->arg0 : "-",
+			      info->arg1 != NULL ? info->arg1 : "-",
+			      info->count != NULL ? info->count : "-");
+	}
+
+	serial_write("Trace records:\n");
+	for (size_t cpu = 0; cpu < cpu_count; ++cpu)
+	{
+		// Nothing was traced on a CPU without a ring.
+		const struct trace_cpu *tc = &trace_cpus[cpu];
+		uint64_t head = __atomic_load_n(&tc->head, __ATOMIC_ACQUIRE);
+		uint64_t first = head > TRACE_BUFFER_RECORDS ? head - TRACE_BUFFER_RECORDS : 0;
+
+		for (uint64_t slot = first; slot < head; ++slot)
+		{
+			const struct trace_record *record = &tc->records[slot & (TRACE_BUFFER_RECORDS - 1)];
+			uint64_t packed = record->event | (uint64_t) record->cpu << 16 | (uint64_t) record->count << 32;
+			serial_printf("%llx %llx %llx %llx\n",
+				      (unsigned long long) record->tsc,
+				      (unsigned long long) packed,
+				      (unsigned long long) record->args[0],
+				      (unsigned long long) record->args[1]);
+			serial_throttle(SERIAL_DUMP_BACKLOG_MAX);
+		}
+	}
+
+	serial_write("End of trace\n");
+	serial_flush();
+}
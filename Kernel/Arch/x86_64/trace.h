@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "static-key.h"
+
+// Tracepoints, which are a NOP until their event is enabled, see
+// static-key.h. Enabled ones write a fixed-size binary record into a
+// ring of the CPU they run on, overwriting the oldest record once the
+// ring is full. trace_dump prints the rings over the serial port, and
+// Tools/trace-to-chrome.py turns that into the Chrome trace format,
+// which Perfetto opens too.
+//
+// With `make TRACE=1`, every event is traced while the boot benchmarks
+// run, and dumped after.
+//
+// Exceptions get no irq events, as the breakpoint handler and NMIs must
+// not run into a site which is being patched.
+
+enum trace_event
+{
+	TRACE_PMM_ALLOC, // <- Page, 0 if none was left.
+	TRACE_PMM_FREE, // <- Page.
+	TRACE_PMM_ALLOC_HUGE, // <- Block, 0 if none was left.
+	TRACE_VIRT_MAP, // <- Virtual address, physical address, pages.
+	TRACE_VIRT_UNMAP, // <- Virtual address, pages.
+	TRACE_VIRT_ALLOC, // <- Virtual address, pages.
+	TRACE_VIRT_FREE, // <- Virtual address, pages.
+	TRACE_IRQ_ENTRY, // <- Vector.
+	TRACE_IRQ_EXIT, // <- Vector, whether it was handled.
+
+	TRACE_EVENT_COUNT,
+};
+
+struct trace_record
+{
+	uint64_t tsc;
+	uint16_t event;
+	uint16_t cpu;
+	uint32_t count;
+	uint64_t args[2];
+};
+
+// The ring of each CPU, allocated when tracing is first enabled.
+#define TRACE_BUFFER_PAGES 64
+
+extern struct static_key trace_keys[TRACE_EVENT_COUNT];
+
+// Turns an event on or off on every CPU. Returns false if the rings
+// couldn't be allocated. Like static_key_set, must be called from a
+// thread with interrupts enabled.
+bool trace_set_enabled(enum trace_event event, bool enabled);
+bool trace_set_all(bool enabled);
+
+// Prints the records left in every ring, oldest first. The events should
+// be disabled first, or records written meanwhile may come out torn.
+void trace_dump(void);
+
+// The out-of-line part of the tracepoints.
+void trace_write(enum trace_event event, uint64_t arg0, uint64_t arg1, uint32_t count);
+
+#define TRACE(event, arg0, arg1, count) \
+	do \
+	{ \
+		if (__builtin_expect(static_key_enabled(&trace_keys[(event)]), 0)) \
+		{ \
+			trace_write((event), (arg0), (arg1), (count)); \
+		} \
+	} while (0)
+
+static inline void
+trace_pmm_alloc(uintptr_t page)
+{
+	TRACE(TRACE_PMM_ALLOC, page, 0, 1);
+}
+
+static inline void
+trace_pmm_free(uintptr_t page)
+{
+	TRACE(TRACE_PMM_FREE, page, 0, 1);
+}
+
+static inline void
+trace_pmm_alloc_huge(uintptr_t block)
+{
+	TRACE(TRACE_PMM_ALLOC_HUGE, block, 0, 512);
+}
+
+static inline void
+trace_virt_map(void *addr, uintptr_t physical_page_addr, size_t page_count)
+{
+	TRACE(TRACE_VIRT_MAP, (uintptr_t) addr, physical_page_addr, page_count);
+}
+
+static inline void
+trace_virt_unmap(void *addr, size_t page_count)
+{
+	TRACE(TRACE_VIRT_UNMAP, (uintptr_t) addr, 0, page_count);
+}
+
+static inline void
+trace_virt_alloc(void *addr, size_t page_count)
+{
+	TRACE(TRACE_VIRT_ALLOC, (uintptr_t) addr, 0, page_count);
+}
+
+static inline void
+trace_virt_free(void *addr, size_t page_count)
+{
+	TRACE(TRACE_VIRT_FREE, (uintptr_t) addr, 0, page_count);
+}
+
+static inline void
+trace_irq_entry(uint64_t vector)
+{
+	TRACE(TRACE_IRQ_ENTRY, vector, 0, 0);
+}
+
+static inline void
+trace_irq_exit(uint64_t vector, bool handled)
+{
+	TRACE(TRACE_IRQ_EXIT, vector, handled, 0);
+}
@@ -0,0 +1,176 @@
+#include "workqueue.h"
+#include "sched.h"
+#include "percpu.h"
+#include "percpu-counter.h"
+#include "arch-utils.h"
+
+struct workqueue_cpu
+{
+	// A lock-free stack, pushed to by any CPU. The worker takes all of
+	// it at once, and turns it around to run it in order.
+	struct work *head;
+
+	uint32_t depth;
+
+	// Only written by the worker.
+	uint32_t max_depth;
+	uint64_t latency_cycles_max;
+} __attribute__((aligned(64)));
+
+static struct workqueue_cpu workqueue_cpus[CPU_MAX];
+
+static struct percpu_counter work_queued = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter work_run = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter work_batches = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH);
+static struct percpu_counter work_latency_cycles = PERCPU_COUNTER_INIT(PERCPU_COUNTER_DEFAULT_BATCH * 100000);
+
+static void
+worker_run_batch(struct workqueue_cpu *wc, struct work *batch)
+{
+	// Newest first, as it comes off the stack.
+	struct work *ordered = NULL;
+	size_t count = 0;
+	while (batch != NULL)
+	{
+		struct work *next = batch->next;
+		batch->next = ordered;
+		ordered = batch;
+		batch = next;
+		++count;
+	}
+
+	if (count > wc->max_depth)
+	{
+		wc->max_depth = count;
+	}
+
+	__atomic_fetch_sub(&wc->depth, count, __ATOMIC_RELAXED);
+	percpu_counter_inc(&work_batches);
+
+	uint64_t now = rdtsc();
+	while (ordered != NULL)
+	{
+		struct work *work = ordered;
+		ordered = work->next;
+
+		uint64_t latency = now - work->queued_at;
+		if (latency > wc->latency_cycles_max)
+		{
+			wc->latency_cycles_max = latency;
+		}
+		percpu_counter_add(&work_latency_cycles, latency);
+
+		// Cleared first, so that it can be queued again from its own function.
+		__atomic_store_n(&work->pending, false, __ATOMIC_RELEASE);
+		work->func(work);
+		percpu_counter_inc(&work_run);
+
+		now = rdtsc();
+	}
+}
+
+static void
+worker_main(void *arg)
+{
+	// Workers never leave their CPU.
+	struct workqueue_cpu *wc = arg;
+
+	for (;;)
+	{
+		struct work *batch = __atomic_exchange_n(&wc->head, NULL, __ATOMIC_ACQUIRE);
+		if (batch == NULL)
+		{
+			sched_worker_sleep();
+			continue;
+		}
+
+		worker_run_batch(wc, batch);
+	}
+}
+
+bool
+init_workqueues(void)
+{
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		if (!sched_start_worker(i, worker_main, &workqueue_cpus[i]))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+queue_work_on(size_t cpu_index, struct work *work)
+{
+	if (__atomic_exchange_n(&work->pending, true, __ATOMIC_ACQUIRE))
+	{
+		return false;
+	}
+
+	struct workqueue_cpu *wc = &workqueue_cpus[cpu_index];
+	work->queued_at = rdtsc();
+	__atomic_fetch_add(&wc->depth, 1, __ATOMIC_RELAXED);
+
+	struct work *head = __atomic_load_n(&wc->head, __ATOMIC_RELAXED);
+	do
+	{
+		work->next = head;
+	}
+	while (!__atomic_compare_exchange_n(&wc->head, &head, work, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	percpu_counter_inc(&work_queued);
+
+	// Otherwise the worker has been woken up already, and hasn't taken
+	// the queue yet.
+	if (head == NULL)
+	{
+		sched_wake_worker(cpu_index);
+	}
+
+	return true;
+}
+
+bool
+queue_work(struct work *work)
+{
+	// Where we are running now may not be where we are once it's queued,
+	// but either way it's queued somewhere.
+	return queue_work_on(this_cpu()->index, work);
+}
+
+size_t
+workqueue_depth(size_t cpu_index)
+{
+	return __atomic_load_n(&workqueue_cpus[cpu_index].depth, __ATOMIC_RELAXED);
+}
+
+void
+workqueue_get_stats(struct workqueue_stats *stats)
+{
+	*stats = (struct workqueue_stats) { 0 };
+	stats->queued = percpu_counter_sum(&work_queued);
+	stats->run = percpu_counter_sum(&work_run);
+	stats->batches = percpu_counter_sum(&work_batches);
+	stats->latency_cycles_total = percpu_counter_sum(&work_latency_cycles);
+
+	for (size_t i = 0; i < cpu_count; ++i)
+	{
+		struct workqueue_cpu *wc = &workqueue_cpus[i];
+
+		uint64_t max_depth = __atomic_load_n(&wc->max_depth, __ATOMIC_RELAXED);
+		if (max_depth > stats->max_depth)
+		{
+			stats->max_depth = max_depth;
+		}
+
+		uint64_t latency_max = __atomic_load_n(&wc->latency_cycles_max, __ATOMIC_RELAXED);
+		if (latency_max > stats->latency_cycles_max)
+		{
+			stats->latency_cycles_max = latency_max;
+		}
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Deferred work, for interrupt handlers to push off everything that
+// doesn't have to happen with interrupts disabled. Every CPU has a queue,
+// drained by its own worker thread (see sched_start_worker). Work can be
+// queued to any CPU from anywhere, without taking a lock.
+
+struct work;
+typedef void (*work_func)(struct work *work);
+
+// Embedded in whatever the work is about, like rcu_head. May be queued
+// again once its function has been called, from the function included.
+struct work
+{
+	struct work *next;
+	work_func func;
+	uint64_t queued_at; // <- TSC, for the latency statistics.
+	bool pending;
+};
+
+#define WORK_INIT(f) { .next = NULL, .func = (f), .queued_at = 0, .pending = false }
+
+static inline void
+work_init(struct work *work, work_func func)
+{
+	*work = (struct work) WORK_INIT(func);
+}
+
+struct workqueue_stats
+{
+	uint64_t queued;
+	uint64_t run;
+	uint64_t batches; // <- How many times the workers took their queue in one go.
+	uint64_t max_depth;
+
+	// From being queued to starting to run, in TSC cycles.
+	uint64_t latency_cycles_total;
+	uint64_t latency_cycles_max;
+};
+
+// Starts a worker on every CPU. Must be called after init_sched.
+bool init_workqueues(void);
+
+// Returns false if the work was already pending, in which case it only
+// runs once.
+bool queue_work_on(size_t cpu_index, struct work *work);
+bool queue_work(struct work *work);
+
+// The work currently queued on a CPU, not counting what its worker has
+// already taken.
+size_t workqueue_depth(size_t cpu_index);
+
+void workqueue_get_stats(struct workqueue_stats *stats);
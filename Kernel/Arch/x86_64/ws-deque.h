@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// A fixed-capacity Chase-Lev work-stealing deque, with the memory
+// orderings from "Correct and Efficient Work-Stealing for Weak Memory
+// Models" (Lê et al., 2013), used as a queue: the owner's own pops go
+// through the top too, so that it runs its items first in, first out.
+//
+// Only the owning CPU may push, at the bottom, and it must do so with
+// interrupts disabled. Any CPU, the owner included, pops from the top
+// with ws_deque_steal.
+struct ws_deque
+{
+	// Kept on separate cache lines, since thieves only ever write `top`.
+	int64_t top __attribute__((aligned(64)));
+	int64_t bottom __attribute__((aligned(64)));
+	void **items;
+	size_t mask; // <- The capacity minus one. The capacity is a power of two.
+};
+
+enum ws_deque_result
+{
+	WS_DEQUE_SUCCESS,
+	WS_DEQUE_EMPTY,
+	WS_DEQUE_ABORT, // <- Lost a race with another CPU, worth retrying.
+};
+
+static inline void
+ws_deque_init(struct ws_deque *deque, void **items, size_t capacity)
+{
+	deque->top = 0;
+	deque->bottom = 0;
+	deque->items = items;
+	deque->mask = capacity - 1;
+}
+
+static inline bool
+ws_deque_push(struct ws_deque *deque, void *item)
+{
+	int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	if ((size_t)(bottom - top) > deque->mask)
+	{
+		return false;
+	}
+
+	__atomic_store_n(&deque->items[bottom & deque->mask], item, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+static inline enum ws_deque_result
+ws_deque_steal(struct ws_deque *deque, void **item)
+{
+	int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+	if (top >= bottom)
+	{
+		return WS_DEQUE_EMPTY;
+	}
+
+	void *candidate = __atomic_load_n(&deque->items[top & deque->mask], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+	{
+		return WS_DEQUE_ABORT;
+	}
+
+	*item = candidate;
+
+	return WS_DEQUE_SUCCESS;
+}
+
+// A racy snapshot, good enough for picking a victim.
+static inline bool
+ws_deque_looks_empty(struct ws_deque *deque)
+{
+	return __atomic_load_n(&deque->top, __ATOMIC_RELAXED) >=
+	       __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+}
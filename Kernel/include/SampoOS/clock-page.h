@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+
+// The page the kernel keeps the time in, which user space can have mapped
+// read-only. Getting the time from it takes no system call: the readers
+// scale the TSC themselves, and retry if the kernel was updating the page
+// meanwhile.
+
+#define SAMPO_CLOCK_PAGE_TSC_INVARIANT (1 << 0) // <- The TSC ticks at the same rate in every power state.
+
+struct sampo_clock_page
+{
+	uint32_t sequence; // <- Odd while the kernel is updating the page.
+	uint32_t flags;
+
+	// Nanoseconds since boot at TSC `tsc_base`.
+	uint64_t tsc_base;
+	uint64_t monotonic_base_ns;
+
+	// Realtime is monotonic time plus this, in nanoseconds since 1970.
+	uint64_t realtime_offset_ns;
+
+	// Nanoseconds are (TSC cycles * mult) >> shift.
+	uint64_t mult;
+	uint32_t shift;
+	uint32_t reserved;
+};
+
+static inline uint64_t
+sampo_clock_read_tsc(void)
+{
+	// Keeps the TSC from being read ahead of the page.
+	uint32_t low, high;
+	asm volatile ("lfence; rdtsc" : "=a"(low), "=d"(high) : : "memory");
+
+	return ((uint64_t) high << 32) | low;
+}
+
+static inline uint64_t
+sampo_clock_scale(const struct sampo_clock_page *page, uint64_t tsc)
+{
+	uint64_t cycles = tsc - page->tsc_base;
+
+	return page->monotonic_base_ns + (uint64_t)(((unsigned __int128) cycles * page->mult) >> page->shift);
+}
+
+static inline uint64_t
+sampo_clock_monotonic_ns(const struct sampo_clock_page *page)
+{
+	uint32_t sequence;
+	uint64_t ns;
+	do
+	{
+		sequence = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+		ns = sampo_clock_scale(page, sampo_clock_read_tsc());
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	while ((sequence & 1) != 0 || __atomic_load_n(&page->sequence, __ATOMIC_RELAXED) != sequence);
+
+	return ns;
+}
+
+static inline uint64_t
+sampo_clock_realtime_ns(const struct sampo_clock_page *page)
+{
+	uint32_t sequence;
+	uint64_t ns;
+	do
+	{
+		sequence = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+		ns = sampo_clock_scale(page, sampo_clock_read_tsc()) + page->realtime_offset_ns;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	while ((sequence & 1) != 0 || __atomic_load_n(&page->sequence, __ATOMIC_RELAXED) != sequence);
+
+	return ns;
+}
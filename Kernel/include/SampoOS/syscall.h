@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+
+// System calls are made with the SYSCALL instruction: the number goes in
+// RAX, up to six arguments in RDI, RSI, RDX, R10, R8 and R9, and the
+// result comes back in RAX. RCX and R11 are taken by the instruction
+// itself, the other argument registers come back zeroed, and everything
+// else is preserved.
+
+enum sampo_syscall
+{
+	SAMPO_SYSCALL_EXIT = 0,
+	SAMPO_SYSCALL_NULL = 1, // <- Does nothing, for measuring the way in and out.
+	SAMPO_SYSCALL_CLOCK = 2, // <- Takes a clock ID, returns nanoseconds.
+	SAMPO_SYSCALL_COUNT
+};
+
+enum sampo_clock_id
+{
+	SAMPO_CLOCK_MONOTONIC = 0,
+	SAMPO_CLOCK_REALTIME = 1,
+};
+
+// Returned for numbers with no system call behind them.
+#define SAMPO_SYSCALL_NO_SUCH_CALL (-1)
+
+static inline int64_t
+sampo_syscall0(uint64_t number)
+{
+	int64_t result;
+	asm volatile ("syscall"
+		      : "=a"(result)
+		      : "a"(number)
+		      : "rcx", "r11", "rdi", "rsi", "rdx", "r8", "r9", "r10", "memory");
+
+	return result;
+}
+
+static inline int64_t
+sampo_syscall1(uint64_t number, uint64_t arg0)
+{
+	int64_t result;
+	asm volatile ("syscall"
+		      : "=a"(result), "+D"(arg0)
+		      : "a"(number)
+		      : "rcx", "r11", "rsi", "rdx", "r8", "r9", "r10", "memory");
+
+	return result;
+}
+
+static inline int64_t
+sampo_syscall2(uint64_t number, uint64_t arg0, uint64_t arg1)
+{
+	int64_t result;
+	asm volatile ("syscall"
+		      : "=a"(result), "+D"(arg0), "+S"(arg1)
+		      : "a"(number)
+		      : "rcx", "r11", "rdx", "r8", "r9", "r10", "memory");
+
+	return result;
+}
@@ -11,6 +11,10 @@
 #define EM_386 3
 #define EM_X86_64 62
 
+#define SHT_SYMTAB 2
+#define SHN_UNDEF 0
+#define STT_FUNC 2
+
 enum elf_class
 {
 	ELF_CLASS_32 = 1,
@@ -37,8 +41,18 @@ static struct elf_header
 	uint64_t prog_header_offset;
 	uint16_t prog_header_count;
 	size_t prog_header_len;
+
+	uint64_t section_header_offset;
+	uint16_t section_header_count;
+	size_t section_header_len;
 } header;
 
+// The function index handed to the kernel, see elf_load_symbols.
+static struct sampo_bootinfo_symbol *symbols;
+static size_t symbol_count;
+static char *symbol_names;
+static size_t symbol_names_len;
+
 extern uint64_t program_entry_point;
 
 static inline uint16_t
@@ -201,8 +215,8 @@ elf_initialize(uint8_t *elf_base_ptr)
 		      (uint32_t)(header.entry_point >> 32),
 		      (uint32_t)(header.entry_point & 0xFFFFFFFF));
 
-	// We don't care about the section offset.
-	elf_read_off(header.base_ptr, &offset);
+	// The section headers lead to the symbol table, see elf_load_symbols.
+	header.section_header_offset = elf_read_off(header.base_ptr, &offset);
 
 	// Neither x86 nor AMD64 have any flags we really care about, so skip those.
 	elf_read_word(header.base_ptr, &offset);
@@ -214,8 +228,11 @@ elf_initialize(uint8_t *elf_base_ptr)
 	header.prog_header_len = elf_read_half(header.base_ptr, &offset);
 	header.prog_header_count = elf_read_half(header.base_ptr, &offset);
 
-	// Rest of the ELF header consists of section things used for linking
-	// so we don't care about them.
+	// And the same for the section headers. We don't need the section
+	// names, so the rest of the header can go.
+	header.section_header_len = elf_read_half(header.base_ptr, &offset);
+	header.section_header_count = elf_read_half(header.base_ptr, &offset);
+
 	return true;
 }
 
@@ -329,3 +346,233 @@ elf_expand(void)
 
 	return true;
 }
+
+struct elf_section
+{
+	uint32_t type;
+	uint64_t offset;
+	uint64_t size;
+	uint32_t link;
+	uint64_t entry_len;
+};
+
+struct elf_symbol
+{
+	uint32_t name;
+	uint8_t info;
+	uint16_t section;
+	uint64_t value;
+	uint64_t size;
+};
+
+static void
+elf_read_section(size_t index, struct elf_section *section)
+{
+	const uint8_t *section_header = header.base_ptr + (uintptr_t) header.section_header_offset
+		+ header.section_header_len * index;
+	size_t offset = 0;
+
+	// We don't care about the name, since the type says what we need.
+	elf_read_word(section_header, &offset);
+	section->type = elf_read_word(section_header, &offset);
+	// Neither do we care about the flags or the address.
+	elf_read_off(section_header, &offset);
+	elf_read_addr(section_header, &offset);
+	section->offset = elf_read_off(section_header, &offset);
+	section->size = elf_read_off(section_header, &offset);
+	section->link = elf_read_word(section_header, &offset);
+	// Nor the extra info and the alignment.
+	elf_read_word(section_header, &offset);
+	elf_read_off(section_header, &offset);
+	section->entry_len = elf_read_off(section_header, &offset);
+}
+
+static void
+elf_read_symbol(const uint8_t *entry, struct elf_symbol *symbol)
+{
+	size_t offset = 0;
+	symbol->name = elf_read_word(entry, &offset);
+
+	// The 64-bit layout moves the value and the size after the rest.
+	if (header.class == ELF_CLASS_32)
+	{
+		symbol->value = elf_read_addr(entry, &offset);
+		symbol->size = elf_read_word(entry, &offset);
+		symbol->info = entry[offset++];
+		// The visibility doesn't matter.
+		++offset;
+		symbol->section = elf_read_half(entry, &offset);
+	}
+	else
+	{
+		symbol->info = entry[offset++];
+		++offset;
+		symbol->section = elf_read_half(entry, &offset);
+		symbol->value = elf_read_addr(entry, &offset);
+		symbol->size = elf_read_u64(&entry[offset]);
+	}
+}
+
+static bool
+elf_symbol_is_function(const struct elf_symbol *symbol, uint64_t names_len)
+{
+	return (symbol->info & 0xF) == STT_FUNC
+		&& symbol->section != SHN_UNDEF
+		&& symbol->value != 0
+		&& symbol->name < names_len;
+}
+
+static void
+elf_sift_down(size_t root, size_t count)
+{
+	for (;;)
+	{
+		size_t child = 2 * root + 1;
+		if (child >= count)
+		{
+			return;
+		}
+
+		if (child + 1 < count && symbols[child].addr < symbols[child + 1].addr)
+		{
+			++child;
+		}
+
+		if (symbols[root].addr >= symbols[child].addr)
+		{
+			return;
+		}
+
+		struct sampo_bootinfo_symbol tmp = symbols[root];
+		symbols[root] = symbols[child];
+		symbols[child] = tmp;
+		root = child;
+	}
+}
+
+// A heap sort, since the symbol table is in no particular order and
+// there may be thousands of functions.
+static void
+elf_sort_symbols(void)
+{
+	for (size_t i = symbol_count / 2; i-- > 0;)
+	{
+		elf_sift_down(i, symbol_count);
+	}
+
+	for (size_t end = symbol_count; end-- > 1;)
+	{
+		struct sampo_bootinfo_symbol tmp = symbols[0];
+		symbols[0] = symbols[end];
+		symbols[end] = tmp;
+		elf_sift_down(0, end);
+	}
+}
+
+bool
+elf_load_symbols(void)
+{
+	struct elf_section symtab;
+	size_t i;
+	for (i = 0; i < header.section_header_count; ++i)
+	{
+		elf_read_section(i, &symtab);
+		if (symtab.type == SHT_SYMTAB)
+		{
+			break;
+		}
+	}
+
+	if (i == header.section_header_count || symtab.entry_len == 0 || symtab.link >= header.section_header_count)
+	{
+		serial_write("Kernel has no symbol table\n");
+		return false;
+	}
+
+	// The symbol table links to the string table with its names.
+	struct elf_section strtab;
+	elf_read_section(symtab.link, &strtab);
+
+	const uint8_t *entries = header.base_ptr + (uintptr_t) symtab.offset;
+	const char *names = (const char *)(header.base_ptr + (uintptr_t) strtab.offset);
+	size_t entry_count = symtab.size / symtab.entry_len;
+
+	// Count first, so that the index and the names fit in one region.
+	struct elf_symbol symbol;
+	for (i = 0; i < entry_count; ++i)
+	{
+		elf_read_symbol(entries + i * symtab.entry_len, &symbol);
+		if (elf_symbol_is_function(&symbol, strtab.size))
+		{
+			++symbol_count;
+			symbol_names_len += strlen(&names[symbol.name]) + 1;
+		}
+	}
+
+	if (symbol_count == 0)
+	{
+		serial_write("Kernel symbol table has no functions\n");
+		return false;
+	}
+
+	size_t index_len = symbol_count * sizeof(*symbols);
+	size_t pages_needed = (index_len + symbol_names_len + 0x0FFF) / 0x1000;
+	uint8_t *region = pmm_allocate_region(pages_needed);
+	if (region == NULL)
+	{
+		serial_write("Couldn't allocate the kernel symbol index!\n");
+		symbol_count = 0;
+		symbol_names_len = 0;
+		return false;
+	}
+
+	symbols = (struct sampo_bootinfo_symbol *) region;
+	symbol_names = (char *)(region + index_len);
+
+	size_t filled = 0;
+	size_t names_filled = 0;
+	for (i = 0; i < entry_count; ++i)
+	{
+		elf_read_symbol(entries + i * symtab.entry_len, &symbol);
+		if (!elf_symbol_is_function(&symbol, strtab.size))
+		{
+			continue;
+		}
+
+		size_t name_len = strlen(&names[symbol.name]) + 1;
+		memcpy(&symbol_names[names_filled], &names[symbol.name], name_len);
+
+		symbols[filled].addr = symbol.value;
+		symbols[filled].size = symbol.size > UINT32_MAX ? UINT32_MAX : (uint32_t) symbol.size;
+		symbols[filled].name_offset = names_filled;
+
+		names_filled += name_len;
+		++filled;
+	}
+
+	elf_sort_symbols();
+
+	// Aliases share an address, and only the first one is kept.
+	size_t kept = 1;
+	for (i = 1; i < symbol_count; ++i)
+	{
+		if (symbols[i].addr != symbols[kept - 1].addr)
+		{
+			symbols[kept++] = symbols[i];
+		}
+	}
+	symbol_count = kept;
+
+	serial_printf("Kernel symbol index has %u functions\n", (uint32_t) symbol_count);
+
+	return true;
+}
+
+void
+elf_fill_bootinfo(struct sampo_bootinfo *info)
+{
+	info->symbols.symbols_ptr = (uintptr_t) symbols;
+	info->symbols.symbols_count = symbol_count;
+	info->symbols.names_ptr = (uintptr_t) symbol_names;
+	info->symbols.names_len = symbol_names_len;
+}
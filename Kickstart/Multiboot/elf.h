@@ -2,6 +2,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <SampoOS/Kernel/bootinfo.h>
 
 enum elf_arch
 {
@@ -14,3 +15,11 @@ bool elf_initialize(uint8_t *elf_base_ptr);
 enum elf_arch elf_get_arch(void);
 
 bool elf_expand(void);
+
+// Builds an index of the kernel's functions out of its symbol table,
+// sorted by address, for the kernel to map addresses back to names
+// without parsing ELF itself. Returns false if there is no symbol table,
+// which the kernel can do without.
+bool elf_load_symbols(void);
+
+void elf_fill_bootinfo(struct sampo_bootinfo *info);
@@ -22,6 +22,13 @@ static bool has_longmode(void);
 
 struct sampo_bootinfo bootinfo;
 
+// A copy of the ACPI RSDP from Multiboot, since the Multiboot information
+// itself isn't kept around for the kernel. 36 bytes is the size of
+// the ACPI 2.0 version.
+static uint8_t acpi_rsdp[36];
+static bool has_acpi_rsdp = false;
+static bool has_new_acpi_rsdp = false;
+
 void
 kickstart_main(uint32_t addr, uint32_t magic)
 {
@@ -113,6 +120,22 @@ kickstart_main(uint32_t addr, uint32_t magic)
 				      (uint32_t)(fb_tag->common.framebuffer_addr >> 32),
 				      (uint32_t)(fb_tag->common.framebuffer_addr & 0xFFFFFFFF));
 		}
+		else if ((tag->type == MULTIBOOT_TAG_TYPE_ACPI_OLD && !has_new_acpi_rsdp) ||
+			 tag->type == MULTIBOOT_TAG_TYPE_ACPI_NEW)
+		{
+			serial_write("Has ACPI RSDP\n");
+
+			// Prefer the ACPI 2.0 version, if the bootloader gives us both.
+			size_t rsdp_len = tag->size - sizeof(*tag);
+			if (rsdp_len > sizeof(acpi_rsdp))
+			{
+				rsdp_len = sizeof(acpi_rsdp);
+			}
+
+			memcpy(acpi_rsdp, ((struct multiboot_tag_old_acpi *) tag)->rsdp, rsdp_len);
+			has_acpi_rsdp = true;
+			has_new_acpi_rsdp = tag->type == MULTIBOOT_TAG_TYPE_ACPI_NEW;
+		}
 		else if (tag->type == MULTIBOOT_TAG_TYPE_MODULE)
 		{
 			serial_write("Has module\n");
@@ -179,6 +202,11 @@ kickstart_main(uint32_t addr, uint32_t magic)
 		return;
 	}
 
+	if (!elf_load_symbols())
+	{
+		serial_write("Kernel addresses won't resolve to function names\n");
+	}
+
 	serial_printf("Parsed memory map (rounded to nearest page boundaries):\n");
 	for (size_t i = 0; i < memory_region_count; ++i)
 	{
@@ -195,6 +223,8 @@ kickstart_main(uint32_t addr, uint32_t magic)
 
 	pmm_fill_bootinfo(&bootinfo);
 	pager_fill_bootinfo(&bootinfo);
+	elf_fill_bootinfo(&bootinfo);
+	bootinfo.acpi_rsdp_ptr = has_acpi_rsdp ? (uintptr_t) acpi_rsdp : 0;
 
 	if (elf_get_arch() == ELF_ARCH_AMD64)
 	{
@@ -21,6 +21,14 @@ struct sampo_bootinfo_memory_region
 	uint64_t type;
 };
 
+// A function of the kernel, see `symbols` below.
+struct sampo_bootinfo_symbol
+{
+	uint64_t addr;
+	uint32_t size;
+	uint32_t name_offset; // <- Into the names, which are NUL terminated.
+};
+
 struct sampo_bootinfo
 {
 	struct
@@ -30,4 +38,18 @@ struct sampo_bootinfo
 	} memory_map;
 
 	uint64_t bootstrap_paging_structure_ptr;
+
+	// Physical address of the ACPI RSDP, or 0 if the bootloader didn't provide one.
+	uint64_t acpi_rsdp_ptr;
+
+	// The functions in the kernel's ELF symbol table, sorted by address,
+	// and their names. Physical addresses, all 0 if the kernel has no
+	// symbol table.
+	struct
+	{
+		uint64_t symbols_ptr;
+		uint64_t symbols_count;
+		uint64_t names_ptr;
+		uint64_t names_len;
+	} symbols;
 };
@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""Resolves a kernel profile dumped over the serial port to function names.
+
+Takes the kernel ELF, which has the symbols, and the serial output with the
+folded stacks printed by profiler_dump. The kernel names the functions
+itself when Kickstart passed it the symbol index, and this resolves the
+addresses left over. Prints the stacks again merged by function, for
+flamegraph.pl and the like. With --histogram, prints how many samples each
+function was running in instead.
+
+    Tools/profile-symbolize.py Kernel/sampo-x86_64.bin serial.log | flamegraph.pl > profile.svg
+
+Set NM to use another nm, like x86_64-elf-nm.
+"""
+
+import argparse
+import bisect
+import collections
+import os
+import re
+import subprocess
+import sys
+
+FOLDED_LINE = re.compile(r"^(\S+) (\d+)$")
+ADDRESS = re.compile(r"^0x[0-9a-f]+$")
+
+
+def load_symbols(kernel):
+    output = subprocess.run([os.environ.get("NM", "nm"), "--defined-only", "-n", kernel],
+                            check=True, capture_output=True, text=True).stdout
+
+    addresses = []
+    names = []
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) != 3 or fields[1] not in "TtWw":
+            continue
+
+        addresses.append(int(fields[0], 16))
+        names.append(fields[2])
+
+    return addresses, names
+
+
+def resolve(symbols, address):
+    addresses, names = symbols
+    i = bisect.bisect_right(addresses, address) - 1
+    if i < 0:
+        return hex(address)
+
+    return names[i]
+
+
+def read_folded(lines):
+    """Yields the frames of each stack, the outermost first, and its count."""
+    inside = False
+    for line in lines:
+        line = line.strip()
+        if line == "Folded stacks:":
+            inside = True
+            continue
+        if line == "End of folded stacks":
+            inside = False
+            continue
+
+        match = FOLDED_LINE.match(line) if inside else None
+        if match is not None:
+            yield match.group(1).split(";"), int(match.group(2))
+
+
+def symbolize(symbols, frames):
+    names = []
+    for i, frame in enumerate(frames):
+        if not ADDRESS.match(frame):
+            names.append(frame)
+            continue
+
+        # All but the innermost are return addresses, which can be the
+        # first byte after the function if it ends in a call.
+        address = int(frame, 16)
+        names.append(resolve(symbols, address if i == len(frames) - 1 else address - 1))
+
+    return names
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("kernel", help="the kernel ELF the profile was taken with")
+    parser.add_argument("log", nargs="?", help="the serial output, stdin if left out")
+    parser.add_argument("--histogram", action="store_true",
+                        help="print samples per function instead of folded stacks")
+    args = parser.parse_args()
+
+    symbols = load_symbols(args.kernel)
+    with (open(args.log, errors="replace") if args.log else sys.stdin) as log:
+        stacks = collections.Counter()
+        for frames, count in read_folded(log):
+            stacks[";".join(symbolize(symbols, frames))] += count
+
+    if not args.histogram:
+        for stack, count in sorted(stacks.items()):
+            print(stack, count)
+        return
+
+    functions = collections.Counter()
+    for stack, count in stacks.items():
+        functions[stack.rsplit(";", 1)[-1]] += count
+
+    total = sum(functions.values())
+    for function, count in functions.most_common():
+        print(f"{count:8} {100 * count / total:6.2f}% {function}")
+
+
+if __name__ == "__main__":
+    main()
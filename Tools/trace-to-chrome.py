@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""Converts a kernel trace dumped over the serial port to a Chrome trace.
+
+Takes the serial output with the records printed by trace_dump, and writes
+them as JSON in the Chrome trace event format, which chrome://tracing and
+ui.perfetto.dev both open. Every CPU shows up as a thread of its own, with
+the time in microseconds since the first record.
+
+    Tools/trace-to-chrome.py serial.log > trace.json
+"""
+
+import argparse
+import json
+import re
+import sys
+
+HEADER = re.compile(r"^Trace of (\d+) records, (\d+) overwritten, from (\d+) CPUs, TSC at (\d+) Hz$")
+EVENT_LINE = re.compile(r"^(\d+) (\S+) ([iBE]) (\S+) (\S+) (\S+)$")
+RECORD_LINE = re.compile(r"^([0-9a-f]+) ([0-9a-f]+) ([0-9a-f]+) ([0-9a-f]+)$")
+
+# Arguments which are addresses read better in hex.
+ADDRESS_ARGS = {"page", "block", "addr", "phys"}
+
+
+def read_trace(lines):
+    """Returns the TSC frequency, the events by number, and the records."""
+    tsc_hz = None
+    events = {}
+    records = []
+    section = None
+    for line in lines:
+        line = line.strip()
+        match = HEADER.match(line)
+        if match is not None:
+            tsc_hz = int(match.group(4))
+            if int(match.group(2)) != 0:
+                print(f"{match.group(2)} records were overwritten", file=sys.stderr)
+            continue
+
+        if line in ("Trace events:", "Trace records:"):
+            section = line
+            continue
+        if line == "End of trace":
+            section = None
+            continue
+
+        if section == "Trace events:":
+            match = EVENT_LINE.match(line)
+            if match is not None:
+                number, name, phase, *args = match.groups()
+                events[int(number)] = (name, phase, [None if arg == "-" else arg for arg in args])
+        elif section == "Trace records:":
+            match = RECORD_LINE.match(line)
+            if match is not None:
+                records.append([int(word, 16) for word in match.groups()])
+
+    if tsc_hz is None:
+        sys.exit("No trace found")
+
+    return tsc_hz, events, records
+
+
+def convert(tsc_hz, events, records):
+    records.sort(key=lambda record: record[0])
+    start = records[0][0] if records else 0
+
+    cpus = set()
+    trace_events = []
+    for tsc, packed, arg0, arg1 in records:
+        number = packed & 0xFFFF
+        cpu = (packed >> 16) & 0xFFFF
+        count = packed >> 32
+        if number not in events:
+            continue
+
+        name, phase, arg_names = events[number]
+        args = {}
+        for arg_name, value in zip(arg_names, (arg0, arg1, count)):
+            if arg_name is not None:
+                args[arg_name] = hex(value) if arg_name in ADDRESS_ARGS else value
+
+        event = {
+            "name": name,
+            "ph": phase,
+            "ts": (tsc - start) * 1e6 / tsc_hz,
+            "pid": 0,
+            "tid": cpu,
+            "args": args,
+        }
+        if phase == "i":
+            event["s"] = "t"
+
+        trace_events.append(event)
+        cpus.add(cpu)
+
+    for cpu in sorted(cpus):
+        trace_events.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": cpu,
+                             "args": {"name": f"CPU {cpu}"}})
+
+    return {"traceEvents": trace_events, "displayTimeUnit": "ns"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("log", nargs="?", help="the serial output, stdin if left out")
+    args = parser.parse_args()
+
+    with (open(args.log, errors="replace") if args.log else sys.stdin) as log:
+        tsc_hz, events, records = read_trace(log)
+
+    json.dump(convert(tsc_hz, events, records), sys.stdout)
+    print()
+
+
+if __name__ == "__main__":
+    main()